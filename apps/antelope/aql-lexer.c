@@ -107,7 +107,8 @@ static const struct keyword keywords[] = {
 
   {"RELATION", RELATION},
 
-  {"ATTRIBUTE", ATTRIBUTE}
+  {"ATTRIBUTE", ATTRIBUTE},
+  {"BPLUSTREE", BPLUSTREE}
 };
 
 /* Provides a pointer to the first keyword of a specific length. */
@@ -645,6 +645,9 @@ PARSER_TOKEN(index_type)
   case MEMHASH:
     type = INDEX_MEMHASH;
     break;
+  case BPLUSTREE:
+    type = INDEX_BPLUSTREE;
+    break;
   default:
     return NONE;
   };
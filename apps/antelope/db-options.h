@@ -104,6 +104,30 @@
 #endif /* DB_MAX_ELEMENT_SIZE */
 
 
+/* The number of tuples that a selection reads from storage and
+   evaluates at a time. Batching amortizes the cost of storage calls
+   and of interpreting the LVM bytecode over several tuples, at the
+   cost of a row buffer and one long per LVM variable for each tuple
+   in the batch. A value of 0 disables batch processing. */
+#ifndef DB_SELECT_BATCH_SIZE
+#define DB_SELECT_BATCH_SIZE		0
+#endif /* DB_SELECT_BATCH_SIZE */
+
+/* The size in bytes of a page in the row cache of the storage layer.
+   Sequential reads fill a whole page at a time, and inserted rows are
+   combined into a page that is written when it is full, or when the
+   relation is released. Inserted rows are therefore not stored
+   persistently until the last reference to the relation is released.
+   A value of 0 disables the cache. */
+#ifndef DB_STORAGE_PAGE_SIZE
+#define DB_STORAGE_PAGE_SIZE		0
+#endif /* DB_STORAGE_PAGE_SIZE */
+
+/* The number of pages in the row cache, shared by all relations. */
+#ifndef DB_STORAGE_PAGE_COUNT
+#define DB_STORAGE_PAGE_COUNT		2
+#endif /* DB_STORAGE_PAGE_COUNT */
+
 /* The maximum size of the LVM bytecode compiled from a
    single database query. */
 #ifndef DB_VM_BYTECODE_SIZE
@@ -186,6 +210,18 @@
 #define DB_INDEX_COST			64
 #endif /* DB_INDEX_COST */
 
+/* The maximum number of tuples from the right relation that a hash
+   join keeps in memory at a time. Larger relations are joined in
+   several passes over the left relation. */
+#ifndef DB_JOIN_HASH_ITEMS
+#define DB_JOIN_HASH_ITEMS		32
+#endif /* DB_JOIN_HASH_ITEMS */
+
+/* The number of buckets in the hash join table. */
+#ifndef DB_JOIN_HASH_BUCKETS
+#define DB_JOIN_HASH_BUCKETS		13
+#endif /* DB_JOIN_HASH_BUCKETS */
+
 /* The maximum number of hash table indexes. */
 #ifndef DB_MEMHASH_INDEX_LIMIT
 #define DB_MEMHASH_INDEX_LIMIT  	1
@@ -206,6 +242,38 @@
 #define DB_HEAP_CACHE_LIMIT		1
 #endif /* DB_HEAP_CACHE_LIMIT */
 
+/* The maximum number of B+-tree indexes. */
+#ifndef DB_BPLUSTREE_INDEX_LIMIT
+#define DB_BPLUSTREE_INDEX_LIMIT	1
+#endif /* DB_BPLUSTREE_INDEX_LIMIT */
+
+/* The number of entries in a B+-tree node. The default order gives
+   128-byte nodes. */
+#ifndef DB_BPLUSTREE_ORDER
+#define DB_BPLUSTREE_ORDER		15
+#endif /* DB_BPLUSTREE_ORDER */
+
+/* The maximum number of nodes in a B+-tree index file. */
+#ifndef DB_BPLUSTREE_NODE_LIMIT
+#define DB_BPLUSTREE_NODE_LIMIT		255
+#endif /* DB_BPLUSTREE_NODE_LIMIT */
+
+/* The maximum height of a B+-tree. */
+#ifndef DB_BPLUSTREE_MAX_HEIGHT
+#define DB_BPLUSTREE_MAX_HEIGHT		6
+#endif /* DB_BPLUSTREE_MAX_HEIGHT */
+
+/* The maximum number of B+-tree nodes cached in RAM. */
+#ifndef DB_BPLUSTREE_CACHE_LIMIT
+#define DB_BPLUSTREE_CACHE_LIMIT	3
+#endif /* DB_BPLUSTREE_CACHE_LIMIT */
+
+/* The number of node updates that the Coffee micro log of a B+-tree
+   file can hold before the file is merged. */
+#ifndef DB_BPLUSTREE_LOG_RECORDS
+#define DB_BPLUSTREE_LOG_RECORDS	16
+#endif /* DB_BPLUSTREE_LOG_RECORDS */
+
 /*----------------------------------------------------------------------------*/
 
 /* LVM options. */
@@ -227,5 +295,20 @@
 #define LVM_USE_FLOATS			DB_FEATURE_FLOATS
 #endif /* LVM_USE_FLOATS */
 
+/* The maximum number of tuples that the LVM evaluates in a batch. */
+#ifndef LVM_BATCH_SIZE
+#define LVM_BATCH_SIZE			DB_SELECT_BATCH_SIZE
+#endif /* LVM_BATCH_SIZE */
+
+/*
+ * The maximum nesting depth of operators that the LVM evaluates in a
+ * batch. Each level statically reserves about 2 * sizeof(long) + 1
+ * bytes per tuple of LVM_BATCH_SIZE. Deeper expressions are evaluated
+ * one tuple at a time.
+ */
+#ifndef LVM_BATCH_MAX_DEPTH
+#define LVM_BATCH_MAX_DEPTH		4
+#endif /* LVM_BATCH_MAX_DEPTH */
+
 
 #endif /* !DB_OPTIONS_H */
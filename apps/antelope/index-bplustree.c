@@ -0,0 +1,737 @@
+/*
+ * Copyright (c) 2026, Contiki contributors.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * 3. Neither the name of the copyright holder nor the names of its
+ *    contributors may be used to endorse or promote products derived
+ *    from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE
+ * COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+ * OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/**
+ * \file
+ *     A B+-tree index stored in a file.
+ *
+ *     The tree consists of fixed-size nodes that are stored in a single
+ *     file, with a small header in the first node slot. Leaves hold
+ *     (key, tuple id) pairs in key order, and are linked from left to
+ *     right, so a range query descends the tree once and then scans
+ *     the leaves sequentially.
+ *
+ *     Nodes are updated in place. On Coffee, the node file is given a
+ *     micro log whose records have the size of a node, so that each
+ *     node update becomes a single log record.
+ *
+ *     Insertions of keys that are larger than all keys in the tree,
+ *     which is the common case when a relation is loaded in order or
+ *     when sensor samples are logged with a timestamp, split the
+ *     rightmost nodes such that the left node remains full. Loading
+ *     an existing relation with increasing keys thereby produces a
+ *     tree with full leaves.
+ *
+ *     Deleting a key removes all of its entries. Nodes are never
+ *     merged or freed, so a leaf that becomes empty stays in the tree
+ *     and the node file does not shrink until the index is recreated.
+ */
+
+#include <limits.h>
+#include <string.h>
+
+#include "cfs/cfs.h"
+#include "cfs/cfs-coffee.h"
+#include "lib/memb.h"
+
+#include "db-options.h"
+#include "index.h"
+#include "result.h"
+#include "storage.h"
+
+#define DEBUG DEBUG_NONE
+#include "net/ip/uip-debug.h"
+
+#define ORDER		DB_BPLUSTREE_ORDER
+#define NODE_NONE	0
+#define HEADER_NODE	0
+
+#if ORDER > 255
+#error "DB_BPLUSTREE_ORDER must be smaller than 256."
+#endif
+
+/* Keys of other sizes are not accepted, see key_in_range(). */
+typedef int32_t bptree_key_t;
+typedef uint16_t bptree_node_id_t;
+
+/*
+ * In a leaf, the value of an entry is a tuple id. In an internal
+ * node, the value is the id of a child node, and the key is the
+ * smallest key that was stored in that child when it was created.
+ */
+struct bptree_entry {
+  bptree_key_t key;
+  uint32_t value;
+};
+
+struct bptree_node {
+  uint8_t leaf;
+  uint8_t count;
+  bptree_node_id_t next;
+  bptree_node_id_t reserved[2];
+  struct bptree_entry entries[ORDER];
+};
+
+struct bptree_header {
+  bptree_node_id_t root;
+  bptree_node_id_t node_count;
+};
+
+struct bptree {
+  int fd;
+  bptree_node_id_t root;
+  bptree_node_id_t node_count;
+};
+typedef struct bptree bptree_t;
+
+struct node_cache {
+  bptree_t *tree;
+  bptree_node_id_t id;
+  uint16_t last_use;
+  struct bptree_node node;
+};
+
+/* Keep a cache of nodes read from storage. */
+static struct node_cache node_cache[DB_BPLUSTREE_CACHE_LIMIT];
+static uint16_t cache_clock;
+
+/* Buffers for the nodes and entries that are modified by an insertion. */
+static struct bptree_node node;
+static struct bptree_node split_node;
+static struct bptree_entry split_entries[ORDER + 1];
+
+MEMB(trees, bptree_t, DB_BPLUSTREE_INDEX_LIMIT);
+
+static db_result_t create(index_t *);
+static db_result_t destroy(index_t *);
+static db_result_t load(index_t *);
+static db_result_t release(index_t *);
+static db_result_t insert(index_t *, attribute_value_t *, tuple_id_t);
+static db_result_t delete(index_t *, attribute_value_t *);
+static tuple_id_t get_next(index_iterator_t *);
+
+index_api_t index_bplustree = {
+  INDEX_BPLUSTREE,
+  INDEX_API_EXTERNAL | INDEX_API_RANGE_QUERIES,
+  create,
+  destroy,
+  load,
+  release,
+  insert,
+  delete,
+  get_next
+};
+
+static struct node_cache *
+cache_find(bptree_t *tree, bptree_node_id_t id)
+{
+  int i;
+
+  for(i = 0; i < DB_BPLUSTREE_CACHE_LIMIT; i++) {
+    if(node_cache[i].tree == tree && node_cache[i].id == id) {
+      node_cache[i].last_use = ++cache_clock;
+      return &node_cache[i];
+    }
+  }
+  return NULL;
+}
+
+static struct node_cache *
+cache_replace(bptree_t *tree, bptree_node_id_t id)
+{
+  struct node_cache *cache;
+  int i;
+
+  /* Replace an unused entry, or the least recently used one. */
+  cache = &node_cache[0];
+  for(i = 0; i < DB_BPLUSTREE_CACHE_LIMIT; i++) {
+    if(node_cache[i].tree == NULL) {
+      cache = &node_cache[i];
+      break;
+    }
+    if((uint16_t)(cache_clock - node_cache[i].last_use) >
+       (uint16_t)(cache_clock - cache->last_use)) {
+      cache = &node_cache[i];
+    }
+  }
+
+  cache->tree = tree;
+  cache->id = id;
+  cache->last_use = ++cache_clock;
+  return cache;
+}
+
+static void
+cache_invalidate(bptree_t *tree)
+{
+  int i;
+
+  for(i = 0; i < DB_BPLUSTREE_CACHE_LIMIT; i++) {
+    if(node_cache[i].tree == tree) {
+      node_cache[i].tree = NULL;
+    }
+  }
+}
+
+static db_result_t
+file_read(bptree_t *tree, void *buf, unsigned long offset, unsigned size)
+{
+  int r;
+
+  if(cfs_seek(tree->fd, offset, CFS_SEEK_SET) == (cfs_offset_t)-1) {
+    return DB_STORAGE_ERROR;
+  }
+
+  r = cfs_read(tree->fd, buf, size);
+  if(r < 0) {
+    return DB_STORAGE_ERROR;
+  }
+
+  /* The file system may regard trailing zero bytes of the last node
+     as unwritten, so a short read is completed with zeros. */
+  memset((char *)buf + r, 0, size - r);
+  return DB_OK;
+}
+
+static db_result_t
+file_write(bptree_t *tree, void *buf, unsigned long offset, unsigned size)
+{
+  if(cfs_seek(tree->fd, offset, CFS_SEEK_SET) == (cfs_offset_t)-1 ||
+     cfs_write(tree->fd, buf, size) != size) {
+    return DB_STORAGE_ERROR;
+  }
+  return DB_OK;
+}
+
+static db_result_t
+node_read(bptree_t *tree, bptree_node_id_t id, struct bptree_node *buf)
+{
+  struct node_cache *cache;
+
+  cache = cache_find(tree, id);
+  if(cache == NULL) {
+    cache = cache_replace(tree, id);
+    if(DB_ERROR(file_read(tree, &cache->node,
+                          (unsigned long)id * sizeof(struct bptree_node),
+                          sizeof(struct bptree_node)))) {
+      PRINTF("DB: Failed to read B+-tree node %u\n", (unsigned)id);
+      cache->tree = NULL;
+      return DB_STORAGE_ERROR;
+    }
+  }
+
+  memcpy(buf, &cache->node, sizeof(*buf));
+  return DB_OK;
+}
+
+static db_result_t
+node_write(bptree_t *tree, bptree_node_id_t id, struct bptree_node *buf)
+{
+  struct node_cache *cache;
+
+  cache = cache_find(tree, id);
+  if(DB_ERROR(file_write(tree, buf,
+                         (unsigned long)id * sizeof(struct bptree_node),
+                         sizeof(struct bptree_node)))) {
+    PRINTF("DB: Failed to write B+-tree node %u\n", (unsigned)id);
+    if(cache != NULL) {
+      cache->tree = NULL;
+    }
+    return DB_STORAGE_ERROR;
+  }
+
+  /* The cache is written through, so that it never holds dirty nodes. */
+  if(cache == NULL) {
+    cache = cache_replace(tree, id);
+  }
+  memcpy(&cache->node, buf, sizeof(cache->node));
+  return DB_OK;
+}
+
+static db_result_t
+header_write(bptree_t *tree)
+{
+  struct bptree_header header;
+
+  header.root = tree->root;
+  header.node_count = tree->node_count;
+  return file_write(tree, &header, HEADER_NODE, sizeof(header));
+}
+
+static bptree_node_id_t
+node_allocate(bptree_t *tree)
+{
+  if(tree->node_count > DB_BPLUSTREE_NODE_LIMIT) {
+    PRINTF("DB: No more B+-tree nodes available\n");
+    return NODE_NONE;
+  }
+
+  tree->node_count++;
+  if(DB_ERROR(header_write(tree))) {
+    tree->node_count--;
+    return NODE_NONE;
+  }
+  return tree->node_count - 1;
+}
+
+static int
+nodes_available(bptree_t *tree, int count)
+{
+  return (long)tree->node_count + count - 1 <= DB_BPLUSTREE_NODE_LIMIT;
+}
+
+/*
+ * Find the child to descend into. For an insertion, we select the last
+ * child whose key is smaller than or equal to the search key, so that
+ * duplicate keys are appended. For a search, we select the last child
+ * whose key is strictly smaller, because the duplicates of a key may
+ * span several leaves.
+ */
+static int
+find_child(struct bptree_node *n, bptree_key_t key, int inclusive)
+{
+  int i;
+
+  for(i = 1; i < n->count; i++) {
+    if(n->entries[i].key > key || (!inclusive && n->entries[i].key == key)) {
+      break;
+    }
+  }
+  return i - 1;
+}
+
+static db_result_t
+find_leaf(bptree_t *tree, bptree_key_t key, bptree_node_id_t *leaf)
+{
+  bptree_node_id_t id;
+  int depth;
+
+  for(id = tree->root, depth = 0; id != NODE_NONE; depth++) {
+    if(depth >= DB_BPLUSTREE_MAX_HEIGHT ||
+       DB_ERROR(node_read(tree, id, &node))) {
+      return DB_INDEX_ERROR;
+    }
+    if(node.leaf) {
+      break;
+    }
+    id = node.entries[find_child(&node, key, 0)].value;
+  }
+
+  *leaf = id;
+  return DB_OK;
+}
+
+static db_result_t
+insert_entry(bptree_t *tree, bptree_key_t key, tuple_id_t tuple_id)
+{
+  bptree_node_id_t path[DB_BPLUSTREE_MAX_HEIGHT];
+  bptree_node_id_t id;
+  bptree_node_id_t new_id;
+  bptree_node_id_t root_id;
+  struct bptree_entry entry;
+  int depth;
+  int full;
+  int pos;
+  int split;
+  int i;
+
+  entry.key = key;
+  entry.value = tuple_id;
+
+  if(tree->root == NODE_NONE) {
+    id = node_allocate(tree);
+    if(id == NODE_NONE) {
+      return DB_LIMIT_ERROR;
+    }
+    memset(&node, 0, sizeof(node));
+    node.leaf = 1;
+    node.count = 1;
+    node.entries[0] = entry;
+    tree->root = id;
+    if(DB_ERROR(node_write(tree, id, &node)) ||
+       DB_ERROR(header_write(tree))) {
+      return DB_STORAGE_ERROR;
+    }
+    return DB_OK;
+  }
+
+  /*
+   * Descend to the leaf, and remember the path for splits. The full
+   * nodes at the end of the path are the ones that will be split.
+   */
+  for(id = tree->root, depth = 0, full = 0;; depth++) {
+    if(depth >= DB_BPLUSTREE_MAX_HEIGHT ||
+       DB_ERROR(node_read(tree, id, &node))) {
+      return DB_INDEX_ERROR;
+    }
+    path[depth] = id;
+    full = node.count < ORDER ? 0 : full + 1;
+    if(node.leaf) {
+      break;
+    }
+    id = node.entries[find_child(&node, key, 1)].value;
+  }
+
+  /* Do not start splitting nodes unless all of the splits can be done. */
+  if(full > depth && depth + 1 >= DB_BPLUSTREE_MAX_HEIGHT) {
+    return DB_LIMIT_ERROR;
+  }
+  if(!nodes_available(tree, full > depth ? full + 1 : full)) {
+    return DB_LIMIT_ERROR;
+  }
+
+  for(pos = node.count; pos > 0 && node.entries[pos - 1].key > key; pos--);
+
+  for(;;) {
+    if(node.count < ORDER) {
+      memmove(&node.entries[pos + 1], &node.entries[pos],
+              (node.count - pos) * sizeof(node.entries[0]));
+      node.entries[pos] = entry;
+      node.count++;
+      return node_write(tree, path[depth], &node);
+    }
+
+    new_id = node_allocate(tree);
+    if(new_id == NODE_NONE) {
+      return DB_STORAGE_ERROR;
+    }
+    root_id = NODE_NONE;
+    if(depth == 0) {
+      /* The root is split; the tree grows by one level. */
+      root_id = node_allocate(tree);
+      if(root_id == NODE_NONE) {
+        return DB_STORAGE_ERROR;
+      }
+    }
+
+    memcpy(split_entries, node.entries, pos * sizeof(split_entries[0]));
+    split_entries[pos] = entry;
+    memcpy(&split_entries[pos + 1], &node.entries[pos],
+           (ORDER - pos) * sizeof(split_entries[0]));
+
+    /* Keep the left node full when appending to the end of the node. */
+    split = pos == ORDER ? ORDER : (ORDER + 1) / 2;
+
+    memset(&split_node, 0, sizeof(split_node));
+    split_node.leaf = node.leaf;
+    split_node.count = ORDER + 1 - split;
+    memcpy(split_node.entries, &split_entries[split],
+           split_node.count * sizeof(split_node.entries[0]));
+    node.count = split;
+    memcpy(node.entries, split_entries, split * sizeof(node.entries[0]));
+    if(node.leaf) {
+      split_node.next = node.next;
+      node.next = new_id;
+    }
+
+    PRINTF("DB: Split B+-tree node %u into node %u at position %d\n",
+           (unsigned)path[depth], (unsigned)new_id, split);
+
+    if(DB_ERROR(node_write(tree, new_id, &split_node)) ||
+       DB_ERROR(node_write(tree, path[depth], &node))) {
+      return DB_STORAGE_ERROR;
+    }
+
+    entry.key = split_node.entries[0].key;
+    entry.value = new_id;
+
+    if(root_id != NODE_NONE) {
+      memset(&node, 0, sizeof(node));
+      node.count = 2;
+      node.entries[0].key = split_entries[0].key;
+      node.entries[0].value = tree->root;
+      node.entries[1] = entry;
+      tree->root = root_id;
+      if(DB_ERROR(node_write(tree, root_id, &node)) ||
+         DB_ERROR(header_write(tree))) {
+        return DB_STORAGE_ERROR;
+      }
+      return DB_OK;
+    }
+
+    /* Insert the new node into the parent after the split node. */
+    depth--;
+    if(DB_ERROR(node_read(tree, path[depth], &node))) {
+      return DB_INDEX_ERROR;
+    }
+    for(i = 0; i < node.count && node.entries[i].value != path[depth + 1]; i++);
+    pos = i + 1;
+    if(pos > node.count) {
+      return DB_INCONSISTENCY_ERROR;
+    }
+  }
+}
+
+static db_result_t
+create(index_t *index)
+{
+  char *filename;
+  bptree_t *tree;
+  unsigned long size;
+
+  size = ((unsigned long)DB_BPLUSTREE_NODE_LIMIT + 1) * sizeof(struct bptree_node);
+
+  filename = storage_generate_file("bptree", size);
+  if(filename == NULL) {
+    PRINTF("DB: Failed to generate a B+-tree file\n");
+    return DB_INDEX_ERROR;
+  }
+
+  memcpy(index->descriptor_file, filename, sizeof(index->descriptor_file));
+
+#if DB_FEATURE_COFFEE
+  /* Let each log record hold exactly one node. */
+  cfs_coffee_configure_log(index->descriptor_file,
+                           DB_BPLUSTREE_LOG_RECORDS * sizeof(struct bptree_node),
+                           sizeof(struct bptree_node));
+#endif
+
+  tree = memb_alloc(&trees);
+  if(tree == NULL) {
+    PRINTF("DB: Failed to allocate a B+-tree\n");
+    cfs_remove(index->descriptor_file);
+    index->descriptor_file[0] = '\0';
+    return DB_ALLOCATION_ERROR;
+  }
+
+  tree->fd = cfs_open(index->descriptor_file, CFS_READ | CFS_WRITE);
+  tree->root = NODE_NONE;
+  tree->node_count = HEADER_NODE + 1;
+  if(tree->fd < 0 || DB_ERROR(header_write(tree))) {
+    cfs_close(tree->fd);
+    memb_free(&trees, tree);
+    cfs_remove(index->descriptor_file);
+    index->descriptor_file[0] = '\0';
+    return DB_STORAGE_ERROR;
+  }
+
+  index->opaque_data = tree;
+
+  PRINTF("DB: Created a B+-tree index in file %s using %lu bytes of space\n",
+         index->descriptor_file, size);
+
+  return DB_OK;
+}
+
+static db_result_t
+destroy(index_t *index)
+{
+  if(index->opaque_data != NULL) {
+    release(index);
+  }
+  cfs_remove(index->descriptor_file);
+  return DB_OK;
+}
+
+static db_result_t
+load(index_t *index)
+{
+  bptree_t *tree;
+  struct bptree_header header;
+
+  tree = memb_alloc(&trees);
+  if(tree == NULL) {
+    PRINTF("DB: Failed to allocate a B+-tree\n");
+    return DB_ALLOCATION_ERROR;
+  }
+
+  tree->fd = cfs_open(index->descriptor_file, CFS_READ | CFS_WRITE);
+  if(tree->fd < 0 ||
+     DB_ERROR(file_read(tree, &header, HEADER_NODE, sizeof(header)))) {
+    cfs_close(tree->fd);
+    memb_free(&trees, tree);
+    return DB_STORAGE_ERROR;
+  }
+
+  tree->root = header.root;
+  tree->node_count = header.node_count;
+  if(tree->node_count == 0) {
+    tree->node_count = HEADER_NODE + 1;
+  }
+  index->opaque_data = tree;
+
+  PRINTF("DB: Loaded a B+-tree index with %u nodes from file %s\n",
+         (unsigned)tree->node_count - 1, index->descriptor_file);
+
+  return DB_OK;
+}
+
+static db_result_t
+release(index_t *index)
+{
+  bptree_t *tree;
+
+  tree = index->opaque_data;
+
+  cache_invalidate(tree);
+  cfs_close(tree->fd);
+  memb_free(&trees, tree);
+  index->opaque_data = NULL;
+
+  return DB_OK;
+}
+
+/*
+ * A long is wider than a key on some platforms. Such values would
+ * collide with other keys once truncated, so they cannot be indexed.
+ */
+static int
+key_in_range(long key)
+{
+  return key >= INT32_MIN && key <= INT32_MAX;
+}
+
+static db_result_t
+insert(index_t *index, attribute_value_t *key, tuple_id_t value)
+{
+  long long_key;
+
+  long_key = db_value_to_long(key);
+  if(!key_in_range(long_key)) {
+    PRINTF("DB: Key %ld is out of range for a B+-tree index\n", long_key);
+    return DB_INDEX_ERROR;
+  }
+
+  if(DB_ERROR(insert_entry(index->opaque_data, (bptree_key_t)long_key, value))) {
+    PRINTF("DB: Failed to insert key %ld into a B+-tree index\n", long_key);
+    return DB_INDEX_ERROR;
+  }
+  return DB_OK;
+}
+
+static db_result_t
+delete(index_t *index, attribute_value_t *value)
+{
+  bptree_t *tree;
+  bptree_node_id_t id;
+  bptree_key_t key;
+  long long_key;
+  unsigned removed;
+  int i;
+  int j;
+
+  tree = index->opaque_data;
+  long_key = db_value_to_long(value);
+  if(!key_in_range(long_key)) {
+    /* Such a key cannot have been inserted. */
+    return DB_INDEX_ERROR;
+  }
+  key = (bptree_key_t)long_key;
+
+  if(DB_ERROR(find_leaf(tree, key, &id))) {
+    return DB_INDEX_ERROR;
+  }
+
+  /* Remove all entries with the key, which may span several leaves.
+     Leaves are not merged, but an empty leaf remains linked and is
+     skipped during iterations. */
+  removed = 0;
+  while(id != NODE_NONE) {
+    if(DB_ERROR(node_read(tree, id, &node))) {
+      return DB_INDEX_ERROR;
+    }
+    for(i = j = 0; i < node.count; i++) {
+      if(node.entries[i].key != key) {
+        node.entries[j++] = node.entries[i];
+      }
+    }
+    if(j < node.count) {
+      removed += node.count - j;
+      node.count = j;
+      if(DB_ERROR(node_write(tree, id, &node))) {
+        return DB_STORAGE_ERROR;
+      }
+    }
+    if(node.count > 0 && node.entries[node.count - 1].key > key) {
+      break;
+    }
+    id = node.next;
+  }
+
+  return removed > 0 ? DB_OK : DB_INDEX_ERROR;
+}
+
+static tuple_id_t
+get_next(index_iterator_t *iterator)
+{
+  struct iteration_cache {
+    index_iterator_t *index_iterator;
+    bptree_node_id_t leaf;
+    uint8_t position;
+  };
+  static struct iteration_cache cache;
+  bptree_t *tree;
+  long min;
+  long max;
+  long key;
+
+  tree = (bptree_t *)iterator->index->opaque_data;
+  min = db_value_to_long(&iterator->min_value);
+  max = db_value_to_long(&iterator->max_value);
+
+  if(cache.index_iterator != iterator || iterator->next_item_no == 0) {
+    /* Initialize the cache for a new search. */
+    cache.index_iterator = iterator;
+    cache.position = 0;
+    if(min < INT32_MIN) {
+      min = INT32_MIN;
+    } else if(min > INT32_MAX) {
+      return INVALID_TUPLE;
+    }
+    if(DB_ERROR(find_leaf(tree, (bptree_key_t)min, &cache.leaf))) {
+      cache.leaf = NODE_NONE;
+    }
+  }
+
+  while(cache.leaf != NODE_NONE) {
+    if(DB_ERROR(node_read(tree, cache.leaf, &node))) {
+      break;
+    }
+
+    for(; cache.position < node.count; cache.position++) {
+      key = node.entries[cache.position].key;
+      if(key < min) {
+        continue;
+      }
+      if(key > max) {
+        cache.leaf = NODE_NONE;
+        return INVALID_TUPLE;
+      }
+      iterator->next_item_no++;
+      return (tuple_id_t)node.entries[cache.position++].value;
+    }
+
+    cache.leaf = node.next;
+    cache.position = 0;
+  }
+
+  return INVALID_TUPLE;
+}
@@ -403,6 +403,328 @@ lvm_execute(lvm_instance_t *p)
   return status;
 }
 
+#if LVM_BATCH_SIZE > 0
+/*
+ * The batch evaluator interprets the bytecode once for a batch of
+ * tuples. The values of each variable are given in a column with one
+ * element per tuple, and every operator is applied to whole columns.
+ *
+ * The error vector records the first error that occurs for each tuple,
+ * in the same evaluation order as eval_expr() and eval_logic(). A
+ * tuple with an error is excluded from further computations.
+ *
+ * The intermediate columns of each operator level are kept in static
+ * frames rather than on the stack, which would otherwise grow by a
+ * few columns for every level of the recursion.
+ */
+static long batch_columns[LVM_MAX_VARIABLE_ID - 1][LVM_BATCH_SIZE];
+
+struct batch_frame {
+  long buffer[2][LVM_BATCH_SIZE];
+  uint8_t logic_result[LVM_BATCH_SIZE];
+};
+static struct batch_frame batch_frames[LVM_BATCH_MAX_DEPTH];
+static unsigned batch_depth;
+
+#define VARIABLE_COUNT (sizeof(variables) / sizeof(variables[0]))
+
+static void
+set_error(uint8_t *errors, unsigned index, lvm_status_t status)
+{
+  if(errors[index] == 0) {
+    errors[index] = status;
+  }
+}
+
+static long *
+get_batch_operand(lvm_instance_t *p, unsigned count, long *buffer)
+{
+  operand_t operand;
+  long value;
+  unsigned i;
+
+  get_operand(p, &operand);
+  if(operand.type == LVM_VARIABLE && operand.value.id < VARIABLE_COUNT) {
+    return batch_columns[operand.value.id];
+  }
+
+  value = operand_to_long(&operand);
+  for(i = 0; i < count; i++) {
+    buffer[i] = value;
+  }
+  return buffer;
+}
+
+static lvm_status_t eval_expr_batch(lvm_instance_t *, operator_t, unsigned,
+                                    long *, uint8_t *);
+
+static lvm_status_t
+get_batch_values(lvm_instance_t *p, unsigned count, long *buffer,
+                 long **values, uint8_t *errors)
+{
+  operator_t *operator;
+  lvm_status_t r;
+
+  switch(get_type(p)) {
+  case LVM_ARITH_OP:
+    operator = get_operator(p);
+    r = eval_expr_batch(p, *operator, count, buffer, errors);
+    if(LVM_ERROR(r)) {
+      return r;
+    }
+    *values = buffer;
+    break;
+  case LVM_OPERAND:
+    *values = get_batch_operand(p, count, buffer);
+    break;
+  default:
+    return SEMANTIC_ERROR;
+  }
+
+  return TRUE;
+}
+
+static lvm_status_t
+eval_expr_batch(lvm_instance_t *p, operator_t op, unsigned count,
+                long *result, uint8_t *errors)
+{
+  struct batch_frame *frame;
+  long *value[2];
+  lvm_status_t r;
+  unsigned i;
+
+  if(batch_depth >= LVM_BATCH_MAX_DEPTH) {
+    return STACK_OVERFLOW;
+  }
+  frame = &batch_frames[batch_depth++];
+
+  for(i = 0; i < 2; i++) {
+    r = get_batch_values(p, count, frame->buffer[i], &value[i], errors);
+    if(LVM_ERROR(r)) {
+      batch_depth--;
+      return r;
+    }
+  }
+  /* The operand columns stay valid, no deeper level is entered again. */
+  batch_depth--;
+
+  switch(op) {
+  case LVM_ADD:
+    for(i = 0; i < count; i++) {
+      result[i] = value[0][i] + value[1][i];
+    }
+    break;
+  case LVM_SUB:
+    for(i = 0; i < count; i++) {
+      result[i] = value[0][i] - value[1][i];
+    }
+    break;
+  case LVM_MUL:
+    for(i = 0; i < count; i++) {
+      result[i] = value[0][i] * value[1][i];
+    }
+    break;
+  case LVM_DIV:
+    for(i = 0; i < count; i++) {
+      if(value[1][i] == 0) {
+        set_error(errors, i, MATH_ERROR);
+        result[i] = 0;
+      } else {
+        result[i] = value[0][i] / value[1][i];
+      }
+    }
+    break;
+  default:
+    return EXECUTION_ERROR;
+  }
+
+  return TRUE;
+}
+
+static lvm_status_t eval_logic_frame(lvm_instance_t *, struct batch_frame *,
+                                     operator_t, unsigned, uint8_t *,
+                                     uint8_t *);
+
+static lvm_status_t
+eval_logic_batch(lvm_instance_t *p, operator_t op, unsigned count,
+                 uint8_t *result, uint8_t *errors)
+{
+  lvm_status_t r;
+
+  if(batch_depth >= LVM_BATCH_MAX_DEPTH) {
+    return STACK_OVERFLOW;
+  }
+  r = eval_logic_frame(p, &batch_frames[batch_depth++], op, count,
+                       result, errors);
+  batch_depth--;
+  return r;
+}
+
+static lvm_status_t
+eval_logic_frame(lvm_instance_t *p, struct batch_frame *frame, operator_t op,
+                 unsigned count, uint8_t *result, uint8_t *errors)
+{
+  long *value[2];
+  operator_t *operator;
+  lvm_status_t r;
+  unsigned i;
+
+  if(IS_CONNECTIVE(op)) {
+    if(get_type(p) != LVM_CMP_OP) {
+      return SEMANTIC_ERROR;
+    }
+    operator = get_operator(p);
+    r = eval_logic_batch(p, *operator, count, result, errors);
+    if(LVM_ERROR(r)) {
+      return r;
+    }
+
+    if(op == LVM_NOT) {
+      for(i = 0; i < count; i++) {
+        result[i] = !result[i];
+      }
+      return TRUE;
+    }
+
+    if(get_type(p) != LVM_CMP_OP) {
+      return SEMANTIC_ERROR;
+    }
+    operator = get_operator(p);
+    r = eval_logic_batch(p, *operator, count, frame->logic_result, errors);
+    if(LVM_ERROR(r)) {
+      return r;
+    }
+
+    for(i = 0; i < count; i++) {
+      if(op == LVM_AND) {
+        result[i] = result[i] && frame->logic_result[i];
+      } else {
+        result[i] = result[i] || frame->logic_result[i];
+      }
+    }
+    return TRUE;
+  }
+
+  for(i = 0; i < 2; i++) {
+    r = get_batch_values(p, count, frame->buffer[i], &value[i], errors);
+    if(LVM_ERROR(r)) {
+      return r;
+    }
+  }
+
+  switch(op) {
+  case LVM_EQ:
+    for(i = 0; i < count; i++) {
+      result[i] = value[0][i] == value[1][i];
+    }
+    break;
+  case LVM_NEQ:
+    for(i = 0; i < count; i++) {
+      result[i] = value[0][i] != value[1][i];
+    }
+    break;
+  case LVM_GE:
+    for(i = 0; i < count; i++) {
+      result[i] = value[0][i] > value[1][i];
+    }
+    break;
+  case LVM_GEQ:
+    for(i = 0; i < count; i++) {
+      result[i] = value[0][i] >= value[1][i];
+    }
+    break;
+  case LVM_LE:
+    for(i = 0; i < count; i++) {
+      result[i] = value[0][i] < value[1][i];
+    }
+    break;
+  case LVM_LEQ:
+    for(i = 0; i < count; i++) {
+      result[i] = value[0][i] <= value[1][i];
+    }
+    break;
+  default:
+    return EXECUTION_ERROR;
+  }
+
+  return TRUE;
+}
+
+/* Get the column that holds the values of a variable in a batch, or
+   NULL if the variable is not used by the current expression. */
+long *
+lvm_get_batch_column(char *name)
+{
+  variable_id_t id;
+
+  id = lookup(name);
+  if(id >= VARIABLE_COUNT || variables[id].name[0] == '\0') {
+    return NULL;
+  }
+  return batch_columns[id];
+}
+
+/* Evaluate the expression for one tuple of the batch at a time. */
+static lvm_status_t
+execute_each(lvm_instance_t *p, unsigned count, uint8_t *results)
+{
+  variable_id_t id;
+  unsigned i;
+
+  for(i = 0; i < count; i++) {
+    for(id = 0; id < VARIABLE_COUNT; id++) {
+      if(variables[id].name[0] != '\0' && variables[id].type == LVM_LONG) {
+        variables[id].value.l = batch_columns[id][i];
+      }
+    }
+    results[i] = lvm_execute(p);
+  }
+
+  return TRUE;
+}
+
+/* Evaluate the expression for the first count tuples in the batch
+   columns. The status of each tuple is stored in the results vector. */
+lvm_status_t
+lvm_execute_batch(lvm_instance_t *p, unsigned count, uint8_t *results)
+{
+  uint8_t errors[LVM_BATCH_SIZE];
+  operator_t *operator;
+  lvm_status_t status;
+  unsigned i;
+
+  if(count > LVM_BATCH_SIZE) {
+    return EXECUTION_ERROR;
+  }
+
+  memset(errors, 0, count);
+
+  p->ip = 0;
+  if(get_type(p) != LVM_CMP_OP) {
+    PRINTF("Error: The code must start with a relational operator\n");
+    status = EXECUTION_ERROR;
+  } else {
+    operator = get_operator(p);
+    batch_depth = 0;
+    status = eval_logic_batch(p, *operator, count, results, errors);
+    if(status == STACK_OVERFLOW) {
+      PRINTF("The expression is too deep for a batch\n");
+      return execute_each(p, count, results);
+    }
+  }
+
+  for(i = 0; i < count; i++) {
+    if(LVM_ERROR(status)) {
+      results[i] = status;
+    } else if(errors[i] != 0) {
+      results[i] = errors[i];
+    }
+  }
+
+  return status;
+}
+#endif /* LVM_BATCH_SIZE > 0 */
+
 void
 lvm_set_op(lvm_instance_t *p, operator_t op)
 {
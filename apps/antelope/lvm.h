@@ -128,6 +128,11 @@ lvm_status_t lvm_get_derived_range(lvm_instance_t *p, char *name,
                                    operand_value_t *max);
 void lvm_print_derivations(lvm_instance_t *p);
 lvm_status_t lvm_execute(lvm_instance_t *p);
+#if LVM_BATCH_SIZE > 0
+long *lvm_get_batch_column(char *name);
+lvm_status_t lvm_execute_batch(lvm_instance_t *p, unsigned count,
+                               uint8_t *results);
+#endif /* LVM_BATCH_SIZE > 0 */
 lvm_status_t lvm_register_variable(char *name, operand_type_t type);
 lvm_status_t lvm_set_variable_value(char *name, operand_value_t value);
 void lvm_print_code(lvm_instance_t *p);
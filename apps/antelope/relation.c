@@ -79,6 +79,30 @@ struct source_map {
 };
 
 static struct source_map source_map[AQL_ATTRIBUTE_LIMIT];
+
+/*
+ * A join is processed by one of three methods, which are chosen by
+ * select_join_method() according to the estimated number of row reads.
+ */
+#define JOIN_NESTED_INDEX	0
+#define JOIN_HASH		1
+#define JOIN_MERGE		2
+
+/*
+ * The hash join table holds the join attribute values of a partition
+ * of the right relation. The items of each bucket are chained through
+ * their indexes in the item array.
+ */
+struct join_hash_item {
+  long key;
+  tuple_id_t tuple_id;
+  uint16_t next;
+};
+
+#define JOIN_HASH_END		0xffff
+
+static struct join_hash_item join_hash_items[DB_JOIN_HASH_ITEMS];
+static uint16_t join_hash_buckets[DB_JOIN_HASH_BUCKETS];
 #endif /* DB_FEATURE_JOIN */
 
 static unsigned char row[DB_MAX_ATTRIBUTES_PER_RELATION * DB_MAX_ELEMENT_SIZE];
@@ -88,6 +112,16 @@ static unsigned char * const left_row = row;
 static unsigned char * const right_row = extra_row;
 static unsigned char * const join_row = result_row;
 
+#if DB_SELECT_BATCH_SIZE > 0
+#if DB_SELECT_BATCH_SIZE > 255
+#error "DB_SELECT_BATCH_SIZE must be smaller than 256."
+#endif
+/* The rows of a batch as read from storage, and the predicate
+   evaluation status of each row. */
+static unsigned char batch_rows[DB_SELECT_BATCH_SIZE * sizeof(row)];
+static uint8_t batch_status[DB_SELECT_BATCH_SIZE];
+#endif /* DB_SELECT_BATCH_SIZE > 0 */
+
 LIST(relations);
 MEMB(relations_memb, relation_t, DB_RELATION_POOL_SIZE);
 MEMB(attributes_memb, attribute_t, DB_ATTRIBUTE_POOL_SIZE);
@@ -261,15 +295,19 @@ end:
 db_result_t
 relation_release(relation_t *rel)
 {
+  db_result_t result;
+
   if(rel->references > 0) {
     rel->references--;
   }
 
+  result = DB_OK;
   if(rel->references == 0) {
+    result = storage_flush(rel);
     storage_unload(rel);
   }
 
-  return DB_OK;
+  return result;
 }
 
 relation_t *
@@ -655,7 +693,8 @@ select_index(db_handle_t *handle, lvm_instance_t *lvm_instance)
 
       if(range <= min_range) {
         index = attr->index;
-        av_min.domain = av_max.domain = DOMAIN_INT;
+        min_range = range;
+        av_min.domain = av_max.domain = DOMAIN_LONG;
         VALUE_LONG(&av_min) = min.l;
         VALUE_LONG(&av_max) = max.l;
       }
@@ -703,6 +742,14 @@ generate_selection_result(db_handle_t *handle, relation_t *rel, aql_adt_t *adt)
     }
   }
 
+#if DB_SELECT_BATCH_SIZE > 0
+  /* Relations that are scanned sequentially are processed in batches. */
+  if(!(handle->flags & DB_HANDLE_FLAG_SEARCH_INDEX)) {
+    handle->flags |= DB_HANDLE_FLAG_BATCH;
+    handle->batch_position = handle->batch_count = 0;
+  }
+#endif /* DB_SELECT_BATCH_SIZE > 0 */
+
   handle->flags |= DB_HANDLE_FLAG_PROCESSING;
 
   return DB_OK;
@@ -731,6 +778,70 @@ relation_process_remove(void *handle_ptr)
 }
 #endif
 
+#if DB_SELECT_BATCH_SIZE > 0
+/*
+ * Read the next batch of rows from the relation, and evaluate the
+ * predicate for all of them. The values of the attributes that are
+ * used in the predicate are stored in the LVM's batch columns.
+ */
+static db_result_t
+read_batch(db_handle_t *handle, aql_adt_t *adt)
+{
+  db_result_t result;
+  unsigned count;
+  unsigned i;
+  size_t row_length;
+  struct source_dest_map *attr_map_ptr, *attr_map_end;
+  attribute_t *result_attr;
+  unsigned char *from_ptr;
+  long *column;
+
+  row_length = handle->rel->row_length;
+  count = DB_SELECT_BATCH_SIZE;
+
+  result = storage_get_rows(handle->rel, handle->tuple_id, batch_rows, &count);
+  if(result != DB_OK) {
+    return result;
+  }
+
+  handle->batch_position = 0;
+  handle->batch_count = count;
+
+  if(adt->lvm_instance == NULL) {
+    return DB_OK;
+  }
+
+  attr_map_end = attr_map + handle->result_rel->attribute_count;
+  for(attr_map_ptr = attr_map; attr_map_ptr < attr_map_end; attr_map_ptr++) {
+    result_attr = attr_map_ptr->to_attr;
+    if(result_attr->domain != DOMAIN_INT && result_attr->domain != DOMAIN_LONG) {
+      continue;
+    }
+
+    column = lvm_get_batch_column(result_attr->name);
+    if(column == NULL) {
+      continue;
+    }
+
+    from_ptr = batch_rows + attr_map_ptr->from_offset;
+    for(i = 0; i < count; i++, from_ptr += row_length) {
+      if(result_attr->domain == DOMAIN_INT) {
+        column[i] = from_ptr[0] << 8 | from_ptr[1];
+      } else {
+        column[i] = (uint32_t)from_ptr[0] << 24 |
+                    (uint32_t)from_ptr[1] << 16 |
+                    (uint32_t)from_ptr[2] << 8 |
+                    from_ptr[3];
+      }
+    }
+  }
+
+  lvm_execute_batch(adt->lvm_instance, count, batch_status);
+
+  return DB_OK;
+}
+#endif /* DB_SELECT_BATCH_SIZE > 0 */
+
 db_result_t
 relation_process_select(void *handle_ptr)
 {
@@ -746,6 +857,8 @@ relation_process_select(void *handle_ptr)
   uint8_t intbuf[2];
   attribute_value_t value;
   lvm_status_t wanted_result;
+  lvm_status_t status;
+  unsigned char *tuple;
 
   handle = (db_handle_t *)handle_ptr;
   adt = (aql_adt_t *)handle->adt;
@@ -769,61 +882,76 @@ relation_process_select(void *handle_ptr)
     }
   }
 
-  /* Put the tuples fulfilling the given condition into a new relation.
-     The tuples may be projected. */
-  result = storage_get_row(handle->rel, &handle->tuple_id, row);
-  handle->tuple_id++;
-  if(DB_ERROR(result)) {
-    PRINTF("DB: Failed to get a row in relation %s!\n", handle->rel->name);
-    return result;
-  } else if(result == DB_FINISHED) {
-    if(AQL_GET_FLAGS(adt) & AQL_FLAG_AGGREGATE) {
-      goto end_aggregation;
-    }
-    return DB_FINISHED;
+  wanted_result = TRUE;
+  if(AQL_GET_FLAGS(adt) & AQL_FLAG_INVERSE_LOGIC) {
+    wanted_result = FALSE;
   }
 
-  /* Process the attributes in the result relation. */
-  for(attr_map_ptr = attr_map; attr_map_ptr < attr_map_end; attr_map_ptr++) {
-    from_ptr = row + attr_map_ptr->from_offset;
-    result_attr = attr_map_ptr->to_attr;
-
-    /* Update the internal state of the PLE. */
-    if(result_attr->domain == DOMAIN_INT) {
-      operand_value.l = from_ptr[0] << 8 | from_ptr[1];
-      lvm_set_variable_value(result_attr->name, operand_value);
-    } else if(result_attr->domain == DOMAIN_LONG) {
-      operand_value.l = (uint32_t)from_ptr[0] << 24 |
-                        (uint32_t)from_ptr[1] << 16 |
-                        (uint32_t)from_ptr[2] << 8 |
-                        from_ptr[3];
-      lvm_set_variable_value(result_attr->name, operand_value);
+#if DB_SELECT_BATCH_SIZE > 0
+  if(handle->flags & DB_HANDLE_FLAG_BATCH) {
+    if(handle->batch_position == handle->batch_count) {
+      result = read_batch(handle, adt);
+      if(DB_ERROR(result)) {
+        PRINTF("DB: Failed to get rows in relation %s!\n", handle->rel->name);
+        return result;
+      } else if(result == DB_FINISHED) {
+        if(AQL_GET_FLAGS(adt) & AQL_FLAG_AGGREGATE) {
+          goto end_aggregation;
+        }
+        return DB_FINISHED;
+      }
     }
 
-    if(result_attr->flags & ATTRIBUTE_FLAG_NO_STORE) {
-      /* The attribute is used just for the predicate,
-         so do not copy the current value into the result. */
-      continue;
+    tuple = batch_rows + handle->batch_position * handle->rel->row_length;
+    status = adt->lvm_instance == NULL ? TRUE :
+      batch_status[handle->batch_position];
+    handle->batch_position++;
+    handle->tuple_id++;
+  } else
+#endif /* DB_SELECT_BATCH_SIZE > 0 */
+  {
+    /* Put the tuples fulfilling the given condition into a new relation.
+       The tuples may be projected. */
+    result = storage_get_row(handle->rel, &handle->tuple_id, row);
+    handle->tuple_id++;
+    if(DB_ERROR(result)) {
+      PRINTF("DB: Failed to get a row in relation %s!\n", handle->rel->name);
+      return result;
+    } else if(result == DB_FINISHED) {
+      if(AQL_GET_FLAGS(adt) & AQL_FLAG_AGGREGATE) {
+        goto end_aggregation;
+      }
+      return DB_FINISHED;
     }
+    tuple = row;
 
-    if(!(AQL_GET_FLAGS(adt) & AQL_FLAG_AGGREGATE)) {
-      /* No aggregators. Copy the original value into the resulting tuple. */
-      memcpy(result_row + attr_map_ptr->to_offset, from_ptr,
-             result_attr->element_size);
+    status = TRUE;
+    if(adt->lvm_instance != NULL) {
+      /* Update the internal state of the PLE. */
+      for(attr_map_ptr = attr_map; attr_map_ptr < attr_map_end; attr_map_ptr++) {
+        from_ptr = row + attr_map_ptr->from_offset;
+        result_attr = attr_map_ptr->to_attr;
+
+        if(result_attr->domain == DOMAIN_INT) {
+          operand_value.l = from_ptr[0] << 8 | from_ptr[1];
+          lvm_set_variable_value(result_attr->name, operand_value);
+        } else if(result_attr->domain == DOMAIN_LONG) {
+          operand_value.l = (uint32_t)from_ptr[0] << 24 |
+                            (uint32_t)from_ptr[1] << 16 |
+                            (uint32_t)from_ptr[2] << 8 |
+                            from_ptr[3];
+          lvm_set_variable_value(result_attr->name, operand_value);
+        }
+      }
+      status = lvm_execute(adt->lvm_instance);
     }
   }
 
-  wanted_result = TRUE;
-  if(AQL_GET_FLAGS(adt) & AQL_FLAG_INVERSE_LOGIC) {
-    wanted_result = FALSE;
-  }
-
   /* Check whether the given predicate is true for this tuple. */
-  if(adt->lvm_instance == NULL ||
-     lvm_execute(adt->lvm_instance) == wanted_result) {
+  if(adt->lvm_instance == NULL || status == wanted_result) {
     if(AQL_GET_FLAGS(adt) & AQL_FLAG_AGGREGATE) {
       for(attr_map_ptr = attr_map; attr_map_ptr < attr_map_end; attr_map_ptr++) {
-        from_ptr = row + attr_map_ptr->from_offset;
+        from_ptr = tuple + attr_map_ptr->from_offset;
         result = db_phy_to_value(&value, attr_map_ptr->to_attr, from_ptr);
         if(DB_ERROR(result)) {
 	  return result;
@@ -831,6 +959,15 @@ relation_process_select(void *handle_ptr)
         aggregate(attr_map_ptr->to_attr, &value);
       }
     } else {
+      /* No aggregators. Copy the projected values into the resulting tuple. */
+      for(attr_map_ptr = attr_map; attr_map_ptr < attr_map_end; attr_map_ptr++) {
+        result_attr = attr_map_ptr->to_attr;
+        if(!(result_attr->flags & ATTRIBUTE_FLAG_NO_STORE)) {
+          memcpy(result_row + attr_map_ptr->to_offset,
+                 tuple + attr_map_ptr->from_offset, result_attr->element_size);
+        }
+      }
+
       if(AQL_GET_FLAGS(adt) & AQL_FLAG_ASSIGN) {
         if(DB_ERROR(storage_put_row(handle->result_rel, result_row))) {
           PRINTF("DB: Failed to store a row in the result relation!\n");
@@ -959,24 +1096,79 @@ relation_select(void *handle_ptr, relation_t *rel, void *adt_ptr)
 }
 
 #if DB_FEATURE_JOIN
-db_result_t
-relation_process_join(void *handle_ptr)
+static db_result_t
+get_join_key(relation_t *rel, attribute_t *attr, unsigned char *row, long *key)
+{
+  attribute_value_t value;
+
+  if(DB_ERROR(relation_get_value(rel, attr, row, &value))) {
+    PRINTF("DB: Failed to get a value of the attribute \"%s\" to join on\n",
+	attr->name);
+    return DB_IMPLEMENTATION_ERROR;
+  }
+
+  *key = db_value_to_long(&value);
+  return DB_OK;
+}
+
+static db_result_t
+emit_join_row(db_handle_t *handle)
 {
-  db_handle_t *handle;
-  db_result_t result;
-  relation_t *left_rel;
-  relation_t *right_rel;
   relation_t *join_rel;
   unsigned char *join_next_attribute_ptr;
   size_t element_size;
+  int i;
+
+  join_rel = handle->join_rel;
+
+  /* Use the source attribute map to fill in the physical representation
+     of the resulting tuple. */
+  join_next_attribute_ptr = join_row;
+
+  for(i = 0; i < join_rel->attribute_count; i++) {
+    element_size = source_map[i].attr->element_size;
+
+    memcpy(join_next_attribute_ptr, source_map[i].from_ptr, element_size);
+    join_next_attribute_ptr += element_size;
+  }
+
+  if(((aql_adt_t *)handle->adt)->flags & AQL_FLAG_ASSIGN) {
+    if(DB_ERROR(storage_put_row(join_rel, join_row))) {
+      return DB_STORAGE_ERROR;
+    }
+  }
+
+  handle->current_row++;
+  return DB_GOT_ROW;
+}
+
+static db_result_t
+get_right_row(relation_t *right_rel, tuple_id_t tuple_id)
+{
+  db_result_t result;
+
+  result = storage_get_row(right_rel, &tuple_id, right_row);
+  if(DB_ERROR(result)) {
+    PRINTF("DB: Failed to get a row in right relation %s!\n", right_rel->name);
+    return result;
+  } else if(result == DB_FINISHED) {
+    PRINTF("DB: The join refers to an invalid row: %lu\n",
+           (unsigned long)tuple_id);
+    return DB_IMPLEMENTATION_ERROR;
+  }
+
+  return DB_OK;
+}
+
+static db_result_t
+process_nested_index_join(db_handle_t *handle)
+{
+  db_result_t result;
+  relation_t *left_rel;
   tuple_id_t right_tuple_id;
   attribute_value_t value;
-  int i;
 
-  handle = (db_handle_t *)handle_ptr;
   left_rel = handle->left_rel;
-  right_rel = handle->right_rel;
-  join_rel = handle->join_rel;
 
   if(!(handle->flags & DB_HANDLE_FLAG_INDEX_STEP)) {
     goto inner_loop;
@@ -1020,37 +1212,311 @@ inner_loop:
         break;
       }
 
-      result = storage_get_row(right_rel, &right_tuple_id, right_row);
+      result = get_right_row(handle->right_rel, right_tuple_id);
+      if(DB_ERROR(result)) {
+        return result;
+      }
+
+      return emit_join_row(handle);
+    }
+  }
+
+  return DB_OK;
+}
+
+/*
+ * Load the next partition of the right relation into the hash join
+ * table, starting from the tuple at the join cursor.
+ */
+static db_result_t
+build_hash_partition(db_handle_t *handle)
+{
+  relation_t *right_rel;
+  struct join_hash_item *item;
+  db_result_t result;
+  uint16_t count;
+  unsigned bucket;
+
+  right_rel = handle->right_rel;
+
+  for(bucket = 0; bucket < DB_JOIN_HASH_BUCKETS; bucket++) {
+    join_hash_buckets[bucket] = JOIN_HASH_END;
+  }
+
+  for(count = 0; count < DB_JOIN_HASH_ITEMS; count++) {
+    result = storage_get_row(right_rel, &handle->join_cursor, right_row);
+    if(DB_ERROR(result)) {
+      PRINTF("DB: Failed to get a row in right relation %s!\n", right_rel->name);
+      return result;
+    } else if(result == DB_FINISHED) {
+      handle->flags |= DB_HANDLE_FLAG_JOIN_END;
+      break;
+    }
+
+    item = &join_hash_items[count];
+    if(DB_ERROR(get_join_key(right_rel, handle->right_join_attr,
+                             right_row, &item->key))) {
+      return DB_IMPLEMENTATION_ERROR;
+    }
+    item->tuple_id = handle->join_cursor++;
+
+    bucket = (unsigned long)item->key % DB_JOIN_HASH_BUCKETS;
+    item->next = join_hash_buckets[bucket];
+    join_hash_buckets[bucket] = count;
+  }
+
+  PRINTF("DB: Loaded %u tuples of relation %s into the hash join table\n",
+         count, right_rel->name);
+
+  return count > 0 ? DB_OK : DB_FINISHED;
+}
+
+/*
+ * The hash join reads a partition of the right relation into RAM, and
+ * then probes the partition with each tuple of the left relation. The
+ * join attribute of the right relation need not be indexed.
+ */
+static db_result_t
+process_hash_join(db_handle_t *handle)
+{
+  db_result_t result;
+  struct join_hash_item *item;
+
+  for(;;) {
+    if(handle->flags & DB_HANDLE_FLAG_JOIN_BUILD) {
+      result = build_hash_partition(handle);
+      if(result != DB_OK) {
+        return result;
+      }
+      handle->flags &= ~DB_HANDLE_FLAG_JOIN_BUILD;
+      handle->flags |= DB_HANDLE_FLAG_INDEX_STEP;
+      handle->tuple_id = 0;
+    }
+
+    if(handle->flags & DB_HANDLE_FLAG_INDEX_STEP) {
+      result = storage_get_row(handle->left_rel, &handle->tuple_id, left_row);
       if(DB_ERROR(result)) {
-        PRINTF("DB: Failed to get a row in right relation %s!\n", right_rel->name);
+        PRINTF("DB: Failed to get a row in left relation %s!\n",
+               handle->left_rel->name);
         return result;
       } else if(result == DB_FINISHED) {
-	PRINTF("DB: The index refers to an invalid row: %lu\n",
-	       (unsigned long)right_tuple_id);
+        if(handle->flags & DB_HANDLE_FLAG_JOIN_END) {
+          return DB_FINISHED;
+        }
+        /* Continue with the next partition of the right relation. */
+        handle->flags |= DB_HANDLE_FLAG_JOIN_BUILD;
+        continue;
+      }
+
+      if(DB_ERROR(get_join_key(handle->left_rel, handle->left_join_attr,
+                               left_row, &handle->join_key))) {
         return DB_IMPLEMENTATION_ERROR;
       }
+      handle->tuple_id++;
+      handle->join_item = join_hash_buckets[(unsigned long)handle->join_key %
+                                            DB_JOIN_HASH_BUCKETS];
+      handle->flags &= ~DB_HANDLE_FLAG_INDEX_STEP;
+    }
 
-      /* Use the source attribute map to fill in the physical representation
-	 of the resulting tuple. */
-      join_next_attribute_ptr = join_row;
+    while(handle->join_item != JOIN_HASH_END) {
+      item = &join_hash_items[handle->join_item];
+      handle->join_item = item->next;
+      if(item->key == handle->join_key) {
+        result = get_right_row(handle->right_rel, item->tuple_id);
+        if(DB_ERROR(result)) {
+          return result;
+        }
+        return emit_join_row(handle);
+      }
+    }
 
-      for(i = 0; i < join_rel->attribute_count; i++) {
-	element_size = source_map[i].attr->element_size;
+    handle->flags |= DB_HANDLE_FLAG_INDEX_STEP;
+  }
+}
 
-	memcpy(join_next_attribute_ptr, source_map[i].from_ptr, element_size);
-	join_next_attribute_ptr += element_size;
+/*
+ * The merge join scans both relations once in the order of the join
+ * attribute. Tuples in the right relation that share a join value are
+ * scanned again for each left tuple with the same value.
+ */
+static db_result_t
+process_merge_join(db_handle_t *handle)
+{
+  db_result_t result;
+  long key;
+
+  for(;;) {
+    if(handle->flags & DB_HANDLE_FLAG_INDEX_STEP) {
+      result = storage_get_row(handle->left_rel, &handle->tuple_id, left_row);
+      if(result != DB_OK) {
+        return result;
       }
 
-      if(((aql_adt_t *)handle->adt)->flags & AQL_FLAG_ASSIGN) {
-        if(DB_ERROR(storage_put_row(join_rel, join_row))) {
-          return DB_STORAGE_ERROR;
+      if(DB_ERROR(get_join_key(handle->left_rel, handle->left_join_attr,
+                               left_row, &key))) {
+        return DB_IMPLEMENTATION_ERROR;
+      }
+
+      if((handle->flags & DB_HANDLE_FLAG_JOIN_GROUP) &&
+         key == handle->join_key) {
+        /* Rewind to the first right tuple with the same value. */
+        handle->join_cursor = handle->join_mark;
+      } else {
+        handle->flags &= ~DB_HANDLE_FLAG_JOIN_GROUP;
+        if(handle->flags & DB_HANDLE_FLAG_JOIN_END) {
+          return DB_FINISHED;
         }
       }
 
-      handle->current_row++;
-      return DB_GOT_ROW;
+      handle->join_key = key;
+      handle->tuple_id++;
+      handle->flags &= ~DB_HANDLE_FLAG_INDEX_STEP;
+    }
+
+    result = storage_get_row(handle->right_rel, &handle->join_cursor, right_row);
+    if(DB_ERROR(result)) {
+      PRINTF("DB: Failed to get a row in right relation %s!\n",
+             handle->right_rel->name);
+      return result;
+    } else if(result == DB_FINISHED) {
+      handle->flags |= DB_HANDLE_FLAG_JOIN_END | DB_HANDLE_FLAG_INDEX_STEP;
+      continue;
+    }
+
+    if(DB_ERROR(get_join_key(handle->right_rel, handle->right_join_attr,
+                             right_row, &key))) {
+      return DB_IMPLEMENTATION_ERROR;
+    }
+
+    if(key < handle->join_key) {
+      handle->join_cursor++;
+    } else if(key > handle->join_key) {
+      handle->flags |= DB_HANDLE_FLAG_INDEX_STEP;
+    } else {
+      if(!(handle->flags & DB_HANDLE_FLAG_JOIN_GROUP)) {
+        handle->join_mark = handle->join_cursor;
+        handle->flags |= DB_HANDLE_FLAG_JOIN_GROUP;
+      }
+      handle->join_cursor++;
+      return emit_join_row(handle);
     }
   }
+}
+
+db_result_t
+relation_process_join(void *handle_ptr)
+{
+  db_handle_t *handle;
+
+  handle = (db_handle_t *)handle_ptr;
+
+  switch(handle->join_method) {
+  case JOIN_HASH:
+    return process_hash_join(handle);
+  case JOIN_MERGE:
+    return process_merge_join(handle);
+  default:
+    return process_nested_index_join(handle);
+  }
+}
+
+static unsigned long
+log2_cost(tuple_id_t cardinality)
+{
+  unsigned long cost;
+
+  for(cost = 1; cardinality > 1; cardinality >>= 1) {
+    cost++;
+  }
+  return cost;
+}
+
+static int
+join_attribute_is_integer(attribute_t *attr)
+{
+  return attr->domain == DOMAIN_INT || attr->domain == DOMAIN_LONG;
+}
+
+static int
+join_attribute_is_sorted(attribute_t *attr)
+{
+  /* The tuples of a relation with an inline index are stored in
+     ascending order of the indexed attribute. */
+  return attr->index != NULL &&
+    ((index_t *)attr->index)->type == INDEX_INLINE;
+}
+
+/*
+ * Select the join method with the smallest estimated number of row
+ * reads. A nested index join reads each left tuple and probes the index
+ * of the right relation for it. A hash join reads the right relation
+ * once, and the left relation once per partition of the right relation
+ * that fits into the hash table. A merge join reads both relations
+ * once, but requires that they are stored in the join attribute order.
+ */
+static db_result_t
+select_join_method(db_handle_t *handle)
+{
+  tuple_id_t left_cardinality;
+  tuple_id_t right_cardinality;
+  unsigned long cost;
+  unsigned long min_cost;
+  unsigned long partitions;
+  index_t *index;
+
+  left_cardinality = relation_cardinality(handle->left_rel);
+  right_cardinality = relation_cardinality(handle->right_rel);
+  if(left_cardinality == INVALID_TUPLE || right_cardinality == INVALID_TUPLE) {
+    return DB_STORAGE_ERROR;
+  }
+
+  handle->join_method = JOIN_NESTED_INDEX;
+  min_cost = ULONG_MAX;
+
+  if(index_exists(handle->right_join_attr)) {
+    index = handle->right_join_attr->index;
+    cost = left_cardinality;
+    if(!(index->api->flags & INDEX_API_INTERNAL)) {
+      cost += (unsigned long)left_cardinality * 2 * log2_cost(right_cardinality);
+    }
+    PRINTF("DB: The cost of a nested index join is %lu\n", cost);
+    min_cost = cost;
+  }
+
+  if(join_attribute_is_integer(handle->left_join_attr) &&
+     join_attribute_is_integer(handle->right_join_attr)) {
+    partitions = (right_cardinality + DB_JOIN_HASH_ITEMS - 1) / DB_JOIN_HASH_ITEMS;
+    cost = right_cardinality + (partitions > 0 ? partitions : 1) * left_cardinality;
+    PRINTF("DB: The cost of a hash join is %lu\n", cost);
+    if(cost < min_cost) {
+      handle->join_method = JOIN_HASH;
+      min_cost = cost;
+    }
+
+    if(join_attribute_is_sorted(handle->left_join_attr) &&
+       join_attribute_is_sorted(handle->right_join_attr)) {
+      cost = (unsigned long)left_cardinality + right_cardinality;
+      PRINTF("DB: The cost of a merge join is %lu\n", cost);
+      if(cost <= min_cost) {
+        handle->join_method = JOIN_MERGE;
+        min_cost = cost;
+      }
+    }
+  }
+
+  if(min_cost == ULONG_MAX) {
+    PRINTF("DB: The attribute to join on is not indexed\n");
+    return DB_INDEX_ERROR;
+  }
+
+  handle->join_cursor = 0;
+  handle->join_mark = 0;
+  handle->tuple_id = 0;
+  handle->flags &= ~(DB_HANDLE_FLAG_JOIN_BUILD | DB_HANDLE_FLAG_JOIN_GROUP |
+                     DB_HANDLE_FLAG_JOIN_END);
+  if(handle->join_method == JOIN_HASH) {
+    handle->flags |= DB_HANDLE_FLAG_JOIN_BUILD;
+  }
 
   return DB_OK;
 }
@@ -1120,6 +1586,7 @@ relation_join(void *query_result, void *adt_ptr)
   int i;
   char *attribute_name;
   attribute_t *attr;
+  db_result_t result;
 
   adt = (aql_adt_t *)adt_ptr;
 
@@ -1158,9 +1625,9 @@ relation_join(void *query_result, void *adt_ptr)
     return DB_RELATIONAL_ERROR;
   }
 
-  if(!index_exists(handle->right_join_attr)) {
-    PRINTF("DB: The attribute to join on is not indexed\n");
-    return DB_INDEX_ERROR;
+  result = select_join_method(handle);
+  if(DB_ERROR(result)) {
+    return result;
   }
 
   /*
@@ -49,6 +49,10 @@ typedef unsigned char *tuple_t;
 #define DB_HANDLE_FLAG_INDEX_STEP	0x01
 #define DB_HANDLE_FLAG_SEARCH_INDEX	0x02
 #define DB_HANDLE_FLAG_PROCESSING	0x04
+#define DB_HANDLE_FLAG_JOIN_BUILD	0x08
+#define DB_HANDLE_FLAG_JOIN_GROUP	0x10
+#define DB_HANDLE_FLAG_JOIN_END		0x20
+#define DB_HANDLE_FLAG_BATCH		0x40
 
 struct db_handle {
   index_iterator_t index_iterator;
@@ -61,6 +65,15 @@ struct db_handle {
   relation_t *result_rel;
   attribute_t *left_join_attr;
   attribute_t *right_join_attr;
+  tuple_id_t join_cursor;
+  tuple_id_t join_mark;
+  long join_key;
+  uint16_t join_item;
+  uint8_t join_method;
+#if DB_SELECT_BATCH_SIZE > 0
+  uint8_t batch_position;
+  uint8_t batch_count;
+#endif /* DB_SELECT_BATCH_SIZE > 0 */
   tuple_t tuple;
   uint8_t flags;
   uint8_t ncolumns;
@@ -68,6 +68,41 @@ struct index_record {
 
 #define ROW_XOR 0xf6U
 
+#if DB_STORAGE_PAGE_SIZE > 0
+/* A page of consecutive rows of a relation, in the same form as they
+   are stored in the tuple file. A dirty page holds rows that have been
+   inserted after the end of the tuple file, but not yet written. */
+struct row_page {
+  relation_t *rel;
+  tuple_id_t first_row;
+  uint16_t row_count;
+  uint16_t last_use;
+  uint8_t dirty;
+  unsigned char data[DB_STORAGE_PAGE_SIZE];
+};
+
+static struct row_page pages[DB_STORAGE_PAGE_COUNT];
+static uint16_t page_clock;
+
+#define PAGE_ROWS(rel)	(DB_STORAGE_PAGE_SIZE / (rel)->row_length)
+#define USE_PAGES(rel)	((rel)->row_length <= DB_STORAGE_PAGE_SIZE)
+#endif /* DB_STORAGE_PAGE_SIZE > 0 */
+
+static void
+discard_pages(relation_t *rel)
+{
+#if DB_STORAGE_PAGE_SIZE > 0
+  struct row_page *page;
+
+  for(page = pages; page < &pages[DB_STORAGE_PAGE_COUNT]; page++) {
+    if(page->rel == rel) {
+      page->rel = NULL;
+      page->dirty = 0;
+    }
+  }
+#endif /* DB_STORAGE_PAGE_SIZE > 0 */
+}
+
 static void
 merge_strings(char *dest, char *prefix, char *suffix)
 {
@@ -103,6 +138,11 @@ storage_generate_file(char *prefix, unsigned long size)
 db_result_t
 storage_load(relation_t *rel)
 {
+  if(RELATION_HAS_TUPLES(rel)) {
+    /* The relation has already been loaded. */
+    return DB_OK;
+  }
+
   PRINTF("DB: Opening the tuple file %s\n", rel->tuple_filename);
   rel->tuple_storage = cfs_open(rel->tuple_filename,
                                 CFS_READ | CFS_WRITE | CFS_APPEND);
@@ -114,9 +154,13 @@ storage_load(relation_t *rel)
   return DB_OK;
 }
 
+/* storage_unload: Close the tuple file. Rows that have not been written
+   by storage_flush() are discarded. */
 void
 storage_unload(relation_t *rel)
 {
+  discard_pages(rel);
+
   if(RELATION_HAS_TUPLES(rel)) {
     PRINTF("DB: Unload tuple file %s\n", rel->tuple_filename);
 
@@ -279,6 +323,8 @@ storage_put_attribute(relation_t *rel, attribute_t *attr)
 db_result_t
 storage_drop_relation(relation_t *rel, int remove_tuples)
 {
+  discard_pages(rel);
+
   if(remove_tuples && RELATION_HAS_TUPLES(rel)) {
     cfs_remove(rel->tuple_filename);
   }
@@ -400,11 +446,245 @@ storage_put_index(index_t *index)
   return result;
 }
 
+/* get_file_row_amount: Get the number of rows in the tuple file. */
+static db_result_t
+get_file_row_amount(relation_t *rel, tuple_id_t *amount)
+{
+  cfs_offset_t offset;
+
+  if(rel->row_length == 0) {
+    *amount = 0;
+  } else {
+    offset = cfs_seek(rel->tuple_storage, 0, CFS_SEEK_END);
+    if(offset == (cfs_offset_t)-1) {
+      return DB_STORAGE_ERROR;
+    }
+
+    *amount = (tuple_id_t)(offset / rel->row_length);
+  }
+
+  return DB_OK;
+}
+
+/* append_rows: Write encoded rows at the end of the tuple file. */
+static db_result_t
+append_rows(relation_t *rel, unsigned char *rows, unsigned length)
+{
+  cfs_offset_t end;
+  unsigned remaining;
+  int r;
+#if DB_FEATURE_INTEGRITY
+  int missing_bytes;
+  char buf[rel->row_length];
+#endif
+
+  end = cfs_seek(rel->tuple_storage, 0, CFS_SEEK_END);
+  if(end == (cfs_offset_t)-1) {
+    return DB_STORAGE_ERROR;
+  }
+
+#if DB_FEATURE_INTEGRITY
+  missing_bytes = end % rel->row_length;
+  if(missing_bytes > 0) {
+    memset(buf, 0xff, sizeof(buf));
+    r = cfs_write(rel->tuple_storage, buf, sizeof(buf));
+    if(r != missing_bytes) {
+      return DB_STORAGE_ERROR;
+    }
+  }
+#endif
+
+  remaining = length;
+  do {
+    r = cfs_write(rel->tuple_storage, rows, remaining);
+    if(r < 0) {
+      PRINTF("DB: Failed to store %u bytes\n", remaining);
+      return DB_STORAGE_ERROR;
+    }
+    rows += r;
+    remaining -= r;
+  } while(remaining > 0);
+
+  PRINTF("DB: Stored %u bytes in relation %s\n", length, rel->name);
+
+  return DB_OK;
+}
+
+#if DB_STORAGE_PAGE_SIZE > 0
+static db_result_t
+page_flush(struct row_page *page)
+{
+  db_result_t result;
+
+  if(!page->dirty) {
+    return DB_OK;
+  }
+
+  result = append_rows(page->rel, page->data,
+                       page->row_count * page->rel->row_length);
+
+  /* The file may have been padded before the rows were written, so
+     the page cannot be trusted to match the file anymore. */
+  page->dirty = 0;
+  page->rel = NULL;
+
+  return result;
+}
+
+static struct row_page *
+page_find(relation_t *rel, tuple_id_t tuple_id)
+{
+  struct row_page *page;
+
+  for(page = pages; page < &pages[DB_STORAGE_PAGE_COUNT]; page++) {
+    if(page->rel == rel && tuple_id >= page->first_row &&
+       tuple_id < page->first_row + page->row_count) {
+      page->last_use = ++page_clock;
+      return page;
+    }
+  }
+
+  return NULL;
+}
+
+static struct row_page *
+page_find_dirty(relation_t *rel)
+{
+  struct row_page *page;
+
+  for(page = pages; page < &pages[DB_STORAGE_PAGE_COUNT]; page++) {
+    if(page->rel == rel && page->dirty) {
+      return page;
+    }
+  }
+
+  return NULL;
+}
+
+/* page_allocate: Take a free page, or the least recently used one. */
+static struct row_page *
+page_allocate(relation_t *rel, tuple_id_t first_row)
+{
+  struct row_page *page;
+  struct row_page *victim;
+
+  victim = NULL;
+  for(page = pages; page < &pages[DB_STORAGE_PAGE_COUNT]; page++) {
+    if(page->rel == NULL) {
+      victim = page;
+      break;
+    }
+    if(victim == NULL ||
+       (uint16_t)(page_clock - page->last_use) >
+       (uint16_t)(page_clock - victim->last_use)) {
+      victim = page;
+    }
+  }
+
+  if(DB_ERROR(page_flush(victim))) {
+    PRINTF("DB: Failed to flush a page of relation %s\n", victim->rel->name);
+    return NULL;
+  }
+
+  victim->rel = rel;
+  victim->first_row = first_row;
+  victim->row_count = 0;
+  victim->last_use = ++page_clock;
+
+  return victim;
+}
+
+/* page_read: Read the page that starts at the given row. */
+static db_result_t
+page_read(relation_t *rel, tuple_id_t tuple_id, tuple_id_t nrows,
+          struct row_page **page_ptr)
+{
+  struct row_page *page;
+  int r;
+
+  /* Allocate the page first, since writing a dirty page moves the
+     file offset. */
+  page = page_allocate(rel, tuple_id);
+  if(page == NULL) {
+    return DB_STORAGE_ERROR;
+  }
+
+  if(cfs_seek(rel->tuple_storage, tuple_id * rel->row_length, CFS_SEEK_SET) ==
+              (cfs_offset_t)-1) {
+    page->rel = NULL;
+    return DB_STORAGE_ERROR;
+  }
+
+  if(nrows - tuple_id < PAGE_ROWS(rel)) {
+    r = (nrows - tuple_id) * rel->row_length;
+  } else {
+    r = PAGE_ROWS(rel) * rel->row_length;
+  }
+
+  r = cfs_read(rel->tuple_storage, page->data, r);
+  if(r < (int)rel->row_length) {
+    page->rel = NULL;
+    if(r < 0) {
+      PRINTF("DB: Reading failed on fd %d\n", rel->tuple_storage);
+      return DB_STORAGE_ERROR;
+    } else if(r == 0) {
+      return DB_FINISHED;
+    }
+    PRINTF("DB: Incomplete record: %d < %d\n", r, rel->row_length);
+    return DB_STORAGE_ERROR;
+  }
+
+  page->row_count = r / rel->row_length;
+  *page_ptr = page;
+
+  PRINTF("DB: Read %u rows into a page from relation %s\n",
+         page->row_count, rel->name);
+
+  return DB_OK;
+}
+
+/* page_append: Add an encoded row to the dirty page of a relation. */
+static db_result_t
+page_append(relation_t *rel, storage_row_t row)
+{
+  struct row_page *page;
+  tuple_id_t nrows;
+
+  page = page_find_dirty(rel);
+  if(page != NULL && page->row_count == PAGE_ROWS(rel)) {
+    if(DB_ERROR(page_flush(page))) {
+      return DB_STORAGE_ERROR;
+    }
+    page = NULL;
+  }
+
+  if(page == NULL) {
+    if(DB_ERROR(get_file_row_amount(rel, &nrows))) {
+      return DB_STORAGE_ERROR;
+    }
+    page = page_allocate(rel, nrows);
+    if(page == NULL) {
+      return DB_STORAGE_ERROR;
+    }
+    page->dirty = 1;
+  }
+
+  memcpy(page->data + page->row_count * rel->row_length, row, rel->row_length);
+  page->row_count++;
+
+  return DB_OK;
+}
+#endif /* DB_STORAGE_PAGE_SIZE > 0 */
+
 db_result_t
 storage_get_row(relation_t *rel, tuple_id_t *tuple_id, storage_row_t row)
 {
   int r;
   tuple_id_t nrows;
+#if DB_STORAGE_PAGE_SIZE > 0
+  struct row_page *page;
+  db_result_t result;
+#endif
 
   if(DB_ERROR(storage_get_row_amount(rel, &nrows))) {
     return DB_STORAGE_ERROR;
@@ -414,6 +694,24 @@ storage_get_row(relation_t *rel, tuple_id_t *tuple_id, storage_row_t row)
     return DB_FINISHED;
   }
 
+#if DB_STORAGE_PAGE_SIZE > 0
+  if(USE_PAGES(rel)) {
+    page = page_find(rel, *tuple_id);
+    if(page == NULL) {
+      result = page_read(rel, *tuple_id, nrows, &page);
+      if(result != DB_OK) {
+        return result;
+      }
+    }
+
+    memcpy(row, page->data + (*tuple_id - page->first_row) * rel->row_length,
+           rel->row_length);
+    row[rel->row_length - 1] ^= ROW_XOR;
+
+    return DB_OK;
+  }
+#endif /* DB_STORAGE_PAGE_SIZE > 0 */
+
   if(cfs_seek(rel->tuple_storage, *tuple_id * rel->row_length, CFS_SEEK_SET) ==
               (cfs_offset_t)-1) {
     return DB_STORAGE_ERROR;
@@ -437,73 +735,119 @@ storage_get_row(relation_t *rel, tuple_id_t *tuple_id, storage_row_t row)
   return DB_OK;
 }
 
+/* storage_get_rows: Read up to *count consecutive rows, starting from
+   the given tuple id, with a single read operation. */
 db_result_t
-storage_put_row(relation_t *rel, storage_row_t row)
+storage_get_rows(relation_t *rel, tuple_id_t tuple_id, storage_row_t rows,
+                 unsigned *count)
 {
-  cfs_offset_t end;
-  unsigned remaining;
   int r;
-  unsigned char *last_byte;
-#if DB_FEATURE_INTEGRITY
-  int missing_bytes;
-  char buf[rel->row_length];
-#endif
+  unsigned i;
+  tuple_id_t nrows;
 
-  end = cfs_seek(rel->tuple_storage, 0, CFS_SEEK_END);
-  if(end == (cfs_offset_t)-1) {
+  /* The rows are read directly from the file, so write any rows that
+     are waiting in the page cache first. */
+  if(DB_ERROR(storage_flush(rel))) {
     return DB_STORAGE_ERROR;
   }
 
-#if DB_FEATURE_INTEGRITY
-  missing_bytes = end % rel->row_length;
-  if(missing_bytes > 0) {
-    memset(buf, 0xff, sizeof(buf));
-    r = cfs_write(rel->tuple_storage, buf, sizeof(buf));
-    if(r != missing_bytes) {
-      return DB_STORAGE_ERROR;
-    }
+  if(DB_ERROR(storage_get_row_amount(rel, &nrows))) {
+    return DB_STORAGE_ERROR;
+  }
+
+  if(tuple_id >= nrows) {
+    *count = 0;
+    return DB_FINISHED;
+  }
+
+  if(*count > nrows - tuple_id) {
+    *count = nrows - tuple_id;
+  }
+
+  if(cfs_seek(rel->tuple_storage, tuple_id * rel->row_length, CFS_SEEK_SET) ==
+              (cfs_offset_t)-1) {
+    return DB_STORAGE_ERROR;
+  }
+
+  r = cfs_read(rel->tuple_storage, rows, *count * rel->row_length);
+  if(r < 0) {
+    PRINTF("DB: Reading failed on fd %d\n", rel->tuple_storage);
+    return DB_STORAGE_ERROR;
+  }
+
+  *count = r / rel->row_length;
+  if(*count == 0) {
+    return DB_FINISHED;
   }
-#endif
+
+  for(i = 1; i <= *count; i++) {
+    rows[i * rel->row_length - 1] ^= ROW_XOR;
+  }
+
+  PRINTF("DB: Read %u rows from relation %s\n", *count, rel->name);
+
+  return DB_OK;
+}
+
+db_result_t
+storage_put_row(relation_t *rel, storage_row_t row)
+{
+  db_result_t result;
+  unsigned char *last_byte;
 
   /* Ensure that last written byte is separated from 0, to make file
      lengths correct in Coffee. */
   last_byte = row + rel->row_length - 1;
   *last_byte ^= ROW_XOR;
 
-  remaining = rel->row_length;
-  do {
-    r = cfs_write(rel->tuple_storage, row, remaining);
-    if(r < 0) {
-      PRINTF("DB: Failed to store %u bytes\n", remaining);
-      *last_byte ^= ROW_XOR;
-      return DB_STORAGE_ERROR;
-    }
-    row += r;
-    remaining -= r;
-  } while(remaining > 0);
-
-  PRINTF("DB: Stored a of %d bytes\n", rel->row_length);
+#if DB_STORAGE_PAGE_SIZE > 0
+  if(USE_PAGES(rel)) {
+    result = page_append(rel, row);
+  } else
+#endif /* DB_STORAGE_PAGE_SIZE > 0 */
+  {
+    result = append_rows(rel, row, rel->row_length);
+  }
 
   *last_byte ^= ROW_XOR;
 
-  return DB_OK;
+  return result;
 }
 
 db_result_t
 storage_get_row_amount(relation_t *rel, tuple_id_t *amount)
 {
-  cfs_offset_t offset;
+#if DB_STORAGE_PAGE_SIZE > 0
+  struct row_page *page;
+#endif
 
-  if(rel->row_length == 0) {
-    *amount = 0;
-  } else {
-    offset = cfs_seek(rel->tuple_storage, 0, CFS_SEEK_END);
-    if(offset == (cfs_offset_t)-1) {
-      return DB_STORAGE_ERROR;
-    }
+  if(DB_ERROR(get_file_row_amount(rel, amount))) {
+    return DB_STORAGE_ERROR;
+  }
 
-    *amount = (tuple_id_t)(offset / rel->row_length);
+#if DB_STORAGE_PAGE_SIZE > 0
+  page = page_find_dirty(rel);
+  if(page != NULL) {
+    *amount += page->row_count;
   }
+#endif
+
+  return DB_OK;
+}
+
+/* storage_flush: Write the rows of a relation that are held in the
+   page cache. */
+db_result_t
+storage_flush(relation_t *rel)
+{
+#if DB_STORAGE_PAGE_SIZE > 0
+  struct row_page *page;
+
+  page = page_find_dirty(rel);
+  if(page != NULL) {
+    return page_flush(page);
+  }
+#endif
 
   return DB_OK;
 }
@@ -65,8 +65,10 @@ db_result_t storage_get_index(index_t *, relation_t *, attribute_t *);
 db_result_t storage_put_index(index_t *);
 
 db_result_t storage_get_row(relation_t *, tuple_id_t *, storage_row_t);
+db_result_t storage_get_rows(relation_t *, tuple_id_t, storage_row_t, unsigned *);
 db_result_t storage_put_row(relation_t *, storage_row_t);
 db_result_t storage_get_row_amount(relation_t *, tuple_id_t *);
+db_result_t storage_flush(relation_t *);
 
 db_storage_id_t storage_open(const char *);
 void storage_close(db_storage_id_t);
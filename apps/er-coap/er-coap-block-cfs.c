@@ -0,0 +1,463 @@
+/*
+ * Copyright (c) 2026, Contiki contributors.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * 3. Neither the name of the copyright holder nor the names of its
+ *    contributors may be used to endorse or promote products derived
+ *    from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE
+ * COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+ * OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+/**
+ * \file
+ *      CoAP module for blockwise transfers streamed to and from CFS files
+ */
+
+#include <string.h>
+#include "contiki.h"
+#include "contiki-net.h"
+#include "cfs/cfs.h"
+#include "er-coap.h"
+#include "er-coap-block-cfs.h"
+
+#if COAP_BLOCK_CFS_COFFEE
+#include "cfs/cfs-coffee.h"
+#endif
+
+#define DEBUG 0
+#if DEBUG
+#include <stdio.h>
+#define PRINTF(...) printf(__VA_ARGS__)
+#else
+#define PRINTF(...)
+#endif
+
+#define TRANSFER_BLOCK1 1
+#define TRANSFER_BLOCK2 2
+
+/*
+ * An ongoing transfer keeps its file open between the blocks. A
+ * completed upload is remembered until it times out, so that the last
+ * block can be acknowledged again if its acknowledgement got lost.
+ */
+struct block_transfer {
+  struct block_transfer *next;  /* for LIST */
+
+  uip_ipaddr_t addr;
+  uint16_t port;
+  uint8_t type;
+
+  int fd;
+  uint32_t offset;      /* Block1: next expected offset */
+  uint32_t num;         /* Block1: number of the last block written */
+  uint16_t mid;         /* Block1: message ID of the last block written */
+  uint32_t size;        /* Block2: size of the file */
+  uint8_t complete;     /* Block1: the last block has been written */
+  struct timer timer;
+
+  char filename[COAP_BLOCK_CFS_NAME_LEN];
+};
+
+MEMB(transfers_memb, struct block_transfer, COAP_MAX_BLOCK_TRANSFERS);
+LIST(transfers_list);
+
+static void end_file_transfers(const char *filename);
+/*---------------------------------------------------------------------------*/
+static void
+end_transfer(struct block_transfer *t, int discard)
+{
+  PRINTF("Blockwise: ending transfer of %s at %lu\n", t->filename,
+         (unsigned long)t->offset);
+
+  if(t->fd >= 0) {
+    cfs_close(t->fd);
+  }
+  list_remove(transfers_list, t);
+  if(discard) {
+    /* do not leave an incomplete upload behind */
+    end_file_transfers(t->filename);
+    cfs_remove(t->filename);
+  }
+  memb_free(&transfers_memb, t);
+}
+/*---------------------------------------------------------------------------*/
+/* removing a file closes its descriptors, so no transfer may keep one */
+static void
+end_file_transfers(const char *filename)
+{
+  struct block_transfer *t;
+  struct block_transfer *next;
+
+  for(t = list_head(transfers_list); t != NULL; t = next) {
+    next = t->next;
+    if(strcmp(t->filename, filename) == 0) {
+      end_transfer(t, 0);
+    }
+  }
+}
+/*---------------------------------------------------------------------------*/
+static void
+purge_transfers(void)
+{
+  struct block_transfer *t;
+  struct block_transfer *next;
+
+  for(t = list_head(transfers_list); t != NULL; t = next) {
+    next = t->next;
+    if(timer_expired(&t->timer)) {
+      PRINTF("Blockwise: transfer of %s timed out\n", t->filename);
+      if(t->type == TRANSFER_BLOCK1 && !t->complete) {
+        /* this also ends the downloads of the file */
+        end_transfer(t, 1);
+        next = list_head(transfers_list);
+      } else {
+        end_transfer(t, 0);
+      }
+    }
+  }
+}
+/*---------------------------------------------------------------------------*/
+static int
+is_requester(struct block_transfer *t)
+{
+  return t->port == UIP_UDP_BUF->srcport
+         && uip_ipaddr_cmp(&t->addr, &UIP_IP_BUF->srcipaddr);
+}
+/*---------------------------------------------------------------------------*/
+static struct block_transfer *
+find_transfer(uint8_t type, const char *filename)
+{
+  struct block_transfer *t;
+
+  for(t = list_head(transfers_list); t != NULL; t = t->next) {
+    if(t->type == type && is_requester(t)
+       && strcmp(t->filename, filename) == 0) {
+      return t;
+    }
+  }
+  return NULL;
+}
+/*---------------------------------------------------------------------------*/
+static struct block_transfer *
+new_transfer(uint8_t type, const char *filename)
+{
+  struct block_transfer *t;
+
+  if(strlen(filename) >= COAP_BLOCK_CFS_NAME_LEN) {
+    return NULL;
+  }
+
+  t = memb_alloc(&transfers_memb);
+  if(t == NULL) {
+    /* a completed upload gives way to a new transfer */
+    for(t = list_head(transfers_list); t != NULL; t = t->next) {
+      if(t->type == TRANSFER_BLOCK1 && t->complete) {
+        end_transfer(t, 0);
+        t = memb_alloc(&transfers_memb);
+        break;
+      }
+    }
+  }
+  if(t != NULL) {
+    uip_ipaddr_copy(&t->addr, &UIP_IP_BUF->srcipaddr);
+    t->port = UIP_UDP_BUF->srcport;
+    t->type = type;
+    t->fd = -1;
+    t->offset = 0;
+    t->num = 0;
+    t->mid = 0;
+    t->size = 0;
+    t->complete = 0;
+    strcpy(t->filename, filename);
+    timer_set(&t->timer, COAP_BLOCK_TRANSFER_TIMEOUT * CLOCK_SECOND);
+    list_add(transfers_list, t);
+  }
+  return t;
+}
+/*---------------------------------------------------------------------------*/
+/**
+ * \brief Block 1 support that writes the request payload to a file
+ *
+ *        Each block is appended to the file as it arrives, so uploads
+ *        are not limited by the available RAM. The first block replaces
+ *        the file. Blocks must arrive in order; a retransmitted block
+ *        is acknowledged again without being written twice, also after
+ *        the upload has completed.
+ *
+ * \param request   Request pointer from the handler
+ * \param response  Response pointer from the handler
+ * \param filename  The file to write
+ * \param max_len   Maximum size of the upload, announced through Size1
+ *
+ * \return 0 if the upload is complete, also for a retransmitted last block
+ *         1 if more blocks will follow
+ *         -1 if the upload failed and the response has been set up
+ */
+int
+coap_block1_cfs_handler(void *request, void *response, const char *filename,
+                        uint32_t max_len)
+{
+  struct block_transfer *t;
+  const uint8_t *payload = NULL;
+  int pay_len = coap_get_payload(request, &payload);
+  uint32_t num = 0;
+  uint8_t more = 0;
+  uint16_t size = 0;
+  uint32_t offset = 0;
+  uint32_t size1 = 0;
+  int block;
+
+  purge_transfers();
+
+  if(!pay_len || !payload) {
+    erbium_status_code = BAD_REQUEST_4_00;
+    coap_error_message = "NoPayload";
+    return -1;
+  }
+
+  block = coap_get_header_block1(request, &num, &more, &size, &offset);
+  t = find_transfer(TRANSFER_BLOCK1, filename);
+
+  if((coap_get_header_size1(request, &size1) && size1 > max_len)
+     || offset + pay_len > max_len) {
+    PRINTF("Blockwise: upload of %s exceeds %lu bytes\n", filename,
+           (unsigned long)max_len);
+    if(t != NULL) {
+      end_transfer(t, !t->complete);
+    }
+    coap_set_status_code(response, REQUEST_ENTITY_TOO_LARGE_4_13);
+    coap_set_header_size1(response, max_len);
+    return -1;
+  }
+
+  /* a new upload of the same size looks like the last block, except
+     for its message ID */
+  if(t != NULL && num == t->num && offset < t->offset
+     && offset + pay_len == t->offset
+     && (!t->complete || ((coap_packet_t *)request)->mid == t->mid)) {
+    /* the acknowledgement of this block got lost */
+    PRINTF("Blockwise: duplicate block %lu of %s\n", (unsigned long)num,
+           filename);
+  } else {
+    if(offset == 0) {
+      struct block_transfer *other;
+
+      if(t != NULL) {
+        /* the client started over */
+        end_transfer(t, 0);
+      }
+      for(other = list_head(transfers_list); other != NULL;
+          other = other->next) {
+        if(other->type == TRANSFER_BLOCK1 && !other->complete
+           && strcmp(other->filename, filename) == 0) {
+          erbium_status_code = SERVICE_UNAVAILABLE_5_03;
+          coap_error_message = "UploadInProgress";
+          return -1;
+        }
+      }
+
+      /* downloads of the old file would read from a closed descriptor */
+      end_file_transfers(filename);
+      if((t = new_transfer(TRANSFER_BLOCK1, filename)) == NULL) {
+        erbium_status_code = SERVICE_UNAVAILABLE_5_03;
+        coap_error_message = "NoFreeTransfer";
+        return -1;
+      }
+
+      cfs_remove(filename);
+#if COAP_BLOCK_CFS_COFFEE
+      if(size1 > 0) {
+        /* avoid growing the file block by block */
+        cfs_coffee_reserve(filename, size1);
+      }
+#endif
+      t->fd = cfs_open(filename, CFS_WRITE);
+      if(t->fd < 0) {
+        end_transfer(t, 0);
+        erbium_status_code = INTERNAL_SERVER_ERROR_5_00;
+        coap_error_message = "OpenFailed";
+        return -1;
+      }
+    } else if(t == NULL || offset != t->offset) {
+      PRINTF("Blockwise: unexpected block %lu of %s\n", (unsigned long)num,
+             filename);
+      coap_set_status_code(response, REQUEST_ENTITY_INCOMPLETE_4_08);
+      return -1;
+    }
+
+    if(cfs_write(t->fd, payload, pay_len) != pay_len) {
+      end_transfer(t, 1);
+      erbium_status_code = INTERNAL_SERVER_ERROR_5_00;
+      coap_error_message = "WriteFailed";
+      return -1;
+    }
+    t->offset += pay_len;
+    t->num = num;
+    t->mid = ((coap_packet_t *)request)->mid;
+  }
+  timer_restart(&t->timer);
+
+  if(block) {
+    PRINTF("Blockwise: block 1 to %s: Num: %lu, More: %u, Size: %u\n",
+           filename, (unsigned long)num, more, size);
+    coap_set_header_block1(response, num, more, size);
+    if(more) {
+      coap_set_status_code(response, CONTINUE_2_31);
+      return 1;
+    }
+
+    /* the engine does not filter duplicates, remember the last block */
+    if(t->fd >= 0) {
+      cfs_close(t->fd);
+      t->fd = -1;
+    }
+    t->complete = 1;
+    return 0;
+  }
+
+  end_transfer(t, 0);
+  return 0;
+}
+/*---------------------------------------------------------------------------*/
+/**
+ * \brief Block 2 support that reads the response payload from a file
+ *
+ *        Meant to be called from a GET handler with the buffer, size
+ *        and offset arguments it received. Only the requested block is
+ *        read, and the file stays open while the client fetches the
+ *        following blocks. Size2 is included in the first block or if
+ *        the client asked for it. Files served this way must be removed
+ *        with coap_block_cfs_remove().
+ *
+ * \param request         Request pointer from the handler
+ * \param response        Response pointer from the handler
+ * \param buffer          Buffer from the handler that receives the block
+ * \param preferred_size  Block size from the handler
+ * \param offset          Offset from the handler, updated for the next block
+ * \param filename        The file to serve
+ *
+ * \return 0 if this is the last block
+ *         1 if more blocks will follow
+ *         -1 if the file cannot be served
+ */
+int
+coap_block2_cfs_handler(void *request, void *response, uint8_t *buffer,
+                        uint16_t preferred_size, int32_t *offset,
+                        const char *filename)
+{
+  struct block_transfer *t;
+  int fd;
+  int len;
+  uint32_t size;
+
+  purge_transfers();
+
+  /* the payload cannot take more, see coap_set_payload() */
+  if(preferred_size > REST_MAX_CHUNK_SIZE) {
+    preferred_size = REST_MAX_CHUNK_SIZE;
+  }
+
+  if((t = find_transfer(TRANSFER_BLOCK2, filename)) != NULL) {
+    fd = t->fd;
+    size = t->size;
+  } else {
+    if((fd = cfs_open(filename, CFS_READ)) < 0) {
+      erbium_status_code = NOT_FOUND_4_04;
+      coap_error_message = "NoSuchFile";
+      return -1;
+    }
+    size = cfs_seek(fd, 0, CFS_SEEK_END);
+  }
+
+  if(*offset < 0 || *offset > size || (*offset == size && size > 0)) {
+    if(t != NULL) {
+      end_transfer(t, 0);
+    } else {
+      cfs_close(fd);
+    }
+    erbium_status_code = BAD_OPTION_4_02;
+    coap_error_message = "BlockOutOfScope";
+    return -1;
+  }
+
+  if(cfs_seek(fd, *offset, CFS_SEEK_SET) != *offset
+     || (len = cfs_read(fd, buffer, preferred_size)) < 0) {
+    if(t != NULL) {
+      end_transfer(t, 0);
+    } else {
+      cfs_close(fd);
+    }
+    erbium_status_code = INTERNAL_SERVER_ERROR_5_00;
+    coap_error_message = "ReadFailed";
+    return -1;
+  }
+
+  coap_set_payload(response, buffer, len);
+  if(*offset == 0 || IS_OPTION((coap_packet_t *)request, COAP_OPTION_SIZE2)) {
+    coap_set_header_size2(response, size);
+  }
+
+  if(*offset + len >= size) {
+    /* last block */
+    *offset = -1;
+    if(t != NULL) {
+      end_transfer(t, 0);
+    } else {
+      cfs_close(fd);
+    }
+    return 0;
+  }
+
+  *offset += len;
+  if(t == NULL && (t = new_transfer(TRANSFER_BLOCK2, filename)) != NULL) {
+    t->fd = fd;
+    t->size = size;
+  }
+  if(t != NULL) {
+    timer_restart(&t->timer);
+  } else {
+    /* no transfer slot, reopen the file for the next block */
+    cfs_close(fd);
+  }
+  return 1;
+}
+/*---------------------------------------------------------------------------*/
+/**
+ * \brief Remove a file that may be in a blockwise transfer
+ *
+ *        Ends the uploads and downloads of the file first, so that no
+ *        transfer keeps a descriptor that CFS closes with the file.
+ *
+ * \param filename The file to remove
+ *
+ * \return 0 on success, -1 if the file could not be removed
+ */
+int
+coap_block_cfs_remove(const char *filename)
+{
+  end_file_transfers(filename);
+  return cfs_remove(filename);
+}
+/*---------------------------------------------------------------------------*/
@@ -68,6 +68,50 @@
 #define COAP_MAX_OBSERVERS    COAP_MAX_OPEN_TRANSACTIONS - 1
 #endif /* COAP_MAX_OBSERVERS */
 
+/* Number of notification transactions, which only store header and token, for observers awaiting a notification */
+#ifndef COAP_MAX_OPEN_NOTIFICATIONS
+#define COAP_MAX_OPEN_NOTIFICATIONS    COAP_MAX_OBSERVERS
+#endif /* COAP_MAX_OPEN_NOTIFICATIONS */
+
+/* Number of buffers for serialized notifications that are shared by all observers of a resource.
+   Each takes about COAP_MAX_PACKET_SIZE bytes. A buffer stays in use as long as a confirmable
+   notification that carries it is retransmitted, so with few buffers pending notifications of
+   one resource can hold all of them and notifications of other resources are dropped meanwhile.
+   Use at least the number of resources that are observed at the same time. */
+#ifndef COAP_MAX_SHARED_PACKETS
+#define COAP_MAX_SHARED_PACKETS        2
+#endif /* COAP_MAX_SHARED_PACKETS */
+
+/* Number of hash buckets used to look up transactions by MID */
+#ifndef COAP_TRANSACTION_HASH_SIZE
+#define COAP_TRANSACTION_HASH_SIZE     8
+#endif /* COAP_TRANSACTION_HASH_SIZE */
+
+/* Number of hash buckets used to look up observers by token and by MID */
+#ifndef COAP_OBSERVER_HASH_SIZE
+#define COAP_OBSERVER_HASH_SIZE        8
+#endif /* COAP_OBSERVER_HASH_SIZE */
+
+/* Number of concurrent blockwise transfers streamed to and from CFS files */
+#ifndef COAP_MAX_BLOCK_TRANSFERS
+#define COAP_MAX_BLOCK_TRANSFERS       2
+#endif /* COAP_MAX_BLOCK_TRANSFERS */
+
+/* Seconds after which an idle blockwise transfer is abandoned */
+#ifndef COAP_BLOCK_TRANSFER_TIMEOUT
+#define COAP_BLOCK_TRANSFER_TIMEOUT    60
+#endif /* COAP_BLOCK_TRANSFER_TIMEOUT */
+
+/* Maximum length of the file names used for blockwise transfers */
+#ifndef COAP_BLOCK_CFS_NAME_LEN
+#define COAP_BLOCK_CFS_NAME_LEN        24
+#endif /* COAP_BLOCK_CFS_NAME_LEN */
+
+/* Reserve the announced Size1 in Coffee before an upload is written */
+#ifndef COAP_BLOCK_CFS_COFFEE
+#define COAP_BLOCK_CFS_COFFEE          0
+#endif /* COAP_BLOCK_CFS_COFFEE */
+
 /* Interval in notifies in which NON notifies are changed to CON notifies to check client. */
 #define COAP_OBSERVE_REFRESH_INTERVAL  20
 
@@ -55,9 +55,58 @@
 /*---------------------------------------------------------------------------*/
 MEMB(observers_memb, coap_observer_t, COAP_MAX_OBSERVERS);
 LIST(observers_list);
+
+/* Observe option value shared by all notifications, which only has to increase for each observer */
+static uint32_t observe_clock;
+
+/* observers hashed by (address, port, token) and by the MID of their last notification */
+static coap_observer_t *token_table[COAP_OBSERVER_HASH_SIZE];
+static coap_observer_t *mid_table[COAP_OBSERVER_HASH_SIZE];
+
+#define MID_HASH(mid) ((mid) % COAP_OBSERVER_HASH_SIZE)
 /*---------------------------------------------------------------------------*/
 /*- Internal API ------------------------------------------------------------*/
 /*---------------------------------------------------------------------------*/
+static unsigned
+token_hash(uip_ipaddr_t *addr, uint16_t port, const uint8_t *token,
+           size_t token_len)
+{
+  unsigned hash = port;
+  int i;
+
+  /* the interface identifier is enough to tell clients apart */
+  for(i = 12; i < 16; ++i) {
+    hash = hash * 31 + addr->u8[i];
+  }
+  for(i = 0; i < token_len; ++i) {
+    hash = hash * 31 + token[i];
+  }
+  return hash % COAP_OBSERVER_HASH_SIZE;
+}
+/*---------------------------------------------------------------------------*/
+static void
+unlink_mid(coap_observer_t *o)
+{
+  coap_observer_t **prev;
+
+  for(prev = &mid_table[MID_HASH(o->last_mid)]; *prev;
+      prev = &(*prev)->mid_next) {
+    if(*prev == o) {
+      *prev = o->mid_next;
+      return;
+    }
+  }
+}
+/*---------------------------------------------------------------------------*/
+static void
+set_last_mid(coap_observer_t *o, uint16_t mid)
+{
+  unlink_mid(o);
+  o->last_mid = mid;
+  o->mid_next = mid_table[MID_HASH(mid)];
+  mid_table[MID_HASH(mid)] = o;
+}
+/*---------------------------------------------------------------------------*/
 static coap_observer_t *
 add_observer(uip_ipaddr_t *addr, uint16_t port, const uint8_t *token,
              size_t token_len, const char *uri, int uri_len)
@@ -66,6 +115,7 @@ add_observer(uip_ipaddr_t *addr, uint16_t port, const uint8_t *token,
   coap_remove_observer_by_uri(addr, port, uri);
 
   coap_observer_t *o = memb_alloc(&observers_memb);
+  unsigned h;
 
   if(o) {
     int max = sizeof(o->url) - 1;
@@ -78,7 +128,14 @@ add_observer(uip_ipaddr_t *addr, uint16_t port, const uint8_t *token,
     o->port = port;
     o->token_len = token_len;
     memcpy(o->token, token, token_len);
+    o->obs_counter = 0;
+
+    h = token_hash(addr, port, token, token_len);
+    o->token_next = token_table[h];
+    token_table[h] = o;
     o->last_mid = 0;
+    o->mid_next = mid_table[MID_HASH(0)];
+    mid_table[MID_HASH(0)] = o;
 
     PRINTF("Adding observer (%u/%u) for /%s [0x%02X%02X]\n",
            list_length(observers_list) + 1, COAP_MAX_OBSERVERS,
@@ -94,9 +151,21 @@ add_observer(uip_ipaddr_t *addr, uint16_t port, const uint8_t *token,
 void
 coap_remove_observer(coap_observer_t *o)
 {
+  coap_observer_t **prev;
+
   PRINTF("Removing observer for /%s [0x%02X%02X]\n", o->url, o->token[0],
          o->token[1]);
 
+  for(prev = &token_table[token_hash(&o->addr, o->port, o->token,
+                                     o->token_len)];
+      *prev; prev = &(*prev)->token_next) {
+    if(*prev == o) {
+      *prev = o->token_next;
+      break;
+    }
+  }
+  unlink_mid(o);
+
   memb_free(&observers_memb, o);
   list_remove(observers_list, o);
 }
@@ -126,9 +195,11 @@ coap_remove_observer_by_token(uip_ipaddr_t *addr, uint16_t port,
 {
   int removed = 0;
   coap_observer_t *obs = NULL;
+  coap_observer_t *next;
 
-  for(obs = (coap_observer_t *)list_head(observers_list); obs;
-      obs = obs->next) {
+  for(obs = token_table[token_hash(addr, port, token, token_len)]; obs;
+      obs = next) {
+    next = obs->token_next;
     PRINTF("Remove check Token 0x%02X%02X\n", token[0], token[1]);
     if(uip_ipaddr_cmp(&obs->addr, addr) && obs->port == port
        && obs->token_len == token_len
@@ -165,9 +236,10 @@ coap_remove_observer_by_mid(uip_ipaddr_t *addr, uint16_t port, uint16_t mid)
 {
   int removed = 0;
   coap_observer_t *obs = NULL;
+  coap_observer_t *next;
 
-  for(obs = (coap_observer_t *)list_head(observers_list); obs;
-      obs = obs->next) {
+  for(obs = mid_table[MID_HASH(mid)]; obs; obs = next) {
+    next = obs->mid_next;
     PRINTF("Remove check MID %u\n", mid);
     if(uip_ipaddr_cmp(&obs->addr, addr) && obs->port == port
        && obs->last_mid == mid) {
@@ -180,6 +252,101 @@ coap_remove_observer_by_mid(uip_ipaddr_t *addr, uint16_t port, uint16_t mid)
 /*---------------------------------------------------------------------------*/
 /*- Notification ------------------------------------------------------------*/
 /*---------------------------------------------------------------------------*/
+static coap_shared_packet_t *
+serialize_notification(resource_t *resource, const char *url)
+{
+  coap_packet_t notification[1]; /* this way the packet can be treated as pointer as usual */
+  coap_packet_t request[1]; /* this way the packet can be treated as pointer as usual */
+  coap_shared_packet_t *shared;
+  size_t len;
+
+  if((shared = coap_new_shared_packet()) == NULL) {
+    PRINTF("Observe: No shared packet available\n");
+    return NULL;
+  }
+
+  coap_init_message(notification, COAP_TYPE_NON, CONTENT_2_05, 0);
+  /* create a "fake" request for the URI */
+  coap_init_message(request, COAP_TYPE_CON, COAP_GET, 0);
+  coap_set_header_uri_path(request, url);
+
+  resource->get_handler(request, notification,
+                        shared->packet + COAP_MAX_HEADER_SIZE,
+                        REST_MAX_CHUNK_SIZE, NULL);
+
+  if(notification->code < BAD_REQUEST_4_00) {
+    observe_clock = (observe_clock + 1) & 0xFFFFFF;
+    coap_set_header_observe(notification, observe_clock);
+  }
+
+  /* serialize without token, then keep only the options and payload,
+     which are the same for all observers */
+  len = coap_serialize_message(notification, shared->packet);
+  if(len < COAP_HEADER_LEN) {
+    PRINTF("Observe: Notification options too large, dropped\n");
+    coap_release_shared_packet(shared);
+    return NULL;
+  }
+  shared->code = notification->code;
+  shared->packet_len = len - COAP_HEADER_LEN;
+  memmove(shared->packet, shared->packet + COAP_HEADER_LEN,
+          shared->packet_len);
+
+  return shared;
+}
+/*---------------------------------------------------------------------------*/
+static void
+notify_observer(coap_observer_t *obs, coap_shared_packet_t *shared)
+{
+  coap_transaction_t *transaction;
+  coap_message_type_t type;
+
+  PRINTF("           Observer ");
+  PRINT6ADDR(&obs->addr);
+  PRINTF(":%u\n", obs->port);
+
+  /* a confirmable notification still being retransmitted carries the new state instead */
+  transaction = coap_get_transaction_by_mid(obs->last_mid);
+  if(transaction && transaction->shared
+     && uip_ipaddr_cmp(&transaction->addr, &obs->addr)
+     && transaction->port == obs->port) {
+    PRINTF("           Updating pending notification %u\n", transaction->mid);
+    coap_set_shared_packet(transaction, shared);
+    transaction->packet[1] = shared->code;
+    return;
+  }
+
+  if((transaction = coap_new_shared_transaction(coap_get_mid(), &obs->addr,
+                                                obs->port, shared)) == NULL) {
+    PRINTF("           No transaction available\n");
+    return;
+  }
+
+  type = COAP_TYPE_NON;
+  if(obs->obs_counter % COAP_OBSERVE_REFRESH_INTERVAL == 0) {
+    PRINTF("           Force Confirmable for\n");
+    type = COAP_TYPE_CON;
+  }
+  if(shared->code < BAD_REQUEST_4_00) {
+    obs->obs_counter++;
+  }
+
+  /* update last MID for RST matching */
+  set_last_mid(obs, transaction->mid);
+
+  /* only the header and token differ between observers */
+  transaction->packet[0] = (COAP_HEADER_VERSION_MASK & 1 << COAP_HEADER_VERSION_POSITION)
+    | (COAP_HEADER_TYPE_MASK & type << COAP_HEADER_TYPE_POSITION)
+    | (COAP_HEADER_TOKEN_LEN_MASK & obs->token_len << COAP_HEADER_TOKEN_LEN_POSITION);
+  transaction->packet[1] = shared->code;
+  transaction->packet[2] = (uint8_t)(transaction->mid >> 8);
+  transaction->packet[3] = (uint8_t)(transaction->mid);
+  memcpy(transaction->packet + COAP_HEADER_LEN, obs->token, obs->token_len);
+  transaction->packet_len = COAP_HEADER_LEN + obs->token_len;
+
+  coap_send_transaction(transaction);
+}
+/*---------------------------------------------------------------------------*/
 void
 coap_notify_observers(resource_t *resource)
 {
@@ -188,9 +355,7 @@ coap_notify_observers(resource_t *resource)
 void
 coap_notify_observers_sub(resource_t *resource, const char *subpath)
 {
-  /* build notification */
-  coap_packet_t notification[1]; /* this way the packet can be treated as pointer as usual */
-  coap_packet_t request[1]; /* this way the packet can be treated as pointer as usual */
+  coap_shared_packet_t *shared = NULL;
   coap_observer_t *obs = NULL;
   int url_len, obs_url_len;
   char url[COAP_OBSERVER_URL_LEN];
@@ -205,11 +370,6 @@ coap_notify_observers_sub(resource_t *resource, const char *subpath)
   /* url now contains the notify URL that needs to match the observer */
   PRINTF("Observe: Notification from %s\n", url);
 
-  coap_init_message(notification, COAP_TYPE_NON, CONTENT_2_05, 0);
-  /* create a "fake" request for the URI */
-  coap_init_message(request, COAP_TYPE_CON, COAP_GET, 0);
-  coap_set_header_uri_path(request, url);
-
   /* iterate over observers */
   url_len = strlen(url);
   for(obs = (coap_observer_t *)list_head(observers_list); obs;
@@ -223,42 +383,18 @@ coap_notify_observers_sub(resource_t *resource, const char *subpath)
             && (resource->flags & HAS_SUB_RESOURCES)
             && obs->url[url_len] == '/'))
        && strncmp(url, obs->url, url_len) == 0) {
-      coap_transaction_t *transaction = NULL;
-
-      /*TODO implement special transaction for CON, sharing the same buffer to allow for more observers */
-
-      if((transaction = coap_new_transaction(coap_get_mid(), &obs->addr, obs->port))) {
-        if(obs->obs_counter % COAP_OBSERVE_REFRESH_INTERVAL == 0) {
-          PRINTF("           Force Confirmable for\n");
-          notification->type = COAP_TYPE_CON;
-        }
 
-        PRINTF("           Observer ");
-        PRINT6ADDR(&obs->addr);
-        PRINTF(":%u\n", obs->port);
-
-        /* update last MID for RST matching */
-        obs->last_mid = transaction->mid;
-
-        /* prepare response */
-        notification->mid = transaction->mid;
-
-        resource->get_handler(request, notification,
-                              transaction->packet + COAP_MAX_HEADER_SIZE,
-                              REST_MAX_CHUNK_SIZE, NULL);
-
-        if(notification->code < BAD_REQUEST_4_00) {
-          coap_set_header_observe(notification, (obs->obs_counter)++);
-        }
-        coap_set_token(notification, obs->token, obs->token_len);
-
-        transaction->packet_len =
-          coap_serialize_message(notification, transaction->packet);
-
-        coap_send_transaction(transaction);
+      /* the resource handler runs once for all observers */
+      if(shared == NULL
+         && (shared = serialize_notification(resource, url)) == NULL) {
+        return;
       }
+
+      notify_observer(obs, shared);
     }
   }
+
+  coap_release_shared_packet(shared);
 }
 /*---------------------------------------------------------------------------*/
 void
@@ -275,7 +411,8 @@ coap_observe_handler(resource_t *resource, void *request, void *response)
                            coap_req->token, coap_req->token_len,
                            coap_req->uri_path, coap_req->uri_path_len);
        if(obs) {
-          coap_set_header_observe(coap_res, (obs->obs_counter)++);
+          coap_set_header_observe(coap_res, observe_clock);
+          obs->obs_counter++;
           /*
            * Following payload is for demonstration purposes only.
            * A subscription should return the same representation as a normal GET.
@@ -65,8 +65,9 @@ typedef struct coap_observer {
 
   int32_t obs_counter;
 
-  struct etimer retrans_timer;
-  uint8_t retrans_counter;
+  /* hash chains for RST and deregistration matching */
+  struct coap_observer *token_next;
+  struct coap_observer *mid_next;
 } coap_observer_t;
 
 list_t coap_get_observers(void);
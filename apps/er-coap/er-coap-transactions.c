@@ -36,6 +36,7 @@
  *      Matthias Kovatsch <kovatsch@inf.ethz.ch>
  */
 
+#include <string.h>
 #include "contiki.h"
 #include "contiki-net.h"
 #include "er-coap-transactions.h"
@@ -54,11 +55,31 @@
 #endif
 
 /*---------------------------------------------------------------------------*/
+struct packet_buffer {
+  uint8_t packet[COAP_MAX_PACKET_SIZE + 1];
+};
+
 MEMB(transactions_memb, coap_transaction_t, COAP_MAX_OPEN_TRANSACTIONS);
-LIST(transactions_list);
+MEMB(packets_memb, struct packet_buffer, COAP_MAX_OPEN_TRANSACTIONS);
+MEMB(notifications_memb, coap_transaction_t, COAP_MAX_OPEN_NOTIFICATIONS);
+MEMB(shared_packets_memb, coap_shared_packet_t, COAP_MAX_SHARED_PACKETS);
+
+/* open transactions hashed by MID, chained through t->next */
+static coap_transaction_t *mid_table[COAP_TRANSACTION_HASH_SIZE];
+
+/* pending CON transactions ordered by retransmission deadline */
+static coap_transaction_t *queue_head = NULL;
+static coap_transaction_t *queue_tail = NULL;
+static struct etimer retrans_timer;
 
 static struct process *transaction_handler_process = NULL;
 
+#define MID_HASH(mid) ((mid) % COAP_TRANSACTION_HASH_SIZE)
+
+/* true if deadline a lies before b, robust against clock wrap-around */
+#define DEADLINE_BEFORE(a, b) \
+  ((clock_time_t)((a) - (b)) > (clock_time_t)(~(clock_time_t)0) / 2)
+
 /*---------------------------------------------------------------------------*/
 /*- Internal API ------------------------------------------------------------*/
 /*---------------------------------------------------------------------------*/
@@ -67,31 +88,189 @@ coap_register_as_transaction_handler()
 {
   transaction_handler_process = PROCESS_CURRENT();
 }
+/*---------------------------------------------------------------------------*/
+static void
+schedule_retransmission(void)
+{
+  clock_time_t now = clock_time();
+
+  if(queue_head == NULL) {
+    etimer_stop(&retrans_timer);
+    return;
+  }
+
+  /* a single timer for the earliest deadline drives all retransmissions */
+  PROCESS_CONTEXT_BEGIN(transaction_handler_process);
+  if(DEADLINE_BEFORE(now, queue_head->retrans_deadline)) {
+    etimer_set(&retrans_timer, queue_head->retrans_deadline - now);
+  } else {
+    etimer_set(&retrans_timer, 0);
+  }
+  PROCESS_CONTEXT_END(transaction_handler_process);
+}
+/*---------------------------------------------------------------------------*/
+static void
+queue_insert(coap_transaction_t *t)
+{
+  coap_transaction_t *prev;
+
+  /* backoff makes new deadlines mostly the latest, so search from the tail */
+  for(prev = queue_tail;
+      prev != NULL && DEADLINE_BEFORE(t->retrans_deadline, prev->retrans_deadline);
+      prev = prev->queue_prev);
+
+  t->queue_prev = prev;
+  if(prev == NULL) {
+    t->queue_next = queue_head;
+    queue_head = t;
+  } else {
+    t->queue_next = prev->queue_next;
+    prev->queue_next = t;
+  }
+  if(t->queue_next == NULL) {
+    queue_tail = t;
+  } else {
+    t->queue_next->queue_prev = t;
+  }
+
+  if(queue_head == t) {
+    schedule_retransmission();
+  }
+}
+/*---------------------------------------------------------------------------*/
+static void
+queue_remove(coap_transaction_t *t)
+{
+  if(t->queue_prev == NULL && queue_head != t) {
+    /* not queued */
+    return;
+  }
+
+  if(t->queue_prev == NULL) {
+    queue_head = t->queue_next;
+  } else {
+    t->queue_prev->queue_next = t->queue_next;
+  }
+  if(t->queue_next == NULL) {
+    queue_tail = t->queue_prev;
+  } else {
+    t->queue_next->queue_prev = t->queue_prev;
+  }
+  t->queue_prev = NULL;
+  t->queue_next = NULL;
+  /* an early timer event is harmless, coap_check_transactions() reschedules */
+}
+/*---------------------------------------------------------------------------*/
+static void
+init_transaction(coap_transaction_t *t, uint16_t mid, uip_ipaddr_t *addr,
+                 uint16_t port)
+{
+  t->mid = mid;
+  t->retrans_counter = 0;
+  t->queue_prev = NULL;
+  t->queue_next = NULL;
+  t->callback = NULL;
+  t->callback_data = NULL;
+
+  /* save client address */
+  uip_ipaddr_copy(&t->addr, addr);
+  t->port = port;
+
+  t->next = mid_table[MID_HASH(mid)];
+  mid_table[MID_HASH(mid)] = t;
+}
 coap_transaction_t *
 coap_new_transaction(uint16_t mid, uip_ipaddr_t *addr, uint16_t port)
 {
   coap_transaction_t *t = memb_alloc(&transactions_memb);
+  struct packet_buffer *buffer;
 
   if(t) {
-    t->mid = mid;
-    t->retrans_counter = 0;
+    buffer = memb_alloc(&packets_memb);
+    if(buffer == NULL) {
+      memb_free(&transactions_memb, t);
+      return NULL;
+    }
+
+    t->packet = buffer->packet;
+    t->shared = NULL;
+    init_transaction(t, mid, addr, port);
+  }
+
+  return t;
+}
+/*---------------------------------------------------------------------------*/
+coap_shared_packet_t *
+coap_new_shared_packet(void)
+{
+  coap_shared_packet_t *p = memb_alloc(&shared_packets_memb);
+
+  if(p) {
+    /* the reference of the caller, see coap_release_shared_packet() */
+    p->references = 1;
+    p->packet_len = 0;
+  }
 
-    /* save client address */
-    uip_ipaddr_copy(&t->addr, addr);
-    t->port = port;
+  return p;
+}
+/*---------------------------------------------------------------------------*/
+void
+coap_release_shared_packet(coap_shared_packet_t *p)
+{
+  if(p && --(p->references) == 0) {
+    PRINTF("Freeing shared packet %p\n", p);
+    memb_free(&shared_packets_memb, p);
+  }
+}
+/*---------------------------------------------------------------------------*/
+coap_transaction_t *
+coap_new_shared_transaction(uint16_t mid, uip_ipaddr_t *addr, uint16_t port,
+                            coap_shared_packet_t *p)
+{
+  coap_transaction_t *t = memb_alloc(&notifications_memb);
 
-    list_add(transactions_list, t); /* list itself makes sure same element is not added twice */
+  if(t) {
+    t->packet = t->header;
+    t->packet_len = 0;
+    t->shared = NULL;
+    coap_set_shared_packet(t, p);
+    init_transaction(t, mid, addr, port);
   }
 
   return t;
 }
 /*---------------------------------------------------------------------------*/
 void
+coap_set_shared_packet(coap_transaction_t *t, coap_shared_packet_t *p)
+{
+  p->references++;
+  coap_release_shared_packet(t->shared);
+  t->shared = p;
+}
+/*---------------------------------------------------------------------------*/
+void
 coap_send_transaction(coap_transaction_t *t)
 {
   PRINTF("Sending transaction %u\n", t->mid);
 
-  coap_send_message(&t->addr, t->port, t->packet, t->packet_len);
+  if(t->shared) {
+    /* assemble the notification where the UDP layer expects it */
+    uint8_t *buffer = &uip_buf[UIP_LLH_LEN + UIP_IPUDPH_LEN];
+
+    if(t->packet_len + t->shared->packet_len >
+       UIP_BUFSIZE - (UIP_LLH_LEN + UIP_IPUDPH_LEN)) {
+      PRINTF("Notification too large for uIP buffer\n");
+      coap_clear_transaction(t);
+      return;
+    }
+
+    memcpy(buffer, t->packet, t->packet_len);
+    memcpy(buffer + t->packet_len, t->shared->packet, t->shared->packet_len);
+    coap_send_message(&t->addr, t->port, buffer,
+                      t->packet_len + t->shared->packet_len);
+  } else {
+    coap_send_message(&t->addr, t->port, t->packet, t->packet_len);
+  }
 
   if(COAP_TYPE_CON ==
      ((COAP_HEADER_TYPE_MASK & t->packet[0]) >> COAP_HEADER_TYPE_POSITION)) {
@@ -100,22 +279,22 @@ coap_send_transaction(coap_transaction_t *t)
       PRINTF("Keeping transaction %u\n", t->mid);
 
       if(t->retrans_counter == 0) {
-        t->retrans_timer.timer.interval =
+        t->retrans_interval =
           COAP_RESPONSE_TIMEOUT_TICKS + (random_rand()
                                          %
                                          (clock_time_t)
                                          COAP_RESPONSE_TIMEOUT_BACKOFF_MASK);
         PRINTF("Initial interval %f\n",
-               (float)t->retrans_timer.timer.interval / CLOCK_SECOND);
+               (float)t->retrans_interval / CLOCK_SECOND);
       } else {
-        t->retrans_timer.timer.interval <<= 1;  /* double */
+        t->retrans_interval <<= 1;  /* double */
         PRINTF("Doubled (%u) interval %f\n", t->retrans_counter,
-               (float)t->retrans_timer.timer.interval / CLOCK_SECOND);
+               (float)t->retrans_interval / CLOCK_SECOND);
       }
 
-      PROCESS_CONTEXT_BEGIN(transaction_handler_process);
-      etimer_restart(&t->retrans_timer);        /* interval updated above */
-      PROCESS_CONTEXT_END(transaction_handler_process);
+      queue_remove(t);
+      t->retrans_deadline = clock_time() + t->retrans_interval;
+      queue_insert(t);
 
       t = NULL;
     } else {
@@ -141,12 +320,26 @@ coap_send_transaction(coap_transaction_t *t)
 void
 coap_clear_transaction(coap_transaction_t *t)
 {
+  coap_transaction_t **prev;
+
   if(t) {
     PRINTF("Freeing transaction %u: %p\n", t->mid, t);
 
-    etimer_stop(&t->retrans_timer);
-    list_remove(transactions_list, t);
-    memb_free(&transactions_memb, t);
+    queue_remove(t);
+    for(prev = &mid_table[MID_HASH(t->mid)]; *prev; prev = &(*prev)->next) {
+      if(*prev == t) {
+        *prev = t->next;
+        break;
+      }
+    }
+
+    if(t->shared) {
+      coap_release_shared_packet(t->shared);
+      memb_free(&notifications_memb, t);
+    } else {
+      memb_free(&packets_memb, t->packet);
+      memb_free(&transactions_memb, t);
+    }
   }
 }
 coap_transaction_t *
@@ -154,7 +347,7 @@ coap_get_transaction_by_mid(uint16_t mid)
 {
   coap_transaction_t *t = NULL;
 
-  for(t = (coap_transaction_t *)list_head(transactions_list); t; t = t->next) {
+  for(t = mid_table[MID_HASH(mid)]; t; t = t->next) {
     if(t->mid == mid) {
       PRINTF("Found transaction for MID %u: %p\n", t->mid, t);
       return t;
@@ -167,13 +360,17 @@ void
 coap_check_transactions()
 {
   coap_transaction_t *t = NULL;
+  clock_time_t now = clock_time();
 
-  for(t = (coap_transaction_t *)list_head(transactions_list); t; t = t->next) {
-    if(etimer_expired(&t->retrans_timer)) {
-      ++(t->retrans_counter);
-      PRINTF("Retransmitting %u (%u)\n", t->mid, t->retrans_counter);
-      coap_send_transaction(t);
-    }
+  /* only the head of the queue can be due */
+  while((t = queue_head) != NULL
+        && !DEADLINE_BEFORE(now, t->retrans_deadline)) {
+    queue_remove(t);
+    ++(t->retrans_counter);
+    PRINTF("Retransmitting %u (%u)\n", t->mid, t->retrans_counter);
+    coap_send_transaction(t);
   }
+
+  schedule_retransmission();
 }
 /*---------------------------------------------------------------------------*/
@@ -48,12 +48,25 @@
 #define COAP_RESPONSE_TIMEOUT_TICKS         (CLOCK_SECOND * COAP_RESPONSE_TIMEOUT)
 #define COAP_RESPONSE_TIMEOUT_BACKOFF_MASK  (long)((CLOCK_SECOND * COAP_RESPONSE_TIMEOUT * ((float)COAP_RESPONSE_RANDOM_FACTOR - 1.0)) + 0.5) + 1
 
+/* serialized notification options and payload, shared by the transactions to all observers */
+typedef struct coap_shared_packet {
+  uint8_t references;
+  uint8_t code;
+  uint16_t packet_len;
+  uint8_t packet[COAP_MAX_PACKET_SIZE + 1];     /* +1 for the terminating '\0' which will not be sent */
+} coap_shared_packet_t;
+
 /* container for transactions with message buffer and retransmission info */
 typedef struct coap_transaction {
-  struct coap_transaction *next;        /* for LIST */
+  struct coap_transaction *next;        /* for the MID hash chain */
+
+  /* retransmission queue, ordered by deadline */
+  struct coap_transaction *queue_prev;
+  struct coap_transaction *queue_next;
 
   uint16_t mid;
-  struct etimer retrans_timer;
+  clock_time_t retrans_interval;
+  clock_time_t retrans_deadline;
   uint8_t retrans_counter;
 
   uip_ipaddr_t addr;
@@ -63,8 +76,12 @@ typedef struct coap_transaction {
   void *callback_data;
 
   uint16_t packet_len;
-  uint8_t packet[COAP_MAX_PACKET_SIZE + 1];     /* +1 for the terminating '\0' which will not be sent
-                                                 * Use snprintf(buf, len+1, "", ...) to completely fill payload */
+  uint8_t *packet;      /* COAP_MAX_PACKET_SIZE + 1 bytes for the terminating '\0' which will not be sent
+                         * Use snprintf(buf, len+1, "", ...) to completely fill payload */
+
+  /* for notifications, packet only holds the header and token, which are followed by the shared options and payload */
+  coap_shared_packet_t *shared;
+  uint8_t header[COAP_HEADER_LEN + COAP_TOKEN_LEN];
 } coap_transaction_t;
 
 void coap_register_as_transaction_handler(void);
@@ -75,6 +92,14 @@ void coap_send_transaction(coap_transaction_t *t);
 void coap_clear_transaction(coap_transaction_t *t);
 coap_transaction_t *coap_get_transaction_by_mid(uint16_t mid);
 
+coap_shared_packet_t *coap_new_shared_packet(void);
+void coap_release_shared_packet(coap_shared_packet_t *p);
+coap_transaction_t *coap_new_shared_transaction(uint16_t mid,
+                                                uip_ipaddr_t *addr,
+                                                uint16_t port,
+                                                coap_shared_packet_t *p);
+void coap_set_shared_packet(coap_transaction_t *t, coap_shared_packet_t *p);
+
 void coap_check_transactions(void);
 
 #endif /* COAP_TRANSACTIONS_H_ */
@@ -57,6 +57,7 @@
 
 #include "lib/assert.h"
 #include "lib/list.h"
+#include "lib/memb.h"
 #include "sys/cc.h"
 
 #include <stdlib.h>
@@ -126,6 +127,7 @@ typedef enum {
 #define RESPONSE_WAIT_TIMEOUT (CLOCK_SECOND * 10)
 /*---------------------------------------------------------------------------*/
 #define INCREMENT_MID(conn)   (conn)->mid_counter += 2
+#define CURRENT_INFLIGHT(conn) (&(conn)->inflight[(conn)->inflight_pos])
 #define MQTT_STRING_LENGTH(s) (((s)->length) == 0 ? 0 : (MQTT_STRING_LEN_SIZE + (s)->length))
 /*---------------------------------------------------------------------------*/
 /* Protothread send macros */
@@ -186,8 +188,10 @@ static void tcp_event(struct tcp_socket *s, void *ptr,
                       tcp_socket_event_t event);
 
 static void reset_packet(struct mqtt_in_packet *packet);
+static void schedule_inflight(struct mqtt_connection *conn);
 /*---------------------------------------------------------------------------*/
 LIST(mqtt_conn_list);
+MEMB(topic_nodes, struct mqtt_topic_node, MQTT_TOPIC_NODES);
 /*---------------------------------------------------------------------------*/
 PROCESS(mqtt_process, "MQTT process");
 /*---------------------------------------------------------------------------*/
@@ -200,10 +204,149 @@ call_event(struct mqtt_connection *conn,
   process_post(conn->app_process, mqtt_update_event, NULL);
 }
 /*---------------------------------------------------------------------------*/
+static int
+next_inflight(struct mqtt_connection *conn)
+{
+  int i;
+  int next = -1;
+
+  /* oldest message with something to send */
+  for(i = 0; i < MQTT_MAX_INFLIGHT; i++) {
+    if((conn->inflight[i].state == MQTT_INFLIGHT_PUBLISH_QUEUED ||
+        conn->inflight[i].state == MQTT_INFLIGHT_PUBREL_QUEUED) &&
+       (next < 0 ||
+        (int16_t)(conn->inflight[i].seq - conn->inflight[next].seq) < 0)) {
+      next = i;
+    }
+  }
+  return next;
+}
+/*---------------------------------------------------------------------------*/
+static struct mqtt_inflight *
+find_inflight(struct mqtt_connection *conn, uint16_t mid,
+              mqtt_inflight_state_t state)
+{
+  int i;
+
+  for(i = 0; i < MQTT_MAX_INFLIGHT; i++) {
+    if(conn->inflight[i].state == state && conn->inflight[i].mid == mid) {
+      return &conn->inflight[i];
+    }
+  }
+  return NULL;
+}
+/*---------------------------------------------------------------------------*/
+/*
+ * The API takes no new subscription or referenced publish while one is in
+ * progress, or while a message still holds the caller's buffers.
+ */
+static void
+update_out_queue_full(struct mqtt_connection *conn)
+{
+  int i;
+
+  conn->out_queue_full = conn->out_packet_busy;
+  for(i = 0; i < MQTT_MAX_INFLIGHT; i++) {
+    if(conn->inflight[i].state != MQTT_INFLIGHT_FREE &&
+       conn->inflight[i].referenced) {
+      conn->out_queue_full = 1;
+    }
+  }
+}
+/*---------------------------------------------------------------------------*/
+static void
+free_inflight(struct mqtt_connection *conn, struct mqtt_inflight *msg)
+{
+  msg->state = MQTT_INFLIGHT_FREE;
+  if(msg->referenced) {
+    /* the caller's buffers may be free again */
+    update_out_queue_full(conn);
+  }
+}
+/*---------------------------------------------------------------------------*/
+static void
+complete_inflight(struct mqtt_connection *conn, struct mqtt_inflight *msg,
+                  mqtt_event_t event)
+{
+  struct mqtt_puback_event puback_event;
+
+  puback_event.mid = msg->mid;
+  puback_event.latency = clock_time() - msg->sent_at;
+  free_inflight(conn, msg);
+
+  call_event(conn, event, &puback_event);
+}
+/*---------------------------------------------------------------------------*/
+static void
+inflight_timeout(void *ptr)
+{
+  struct mqtt_connection *conn = ptr;
+  struct mqtt_inflight *msg;
+  int resend = 0;
+  int i;
+
+  for(i = 0; i < MQTT_MAX_INFLIGHT; i++) {
+    msg = &conn->inflight[i];
+    if((msg->state != MQTT_INFLIGHT_PUBLISH_SENT &&
+        msg->state != MQTT_INFLIGHT_PUBREL_SENT) ||
+       !timer_expired(&msg->retry_timer)) {
+      continue;
+    }
+
+    if(msg->retries >= MQTT_INFLIGHT_RETRIES) {
+      PRINTF("MQTT - Giving up on message %u\n", msg->mid);
+      complete_inflight(conn, msg, MQTT_EVENT_PUBLISH_TIMEOUT_ERROR);
+      continue;
+    }
+
+    DBG("MQTT - Retrying message %u\n", msg->mid);
+    msg->retries++;
+    if(msg->state == MQTT_INFLIGHT_PUBLISH_SENT) {
+      msg->dup = 1;
+      msg->state = MQTT_INFLIGHT_PUBLISH_QUEUED;
+    } else {
+      msg->state = MQTT_INFLIGHT_PUBREL_QUEUED;
+    }
+    resend = 1;
+  }
+
+  if(resend && conn->state == MQTT_CONN_STATE_CONNECTED_TO_BROKER) {
+    process_post(&mqtt_process, mqtt_do_publish_event, conn);
+  }
+  schedule_inflight(conn);
+}
+/*---------------------------------------------------------------------------*/
+static void
+schedule_inflight(struct mqtt_connection *conn)
+{
+  clock_time_t next = 0;
+  clock_time_t remaining;
+  uint8_t waiting = 0;
+  int i;
+
+  /* one ctimer for the earliest retry of all messages */
+  for(i = 0; i < MQTT_MAX_INFLIGHT; i++) {
+    if(conn->inflight[i].state == MQTT_INFLIGHT_PUBLISH_SENT ||
+       conn->inflight[i].state == MQTT_INFLIGHT_PUBREL_SENT) {
+      remaining = timer_expired(&conn->inflight[i].retry_timer) ? 0 :
+        timer_remaining(&conn->inflight[i].retry_timer);
+      if(!waiting || remaining < next) {
+        next = remaining;
+      }
+      waiting = 1;
+    }
+  }
+
+  if(waiting) {
+    ctimer_set(&conn->inflight_timer, MAX(next, 1), inflight_timeout, conn);
+  } else {
+    ctimer_stop(&conn->inflight_timer);
+  }
+}
+/*---------------------------------------------------------------------------*/
 static void
 reset_defaults(struct mqtt_connection *conn)
 {
-  conn->mid_counter = 1;
   PT_INIT(&conn->out_proto_thread);
   conn->waiting_for_pingresp = 0;
 
@@ -214,11 +357,26 @@ reset_defaults(struct mqtt_connection *conn)
 static void
 abort_connection(struct mqtt_connection *conn)
 {
+  int i;
+
   conn->out_buffer_ptr = conn->out_buffer;
-  conn->out_queue_full = 0;
 
   /* Reset outgoing packet */
   memset(&conn->out_packet, 0, sizeof(conn->out_packet));
+  conn->out_packet_busy = 0;
+
+  /* Unacknowledged messages are sent again once we are reconnected */
+  ctimer_stop(&conn->inflight_timer);
+  for(i = 0; i < MQTT_MAX_INFLIGHT; i++) {
+    if(conn->inflight[i].state == MQTT_INFLIGHT_PUBLISH_SENT) {
+      conn->inflight[i].dup = 1;
+      conn->inflight[i].state = MQTT_INFLIGHT_PUBLISH_QUEUED;
+    } else if(conn->inflight[i].state == MQTT_INFLIGHT_PUBREL_SENT) {
+      conn->inflight[i].state = MQTT_INFLIGHT_PUBREL_QUEUED;
+    }
+  }
+  /* Messages to be sent again still hold the caller's buffers */
+  update_out_queue_full(conn);
 
   tcp_socket_close(&conn->socket);
   tcp_socket_unregister(&conn->socket);
@@ -304,7 +462,7 @@ write_byte(struct mqtt_connection *conn, uint8_t data)
 }
 /*---------------------------------------------------------------------------*/
 static int
-write_bytes(struct mqtt_connection *conn, uint8_t *data, uint16_t len)
+write_bytes(struct mqtt_connection *conn, uint8_t *data, uint32_t len)
 {
   uint16_t write_bytes;
   write_bytes =
@@ -315,7 +473,7 @@ write_bytes(struct mqtt_connection *conn, uint8_t *data, uint16_t len)
   conn->out_write_pos += write_bytes;
   conn->out_buffer_ptr += write_bytes;
 
-  DBG("MQTT - (write_bytes) len: %u write_pos: %lu\n", len,
+  DBG("MQTT - (write_bytes) len: %lu write_pos: %lu\n", len,
       conn->out_write_pos);
 
   if(len - conn->out_write_pos == 0) {
@@ -371,8 +529,17 @@ keep_alive_callback(void *ptr)
 static void
 reset_packet(struct mqtt_in_packet *packet)
 {
-  memset(packet, 0, sizeof(struct mqtt_in_packet));
+  /* Called after every packet, so leave the payload buffer alone */
+  packet->state = MQTT_IN_STATE_FHDR;
+  packet->fhdr = 0;
+  packet->remaining_length = 0;
   packet->remaining_multiplier = 1;
+  packet->remaining_length_bytes = 0;
+  packet->left = 0;
+  packet->mid = 0;
+  packet->payload_pos = 0;
+  packet->topic_len = 0;
+  packet->topic_pos = 0;
 }
 /*---------------------------------------------------------------------------*/
 static
@@ -453,7 +620,6 @@ PT_THREAD(connect_pt(struct pt *pt, struct mqtt_connection *conn))
   timer_set(&conn->t, RESPONSE_WAIT_TIMEOUT);
 
   /* Wait for CONNACK */
-  reset_packet(&conn->in_packet);
   PT_WAIT_UNTIL(pt, conn->out_packet.qos_state == MQTT_QOS_STATE_GOT_ACK ||
                 timer_expired(&conn->t));
   if(timer_expired(&conn->t)) {
@@ -461,7 +627,6 @@ PT_THREAD(connect_pt(struct pt *pt, struct mqtt_connection *conn))
     /* We stick to the letter of the spec here: Tear the connection down */
     mqtt_disconnect(conn);
   }
-  reset_packet(&conn->in_packet);
 
   DBG("MQTT - Done sending CONNECT\n");
 
@@ -530,7 +695,7 @@ PT_THREAD(subscribe_pt(struct pt *pt, struct mqtt_connection *conn))
                       conn->out_packet.remaining_length_enc,
                       conn->out_packet.remaining_length_enc_bytes);
   /* Write Variable Header */
-  PT_MQTT_WRITE_BYTE(conn, (conn->out_packet.mid << 8));
+  PT_MQTT_WRITE_BYTE(conn, (conn->out_packet.mid >> 8));
   PT_MQTT_WRITE_BYTE(conn, (conn->out_packet.mid & 0x00FF));
   /* Write Payload */
   PT_MQTT_WRITE_BYTE(conn, (conn->out_packet.topic_length >> 8));
@@ -544,17 +709,16 @@ PT_THREAD(subscribe_pt(struct pt *pt, struct mqtt_connection *conn))
   timer_set(&conn->t, RESPONSE_WAIT_TIMEOUT);
 
   /* Wait for SUBACK. */
-  reset_packet(&conn->in_packet);
   PT_WAIT_UNTIL(pt, conn->out_packet.qos_state == MQTT_QOS_STATE_GOT_ACK ||
                 timer_expired(&conn->t));
 
   if(timer_expired(&conn->t)) {
     DBG("Timeout waiting for SUBACK\n");
   }
-  reset_packet(&conn->in_packet);
 
   /* This is clear after the entire transaction is complete */
-  conn->out_queue_full = 0;
+  conn->out_packet_busy = 0;
+  update_out_queue_full(conn);
 
   DBG("MQTT - Done in send_subscribe!\n");
 
@@ -592,7 +756,7 @@ PT_THREAD(unsubscribe_pt(struct pt *pt, struct mqtt_connection *conn))
   PT_MQTT_WRITE_BYTES(conn, (uint8_t *)conn->out_packet.remaining_length_enc,
                       conn->out_packet.remaining_length_enc_bytes);
   /* Write Variable Header */
-  PT_MQTT_WRITE_BYTE(conn, (conn->out_packet.mid << 8));
+  PT_MQTT_WRITE_BYTE(conn, (conn->out_packet.mid >> 8));
   PT_MQTT_WRITE_BYTE(conn, (conn->out_packet.mid & 0x00FF));
   /* Write Payload */
   PT_MQTT_WRITE_BYTE(conn, (conn->out_packet.topic_length >> 8));
@@ -605,7 +769,6 @@ PT_THREAD(unsubscribe_pt(struct pt *pt, struct mqtt_connection *conn))
   timer_set(&conn->t, RESPONSE_WAIT_TIMEOUT);
 
   /* Wait for UNSUBACK */
-  reset_packet(&conn->in_packet);
   PT_WAIT_UNTIL(pt, conn->out_packet.qos_state == MQTT_QOS_STATE_GOT_ACK ||
                 timer_expired(&conn->t));
 
@@ -613,10 +776,9 @@ PT_THREAD(unsubscribe_pt(struct pt *pt, struct mqtt_connection *conn))
     DBG("Timeout waiting for UNSUBACK\n");
   }
 
-  reset_packet(&conn->in_packet);
-
   /* This is clear after the entire transaction is complete */
-  conn->out_queue_full = 0;
+  conn->out_packet_busy = 0;
+  update_out_queue_full(conn);
 
   DBG("MQTT - Done writing subscribe message to out buffer!\n");
 
@@ -626,85 +788,98 @@ PT_THREAD(unsubscribe_pt(struct pt *pt, struct mqtt_connection *conn))
 static
 PT_THREAD(publish_pt(struct pt *pt, struct mqtt_connection *conn))
 {
+  int next;
+
   PT_BEGIN(pt);
 
-  DBG("MQTT - Sending publish message! topic %s topic_length %i\n",
-      conn->out_packet.topic,
-      conn->out_packet.topic_length);
-  DBG("MQTT - Buffer space is %i \n",
-      &conn->out_buffer[MQTT_TCP_OUTPUT_BUFF_SIZE] - conn->out_buffer_ptr);
+  /* Write all queued messages back to back, they will share TCP segments */
+  while((next = next_inflight(conn)) >= 0) {
+    conn->inflight_pos = next;
 
-  /* Set up FHDR */
-  conn->out_packet.fhdr = MQTT_FHDR_MSG_TYPE_PUBLISH |
-    conn->out_packet.qos << 1;
-  if(conn->out_packet.retain == MQTT_RETAIN_ON) {
-    conn->out_packet.fhdr |= MQTT_FHDR_RETAIN_FLAG;
-  }
-  conn->out_packet.remaining_length = MQTT_STRING_LEN_SIZE +
-    conn->out_packet.topic_length +
-    conn->out_packet.payload_size;
-  if(conn->out_packet.qos > MQTT_QOS_LEVEL_0) {
-    conn->out_packet.remaining_length += MQTT_MID_SIZE;
-  }
-  encode_remaining_length(conn->out_packet.remaining_length_enc,
-                          &conn->out_packet.remaining_length_enc_bytes,
-                          conn->out_packet.remaining_length);
-  if(conn->out_packet.remaining_length_enc_bytes > 4) {
-    call_event(conn, MQTT_EVENT_PROTOCOL_ERROR, NULL);
-    PRINTF("MQTT - Error, remaining length > 4 bytes\n");
-    PT_EXIT(pt);
-  }
+    if(CURRENT_INFLIGHT(conn)->state == MQTT_INFLIGHT_PUBREL_QUEUED) {
+      DBG("MQTT - Sending PUBREL %u\n", CURRENT_INFLIGHT(conn)->mid);
 
-  /* Write Fixed Header */
-  PT_MQTT_WRITE_BYTE(conn, conn->out_packet.fhdr);
-  PT_MQTT_WRITE_BYTES(conn, (uint8_t *)conn->out_packet.remaining_length_enc,
-                      conn->out_packet.remaining_length_enc_bytes);
-  /* Write Variable Header */
-  PT_MQTT_WRITE_BYTE(conn, (conn->out_packet.topic_length >> 8));
-  PT_MQTT_WRITE_BYTE(conn, (conn->out_packet.topic_length & 0x00FF));
-  PT_MQTT_WRITE_BYTES(conn, (uint8_t *)conn->out_packet.topic,
-                      conn->out_packet.topic_length);
-  if(conn->out_packet.qos > MQTT_QOS_LEVEL_0) {
-    PT_MQTT_WRITE_BYTE(conn, (conn->out_packet.mid << 8));
-    PT_MQTT_WRITE_BYTE(conn, (conn->out_packet.mid & 0x00FF));
-  }
-  /* Write Payload */
-  PT_MQTT_WRITE_BYTES(conn,
-                      conn->out_packet.payload,
-                      conn->out_packet.payload_size);
+      PT_MQTT_WRITE_BYTE(conn, MQTT_FHDR_MSG_TYPE_PUBREL | MQTT_FHDR_QOS_LEVEL_1);
+      PT_MQTT_WRITE_BYTE(conn, MQTT_MID_SIZE);
+      PT_MQTT_WRITE_BYTE(conn, (CURRENT_INFLIGHT(conn)->mid >> 8));
+      PT_MQTT_WRITE_BYTE(conn, (CURRENT_INFLIGHT(conn)->mid & 0x00FF));
 
-  send_out_buffer(conn);
-  timer_set(&conn->t, RESPONSE_WAIT_TIMEOUT);
+      CURRENT_INFLIGHT(conn)->state = MQTT_INFLIGHT_PUBREL_SENT;
+      timer_set(&CURRENT_INFLIGHT(conn)->retry_timer, RESPONSE_WAIT_TIMEOUT);
+      continue;
+    }
 
-  /*
-   * If QoS is zero then wait until the message has been sent, since there is
-   * no ACK to wait for.
-   *
-   * Also notify the app will not be notified via PUBACK or PUBCOMP
-   */
-  if(conn->out_packet.qos == 0) {
-    process_post(conn->app_process, mqtt_update_event, NULL);
-  } else if(conn->out_packet.qos == 1) {
-    /* Wait for PUBACK */
-    reset_packet(&conn->in_packet);
-    PT_WAIT_UNTIL(pt, conn->out_packet.qos_state == MQTT_QOS_STATE_GOT_ACK ||
-                  timer_expired(&conn->t));
-    if(timer_expired(&conn->t)) {
-      DBG("Timeout waiting for PUBACK\n");
+    DBG("MQTT - Sending publish message! topic %s topic_length %i\n",
+        CURRENT_INFLIGHT(conn)->topic,
+        CURRENT_INFLIGHT(conn)->topic_length);
+    DBG("MQTT - Buffer space is %i \n",
+        &conn->out_buffer[MQTT_TCP_OUTPUT_BUFF_SIZE] - conn->out_buffer_ptr);
+
+    /* Set up FHDR */
+    conn->out_packet.fhdr = MQTT_FHDR_MSG_TYPE_PUBLISH |
+      CURRENT_INFLIGHT(conn)->qos << 1;
+    if(CURRENT_INFLIGHT(conn)->retain == MQTT_RETAIN_ON) {
+      conn->out_packet.fhdr |= MQTT_FHDR_RETAIN_FLAG;
     }
-    if(conn->in_packet.mid != conn->out_packet.mid) {
-      DBG("MQTT - Warning, got PUBACK with none matching MID. Currently there "
-          "is no support for several concurrent PUBLISH messages.\n");
+    if(CURRENT_INFLIGHT(conn)->dup) {
+      conn->out_packet.fhdr |= MQTT_FHDR_DUP_FLAG;
+    }
+    conn->out_packet.remaining_length = MQTT_STRING_LEN_SIZE +
+      CURRENT_INFLIGHT(conn)->topic_length +
+      CURRENT_INFLIGHT(conn)->payload_size;
+    if(CURRENT_INFLIGHT(conn)->qos > MQTT_QOS_LEVEL_0) {
+      conn->out_packet.remaining_length += MQTT_MID_SIZE;
+    }
+    encode_remaining_length(conn->out_packet.remaining_length_enc,
+                            &conn->out_packet.remaining_length_enc_bytes,
+                            conn->out_packet.remaining_length);
+    if(conn->out_packet.remaining_length_enc_bytes > 4) {
+      free_inflight(conn, CURRENT_INFLIGHT(conn));
+      call_event(conn, MQTT_EVENT_PROTOCOL_ERROR, NULL);
+      PRINTF("MQTT - Error, remaining length > 4 bytes\n");
+      continue;
     }
-  } else if(conn->out_packet.qos == 2) {
-    DBG("MQTT - QoS not implemented yet.\n");
-    /* Should wait for PUBREC, send PUBREL and then wait for PUBCOMP */
-  }
 
-  reset_packet(&conn->in_packet);
+    /* Write Fixed Header */
+    PT_MQTT_WRITE_BYTE(conn, conn->out_packet.fhdr);
+    PT_MQTT_WRITE_BYTES(conn, (uint8_t *)conn->out_packet.remaining_length_enc,
+                        conn->out_packet.remaining_length_enc_bytes);
+    /* Write Variable Header */
+    PT_MQTT_WRITE_BYTE(conn, (CURRENT_INFLIGHT(conn)->topic_length >> 8));
+    PT_MQTT_WRITE_BYTE(conn, (CURRENT_INFLIGHT(conn)->topic_length & 0x00FF));
+    PT_MQTT_WRITE_BYTES(conn, (uint8_t *)CURRENT_INFLIGHT(conn)->topic,
+                        CURRENT_INFLIGHT(conn)->topic_length);
+    if(CURRENT_INFLIGHT(conn)->qos > MQTT_QOS_LEVEL_0) {
+      PT_MQTT_WRITE_BYTE(conn, (CURRENT_INFLIGHT(conn)->mid >> 8));
+      PT_MQTT_WRITE_BYTE(conn, (CURRENT_INFLIGHT(conn)->mid & 0x00FF));
+    }
+    /* Write Payload, fragment by fragment */
+    for(conn->out_packet.iov_pos = 0;
+        conn->out_packet.iov_pos < CURRENT_INFLIGHT(conn)->iovcnt;
+        conn->out_packet.iov_pos++) {
+      PT_MQTT_WRITE_BYTES(conn,
+        (uint8_t *)CURRENT_INFLIGHT(conn)->iov[conn->out_packet.iov_pos].data,
+        CURRENT_INFLIGHT(conn)->iov[conn->out_packet.iov_pos].len);
+    }
 
-  /* This is clear after the entire transaction is complete */
-  conn->out_queue_full = 0;
+    /*
+     * If QoS is zero we are done, since there is no ACK to wait for. Notify
+     * the app, it will not be notified via PUBACK or PUBCOMP.
+     */
+    if(CURRENT_INFLIGHT(conn)->qos == MQTT_QOS_LEVEL_0) {
+      free_inflight(conn, CURRENT_INFLIGHT(conn));
+      process_post(conn->app_process, mqtt_update_event, NULL);
+    } else {
+      if(!CURRENT_INFLIGHT(conn)->dup) {
+        CURRENT_INFLIGHT(conn)->sent_at = clock_time();
+      }
+      CURRENT_INFLIGHT(conn)->state = MQTT_INFLIGHT_PUBLISH_SENT;
+      timer_set(&CURRENT_INFLIGHT(conn)->retry_timer, RESPONSE_WAIT_TIMEOUT);
+    }
+  }
+
+  send_out_buffer(conn);
+  schedule_inflight(conn);
 
   DBG("MQTT - Publish Enqueued\n");
 
@@ -728,12 +903,9 @@ PT_THREAD(pingreq_pt(struct pt *pt, struct mqtt_connection *conn))
   conn->waiting_for_pingresp = 1;
 
   /* Wait for PINGRESP or timeout */
-  reset_packet(&conn->in_packet);
   timer_set(&conn->t, RESPONSE_WAIT_TIMEOUT);
 
-  PT_WAIT_UNTIL(pt, conn->in_packet.packet_received || timer_expired(&conn->t));
-
-  reset_packet(&conn->in_packet);
+  PT_WAIT_UNTIL(pt, !conn->waiting_for_pingresp || timer_expired(&conn->t));
 
   conn->waiting_for_pingresp = 0;
 
@@ -763,12 +935,19 @@ handle_connack(struct mqtt_connection *conn)
   /* Always reset packet before callback since it might be used directly */
   conn->state = MQTT_CONN_STATE_CONNECTED_TO_BROKER;
   call_event(conn, MQTT_EVENT_CONNECTED, NULL);
+
+  /* Send what was queued or unacknowledged before the connection dropped */
+  if(next_inflight(conn) >= 0) {
+    process_post(&mqtt_process, mqtt_do_publish_event, conn);
+  }
 }
 /*---------------------------------------------------------------------------*/
 static void
 handle_pingresp(struct mqtt_connection *conn)
 {
   DBG("MQTT - Got RINGRESP\n");
+
+  conn->waiting_for_pingresp = 0;
 }
 /*---------------------------------------------------------------------------*/
 static void
@@ -820,247 +999,261 @@ handle_unsuback(struct mqtt_connection *conn)
 static void
 handle_puback(struct mqtt_connection *conn)
 {
+  struct mqtt_inflight *msg;
+
   DBG("MQTT - Got PUBACK\n");
 
-  conn->out_packet.qos_state = MQTT_QOS_STATE_GOT_ACK;
   conn->in_packet.mid = (conn->in_packet.payload[0] << 8) |
     (conn->in_packet.payload[1]);
 
-  call_event(conn, MQTT_EVENT_PUBACK, &conn->in_packet.mid);
+  msg = find_inflight(conn, conn->in_packet.mid, MQTT_INFLIGHT_PUBLISH_SENT);
+  if(msg == NULL || msg->qos != MQTT_QOS_LEVEL_1) {
+    DBG("MQTT - Warning, got PUBACK with none matching MID %u\n",
+        conn->in_packet.mid);
+    return;
+  }
+
+  complete_inflight(conn, msg, MQTT_EVENT_PUBACK);
+  schedule_inflight(conn);
 }
 /*---------------------------------------------------------------------------*/
 static void
-handle_publish(struct mqtt_connection *conn)
+handle_pubrec(struct mqtt_connection *conn)
 {
-  DBG("MQTT - Got PUBLISH, called once per manageable chunk of message.\n");
-  DBG("MQTT - Handling publish on topic '%s'\n", conn->in_publish_msg.topic);
+  struct mqtt_inflight *msg;
 
-  DBG("MQTT - This chunk is %i bytes\n", conn->in_packet.payload_pos);
+  DBG("MQTT - Got PUBREC\n");
 
-  if(((conn->in_packet.fhdr & 0x09) >> 1) > 0) {
-    PRINTF("MQTT - Error, got incoming PUBLISH with QoS > 0, not supported atm!\n");
+  conn->in_packet.mid = (conn->in_packet.payload[0] << 8) |
+    (conn->in_packet.payload[1]);
+
+  /* A repeated PUBREC is answered with another PUBREL */
+  msg = find_inflight(conn, conn->in_packet.mid, MQTT_INFLIGHT_PUBLISH_SENT);
+  if(msg == NULL) {
+    msg = find_inflight(conn, conn->in_packet.mid, MQTT_INFLIGHT_PUBREL_SENT);
+  }
+  if(msg == NULL || msg->qos != MQTT_QOS_LEVEL_2) {
+    DBG("MQTT - Warning, got PUBREC with none matching MID %u\n",
+        conn->in_packet.mid);
+    return;
   }
 
-  call_event(conn, MQTT_EVENT_PUBLISH, &conn->in_publish_msg);
+  msg->state = MQTT_INFLIGHT_PUBREL_QUEUED;
+  msg->retries = 0;
+  process_post(&mqtt_process, mqtt_do_publish_event, conn);
+}
+/*---------------------------------------------------------------------------*/
+static void
+handle_pubcomp(struct mqtt_connection *conn)
+{
+  struct mqtt_inflight *msg;
 
-  if(conn->in_publish_msg.first_chunk == 1) {
-    conn->in_publish_msg.first_chunk = 0;
-  }
+  DBG("MQTT - Got PUBCOMP\n");
 
-  /* If this is the last time handle_publish will be called, reset packet. */
-  if(conn->in_publish_msg.payload_left == 0) {
+  conn->in_packet.mid = (conn->in_packet.payload[0] << 8) |
+    (conn->in_packet.payload[1]);
 
-    /* Check for QoS and initiate the reply, do not rely on the data in the
-     * in_packet being untouched. */
+  msg = find_inflight(conn, conn->in_packet.mid, MQTT_INFLIGHT_PUBREL_SENT);
+  if(msg == NULL) {
+    DBG("MQTT - Warning, got PUBCOMP with none matching MID %u\n",
+        conn->in_packet.mid);
+    return;
+  }
 
-    DBG("MQTT - (handle_publish) resetting packet.\n");
-    reset_packet(&conn->in_packet);
+  complete_inflight(conn, msg, MQTT_EVENT_PUBACK);
+  schedule_inflight(conn);
+}
+/*---------------------------------------------------------------------------*/
+static const char *
+level_end(const char *level)
+{
+  while(*level != '\0' && *level != '/') {
+    level++;
   }
+  return level;
 }
 /*---------------------------------------------------------------------------*/
-static void
-parse_publish_vhdr(struct mqtt_connection *conn,
-                   uint32_t *pos,
-                   const uint8_t *input_data_ptr,
-                   int input_data_len)
+static struct mqtt_topic_node **
+find_node(struct mqtt_topic_node **list, const char *level, uint8_t length)
 {
-  uint16_t copy_bytes;
-
-  /* Read out topic length */
-  if(conn->in_packet.topic_len_received == 0) {
-    conn->in_packet.topic_len = (input_data_ptr[(*pos)++] << 8);
-    conn->in_packet.byte_counter++;
-    if(*pos >= input_data_len) {
-      return;
-    }
-    conn->in_packet.topic_len |= input_data_ptr[(*pos)++];
-    conn->in_packet.byte_counter++;
-    conn->in_packet.topic_len_received = 1;
-
-    DBG("MQTT - Read PUBLISH topic len %i\n", conn->in_packet.topic_len);
-    /* WARNING: Check here if TOPIC fits in payload area, otherwise error */
-  }
-
-  /* Read out topic */
-  if(conn->in_packet.topic_len_received == 1 &&
-     conn->in_packet.topic_received == 0) {
-    copy_bytes = MIN(conn->in_packet.topic_len - conn->in_packet.topic_pos,
-                     input_data_len - *pos);
-    DBG("MQTT - topic_pos: %i copy_bytes: %i", conn->in_packet.topic_pos,
-        copy_bytes);
-    memcpy(&conn->in_publish_msg.topic[conn->in_packet.topic_pos],
-           &input_data_ptr[*pos],
-           copy_bytes);
-    (*pos) += copy_bytes;
-    conn->in_packet.byte_counter += copy_bytes;
-    conn->in_packet.topic_pos += copy_bytes;
-
-    if(conn->in_packet.topic_len - conn->in_packet.topic_pos == 0) {
-      DBG("MQTT - Got topic '%s'", conn->in_publish_msg.topic);
-      conn->in_packet.topic_received = 1;
-      conn->in_publish_msg.topic[conn->in_packet.topic_pos] = '\0';
-      conn->in_publish_msg.payload_length =
-        conn->in_packet.remaining_length - conn->in_packet.topic_len - 2;
-      conn->in_publish_msg.payload_left = conn->in_publish_msg.payload_length;
+  for(; *list != NULL; list = &(*list)->next) {
+    if((*list)->level_length == length &&
+       memcmp((*list)->level, level, length) == 0) {
+      break;
     }
-
-    /* Set this once per incomming publish message */
-    conn->in_publish_msg.first_chunk = 1;
   }
+  return list;
 }
 /*---------------------------------------------------------------------------*/
-static int
-tcp_input(struct tcp_socket *s,
-          void *ptr,
-          const uint8_t *input_data_ptr,
-          int input_data_len)
+static void
+remove_filter(struct mqtt_topic_node **list, const char *filter)
 {
-  struct mqtt_connection *conn = ptr;
-  uint32_t pos = 0;
-  uint32_t copy_bytes = 0;
-  uint8_t byte;
+  const char *end = level_end(filter);
+  struct mqtt_topic_node *node;
 
-  if(input_data_len == 0) {
-    return 0;
+  if(end - filter > MQTT_TOPIC_LEVEL_LENGTH) {
+    return;
   }
-
-  if(conn->in_packet.packet_received) {
-    reset_packet(&conn->in_packet);
+  list = find_node(list, filter, end - filter);
+  node = *list;
+  if(node == NULL) {
+    return;
   }
 
-  DBG("tcp_input with %i bytes of data:\n", input_data_len);
-
-  /* Read the fixed header field, if we do not have it */
-  if(!conn->in_packet.fhdr) {
-    conn->in_packet.fhdr = input_data_ptr[pos++];
-    conn->in_packet.byte_counter++;
-
-    DBG("MQTT - Read VHDR '%02X'\n", conn->in_packet.fhdr);
-
-    if(pos >= input_data_len) {
-      return 0;
-    }
+  if(*end == '\0') {
+    node->callback = NULL;
+  } else {
+    remove_filter(&node->children, end + 1);
   }
 
-  /* Read the Remaining Length field, if we do not have it */
-  if(!conn->in_packet.has_remaining_length) {
-    do {
-      if(pos >= input_data_len) {
-        return 0;
-      }
-
-      byte = input_data_ptr[pos++];
-      conn->in_packet.byte_counter++;
-      conn->in_packet.remaining_length_bytes++;
-      DBG("MQTT - Read Remaining Length byte\n");
-
-      if(conn->in_packet.byte_counter > 5) {
-        call_event(conn, MQTT_EVENT_ERROR, NULL);
-        DBG("Received more then 4 byte 'remaining lenght'.");
-        return 0;
-      }
-
-      conn->in_packet.remaining_length +=
-        (byte & 127) * conn->in_packet.remaining_multiplier;
-      conn->in_packet.remaining_multiplier *= 128;
-    } while((byte & 128) != 0);
-
-    DBG("MQTT - Finished reading remaining length byte\n");
-    conn->in_packet.has_remaining_length = 1;
+  /* Drop the levels no other filter needs */
+  if(node->callback == NULL && node->children == NULL) {
+    *list = node->next;
+    memb_free(&topic_nodes, node);
   }
+}
+/*---------------------------------------------------------------------------*/
+static mqtt_status_t
+add_filter(struct mqtt_topic_node **root, const char *filter,
+           mqtt_topic_callback_t callback)
+{
+  struct mqtt_topic_node **list = root;
+  struct mqtt_topic_node *node = NULL;
+  const char *level = filter;
+  const char *end;
 
-  /*
-   * Check for unsupported payload length. Will read all incoming data from the
-   * server in any case and then reset the packet.
-   *
-   * TODO: Decide if we, for example, want to disconnect instead.
-   */
-  if((conn->in_packet.remaining_length > MQTT_INPUT_BUFF_SIZE) &&
-     (conn->in_packet.fhdr & 0xF0) != MQTT_FHDR_MSG_TYPE_PUBLISH) {
+  while(1) {
+    end = level_end(level);
+    if(end - level > MQTT_TOPIC_LEVEL_LENGTH ||
+       (memchr(level, '+', end - level) != NULL && end - level != 1) ||
+       (memchr(level, '#', end - level) != NULL &&
+        (end - level != 1 || *end != '\0'))) {
+      remove_filter(root, filter);
+      return MQTT_STATUS_INVALID_ARGS_ERROR;
+    }
 
-    PRINTF("MQTT - Error, unsupported payload size for non-PUBLISH message\n");
+    list = find_node(list, level, end - level);
+    node = *list;
+    if(node == NULL) {
+      node = memb_alloc(&topic_nodes);
+      if(node == NULL) {
+        PRINTF("MQTT - Out of topic nodes for '%s'\n", filter);
+        remove_filter(root, filter);
+        return MQTT_STATUS_ERROR;
+      }
+      memset(node, 0, sizeof(*node));
+      node->level_length = end - level;
+      memcpy(node->level, level, end - level);
+      *list = node;
+    }
 
-    conn->in_packet.byte_counter += input_data_len;
-    if(conn->in_packet.byte_counter >=
-       (MQTT_FHDR_SIZE + conn->in_packet.remaining_length)) {
-      conn->in_packet.packet_received = 1;
+    if(*end == '\0') {
+      break;
     }
-    return 0;
+    list = &node->children;
+    level = end + 1;
   }
 
-  /*
-   * Supported payload, reads out both VHDR and Payload of all packets.
-   *
-   * Note: There will always be at least one byte left to read when we enter
-   *       this loop.
-   */
-  while(conn->in_packet.byte_counter <
-        (MQTT_FHDR_SIZE + conn->in_packet.remaining_length)) {
+  node->callback = callback;
+  return MQTT_STATUS_OK;
+}
+/*---------------------------------------------------------------------------*/
+static void
+add_match(struct mqtt_connection *conn, struct mqtt_topic_node *node)
+{
+  if(node->callback == NULL) {
+    return;
+  }
+  if(conn->match_count == MQTT_TOPIC_MATCHES) {
+    PRINTF("MQTT - Too many filters match '%s'\n", conn->in_publish_msg.topic);
+    return;
+  }
+  conn->matches[conn->match_count++] = node;
+}
+/*---------------------------------------------------------------------------*/
+/*
+ * Collects the filters matching the topic, one trie level per topic level.
+ * Wildcards do not match topics beginning with '$' on the first level.
+ */
+static void
+match_topic(struct mqtt_connection *conn, struct mqtt_topic_node *node,
+            const char *level, uint8_t wildcards)
+{
+  const char *end = level_end(level);
+  struct mqtt_topic_node *child;
 
-    if((conn->in_packet.fhdr & 0xF0) == MQTT_FHDR_MSG_TYPE_PUBLISH &&
-       conn->in_packet.topic_received == 0) {
-      parse_publish_vhdr(conn, &pos, input_data_ptr, input_data_len);
+  for(; node != NULL; node = node->next) {
+    if(node->level_length == 1 && node->level[0] == '#') {
+      if(wildcards) {
+        add_match(conn, node);
+      }
+      continue;
     }
 
-    /* Read in as much as we can into the packet payload */
-    copy_bytes = MIN(input_data_len - pos,
-                     MQTT_INPUT_BUFF_SIZE - conn->in_packet.payload_pos);
-    DBG("- Copied %lu payload bytes\n", copy_bytes);
-    memcpy(&conn->in_packet.payload[conn->in_packet.payload_pos],
-           &input_data_ptr[pos],
-           copy_bytes);
-    conn->in_packet.byte_counter += copy_bytes;
-    conn->in_packet.payload_pos += copy_bytes;
-    pos += copy_bytes;
-
-    uint8_t i;
-    DBG("MQTT - Copied bytes: \n");
-    for(i = 0; i < copy_bytes; i++) {
-      DBG("%02X ", conn->in_packet.payload[i]);
-    }
-    DBG("\n");
+    if((wildcards && node->level_length == 1 && node->level[0] == '+') ||
+       (node->level_length == end - level &&
+        memcmp(node->level, level, end - level) == 0)) {
+      if(*end != '\0') {
+        match_topic(conn, node->children, end + 1, 1);
+        continue;
+      }
 
-    /* Full buffer, shall only happen to PUBLISH messages. */
-    if(MQTT_INPUT_BUFF_SIZE - conn->in_packet.payload_pos == 0) {
-      conn->in_publish_msg.payload_chunk = conn->in_packet.payload;
-      conn->in_publish_msg.payload_chunk_length = MQTT_INPUT_BUFF_SIZE;
-      conn->in_publish_msg.payload_left -= MQTT_INPUT_BUFF_SIZE;
+      add_match(conn, node);
+      /* "a/#" matches "a" as well */
+      for(child = node->children; child != NULL; child = child->next) {
+        if(child->level_length == 1 && child->level[0] == '#') {
+          add_match(conn, child);
+        }
+      }
+    }
+  }
+}
+/*---------------------------------------------------------------------------*/
+static void
+handle_publish(struct mqtt_connection *conn)
+{
+  uint8_t first_chunk;
+  uint8_t i;
 
-      handle_publish(conn);
+  DBG("MQTT - Got PUBLISH, called once per manageable chunk of message.\n");
+  DBG("MQTT - Handling publish on topic '%s'\n", conn->in_publish_msg.topic);
 
-      conn->in_publish_msg.payload_chunk = conn->in_packet.payload;
-      conn->in_packet.payload_pos = 0;
-    }
+  DBG("MQTT - This chunk is %u bytes\n",
+      conn->in_publish_msg.payload_chunk_length);
 
-    if(pos >= input_data_len &&
-       (conn->in_packet.byte_counter < (MQTT_FHDR_SIZE + conn->in_packet.remaining_length))) {
-      return 0;
+  if(conn->match_count == 0) {
+    call_event(conn, MQTT_EVENT_PUBLISH, &conn->in_publish_msg);
+  } else {
+    first_chunk = conn->in_publish_msg.first_chunk;
+    for(i = 0; i < conn->match_count; i++) {
+      conn->in_publish_msg.first_chunk = first_chunk;
+      conn->matches[i]->callback(conn, &conn->in_publish_msg);
     }
   }
 
-  /* Debug information */
-  DBG("\n");
-  /* Take care of input */
+  conn->in_publish_msg.first_chunk = 0;
+}
+/*---------------------------------------------------------------------------*/
+static void
+handle_packet(struct mqtt_connection *conn)
+{
   DBG("MQTT - Finished reading packet!\n");
-  /* What to return? */
-  DBG("MQTT - total data was %i bytes of data. \n",
+  DBG("MQTT - total data was %lu bytes of data. \n",
       (MQTT_FHDR_SIZE + conn->in_packet.remaining_length));
 
-  /* Handle packet here. */
   switch(conn->in_packet.fhdr & 0xF0) {
   case MQTT_FHDR_MSG_TYPE_CONNACK:
     handle_connack(conn);
     break;
-  case MQTT_FHDR_MSG_TYPE_PUBLISH:
-    /* This is the only or the last chunk of publish payload */
-    conn->in_publish_msg.payload_chunk = conn->in_packet.payload;
-    conn->in_publish_msg.payload_chunk_length = conn->in_packet.payload_pos;
-    conn->in_publish_msg.payload_left = 0;
-    handle_publish(conn);
-    break;
   case MQTT_FHDR_MSG_TYPE_PUBACK:
     handle_puback(conn);
     break;
+  case MQTT_FHDR_MSG_TYPE_PUBREC:
+    handle_pubrec(conn);
+    break;
+  case MQTT_FHDR_MSG_TYPE_PUBCOMP:
+    handle_pubcomp(conn);
+    break;
   case MQTT_FHDR_MSG_TYPE_SUBACK:
     handle_suback(conn);
     break;
@@ -1071,10 +1264,8 @@ tcp_input(struct tcp_socket *s,
     handle_pingresp(conn);
     break;
 
-  /* QoS 2 not implemented yet */
-  case MQTT_FHDR_MSG_TYPE_PUBREC:
+  /* QoS 2 not implemented yet for incoming PUBLISH */
   case MQTT_FHDR_MSG_TYPE_PUBREL:
-  case MQTT_FHDR_MSG_TYPE_PUBCOMP:
     call_event(conn, MQTT_EVENT_NOT_IMPLEMENTED_ERROR, NULL);
     PRINTF("MQTT - Got unhandled MQTT Message Type '%i'",
            (conn->in_packet.fhdr & 0xF0));
@@ -1085,8 +1276,196 @@ tcp_input(struct tcp_socket *s,
     PRINTF("MQTT - Got MQTT Message Type '%i'", (conn->in_packet.fhdr & 0xF0));
     break;
   }
+}
+/*---------------------------------------------------------------------------*/
+static void
+start_publish_payload(struct mqtt_connection *conn)
+{
+  conn->in_publish_msg.payload_length = conn->in_packet.left;
+  conn->in_publish_msg.payload_left = conn->in_packet.left;
+  conn->in_publish_msg.first_chunk = 1;
+  conn->in_packet.state = MQTT_IN_STATE_PUBLISH_PAYLOAD;
+
+  if(((conn->in_packet.fhdr & 0x06) >> 1) > 0) {
+    PRINTF("MQTT - Error, got incoming PUBLISH with QoS > 0, not supported atm!\n");
+  }
+
+  if(conn->in_packet.left == 0) {
+    /* Empty messages are passed on as well, e.g. to clear retained ones */
+    conn->in_publish_msg.payload_chunk = conn->in_packet.payload;
+    conn->in_publish_msg.payload_chunk_length = 0;
+    handle_publish(conn);
+    reset_packet(&conn->in_packet);
+  }
+}
+/*---------------------------------------------------------------------------*/
+static void
+topic_received(struct mqtt_connection *conn)
+{
+  conn->in_publish_msg.topic[conn->in_packet.topic_len] = '\0';
+  DBG("MQTT - Got topic '%s'\n", conn->in_publish_msg.topic);
+
+  /* Matched once, all chunks of the payload go to the same handlers */
+  conn->match_count = 0;
+  match_topic(conn, conn->topics, conn->in_publish_msg.topic,
+              conn->in_publish_msg.topic[0] != '$');
+
+  if((conn->in_packet.fhdr & 0x06) && conn->in_packet.left >= MQTT_MID_SIZE) {
+    conn->in_packet.state = MQTT_IN_STATE_MID_MSB;
+  } else {
+    start_publish_payload(conn);
+  }
+}
+/*---------------------------------------------------------------------------*/
+/*
+ * Parses as much of the input as there is. The parser state is kept in
+ * conn->in_packet, so a packet may be split over any number of segments and a
+ * segment may hold any number of packets.
+ */
+static int
+tcp_input(struct tcp_socket *s,
+          void *ptr,
+          const uint8_t *input_data_ptr,
+          int input_data_len)
+{
+  struct mqtt_connection *conn = ptr;
+  struct mqtt_in_packet *in = &conn->in_packet;
+  uint32_t pos = 0;
+  uint32_t copy_bytes;
+  uint8_t byte;
+
+  DBG("tcp_input with %i bytes of data:\n", input_data_len);
 
-  conn->in_packet.packet_received = 1;
+  while(pos < input_data_len) {
+    switch(in->state) {
+    case MQTT_IN_STATE_FHDR:
+      in->fhdr = input_data_ptr[pos++];
+      in->state = MQTT_IN_STATE_REMAINING_LENGTH;
+      DBG("MQTT - Read FHDR '%02X'\n", in->fhdr);
+      break;
+
+    case MQTT_IN_STATE_REMAINING_LENGTH:
+      byte = input_data_ptr[pos++];
+      in->remaining_length_bytes++;
+      in->remaining_length += (byte & 127) * in->remaining_multiplier;
+      in->remaining_multiplier *= 128;
+
+      if(byte & 128) {
+        if(in->remaining_length_bytes == MQTT_MAX_REMAINING_LENGTH_BYTES) {
+          /* We cannot tell where the next packet starts, give up */
+          PRINTF("MQTT - Error, more than 4 byte remaining length\n");
+          reset_packet(in);
+          call_event(conn, MQTT_EVENT_ERROR, NULL);
+          return 0;
+        }
+        break;
+      }
+
+      DBG("MQTT - Remaining length %lu\n", in->remaining_length);
+      in->left = in->remaining_length;
+
+      if((in->fhdr & 0xF0) == MQTT_FHDR_MSG_TYPE_PUBLISH) {
+        in->state = in->remaining_length < MQTT_STRING_LEN_SIZE ?
+          MQTT_IN_STATE_DISCARD : MQTT_IN_STATE_TOPIC_LENGTH_MSB;
+      } else if(in->remaining_length > MQTT_INPUT_BUFF_SIZE) {
+        /* Read and drop the packet, it will not fit */
+        PRINTF("MQTT - Error, unsupported payload size for non-PUBLISH message\n");
+        in->state = MQTT_IN_STATE_DISCARD;
+      } else if(in->remaining_length == 0) {
+        handle_packet(conn);
+        reset_packet(in);
+      } else {
+        in->state = MQTT_IN_STATE_PAYLOAD;
+      }
+      break;
+
+    case MQTT_IN_STATE_TOPIC_LENGTH_MSB:
+      in->topic_len = input_data_ptr[pos++] << 8;
+      in->left--;
+      in->state = MQTT_IN_STATE_TOPIC_LENGTH_LSB;
+      break;
+
+    case MQTT_IN_STATE_TOPIC_LENGTH_LSB:
+      in->topic_len |= input_data_ptr[pos++];
+      in->left--;
+      DBG("MQTT - Read PUBLISH topic len %u\n", in->topic_len);
+
+      if(in->topic_len > MQTT_MAX_TOPIC_LENGTH || in->topic_len > in->left) {
+        PRINTF("MQTT - Error, PUBLISH topic too long (%u)\n", in->topic_len);
+        in->state = MQTT_IN_STATE_DISCARD;
+      } else if(in->topic_len == 0) {
+        topic_received(conn);
+      } else {
+        in->state = MQTT_IN_STATE_TOPIC;
+      }
+      break;
+
+    case MQTT_IN_STATE_TOPIC:
+      copy_bytes = MIN(in->topic_len - in->topic_pos, input_data_len - pos);
+      memcpy(&conn->in_publish_msg.topic[in->topic_pos],
+             &input_data_ptr[pos], copy_bytes);
+      pos += copy_bytes;
+      in->topic_pos += copy_bytes;
+      in->left -= copy_bytes;
+
+      if(in->topic_pos == in->topic_len) {
+        topic_received(conn);
+      }
+      break;
+
+    case MQTT_IN_STATE_MID_MSB:
+      in->mid = input_data_ptr[pos++] << 8;
+      in->left--;
+      in->state = MQTT_IN_STATE_MID_LSB;
+      break;
+
+    case MQTT_IN_STATE_MID_LSB:
+      in->mid |= input_data_ptr[pos++];
+      in->left--;
+      conn->in_publish_msg.mid = in->mid;
+      start_publish_payload(conn);
+      break;
+
+    case MQTT_IN_STATE_PUBLISH_PAYLOAD:
+      /* Pass on whatever this segment holds, without copying it */
+      copy_bytes = MIN(in->left, input_data_len - pos);
+      conn->in_publish_msg.payload_chunk = (uint8_t *)&input_data_ptr[pos];
+      conn->in_publish_msg.payload_chunk_length = copy_bytes;
+      conn->in_publish_msg.payload_left -= copy_bytes;
+      pos += copy_bytes;
+      in->left -= copy_bytes;
+
+      handle_publish(conn);
+
+      if(in->left == 0) {
+        reset_packet(in);
+      }
+      break;
+
+    case MQTT_IN_STATE_PAYLOAD:
+      copy_bytes = MIN(in->left, input_data_len - pos);
+      memcpy(&in->payload[in->payload_pos], &input_data_ptr[pos], copy_bytes);
+      pos += copy_bytes;
+      in->payload_pos += copy_bytes;
+      in->left -= copy_bytes;
+
+      if(in->left == 0) {
+        handle_packet(conn);
+        reset_packet(in);
+      }
+      break;
+
+    case MQTT_IN_STATE_DISCARD:
+      copy_bytes = MIN(in->left, input_data_len - pos);
+      pos += copy_bytes;
+      in->left -= copy_bytes;
+
+      if(in->left == 0) {
+        reset_packet(in);
+      }
+      break;
+    }
+  }
 
   return 0;
 }
@@ -1133,6 +1512,12 @@ tcp_event(struct tcp_socket *s, void *ptr, tcp_socket_event_t event)
     if(conn->socket.output_data_len == 0) {
       conn->out_buffer_sent = 1;
       conn->out_buffer_ptr = conn->out_buffer;
+
+      /* Messages queued while the buffer was busy */
+      if(conn->state == MQTT_CONN_STATE_CONNECTED_TO_BROKER &&
+         next_inflight(conn) >= 0) {
+        process_post(&mqtt_process, mqtt_do_publish_event, conn);
+      }
     }
 
     ctimer_restart(&conn->keep_alive_timer);
@@ -1276,6 +1661,7 @@ mqtt_init(void)
     mqtt_continue_send_event = process_alloc_event();
 
     list_init(mqtt_conn_list);
+    memb_init(&topic_nodes);
     process_start(&mqtt_process, NULL);
     inited = 1;
   }
@@ -1297,6 +1683,8 @@ mqtt_register(struct mqtt_connection *conn, struct process *app_process,
   conn->app_process = app_process;
   conn->auto_reconnect = 1;
   conn->max_segment_size = max_segment_size;
+  /* Kept over reconnects, queued messages keep their MID */
+  conn->mid_counter = 1;
   reset_defaults(conn);
 
   mqtt_init();
@@ -1375,6 +1763,7 @@ mqtt_subscribe(struct mqtt_connection *conn, uint16_t *mid, char *topic,
     return MQTT_STATUS_OUT_QUEUE_FULL;
   }
   conn->out_queue_full = 1;
+  conn->out_packet_busy = 1;
   DBG("MQTT - Accepted!\n");
 
   conn->out_packet.mid = INCREMENT_MID(conn);
@@ -1382,12 +1771,37 @@ mqtt_subscribe(struct mqtt_connection *conn, uint16_t *mid, char *topic,
   conn->out_packet.topic_length = strlen(topic);
   conn->out_packet.qos = qos_level;
   conn->out_packet.qos_state = MQTT_QOS_STATE_NO_ACK;
+  if(mid != NULL) {
+    *mid = conn->out_packet.mid;
+  }
 
   process_post(&mqtt_process, mqtt_do_subscribe_event, conn);
   return MQTT_STATUS_OK;
 }
 /*----------------------------------------------------------------------------*/
 mqtt_status_t
+mqtt_subscribe_callback(struct mqtt_connection *conn, uint16_t *mid,
+                        char *topic, mqtt_qos_level_t qos_level,
+                        mqtt_topic_callback_t callback)
+{
+  mqtt_status_t status;
+
+  if(conn->state != MQTT_CONN_STATE_CONNECTED_TO_BROKER) {
+    return MQTT_STATUS_NOT_CONNECTED_ERROR;
+  }
+  if(conn->out_queue_full) {
+    return MQTT_STATUS_OUT_QUEUE_FULL;
+  }
+
+  status = add_filter(&conn->topics, topic, callback);
+  if(status != MQTT_STATUS_OK) {
+    return status;
+  }
+
+  return mqtt_subscribe(conn, mid, topic, qos_level);
+}
+/*----------------------------------------------------------------------------*/
+mqtt_status_t
 mqtt_unsubscribe(struct mqtt_connection *conn, uint16_t *mid, char *topic)
 {
   if(conn->state != MQTT_CONN_STATE_CONNECTED_TO_BROKER) {
@@ -1401,46 +1815,147 @@ mqtt_unsubscribe(struct mqtt_connection *conn, uint16_t *mid, char *topic)
     return MQTT_STATUS_OUT_QUEUE_FULL;
   }
   conn->out_queue_full = 1;
+  conn->out_packet_busy = 1;
   DBG("MQTT - Accepted!\n");
 
   conn->out_packet.mid = INCREMENT_MID(conn);
   conn->out_packet.topic = topic;
   conn->out_packet.topic_length = strlen(topic);
   conn->out_packet.qos_state = MQTT_QOS_STATE_NO_ACK;
+  if(mid != NULL) {
+    *mid = conn->out_packet.mid;
+  }
+
+  /* Messages still on their way go to the event callback */
+  remove_filter(&conn->topics, topic);
 
   process_post(&mqtt_process, mqtt_do_unsubscribe_event, conn);
   return MQTT_STATUS_OK;
 }
 /*----------------------------------------------------------------------------*/
+static struct mqtt_inflight *
+alloc_inflight(struct mqtt_connection *conn)
+{
+  int i;
+
+  for(i = 0; i < MQTT_MAX_INFLIGHT; i++) {
+    if(conn->inflight[i].state == MQTT_INFLIGHT_FREE) {
+      return &conn->inflight[i];
+    }
+  }
+  return NULL;
+}
+/*---------------------------------------------------------------------------*/
+static void
+queue_publish(struct mqtt_connection *conn, struct mqtt_inflight *msg,
+              uint16_t *mid, mqtt_qos_level_t qos_level, mqtt_retain_t retain)
+{
+  if(msg->referenced) {
+    conn->out_queue_full = 1;
+  }
+  msg->qos = qos_level;
+  msg->retain = retain;
+  msg->dup = 0;
+  msg->retries = 0;
+  msg->mid = 0;
+  if(qos_level > MQTT_QOS_LEVEL_0) {
+    msg->mid = INCREMENT_MID(conn);
+  }
+  msg->seq = conn->inflight_seq++;
+  msg->state = MQTT_INFLIGHT_PUBLISH_QUEUED;
+
+  if(mid != NULL) {
+    *mid = msg->mid;
+  }
+
+  process_post(&mqtt_process, mqtt_do_publish_event, conn);
+}
+/*---------------------------------------------------------------------------*/
 mqtt_status_t
 mqtt_publish(struct mqtt_connection *conn, uint16_t *mid, char *topic,
              uint8_t *payload, uint32_t payload_size,
              mqtt_qos_level_t qos_level, mqtt_retain_t retain)
 {
+  struct mqtt_inflight *msg;
+  uint16_t topic_length;
+
   if(conn->state != MQTT_CONN_STATE_CONNECTED_TO_BROKER) {
     return MQTT_STATUS_NOT_CONNECTED_ERROR;
   }
 
   DBG("MQTT - Call to mqtt_publish...\n");
 
-  /* Currently don't have a queue, so only one item at a time */
-  if(conn->out_queue_full) {
+  msg = alloc_inflight(conn);
+  topic_length = strlen(topic);
+
+  if(msg == NULL || (topic_length + payload_size > MQTT_INFLIGHT_BUFFER_SIZE &&
+                     conn->out_queue_full)) {
     DBG("MQTT - Not accepted!\n");
     return MQTT_STATUS_OUT_QUEUE_FULL;
   }
-  conn->out_queue_full = 1;
   DBG("MQTT - Accepted!\n");
 
-  conn->out_packet.mid = INCREMENT_MID(conn);
-  conn->out_packet.retain = retain;
-  conn->out_packet.topic = topic;
-  conn->out_packet.topic_length = strlen(topic);
-  conn->out_packet.payload = payload;
-  conn->out_packet.payload_size = payload_size;
-  conn->out_packet.qos = qos_level;
-  conn->out_packet.qos_state = MQTT_QOS_STATE_NO_ACK;
+  if(topic_length + payload_size <= MQTT_INFLIGHT_BUFFER_SIZE) {
+    memcpy(msg->buffer, topic, topic_length);
+    memcpy(msg->buffer + topic_length, payload, payload_size);
+    msg->topic = (char *)msg->buffer;
+    msg->payload_iov.data = msg->buffer + topic_length;
+    msg->referenced = 0;
+  } else {
+    /* Too large to copy, the caller's buffers are used until we are done */
+    msg->topic = topic;
+    msg->payload_iov.data = payload;
+    msg->referenced = 1;
+  }
 
-  process_post(&mqtt_process, mqtt_do_publish_event, conn);
+  msg->topic_length = topic_length;
+  msg->payload_iov.len = payload_size;
+  msg->payload_size = payload_size;
+  msg->iov = &msg->payload_iov;
+  msg->iovcnt = 1;
+
+  queue_publish(conn, msg, mid, qos_level, retain);
+  return MQTT_STATUS_OK;
+}
+/*----------------------------------------------------------------------------*/
+mqtt_status_t
+mqtt_publish_iov(struct mqtt_connection *conn, uint16_t *mid, char *topic,
+                 const struct mqtt_iovec *iov, uint8_t iovcnt,
+                 mqtt_qos_level_t qos_level, mqtt_retain_t retain)
+{
+  struct mqtt_inflight *msg;
+  uint8_t i;
+
+  if(conn->state != MQTT_CONN_STATE_CONNECTED_TO_BROKER) {
+    return MQTT_STATUS_NOT_CONNECTED_ERROR;
+  }
+
+  DBG("MQTT - Call to mqtt_publish_iov...\n");
+
+  msg = alloc_inflight(conn);
+  if(msg == NULL || conn->out_queue_full) {
+    DBG("MQTT - Not accepted!\n");
+    return MQTT_STATUS_OUT_QUEUE_FULL;
+  }
+  DBG("MQTT - Accepted!\n");
+
+  msg->topic_length = strlen(topic);
+  if(msg->topic_length <= MQTT_INFLIGHT_BUFFER_SIZE) {
+    memcpy(msg->buffer, topic, msg->topic_length);
+    msg->topic = (char *)msg->buffer;
+  } else {
+    msg->topic = topic;
+  }
+
+  msg->payload_size = 0;
+  for(i = 0; i < iovcnt; i++) {
+    msg->payload_size += iov[i].len;
+  }
+  msg->iov = iov;
+  msg->iovcnt = iovcnt;
+  msg->referenced = 1;
+
+  queue_publish(conn, msg, mid, qos_level, retain);
   return MQTT_STATUS_OK;
 }
 /*----------------------------------------------------------------------------*/
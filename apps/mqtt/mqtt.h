@@ -35,7 +35,8 @@
  * \defgroup mqtt-engine An implementation of MQTT v3.1
  * @{
  *
- * This application is an engine for MQTT v3.1. It supports QoS Levels 0 and 1.
+ * This application is an engine for MQTT v3.1. It supports QoS Levels 0 and 1,
+ * and QoS Level 2 for messages published by the client.
  *
  * MQTT is a Client Server publish/subscribe messaging transport protocol.
  * It is light weight, open, simple, and designed so as to be easy to implement.
@@ -61,7 +62,7 @@
  *  -- "Exactly once" (2), where message are assured to arrive exactly once.
  *  This level could be used, for example, with billing systems where duplicate
  *  or lost messages could lead to incorrect charges being applied. This QoS
- *  level is currently not supported in this implementation.
+ *  level is currently only supported for messages published by the client.
  *
  * - A small transport overhead and protocol exchanges minimized to reduce
  *   network traffic.
@@ -117,6 +118,58 @@
 #define MQTT_PROTOCOL_VERSION 3
 #define MQTT_PROTOCOL_NAME "MQIsdp"
 #define MQTT_TOPIC_MAX_LENGTH 128
+
+/*
+ * Number of PUBLISH messages that can be outstanding at the same time, each
+ * with its own packet ID, retry timer and buffer.
+ */
+#ifdef MQTT_CONF_MAX_INFLIGHT
+#define MQTT_MAX_INFLIGHT MQTT_CONF_MAX_INFLIGHT
+#else
+#define MQTT_MAX_INFLIGHT 4
+#endif
+
+/*
+ * Bytes per in-flight message for a copy of topic and payload. Larger messages
+ * are sent from the caller's buffers, which then have to stay untouched until
+ * the message is complete, and hold the out queue like before.
+ */
+#ifdef MQTT_CONF_INFLIGHT_BUFFER_SIZE
+#define MQTT_INFLIGHT_BUFFER_SIZE MQTT_CONF_INFLIGHT_BUFFER_SIZE
+#else
+#define MQTT_INFLIGHT_BUFFER_SIZE 96
+#endif
+
+/* Retransmissions of a PUBLISH or PUBREL before the message is given up */
+#ifdef MQTT_CONF_INFLIGHT_RETRIES
+#define MQTT_INFLIGHT_RETRIES MQTT_CONF_INFLIGHT_RETRIES
+#else
+#define MQTT_INFLIGHT_RETRIES 3
+#endif
+
+/*
+ * Topic filters registered with mqtt_subscribe_callback() are kept in a trie
+ * with one node per filter level, shared by all connections. Filter levels
+ * may be at most MQTT_TOPIC_LEVEL_LENGTH characters long.
+ */
+#ifdef MQTT_CONF_TOPIC_NODES
+#define MQTT_TOPIC_NODES MQTT_CONF_TOPIC_NODES
+#else
+#define MQTT_TOPIC_NODES 16
+#endif
+
+#ifdef MQTT_CONF_TOPIC_LEVEL_LENGTH
+#define MQTT_TOPIC_LEVEL_LENGTH MQTT_CONF_TOPIC_LEVEL_LENGTH
+#else
+#define MQTT_TOPIC_LEVEL_LENGTH 16
+#endif
+
+/* Filters a single incoming message is handed to at most */
+#ifdef MQTT_CONF_TOPIC_MATCHES
+#define MQTT_TOPIC_MATCHES MQTT_CONF_TOPIC_MATCHES
+#else
+#define MQTT_TOPIC_MATCHES 4
+#endif
 /*---------------------------------------------------------------------------*/
 /*
  * Debug configuration, this is similar but not exactly like the Debugging
@@ -158,6 +211,7 @@ typedef enum {
   MQTT_EVENT_CONNECTION_REFUSED_ERROR,
   MQTT_EVENT_DNS_ERROR,
   MQTT_EVENT_NOT_IMPLEMENTED_ERROR,
+  MQTT_EVENT_PUBLISH_TIMEOUT_ERROR,
   /* Add more */
 } mqtt_event_t;
 
@@ -224,7 +278,22 @@ struct mqtt_suback_event {
   mqtt_qos_level_t qos_level;
 };
 
-/* This is the MQTT message that is exposed to the end user. */
+/*
+ * Passed with MQTT_EVENT_PUBACK once a QoS 1 message got its PUBACK or a QoS 2
+ * message its PUBCOMP, and with MQTT_EVENT_PUBLISH_TIMEOUT_ERROR when it was
+ * given up. The MID comes first, so it can still be read as a plain uint16_t.
+ */
+struct mqtt_puback_event {
+  uint16_t mid;
+  clock_time_t latency; /* since the first transmission */
+};
+
+/*
+ * This is the MQTT message that is exposed to the end user. It is passed with
+ * MQTT_EVENT_PUBLISH once for every piece of payload as it arrives, with
+ * first_chunk set for the first one. payload_chunk points into the TCP input
+ * buffer and is only valid during the event.
+ */
 struct mqtt_message {
   uint32_t mid;
   char topic[MQTT_MAX_TOPIC_LENGTH + 1]; /* +1 for string termination */
@@ -233,40 +302,52 @@ struct mqtt_message {
   uint16_t payload_chunk_length;
 
   uint8_t first_chunk;
-  uint16_t payload_length;
-  uint16_t payload_left;
+  uint32_t payload_length;
+  uint32_t payload_left;
 };
 
-/* This struct represents a packet received from the MQTT server. */
-struct mqtt_in_packet {
-  /* Used by the list interface, must be first in the struct. */
-  struct mqtt_connection *next;
+/* Where the parser is within the packet currently being received */
+typedef enum {
+  MQTT_IN_STATE_FHDR,
+  MQTT_IN_STATE_REMAINING_LENGTH,
+  MQTT_IN_STATE_TOPIC_LENGTH_MSB,
+  MQTT_IN_STATE_TOPIC_LENGTH_LSB,
+  MQTT_IN_STATE_TOPIC,
+  MQTT_IN_STATE_MID_MSB,
+  MQTT_IN_STATE_MID_LSB,
+  MQTT_IN_STATE_PUBLISH_PAYLOAD,
+  MQTT_IN_STATE_PAYLOAD,
+  MQTT_IN_STATE_DISCARD,
+} mqtt_in_state_t;
 
-  /* Total bytes read so far. Compared to the remaining length to to decide when
-   * we've read the payload. */
-  uint32_t byte_counter;
-  uint8_t packet_received;
+/*
+ * This struct represents a packet received from the MQTT server. It holds the
+ * state of the parser between TCP segments, which may end anywhere within a
+ * packet or hold several packets.
+ */
+struct mqtt_in_packet {
+  mqtt_in_state_t state;
 
   uint8_t fhdr;
-  uint16_t remaining_length;
+  uint32_t remaining_length;
+  /* Bytes of the packet that have not been read yet */
+  uint32_t left;
   uint16_t mid;
 
   /* Helper variables needed to decode the remaining_length */
-  uint8_t remaining_multiplier;
-  uint8_t has_remaining_length;
+  uint32_t remaining_multiplier;
   uint8_t remaining_length_bytes;
 
-  /* Not the same as payload in the MQTT sense, it also contains the variable
-   * header.
+  /*
+   * Variable header and payload of all packets but PUBLISH, whose payload is
+   * passed on to the application straight from the TCP segments.
    */
-  uint8_t payload_pos;
+  uint16_t payload_pos;
   uint8_t payload[MQTT_INPUT_BUFF_SIZE];
 
   /* Message specific data */
   uint16_t topic_len;
   uint16_t topic_pos;
-  uint8_t topic_len_received;
-  uint8_t topic_received;
 };
 
 /* This struct represents a packet sent to the MQTT server. */
@@ -283,6 +364,42 @@ struct mqtt_out_packet {
   mqtt_qos_level_t qos;
   mqtt_qos_state_t qos_state;
   mqtt_retain_t retain;
+  uint8_t iov_pos;
+};
+
+/* A fragment of a PUBLISH payload, see mqtt_publish_iov() */
+struct mqtt_iovec {
+  const uint8_t *data;
+  uint32_t len;
+};
+
+typedef enum {
+  MQTT_INFLIGHT_FREE,
+  MQTT_INFLIGHT_PUBLISH_QUEUED,
+  MQTT_INFLIGHT_PUBLISH_SENT,   /* waiting for PUBACK or PUBREC */
+  MQTT_INFLIGHT_PUBREL_QUEUED,
+  MQTT_INFLIGHT_PUBREL_SENT,    /* waiting for PUBCOMP */
+} mqtt_inflight_state_t;
+
+/* A PUBLISH message from the time it is queued until it is acknowledged. */
+struct mqtt_inflight {
+  mqtt_inflight_state_t state;
+  uint16_t mid;
+  uint16_t seq;         /* keeps the messages in the order they were queued */
+  mqtt_qos_level_t qos;
+  mqtt_retain_t retain;
+  uint8_t dup;
+  uint8_t retries;
+  uint8_t referenced;   /* holds the caller's buffers, see out_queue_full */
+  char *topic;
+  uint16_t topic_length;
+  const struct mqtt_iovec *iov;
+  uint8_t iovcnt;
+  uint32_t payload_size;
+  struct mqtt_iovec payload_iov;
+  clock_time_t sent_at;
+  struct timer retry_timer;
+  uint8_t buffer[MQTT_INFLIGHT_BUFFER_SIZE];
 };
 /*---------------------------------------------------------------------------*/
 /**
@@ -301,6 +418,15 @@ typedef void (*mqtt_event_callback_t)(struct mqtt_connection *m,
 
 typedef void (*mqtt_topic_callback_t)(struct mqtt_connection *m,
                                       struct mqtt_message *msg);
+
+/* One level of the topic filters registered on a connection */
+struct mqtt_topic_node {
+  struct mqtt_topic_node *next;       /* next node on the same level */
+  struct mqtt_topic_node *children;   /* nodes on the level below */
+  mqtt_topic_callback_t callback;     /* set if a filter ends here */
+  uint8_t level_length;
+  char level[MQTT_TOPIC_LEVEL_LENGTH];
+};
 /*---------------------------------------------------------------------------*/
 struct mqtt_will {
   struct mqtt_string topic;
@@ -338,6 +464,7 @@ struct mqtt_connection {
 
   /* Used for communication between MQTT API and APP */
   uint8_t out_queue_full;
+  uint8_t out_packet_busy;  /* a SUBSCRIBE or UNSUBSCRIBE is in progress */
   struct process *app_process;
 
   /* Outgoing data related */
@@ -345,6 +472,10 @@ struct mqtt_connection {
   uint8_t out_buffer[MQTT_TCP_OUTPUT_BUFF_SIZE];
   uint8_t out_buffer_sent;
   struct mqtt_out_packet out_packet;
+  struct mqtt_inflight inflight[MQTT_MAX_INFLIGHT];
+  uint8_t inflight_pos;
+  uint16_t inflight_seq;
+  struct ctimer inflight_timer;
   struct pt out_proto_thread;
   uint32_t out_write_pos;
   uint16_t max_segment_size;
@@ -354,6 +485,11 @@ struct mqtt_connection {
   struct mqtt_in_packet in_packet;
   struct mqtt_message in_publish_msg;
 
+  /* Topic filters, and those matching the message being received */
+  struct mqtt_topic_node *topics;
+  struct mqtt_topic_node *matches[MQTT_TOPIC_MATCHES];
+  uint8_t match_count;
+
   /* TCP related information */
   char *server_host;
   uip_ipaddr_t server_ip;
@@ -423,6 +559,33 @@ mqtt_status_t mqtt_subscribe(struct mqtt_connection *conn,
                              char *topic,
                              mqtt_qos_level_t qos_level);
 /*---------------------------------------------------------------------------*/
+/**
+ * \brief Subscribes to a MQTT topic filter and registers its handler.
+ * \param conn A pointer to the MQTT connection.
+ * \param mid A pointer to message ID.
+ * \param topic The topic filter, may contain the '+' and '#' wildcards.
+ * \param qos_level Quality Of Service level to use. Currently supports 0, 1.
+ * \param callback Called for messages matching the filter.
+ * \return MQTT_STATUS_OK or some error status
+ *
+ * Like mqtt_subscribe(), but incoming messages matching the filter are passed
+ * to callback instead of the connection's event callback, once for every
+ * chunk of payload as with MQTT_EVENT_PUBLISH. A message matching several
+ * filters is passed to each of them. Messages not matching any filter still
+ * go to the event callback.
+ *
+ * Filters are compiled into a trie of topic levels when subscribing, so an
+ * incoming topic is matched once per message, in time proportional to its
+ * number of levels rather than to the number of filters. Subscribing to the
+ * same filter again replaces its callback, mqtt_unsubscribe() removes it.
+ * MQTT_STATUS_ERROR is returned if MQTT_TOPIC_NODES does not suffice.
+ */
+mqtt_status_t mqtt_subscribe_callback(struct mqtt_connection *conn,
+                                      uint16_t *mid,
+                                      char *topic,
+                                      mqtt_qos_level_t qos_level,
+                                      mqtt_topic_callback_t callback);
+/*---------------------------------------------------------------------------*/
 /**
  * \brief Unsubscribes from a MQTT topic.
  * \param conn A pointer to the MQTT connection.
@@ -443,7 +606,7 @@ mqtt_status_t mqtt_unsubscribe(struct mqtt_connection *conn,
  * \param topic A pointer to the topic to subscribe to.
  * \param payload A pointer to the topic payload.
  * \param payload_size Payload size.
- * \param qos_level Quality Of Service level to use. Currently supports 0, 1.
+ * \param qos_level Quality Of Service level to use. Supports 0, 1 and 2.
  * \param retain If the RETAIN flag is set to 1, in a PUBLISH Packet sent by a
  *        Client to a Server, the Server MUST store the Application Message
  *        and its QoS, so that it can be delivered to future subscribers whose
@@ -451,6 +614,13 @@ mqtt_status_t mqtt_unsubscribe(struct mqtt_connection *conn,
  * \return MQTT_STATUS_OK or some error status
  *
  * This function publishes to a topic on a MQTT broker.
+ *
+ * Up to MQTT_MAX_INFLIGHT messages are queued without waiting for the broker
+ * to acknowledge the previous ones, and are written to the connection back to
+ * back. Messages that fit into MQTT_INFLIGHT_BUFFER_SIZE are copied, so topic
+ * and payload can be reused right away. MQTT_STATUS_OUT_QUEUE_FULL is returned
+ * while all slots are taken. Completion of QoS 1 and 2 messages is reported
+ * with MQTT_EVENT_PUBACK and a struct mqtt_puback_event.
  */
 mqtt_status_t mqtt_publish(struct mqtt_connection *conn,
                            uint16_t *mid,
@@ -460,6 +630,34 @@ mqtt_status_t mqtt_publish(struct mqtt_connection *conn,
                            mqtt_qos_level_t qos_level,
                            mqtt_retain_t retain);
 /*---------------------------------------------------------------------------*/
+/**
+ * \brief Publish a payload gathered from several fragments.
+ * \param conn A pointer to the MQTT connection.
+ * \param mid A pointer to where the Message ID will be stored.
+ * \param topic A pointer to the topic to publish to.
+ * \param iov An array of payload fragments.
+ * \param iovcnt Number of entries in iov.
+ * \param qos_level Quality Of Service level to use. Supports 0, 1 and 2.
+ * \param retain The RETAIN flag, as for mqtt_publish().
+ * \return MQTT_STATUS_OK or some error status
+ *
+ * Works like mqtt_publish(), but the payload is written to the connection
+ * straight from the fragments, e.g. a fixed JSON head and tail around a
+ * buffer of readings, without assembling it in an application buffer first.
+ *
+ * The fragments and the iov array itself are referenced, not copied. They
+ * must stay unchanged until the message is completed, which the application
+ * can tell by mqtt_ready() becoming true again. Only one such message can be
+ * queued at a time.
+ */
+mqtt_status_t mqtt_publish_iov(struct mqtt_connection *conn,
+                               uint16_t *mid,
+                               char *topic,
+                               const struct mqtt_iovec *iov,
+                               uint8_t iovcnt,
+                               mqtt_qos_level_t qos_level,
+                               mqtt_retain_t retain);
+/*---------------------------------------------------------------------------*/
 /**
  * \brief Set the user name and password for a MQTT client.
  * \param conn A pointer to the MQTT connection.
@@ -64,6 +64,165 @@ PROCESS(rest_engine_process, "REST Engine");
 LIST(restful_services);
 LIST(restful_periodic_services);
 /*---------------------------------------------------------------------------*/
+/* trie of URI path segments, to find resources in time proportional to the URI depth */
+struct path_node {
+  struct path_node *next;       /* next sibling */
+  struct path_node *children;
+  const char *segment;          /* points into the URL of the resource that added it */
+  uint8_t segment_len;
+  uint8_t order;                /* activation order of the resources, as the first resource in the list wins */
+  uint8_t parent_order;
+  resource_t *resource;         /* first resource for this path */
+  resource_t *parent;           /* first resource for this path with sub-resources */
+};
+
+MEMB(path_nodes_memb, struct path_node, REST_MAX_PATH_SEGMENTS);
+static struct path_node *path_root;
+static uint8_t path_order;
+static uint8_t path_incomplete;
+/*---------------------------------------------------------------------------*/
+static int
+segment_end(const char *url, int url_len, int start)
+{
+  while(start < url_len && url[start] != '/') {
+    ++start;
+  }
+  return start;
+}
+/*---------------------------------------------------------------------------*/
+static struct path_node *
+find_segment(struct path_node *node, const char *segment, int segment_len)
+{
+  for(; node; node = node->next) {
+    if(node->segment_len == segment_len
+       && memcmp(node->segment, segment, segment_len) == 0) {
+      return node;
+    }
+  }
+  return NULL;
+}
+/*---------------------------------------------------------------------------*/
+static void
+add_path(resource_t *resource)
+{
+  struct path_node **siblings = &path_root;
+  struct path_node *node = NULL;
+  int url_len = strlen(resource->url);
+  int start = 0;
+  int end;
+
+  if(path_incomplete || path_order == 0xFF) {
+    path_incomplete = 1;
+    return;
+  }
+
+  do {
+    end = segment_end(resource->url, url_len, start);
+    node = find_segment(*siblings, &resource->url[start], end - start);
+    if(node == NULL) {
+      if(end - start > 0xFF
+         || (node = memb_alloc(&path_nodes_memb)) == NULL) {
+        PRINTF("Path trie full, searching resources linearly\n");
+        path_incomplete = 1;
+        return;
+      }
+      node->segment = &resource->url[start];
+      node->segment_len = end - start;
+      node->children = NULL;
+      node->resource = NULL;
+      node->parent = NULL;
+      node->next = *siblings;
+      *siblings = node;
+    }
+    siblings = &node->children;
+    start = end + 1;
+  } while(end < url_len);
+
+  /* a resource activated earlier for the same path takes precedence */
+  if(node->resource == NULL) {
+    node->resource = resource;
+    node->order = path_order;
+  }
+  if(node->parent == NULL && (resource->flags & HAS_SUB_RESOURCES)) {
+    node->parent = resource;
+    node->parent_order = path_order;
+  }
+  ++path_order;
+}
+/*---------------------------------------------------------------------------*/
+static void
+rebuild_paths(void)
+{
+  resource_t *resource;
+
+  memb_init(&path_nodes_memb);
+  path_root = NULL;
+  path_order = 0;
+  path_incomplete = 0;
+
+  for(resource = (resource_t *)list_head(restful_services);
+      resource; resource = resource->next) {
+    add_path(resource);
+  }
+}
+/*---------------------------------------------------------------------------*/
+static resource_t *
+find_resource(const char *url, int url_len)
+{
+  resource_t *resource = NULL;
+  struct path_node *node = path_root;
+  int start = 0;
+  int end;
+  uint8_t order = 0;
+
+  if(url == NULL) {
+    url = "";
+  }
+
+  if(path_incomplete) {
+    int res_url_len;
+
+    for(resource = (resource_t *)list_head(restful_services);
+        resource; resource = resource->next) {
+
+      /* if the web service handles that kind of requests and urls matches */
+      res_url_len = strlen(resource->url);
+
+      if((url_len == res_url_len
+          || (url_len > res_url_len
+              && (resource->flags & HAS_SUB_RESOURCES)
+              && url[res_url_len] == '/'))
+         && strncmp(resource->url, url, res_url_len) == 0) {
+        return resource;
+      }
+    }
+    return NULL;
+  }
+
+  /* walk down the path, the exact match or a parent with sub-resources handles the request */
+  do {
+    end = segment_end(url, url_len, start);
+    node = find_segment(node, &url[start], end - start);
+    if(node == NULL) {
+      break;
+    }
+    if(end == url_len) {
+      if(node->resource && (resource == NULL || node->order < order)) {
+        resource = node->resource;
+      }
+      break;
+    }
+    if(node->parent && (resource == NULL || node->parent_order < order)) {
+      resource = node->parent;
+      order = node->parent_order;
+    }
+    node = node->children;
+    start = end + 1;
+  } while(end < url_len);
+
+  return resource;
+}
+/*---------------------------------------------------------------------------*/
 /*- REST Engine API ---------------------------------------------------------*/
 /*---------------------------------------------------------------------------*/
 /**
@@ -85,6 +244,7 @@ rest_init_engine(void)
   initialized = 1;
 
   list_init(restful_services);
+  rebuild_paths();
 
   // CoAP Interface
   rest_select_if(COAP_IF);
@@ -117,9 +277,21 @@ rest_init_engine(void)
 void
 rest_activate_resource(resource_t *resource, char *path)
 {
+  resource_t *active;
+
+  for(active = (resource_t *)list_head(restful_services);
+      active && active != resource; active = active->next);
+
   resource->url = path;
   list_add(restful_services, resource);
 
+  if(active) {
+    /* re-activation moves the resource to the end of the list */
+    rebuild_paths();
+  } else {
+    add_path(resource);
+  }
+
   PRINTF("Activating: %s\n", resource->url);
 
   /* Only add periodic resources with a periodic_handler and a period > 0. */
@@ -156,47 +328,35 @@ rest_invoke_restful_service(void *request, void *response, uint8_t *buffer,
 
   resource_t *resource = NULL;
   const char *url = NULL;
-  int url_len, res_url_len;
+  int url_len;
 
   url_len = REST.get_url(request, &url);
 
-  for(resource = (resource_t *)list_head(restful_services);
-      resource; resource = resource->next) {
-
-    /* if the web service handles that kind of requests and urls matches */
-    res_url_len = strlen(resource->url);
+  if((resource = find_resource(url, url_len)) != NULL) {
+    found = 1;
 
-    if((url_len == res_url_len
-        || (url_len > res_url_len
-            && (resource->flags & HAS_SUB_RESOURCES)
-            && url[res_url_len] == '/'))
-       && strncmp(resource->url, url, res_url_len) == 0) {
-      found = 1;
+    rest_resource_flags_t method = REST.get_method_type(request);
 
-      rest_resource_flags_t method = REST.get_method_type(request);
+    PRINTF("/%s, method %u, resource->flags %u\n", resource->url,
+           (uint16_t)method, resource->flags);
 
-      PRINTF("/%s, method %u, resource->flags %u\n", resource->url,
-             (uint16_t)method, resource->flags);
-
-      if((method & METHOD_GET) && resource->get_handler != NULL) {
-        /* call handler function */
-        resource->get_handler(request, response, buffer, buffer_size, offset);
-      } else if((method & METHOD_POST) && resource->post_handler != NULL) {
-        /* call handler function */
-        resource->post_handler(request, response, buffer, buffer_size,
+    if((method & METHOD_GET) && resource->get_handler != NULL) {
+      /* call handler function */
+      resource->get_handler(request, response, buffer, buffer_size, offset);
+    } else if((method & METHOD_POST) && resource->post_handler != NULL) {
+      /* call handler function */
+      resource->post_handler(request, response, buffer, buffer_size,
+                             offset);
+    } else if((method & METHOD_PUT) && resource->put_handler != NULL) {
+      /* call handler function */
+      resource->put_handler(request, response, buffer, buffer_size, offset);
+    } else if((method & METHOD_DELETE) && resource->delete_handler != NULL) {
+      /* call handler function */
+      resource->delete_handler(request, response, buffer, buffer_size,
                                offset);
-      } else if((method & METHOD_PUT) && resource->put_handler != NULL) {
-        /* call handler function */
-        resource->put_handler(request, response, buffer, buffer_size, offset);
-      } else if((method & METHOD_DELETE) && resource->delete_handler != NULL) {
-        /* call handler function */
-        resource->delete_handler(request, response, buffer, buffer_size,
-                                 offset);
-      } else {
-        allowed = 0;
-        REST.set_response_status(response, REST.status.METHOD_NOT_ALLOWED);
-      }
-      break;
+    } else {
+      allowed = 0;
+      REST.set_response_status(response, REST.status.METHOD_NOT_ALLOWED);
     }
   }
   if(!found) {
@@ -62,6 +62,14 @@
 #define REST_MAX_CHUNK_SIZE     64
 #endif
 
+/*
+ * The number of distinct URI path segments in the trie that dispatches requests to resources.
+ * When the resource paths do not fit, the resources are searched linearly instead.
+ */
+#ifndef REST_MAX_PATH_SEGMENTS
+#define REST_MAX_PATH_SEGMENTS  32
+#endif
+
 struct resource_s;
 struct periodic_resource_s;
 
@@ -43,6 +43,7 @@ int snprintf(char *str, size_t size, const char *format, ...);
 #include "webserver.h"
 #include "cfs/cfs.h"
 #include "lib/petsciiconv.h"
+#include "lib/crc16.h"
 #include "http-strings.h"
 #include "urlconv.h"
 
@@ -60,12 +61,50 @@ int snprintf(char *str, size_t size, const char *format, ...);
 #define URLCONV WEBSERVER_CONF_CFS_URLCONV
 #endif /* WEBSERVER_CONF_CFS_URLCONV */
 
+#ifndef WEBSERVER_CONF_CFS_CACHE_FILES
+#define CACHE_FILES 2
+#else /* WEBSERVER_CONF_CFS_CACHE_FILES */
+#define CACHE_FILES WEBSERVER_CONF_CFS_CACHE_FILES
+#endif /* WEBSERVER_CONF_CFS_CACHE_FILES */
+
+#ifndef WEBSERVER_CONF_CFS_CACHE_FILESIZE
+#define CACHE_FILESIZE 512
+#else /* WEBSERVER_CONF_CFS_CACHE_FILESIZE */
+#define CACHE_FILESIZE WEBSERVER_CONF_CFS_CACHE_FILESIZE
+#endif /* WEBSERVER_CONF_CFS_CACHE_FILESIZE */
+
+/* Room for the status line, Content-Length, ETag and the longest
+   content type */
+#define CACHE_HEADERLEN (sizeof(http_header_200) + sizeof(http_content_length) + \
+                         sizeof(http_etag) + HTTPD_ETAGLEN + \
+                         sizeof(http_content_type_binary) + 8)
+
 #define STATE_WAITING 0
 #define STATE_OUTPUT  1
 
 #define SEND_STRING(s, str) PSOCK_SEND(s, (uint8_t *)str, strlen(str))
 MEMB(conns, struct httpd_state, CONNS);
 
+#if CACHE_FILES
+/*
+ * Small files are kept in RAM as complete responses, headers included,
+ * so that they can be sent without touching the file system. The list
+ * is kept in order of use, the least recently used file is replaced.
+ */
+struct httpd_cache_entry {
+  struct httpd_cache_entry *next;
+  char filename[HTTPD_PATHLEN];
+  char etag[HTTPD_ETAGLEN];
+  uint8_t refs;
+  uint16_t headerlen;
+  uint16_t len;
+  uint8_t buf[CACHE_HEADERLEN + CACHE_FILESIZE];
+};
+
+MEMB(cache_memb, struct httpd_cache_entry, CACHE_FILES);
+LIST(cache);
+#endif /* CACHE_FILES */
+
 #define ISO_nl      0x0a
 #define ISO_space   0x20
 #define ISO_period  0x2e
@@ -76,19 +115,27 @@ static
 PT_THREAD(send_file(struct httpd_state *s))
 {
   PSOCK_BEGIN(&s->sout);
-  
-  do {
-    /* Read data from file system into buffer */
-    s->len = cfs_read(s->fd, s->outputbuf, sizeof(s->outputbuf));
 
-    /* If there is data in the buffer, send it */
-    if(s->len > 0) {
-      PSOCK_SEND(&s->sout, (uint8_t *)s->outputbuf, s->len);
-    } else {
+  s->pos = 0;
+  do {
+    /* Read data from file system straight into the packet buffer */
+    s->len = cfs_read(s->fd, uip_appdata, uip_mss());
+    if(s->len <= 0) {
       break;
     }
+
+    do {
+      uip_send(uip_appdata, s->len);
+      PT_YIELD_UNTIL(&s->sout.pt, uip_acked() || uip_rexmit());
+      if(uip_rexmit()) {
+        /* The data is not kept around, read it again */
+        cfs_seek(s->fd, s->pos, CFS_SEEK_SET);
+        cfs_read(s->fd, uip_appdata, s->len);
+      }
+    } while(!uip_acked());
+    s->pos += s->len;
   } while(s->len > 0);
-      
+
   PSOCK_END(&s->sout);
 }
 /*---------------------------------------------------------------------------*/
@@ -136,14 +183,158 @@ PT_THREAD(send_headers(struct httpd_state *s, const char *statushdr))
   PSOCK_END(&s->sout);
 }
 /*---------------------------------------------------------------------------*/
+static void
+open_file(struct httpd_state *s)
+{
+  petsciiconv_topetscii(s->filename, sizeof(s->filename));
+  s->fd = cfs_open(&s->filename[1], CFS_READ);
+  petsciiconv_toascii(s->filename, sizeof(s->filename));
+}
+/*---------------------------------------------------------------------------*/
+#if CACHE_FILES
+static uint16_t
+append(struct httpd_cache_entry *e, uint16_t pos, const char *str)
+{
+  strcpy((char *)&e->buf[pos], str);
+  return pos + strlen(str);
+}
+/*---------------------------------------------------------------------------*/
+/*
+ * Returns the cache entry for the requested file, reading the file into
+ * the cache if it is small enough. Otherwise NULL is returned, with the
+ * file open in s->fd if there is such a file.
+ */
+static struct httpd_cache_entry *
+cache_get(struct httpd_state *s)
+{
+  struct httpd_cache_entry *e, *lru;
+  cfs_offset_t size;
+  uint16_t pos;
+  char str[8];
+
+  for(e = list_head(cache); e != NULL; e = list_item_next(e)) {
+    if(strcmp(e->filename, s->filename) == 0) {
+      list_remove(cache, e);
+      list_push(cache, e);
+      e->refs++;
+      return e;
+    }
+  }
+
+  open_file(s);
+  if(s->fd < 0) {
+    return NULL;
+  }
+
+  size = cfs_seek(s->fd, 0, CFS_SEEK_END);
+  if(cfs_seek(s->fd, 0, CFS_SEEK_SET) != 0 ||
+     size < 0 || size > CACHE_FILESIZE) {
+    return NULL;
+  }
+
+  e = memb_alloc(&cache_memb);
+  if(e == NULL) {
+    /* Replace the least recently used file that is not being sent */
+    lru = NULL;
+    for(e = list_head(cache); e != NULL; e = list_item_next(e)) {
+      if(e->refs == 0) {
+        lru = e;
+      }
+    }
+    if(lru == NULL) {
+      return NULL;
+    }
+    list_remove(cache, lru);
+    e = lru;
+  }
+
+  if(cfs_read(s->fd, &e->buf[CACHE_HEADERLEN], size) != size) {
+    memb_free(&cache_memb, e);
+    cfs_seek(s->fd, 0, CFS_SEEK_SET);
+    return NULL;
+  }
+  cfs_close(s->fd);
+  s->fd = -1;
+
+  snprintf(e->etag, sizeof(e->etag), "\"%u-%u\"", (unsigned)size,
+           crc16_data(&e->buf[CACHE_HEADERLEN], size, 0));
+
+  /* Put the headers in front of the data */
+  pos = append(e, 0, http_header_200);
+  pos = append(e, pos, http_content_length);
+  snprintf(str, sizeof(str), "%u", (unsigned)size);
+  pos = append(e, pos, str);
+  pos = append(e, pos, http_crnl);
+  pos = append(e, pos, http_etag);
+  pos = append(e, pos, e->etag);
+  pos = append(e, pos, http_crnl);
+  pos = append(e, pos, get_content_type(s->filename));
+  memmove(&e->buf[pos], &e->buf[CACHE_HEADERLEN], size);
+  e->headerlen = pos;
+  e->len = pos + size;
+
+  strncpy(e->filename, s->filename, sizeof(e->filename));
+  e->refs = 1;
+  list_push(cache, e);
+  return e;
+}
+/*---------------------------------------------------------------------------*/
+static void
+cache_release(struct httpd_state *s)
+{
+  if(s->entry != NULL) {
+    s->entry->refs--;
+    s->entry = NULL;
+  }
+}
+/*---------------------------------------------------------------------------*/
+static
+PT_THREAD(send_cached(struct httpd_state *s))
+{
+  PSOCK_BEGIN(&s->sout);
+
+  if(strcmp(s->etag, s->entry->etag) == 0 ||
+     strcmp(s->etag, "*") == 0) {
+    /* The client has this version already */
+    SEND_STRING(&s->sout, http_header_304);
+    PSOCK_SEND(&s->sout, &s->entry->buf[sizeof(http_header_200) - 1],
+               s->entry->headerlen - (sizeof(http_header_200) - 1));
+  } else {
+    PSOCK_SEND(&s->sout, s->entry->buf, s->entry->len);
+  }
+
+  PSOCK_END(&s->sout);
+}
+#else /* CACHE_FILES */
+#define cache_get(s) (open_file(s), NULL)
+#define cache_release(s)
+#endif /* CACHE_FILES */
+/*---------------------------------------------------------------------------*/
+static void
+release(struct httpd_state *s)
+{
+  if(s->fd >= 0) {
+    cfs_close(s->fd);
+    s->fd = -1;
+  }
+  cache_release(s);
+}
+/*---------------------------------------------------------------------------*/
 static
 PT_THREAD(handle_output(struct httpd_state *s))
 {
   PT_BEGIN(&s->outputpt);
 
-  petsciiconv_topetscii(s->filename, sizeof(s->filename));
-  s->fd = cfs_open(&s->filename[1], CFS_READ);
-  petsciiconv_toascii(s->filename, sizeof(s->filename));
+  s->entry = cache_get(s);
+#if CACHE_FILES
+  if(s->entry != NULL) {
+    PT_WAIT_THREAD(&s->outputpt, send_cached(s));
+    cache_release(s);
+    PSOCK_CLOSE(&s->sout);
+    PT_EXIT(&s->outputpt);
+  }
+#endif /* CACHE_FILES */
+
   if(s->fd < 0) {
     strcpy(s->filename, "/notfound.htm");
     s->fd = cfs_open(&s->filename[1], CFS_READ);
@@ -200,12 +391,18 @@ PT_THREAD(handle_input(struct httpd_state *s))
   petsciiconv_topetscii(s->filename, sizeof(s->filename));
   webserver_log_file(&uip_conn->ripaddr, s->filename);
   petsciiconv_toascii(s->filename, sizeof(s->filename));
-  s->state = STATE_OUTPUT;
 
   while(1) {
     PSOCK_READTO(&s->sin, ISO_nl);
 
-    if(strncmp(s->inputbuf, http_referer, 8) == 0) {
+    if(PSOCK_DATALEN(&s->sin) <= 2) {
+      /* An empty line ends the request headers */
+      s->state = STATE_OUTPUT;
+    } else if(strncmp(s->inputbuf, http_if_none_match, 14) == 0) {
+      s->inputbuf[PSOCK_DATALEN(&s->sin) - 2] = 0;
+      strncpy(s->etag, &s->inputbuf[14 + strspn(&s->inputbuf[14], " ")],
+              sizeof(s->etag) - 1);
+    } else if(strncmp(s->inputbuf, http_referer, 8) == 0) {
       s->inputbuf[PSOCK_DATALEN(&s->sin) - 2] = 0;
       petsciiconv_topetscii(s->inputbuf, PSOCK_DATALEN(&s->sin) - 2);
       webserver_log(s->inputbuf);
@@ -231,10 +428,7 @@ httpd_appcall(void *state)
 
   if(uip_closed() || uip_aborted() || uip_timedout()) {
     if(s != NULL) {
-      if(s->fd >= 0) {
-        cfs_close(s->fd);
-	s->fd = -1;
-      }
+      release(s);
       memb_free(&conns, s);
     }
   } else if(uip_connected()) {
@@ -249,6 +443,8 @@ httpd_appcall(void *state)
     PSOCK_INIT(&s->sout, (uint8_t *)s->inputbuf, sizeof(s->inputbuf) - 1);
     PT_INIT(&s->outputpt);
     s->fd = -1;
+    s->entry = NULL;
+    memset(s->etag, 0, sizeof(s->etag));
     s->state = STATE_WAITING;
     timer_set(&s->timer, CLOCK_SECOND * 10);
     handle_connection(s);
@@ -256,10 +452,7 @@ httpd_appcall(void *state)
     if(uip_poll()) {
       if(timer_expired(&s->timer)) {
 	uip_abort();
-	if(s->fd >= 0) {
-	  cfs_close(s->fd);
-	  s->fd = -1;
-	}
+	release(s);
         memb_free(&conns, s);
         webserver_log_file(&uip_conn->ripaddr, "reset (timeout)");
       }
@@ -277,8 +470,36 @@ httpd_init(void)
 {
   tcp_listen(UIP_HTONS(80));
   memb_init(&conns);
+#if CACHE_FILES
+  memb_init(&cache_memb);
+  list_init(cache);
+#endif /* CACHE_FILES */
 #if URLCONV
   urlconv_init();
 #endif /* URLCONV */
 }
 /*---------------------------------------------------------------------------*/
+void
+httpd_cache_invalidate(const char *filename)
+{
+#if CACHE_FILES
+  struct httpd_cache_entry *e, *next;
+
+  for(e = list_head(cache); e != NULL; e = next) {
+    next = list_item_next(e);
+    /* Entries are keyed by the request path, which is the file name
+       with a leading slash */
+    if(filename == NULL ||
+       (e->filename[0] != 0 && strcmp(&e->filename[1], filename) == 0)) {
+      if(e->refs > 0) {
+        /* Still being sent, it is replaced when no longer in use */
+        e->filename[0] = 0;
+      } else {
+        list_remove(cache, e);
+        memb_free(&cache_memb, e);
+      }
+    }
+  }
+#endif /* CACHE_FILES */
+}
+/*---------------------------------------------------------------------------*/
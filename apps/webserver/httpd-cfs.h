@@ -35,6 +35,7 @@
 #define HTTPD_CFS_H_
 
 #include "contiki-net.h"
+#include "cfs/cfs.h"
 
 #ifndef WEBSERVER_CONF_CFS_PATHLEN
 #define HTTPD_PATHLEN 80
@@ -42,20 +43,31 @@
 #define HTTPD_PATHLEN WEBSERVER_CONF_CFS_PATHLEN
 #endif /* WEBSERVER_CONF_CFS_CONNS */
 
+#define HTTPD_ETAGLEN 16
+
+struct httpd_cache_entry;
+
 struct httpd_state {
   struct timer timer;
   struct psock sin, sout;
   struct pt outputpt;
   char inputbuf[HTTPD_PATHLEN + 30];
-  char outputbuf[UIP_TCP_MSS];
   char filename[HTTPD_PATHLEN];
+  char etag[HTTPD_ETAGLEN];
   char state;
   int fd;
   int len;
+  cfs_offset_t pos;
+  struct httpd_cache_entry *entry;
 };
 
 
 void httpd_init(void);
 void httpd_appcall(void *state);
 
+/* Drops a file from the cache after it has been changed. The file name
+   is the one passed to cfs_open(), such as "index.htm" for the request
+   path "/index.htm". NULL drops all files. */
+void httpd_cache_invalidate(const char *filename);
+
 #endif /* HTTPD_CFS_H_ */
@@ -58,6 +58,9 @@
 #include "cfs/cfs.h"
 #include "cfs-coffee-arch.h"
 #include "cfs/cfs-coffee.h"
+#include "sys/clock.h"
+#include "sys/process.h"
+#include "sys/rtimer.h"
 
 /* Micro logs enable modifications on storage types that do not support
    in-place updates. This applies primarily to flash memories. */
@@ -84,6 +87,49 @@
 #define COFFEE_EXTENDED_WEAR_LEVELLING  1
 #endif
 
+/*
+ * Keep an index of file names and bitmaps of free and obsolete pages
+ * in RAM. The index is built by scanning the storage once, when the
+ * file system is first accessed after boot. Thereafter, files are
+ * found and pages are allocated without scanning the storage. The
+ * bitmaps take two bits of RAM per page.
+ */
+#ifndef COFFEE_NAME_INDEX
+#define COFFEE_NAME_INDEX 0
+#endif
+
+/* The number of files that the name index can hold. Files that do not
+   fit in the index are still found, but by scanning the storage. */
+#ifndef COFFEE_NAME_INDEX_SIZE
+#define COFFEE_NAME_INDEX_SIZE 32
+#endif
+
+/*
+ * Collect garbage in a separate process when a file is removed or a
+ * reservation takes a free sector, so that file reservations seldom
+ * have to wait for sectors to be erased. The process yields after each
+ * erasure.
+ */
+#ifndef COFFEE_BACKGROUND_GC
+#define COFFEE_BACKGROUND_GC 0
+#endif
+
+/* The background garbage collector keeps erasing sectors until this
+   many sectors are completely free, or no more sectors can be erased. */
+#ifndef COFFEE_GC_FREE_SECTORS
+#define COFFEE_GC_FREE_SECTORS 2
+#endif
+
+/*
+ * Cache the index table of the micro log of each open file in RAM, so
+ * that reading a modified file does not require searching the table in
+ * the storage. Logs with more records than this are not cached. Each
+ * record takes two bytes of RAM per open file. Set to 0 to disable.
+ */
+#ifndef COFFEE_LOG_CACHE_RECORDS
+#define COFFEE_LOG_CACHE_RECORDS 0
+#endif
+
 #if COFFEE_START & (COFFEE_SECTOR_SIZE - 1)
 #error COFFEE_START must point to the first byte in a sector.
 #endif
@@ -145,6 +191,15 @@
                                !HDR_OBSOLETE(hdr) && \
                                !HDR_ISOLATED(hdr))
 
+/*
+ * End-of-file hints. Bit i of the hint is set before the file is written
+ * past (i + 1) eighths of its extent, which bounds the part of the extent
+ * that must be read to find the end of the file. Files created before
+ * the hint was maintained lack the valid flag.
+ */
+#define EOF_HINT_VALID     0x80
+#define EOF_HINT_BITS      7
+
 /* Shortcuts derived from the hardware-dependent configuration of Coffee. */
 #define COFFEE_SECTOR_COUNT \
   (coffee_page_t)(COFFEE_SIZE / COFFEE_SECTOR_SIZE)
@@ -158,6 +213,9 @@ struct sector_status {
   coffee_page_t active;
   coffee_page_t obsolete;
   coffee_page_t free;
+  /* Pages at the start of the sector that belong to a file starting
+     in a previous sector. */
+  coffee_page_t covered;
 };
 
 /* The structure of cached file objects. */
@@ -168,6 +226,7 @@ struct file {
   int16_t record_count;
   uint8_t references;
   uint8_t flags;
+  uint8_t eof_hint;
 };
 
 /* The file descriptor structure. */
@@ -185,7 +244,7 @@ struct file_header {
   uint16_t log_records;
   uint16_t log_record_size;
   coffee_page_t max_pages;
-  uint8_t deprecated_eof_hint;
+  uint8_t eof_hint;
   uint8_t flags;
   char name[COFFEE_NAME_LENGTH];
 };
@@ -206,12 +265,64 @@ static struct file_desc coffee_fd_set[COFFEE_FD_SET_SIZE];
 static coffee_page_t next_free;
 static char gc_wait;
 
+#if COFFEE_NAME_INDEX
+/* States of the name index. */
+#define INDEX_UNKNOWN     0 /* Not built since boot. */
+#define INDEX_COMPLETE    1 /* Holds every active file. */
+#define INDEX_PARTIAL     2 /* Overflowed; misses require a scan. */
+
+#define MAP_TEST(map, page) ((map)[(page) >> 3] & (1 << ((page) & 7)))
+
+/* Entries of the open-addressed name index. */
+struct name_entry {
+  coffee_page_t page;
+  uint16_t hash;
+};
+
+static struct name_entry name_index[COFFEE_NAME_INDEX_SIZE];
+static uint8_t free_map[(COFFEE_PAGE_COUNT + 7) / 8];
+static uint8_t obsolete_map[(COFFEE_PAGE_COUNT + 7) / 8];
+static uint8_t index_state;
+
+static void build_index(void);
+#endif /* COFFEE_NAME_INDEX */
+
+#if COFFEE_MICRO_LOGS && COFFEE_LOG_CACHE_RECORDS > 0
+/* Cached log index tables, one for each file object. */
+struct log_cache {
+  coffee_page_t log_page;
+  uint16_t records;
+  uint16_t regions[COFFEE_LOG_CACHE_RECORDS];
+};
+
+static struct log_cache log_caches[COFFEE_MAX_OPEN_FILES];
+#endif /* COFFEE_MICRO_LOGS && COFFEE_LOG_CACHE_RECORDS > 0 */
+
+#if COFFEE_BACKGROUND_GC
+PROCESS(coffee_gc_process, "Coffee GC");
+
+/* Sectors that the background garbage collector is going to erase. */
+struct gc_victim {
+  coffee_page_t sector;
+  coffee_page_t sectors;
+  coffee_page_t covered;
+  coffee_page_t isolation_count;
+};
+
+static struct cfs_coffee_gc_stats gc_stats;
+/* Incremented whenever a file header is written or a sector is erased. */
+static uint16_t storage_changes;
+#endif /* COFFEE_BACKGROUND_GC */
+
 /*---------------------------------------------------------------------------*/
 static void
 write_header(struct file_header *hdr, coffee_page_t page)
 {
   hdr->flags |= HDR_FLAG_VALID;
   COFFEE_WRITE(hdr, sizeof(*hdr), page * COFFEE_PAGE_SIZE);
+#if COFFEE_BACKGROUND_GC
+  storage_changes++;
+#endif /* COFFEE_BACKGROUND_GC */
 }
 /*---------------------------------------------------------------------------*/
 static void
@@ -223,6 +334,97 @@ read_header(struct file_header *hdr, coffee_page_t page)
   }
 }
 /*---------------------------------------------------------------------------*/
+#if COFFEE_NAME_INDEX
+static uint16_t
+name_hash(const char *name)
+{
+  uint16_t hash;
+  int i;
+
+  /* Only the part of the name that is stored in the header counts. */
+  hash = 5381;
+  for(i = 0; i < COFFEE_NAME_LENGTH - 1 && name[i] != '\0'; i++) {
+    hash = (hash << 5) + hash + (uint8_t)name[i];
+  }
+  return hash;
+}
+/*---------------------------------------------------------------------------*/
+static void
+map_set(uint8_t *map, coffee_page_t start, coffee_page_t count, int value)
+{
+  coffee_page_t page;
+
+  for(page = start; page < start + count && page < COFFEE_PAGE_COUNT; page++) {
+    if(value) {
+      map[page >> 3] |= 1 << (page & 7);
+    } else {
+      map[page >> 3] &= ~(1 << (page & 7));
+    }
+  }
+}
+/*---------------------------------------------------------------------------*/
+static void
+index_add(const char *name, coffee_page_t page)
+{
+  uint16_t hash;
+  unsigned i, n;
+
+  hash = name_hash(name);
+  i = hash % COFFEE_NAME_INDEX_SIZE;
+  for(n = 0; n < COFFEE_NAME_INDEX_SIZE; n++) {
+    if(name_index[i].page == INVALID_PAGE) {
+      name_index[i].page = page;
+      name_index[i].hash = hash;
+      return;
+    }
+    i = (i + 1) % COFFEE_NAME_INDEX_SIZE;
+  }
+
+  PRINTF("Coffee: The name index is full\n");
+  index_state = INDEX_PARTIAL;
+}
+/*---------------------------------------------------------------------------*/
+static void
+index_remove(const char *name, coffee_page_t page)
+{
+  unsigned i, j, home, n;
+
+  i = name_hash(name) % COFFEE_NAME_INDEX_SIZE;
+  for(n = 0; name_index[i].page != page; n++) {
+    if(n == COFFEE_NAME_INDEX_SIZE || name_index[i].page == INVALID_PAGE) {
+      return;
+    }
+    i = (i + 1) % COFFEE_NAME_INDEX_SIZE;
+  }
+
+  /* Move the following entries of the probe sequence back, so that
+     lookups do not stop at the slot that we free. */
+  j = i;
+  for(n = 1; n < COFFEE_NAME_INDEX_SIZE; n++) {
+    j = (j + 1) % COFFEE_NAME_INDEX_SIZE;
+    if(name_index[j].page == INVALID_PAGE) {
+      break;
+    }
+    home = name_index[j].hash % COFFEE_NAME_INDEX_SIZE;
+    if((i < j && (home <= i || home > j)) ||
+       (i > j && home <= i && home > j)) {
+      name_index[i] = name_index[j];
+      i = j;
+    }
+  }
+  name_index[i].page = INVALID_PAGE;
+}
+/*---------------------------------------------------------------------------*/
+static void
+index_reset(void)
+{
+  memset(name_index, 0xff, sizeof(name_index));
+  memset(free_map, 0xff, sizeof(free_map));
+  memset(obsolete_map, 0, sizeof(obsolete_map));
+  index_state = INDEX_COMPLETE;
+}
+#endif /* COFFEE_NAME_INDEX */
+/*---------------------------------------------------------------------------*/
 static cfs_offset_t
 absolute_offset(coffee_page_t page, cfs_offset_t offset)
 {
@@ -260,6 +462,12 @@ get_sector_status(coffee_page_t sector, struct sector_status *stats)
    * segment that extends into this segment. If the whole segment is
    * covered, we do not need to continue counting pages in this iteration.
    */
+  if(skip_pages >= COFFEE_PAGES_PER_SECTOR) {
+    stats->covered = COFFEE_PAGES_PER_SECTOR;
+  } else {
+    stats->covered = skip_pages;
+  }
+
   if(last_pages_are_active) {
     if(skip_pages >= COFFEE_PAGES_PER_SECTOR) {
       stats->active = COFFEE_PAGES_PER_SECTOR;
@@ -348,21 +556,152 @@ isolate_pages(coffee_page_t start, coffee_page_t skip_pages)
          (unsigned)skip_pages, (int)start / COFFEE_PAGES_PER_SECTOR);
 }
 /*---------------------------------------------------------------------------*/
+#if COFFEE_NAME_INDEX
+static int
+gc_has_candidates(int mode)
+{
+  coffee_page_t sector, page, end;
+  coffee_page_t free, obsolete;
+
+  for(sector = 0; sector < COFFEE_SECTOR_COUNT; sector++) {
+    free = obsolete = 0;
+    page = sector * COFFEE_PAGES_PER_SECTOR;
+    for(end = page + COFFEE_PAGES_PER_SECTOR; page < end; page++) {
+      if(MAP_TEST(free_map, page)) {
+        free++;
+      } else if(MAP_TEST(obsolete_map, page)) {
+        obsolete++;
+      } else {
+        break;
+      }
+    }
+    if(page == end &&
+       ((mode == GC_RELUCTANT && free == 0) ||
+        (mode == GC_GREEDY && obsolete > 0))) {
+      return 1;
+    }
+  }
+  return 0;
+}
+#endif /* COFFEE_NAME_INDEX */
+/*---------------------------------------------------------------------------*/
+#if COFFEE_BACKGROUND_GC
+/*
+ * A pause is timed with both clocks. The clock ticks too slowly for
+ * the short buckets of the histogram, so the rtimer is used as long as
+ * it cannot have wrapped around during the pause.
+ */
+struct pause_start {
+  clock_time_t clock;
+  rtimer_clock_t rtimer;
+};
+
+#define RTIMER_WRAP_MS \
+  ((unsigned long)(rtimer_clock_t)~0 / RTIMER_SECOND * 1000)
+
+static void
+start_pause(struct pause_start *start)
+{
+  start->clock = clock_time();
+  start->rtimer = RTIMER_NOW();
+}
+
+static void
+record_pause(uint16_t *histogram, const struct pause_start *start)
+{
+  unsigned long ms;
+  rtimer_clock_t ticks;
+  int i;
+
+  ms = (unsigned long)(clock_time() - start->clock) * 1000 / CLOCK_SECOND;
+  if(ms + 1000 / CLOCK_SECOND < RTIMER_WRAP_MS / 2) {
+    ticks = RTIMER_NOW() - start->rtimer;
+    ms = (unsigned long)(ticks / RTIMER_SECOND) * 1000 +
+      (unsigned long)(ticks % RTIMER_SECOND) * 1000 / RTIMER_SECOND;
+  }
+  for(i = 0; i < CFS_COFFEE_GC_HISTOGRAM_SIZE - 1 && ms >= (1UL << i); i++);
+  histogram[i]++;
+}
+#endif /* COFFEE_BACKGROUND_GC */
+/*---------------------------------------------------------------------------*/
+static void
+erase_sector(coffee_page_t sector, coffee_page_t covered,
+             coffee_page_t isolation_count)
+{
+  coffee_page_t first_page;
+
+  first_page = sector * COFFEE_PAGES_PER_SECTOR;
+  if(first_page < next_free) {
+    /*
+     * The first pages of the erased sector can still belong to an
+     * obsolete file that starts in the previous sector. The search for
+     * free pages must therefore start from a page where a file starts.
+     */
+    next_free = 0;
+  }
+
+  if(isolation_count > 0) {
+    isolate_pages(first_page + COFFEE_PAGES_PER_SECTOR, isolation_count);
+  }
+
+  COFFEE_ERASE(sector);
+  PRINTF("Coffee: Erased sector %d!\n", sector);
+#if COFFEE_NAME_INDEX
+  /*
+   * The sector held no active files. The pages that are covered by an
+   * obsolete file starting in a previous sector remain obsolete until
+   * that sector is erased; the others are free now. The isolated pages
+   * in the next sector were obsolete already.
+   */
+  if(index_state != INDEX_UNKNOWN) {
+    map_set(free_map, first_page + covered,
+            COFFEE_PAGES_PER_SECTOR - covered, 1);
+    map_set(obsolete_map, first_page + covered,
+            COFFEE_PAGES_PER_SECTOR - covered, 0);
+  }
+#endif /* COFFEE_NAME_INDEX */
+#if COFFEE_BACKGROUND_GC
+  gc_stats.erased_sectors++;
+  storage_changes++;
+#endif /* COFFEE_BACKGROUND_GC */
+}
+/*---------------------------------------------------------------------------*/
 static void
 collect_garbage(int mode)
 {
   coffee_page_t sector;
   struct sector_status stats;
-  coffee_page_t first_page, isolation_count;
+  coffee_page_t isolation_count;
+  int uncovered;
+#if COFFEE_BACKGROUND_GC
+  struct pause_start start;
+#endif /* COFFEE_BACKGROUND_GC */
 
   PRINTF("Coffee: Running the garbage collector in %s mode\n",
          mode == GC_RELUCTANT ? "reluctant" : "greedy");
+#if COFFEE_NAME_INDEX
+  if(index_state != INDEX_UNKNOWN && !gc_has_candidates(mode)) {
+    /* No sector can be erased; save the scan of the storage. */
+    return;
+  }
+#endif /* COFFEE_NAME_INDEX */
+#if COFFEE_BACKGROUND_GC
+  start_pause(&start);
+#endif /* COFFEE_BACKGROUND_GC */
   /*
    * The garbage collector erases as many sectors as possible. A sector is
    * erasable if there are only free or obsolete pages in it.
    */
+  uncovered = 0;
   for(sector = 0; sector < COFFEE_SECTOR_COUNT; sector++) {
     isolation_count = get_sector_status(sector, &stats);
+    if(uncovered) {
+      /* The file that covered the first pages of this sector started in
+         the previous sector, which has been erased. The pages are either
+         isolated now or erased together with this sector. */
+      stats.covered = 0;
+    }
+    uncovered = 0;
     PRINTF("Coffee: Sector %u has %u active, %u obsolete, and %u free pages.\n",
            (unsigned)sector, (unsigned)stats.active,
            (unsigned)stats.obsolete, (unsigned)stats.free);
@@ -373,25 +712,134 @@ collect_garbage(int mode)
 
     if((mode == GC_RELUCTANT && stats.free == 0) ||
        (mode == GC_GREEDY && stats.obsolete > 0)) {
-      first_page = sector * COFFEE_PAGES_PER_SECTOR;
-      if(first_page < next_free) {
-        next_free = first_page;
-      }
-
-      if(isolation_count > 0) {
-        isolate_pages(first_page + COFFEE_PAGES_PER_SECTOR, isolation_count);
-      }
-
-      COFFEE_ERASE(sector);
-      PRINTF("Coffee: Erased sector %d!\n", sector);
+      erase_sector(sector, stats.covered, isolation_count);
+      uncovered = stats.covered < COFFEE_PAGES_PER_SECTOR;
 
       if(mode == GC_RELUCTANT && isolation_count > 0) {
         break;
       }
     }
   }
+
+#if COFFEE_BACKGROUND_GC
+  record_pause(gc_stats.foreground, &start);
+#endif /* COFFEE_BACKGROUND_GC */
 }
 /*---------------------------------------------------------------------------*/
+#if COFFEE_BACKGROUND_GC
+/*
+ * Find the sectors to erase so that COFFEE_GC_FREE_SECTORS sectors
+ * become free, if possible. A sector qualifies if it holds obsolete
+ * pages but no active pages, and if a file starts in it. The following
+ * sectors that are completely covered by an obsolete file starting in
+ * it must be erased along with it, as they hold no file headers.
+ * Returns the number of victims to erase.
+ */
+static int
+find_gc_victims(struct gc_victim *victims)
+{
+  coffee_page_t sector, isolation_count, free_sectors;
+  struct sector_status stats;
+  struct gc_victim *victim;
+  int count;
+
+  victim = NULL;
+  count = free_sectors = 0;
+  for(sector = 0; sector < COFFEE_SECTOR_COUNT; sector++) {
+    isolation_count = get_sector_status(sector, &stats);
+    if(victim != NULL && stats.active == 0 &&
+       stats.covered == COFFEE_PAGES_PER_SECTOR) {
+      victim->sectors++;
+      victim->isolation_count = isolation_count;
+      continue;
+    }
+    victim = NULL;
+
+    if(stats.free == COFFEE_PAGES_PER_SECTOR) {
+      free_sectors++;
+    } else if(count < COFFEE_GC_FREE_SECTORS && stats.active == 0 &&
+              stats.obsolete > 0 && stats.covered < COFFEE_PAGES_PER_SECTOR) {
+      victim = &victims[count++];
+      victim->sector = sector;
+      victim->sectors = 1;
+      victim->covered = stats.covered;
+      victim->isolation_count = isolation_count;
+    }
+  }
+
+  PRINTF("Coffee: %u free sectors, %d background GC victims\n",
+         (unsigned)free_sectors, count);
+
+  if(free_sectors >= COFFEE_GC_FREE_SECTORS) {
+    return 0;
+  }
+  return MIN(count, COFFEE_GC_FREE_SECTORS - free_sectors);
+}
+/*---------------------------------------------------------------------------*/
+static void
+erase_gc_victim(const struct gc_victim *victim, int uncovered)
+{
+  coffee_page_t i;
+
+  PRINTF("Coffee: Background collection of %u sectors from sector %u\n",
+         (unsigned)victim->sectors, (unsigned)victim->sector);
+  for(i = 0; i < victim->sectors; i++) {
+    erase_sector(victim->sector + i,
+                 i == 0 && !uncovered ? victim->covered : 0,
+                 i == victim->sectors - 1 ? victim->isolation_count : 0);
+  }
+  gc_wait = 0;
+}
+/*---------------------------------------------------------------------------*/
+static void
+poll_gc(void)
+{
+  if(!process_is_running(&coffee_gc_process)) {
+    process_start(&coffee_gc_process, NULL);
+  }
+  process_poll(&coffee_gc_process);
+}
+/*---------------------------------------------------------------------------*/
+PROCESS_THREAD(coffee_gc_process, ev, data)
+{
+  static struct gc_victim victims[COFFEE_GC_FREE_SECTORS];
+  static struct pause_start start;
+  static uint16_t changes;
+  static int count, i;
+
+  PROCESS_BEGIN();
+
+  for(;;) {
+    PROCESS_WAIT_EVENT_UNTIL(ev == PROCESS_EVENT_POLL);
+
+    do {
+      start_pause(&start);
+      count = find_gc_victims(victims);
+      for(i = 0; i < count; i++) {
+        if(i > 0) {
+          start_pause(&start);
+        }
+        /* A victim that follows the previous one directly has had its
+           first pages isolated or erased. */
+        erase_gc_victim(&victims[i], i > 0 && victims[i].sector ==
+                        victims[i - 1].sector + victims[i - 1].sectors);
+        record_pause(gc_stats.background, &start);
+
+        /* Let other processes run between the erasures. The victims
+           must be searched for again if they modified the storage. */
+        changes = storage_changes;
+        PROCESS_PAUSE();
+        if(changes != storage_changes) {
+          break;
+        }
+      }
+    } while(i < count);
+  }
+
+  PROCESS_END();
+}
+#endif /* COFFEE_BACKGROUND_GC */
+/*---------------------------------------------------------------------------*/
 static coffee_page_t
 next_file(coffee_page_t page, struct file_header *hdr)
 {
@@ -413,6 +861,32 @@ next_file(coffee_page_t page, struct file_header *hdr)
   return page + hdr->max_pages;
 }
 /*---------------------------------------------------------------------------*/
+#if COFFEE_NAME_INDEX
+static void
+build_index(void)
+{
+  struct file_header hdr;
+  coffee_page_t page, next;
+
+  index_reset();
+  memset(free_map, 0, sizeof(free_map));
+
+  for(page = 0; page < COFFEE_PAGE_COUNT; page = next) {
+    read_header(&hdr, page);
+    next = next_file(page, &hdr);
+    if(HDR_FREE(hdr)) {
+      map_set(free_map, page, next - page, 1);
+    } else if(HDR_ACTIVE(hdr)) {
+      if(!HDR_LOG(hdr)) {
+        index_add(hdr.name, page);
+      }
+    } else {
+      map_set(obsolete_map, page, next - page, 1);
+    }
+  }
+}
+#endif /* COFFEE_NAME_INDEX */
+/*---------------------------------------------------------------------------*/
 static struct file *
 load_file(coffee_page_t start, struct file_header *hdr)
 {
@@ -446,8 +920,12 @@ load_file(coffee_page_t start, struct file_header *hdr)
   file->end = UNKNOWN_OFFSET;
   file->max_pages = hdr->max_pages;
   file->flags = HDR_MODIFIED(*hdr) ? COFFEE_FILE_MODIFIED : 0;
+  file->eof_hint = hdr->eof_hint;
   /* We don't know the amount of records yet. */
   file->record_count = -1;
+#if COFFEE_MICRO_LOGS && COFFEE_LOG_CACHE_RECORDS > 0
+  log_caches[i].log_page = INVALID_PAGE;
+#endif /* COFFEE_MICRO_LOGS && COFFEE_LOG_CACHE_RECORDS > 0 */
 
   return file;
 }
@@ -458,6 +936,39 @@ find_file(const char *name)
   int i;
   struct file_header hdr;
   coffee_page_t page;
+#if COFFEE_NAME_INDEX
+  uint16_t hash;
+  unsigned slot, n;
+
+  if(index_state == INDEX_UNKNOWN) {
+    build_index();
+  }
+
+  hash = name_hash(name);
+  slot = hash % COFFEE_NAME_INDEX_SIZE;
+  for(n = 0; n < COFFEE_NAME_INDEX_SIZE; n++) {
+    page = name_index[slot].page;
+    if(page == INVALID_PAGE) {
+      break;
+    }
+    if(name_index[slot].hash == hash) {
+      read_header(&hdr, page);
+      if(HDR_ACTIVE(hdr) && !HDR_LOG(hdr) && strcmp(name, hdr.name) == 0) {
+        for(i = 0; i < COFFEE_MAX_OPEN_FILES; i++) {
+          if(!FILE_FREE(&coffee_files[i]) && coffee_files[i].page == page) {
+            return &coffee_files[i];
+          }
+        }
+        return load_file(page, &hdr);
+      }
+    }
+    slot = (slot + 1) % COFFEE_NAME_INDEX_SIZE;
+  }
+
+  if(index_state == INDEX_COMPLETE) {
+    return NULL;
+  }
+#endif /* COFFEE_NAME_INDEX */
 
   /* First check if the file metadata is cached. */
   for(i = 0; i < COFFEE_MAX_OPEN_FILES; i++) {
@@ -482,6 +993,41 @@ find_file(const char *name)
   return NULL;
 }
 /*---------------------------------------------------------------------------*/
+static uint8_t
+eof_hint(coffee_page_t max_pages, cfs_offset_t end)
+{
+  cfs_offset_t eighth;
+  uint8_t hint;
+  int i;
+
+  eighth = max_pages * COFFEE_PAGE_SIZE / 8;
+  end += sizeof(struct file_header);
+  hint = EOF_HINT_VALID;
+  for(i = 0; i < EOF_HINT_BITS && end > (i + 1) * eighth; i++) {
+    hint |= 1 << i;
+  }
+  return hint;
+}
+/*---------------------------------------------------------------------------*/
+static void
+update_eof_hint(struct file *file, cfs_offset_t end)
+{
+  struct file_header hdr;
+  uint8_t hint;
+
+  if(!(file->eof_hint & EOF_HINT_VALID)) {
+    return;
+  }
+
+  hint = eof_hint(file->max_pages, end);
+  if((file->eof_hint & hint) != hint) {
+    read_header(&hdr, file->page);
+    hdr.eof_hint |= hint;
+    write_header(&hdr, file->page);
+    file->eof_hint = hdr.eof_hint;
+  }
+}
+/*---------------------------------------------------------------------------*/
 static cfs_offset_t
 file_end(coffee_page_t start)
 {
@@ -492,6 +1038,17 @@ file_end(coffee_page_t start)
 
   read_header(&hdr, start);
 
+  /* Skip the part of the extent that the file has never been
+     written to, according to the hint. */
+  page = hdr.max_pages - 1;
+  if(hdr.eof_hint & EOF_HINT_VALID) {
+    for(i = 0; i < EOF_HINT_BITS && (hdr.eof_hint & (1 << i)); i++);
+    if(i < EOF_HINT_BITS) {
+      page = ((i + 1) * (hdr.max_pages * COFFEE_PAGE_SIZE / 8) - 1) /
+             COFFEE_PAGE_SIZE;
+    }
+  }
+
   /*
    * Move from the end of the range towards the beginning and look for
    * a byte that has been modified.
@@ -500,7 +1057,7 @@ file_end(coffee_page_t start)
    * are zeroes, then these are skipped from the calculation.
    */
 
-  for(page = hdr.max_pages - 1; page >= 0; page--) {
+  for(; page >= 0; page--) {
     COFFEE_READ(buf, sizeof(buf), (start + page) * COFFEE_PAGE_SIZE);
     for(i = COFFEE_PAGE_SIZE - 1; i >= 0; i--) {
       if(buf[i] != 0) {
@@ -520,9 +1077,42 @@ static coffee_page_t
 find_contiguous_pages(coffee_page_t amount)
 {
   coffee_page_t page, start;
+#if !COFFEE_NAME_INDEX
   struct file_header hdr;
+#endif /* !COFFEE_NAME_INDEX */
 
   start = INVALID_PAGE;
+#if COFFEE_NAME_INDEX
+  if(index_state == INDEX_UNKNOWN) {
+    build_index();
+  }
+
+  for(page = next_free; page < COFFEE_PAGE_COUNT; page++) {
+    if((page & 7) == 0 && free_map[page >> 3] == 0) {
+      /* Skip eight allocated pages at once. */
+      start = INVALID_PAGE;
+      page += 7;
+      continue;
+    }
+    if(!MAP_TEST(free_map, page)) {
+      start = INVALID_PAGE;
+      continue;
+    }
+    if(start == INVALID_PAGE) {
+      start = page;
+      if(start + amount >= COFFEE_PAGE_COUNT) {
+        break;
+      }
+    }
+    if(page - start + 1 == amount) {
+      if(start == next_free) {
+        next_free = start + amount;
+      }
+      return start;
+    }
+  }
+  return INVALID_PAGE;
+#else /* COFFEE_NAME_INDEX */
   for(page = next_free; page < COFFEE_PAGE_COUNT;) {
     read_header(&hdr, page);
     if(HDR_FREE(hdr)) {
@@ -550,6 +1140,7 @@ find_contiguous_pages(coffee_page_t amount)
     }
   }
   return INVALID_PAGE;
+#endif /* COFFEE_NAME_INDEX */
 }
 /*---------------------------------------------------------------------------*/
 static int
@@ -573,8 +1164,21 @@ remove_by_page(coffee_page_t page, int remove_log,
   hdr.flags |= HDR_FLAG_OBSOLETE;
   write_header(&hdr, page);
 
+#if COFFEE_NAME_INDEX
+  if(index_state != INDEX_UNKNOWN) {
+    map_set(obsolete_map, page, hdr.max_pages, 1);
+    if(!HDR_LOG(hdr)) {
+      index_remove(hdr.name, page);
+    }
+  }
+#endif /* COFFEE_NAME_INDEX */
+
   gc_wait = 0;
 
+#if COFFEE_BACKGROUND_GC
+  poll_gc();
+#endif /* COFFEE_BACKGROUND_GC */
+
   /* Close all file descriptors that reference the removed file. */
   if(close_fds) {
     for(i = 0; i < COFFEE_FD_SET_SIZE; i++) {
@@ -590,6 +1194,11 @@ remove_by_page(coffee_page_t page, int remove_log,
       coffee_files[i].references = 0;
       coffee_files[i].max_pages = 0;
     }
+#if COFFEE_MICRO_LOGS && COFFEE_LOG_CACHE_RECORDS > 0
+    if(log_caches[i].log_page == page) {
+      log_caches[i].log_page = INVALID_PAGE;
+    }
+#endif /* COFFEE_MICRO_LOGS && COFFEE_LOG_CACHE_RECORDS > 0 */
   }
 
   if(!COFFEE_EXTENDED_WEAR_LEVELLING && gc_allowed) {
@@ -635,11 +1244,34 @@ reserve(const char *name, coffee_page_t pages,
   strncpy(hdr.name, name, sizeof(hdr.name) - 1);
   hdr.max_pages = pages;
   hdr.flags = HDR_FLAG_ALLOCATED | flags;
+  if(!(flags & HDR_FLAG_LOG)) {
+    hdr.eof_hint = EOF_HINT_VALID;
+  }
   write_header(&hdr, page);
 
+#if COFFEE_NAME_INDEX
+  if(index_state != INDEX_UNKNOWN) {
+    map_set(free_map, page, pages, 0);
+    map_set(obsolete_map, page, pages, 0);
+    if(!(flags & HDR_FLAG_LOG)) {
+      index_add(hdr.name, page);
+    }
+  }
+#endif /* COFFEE_NAME_INDEX */
+
   PRINTF("Coffee: Reserved %u pages starting from %u for file %s\n",
          (unsigned)pages, (unsigned)page, name);
 
+#if COFFEE_BACKGROUND_GC
+  /* The first page of a sector is free only if the whole sector is.
+     Collect garbage if the file has taken one of the free sectors. */
+  if(page % COFFEE_PAGES_PER_SECTOR == 0 ||
+     page / COFFEE_PAGES_PER_SECTOR !=
+     (page + pages - 1) / COFFEE_PAGES_PER_SECTOR) {
+    poll_gc();
+  }
+#endif /* COFFEE_BACKGROUND_GC */
+
   file = load_file(page, &hdr);
   if(file != NULL) {
     file->end = 0;
@@ -678,15 +1310,52 @@ modify_log_buffer(uint16_t log_record_size,
 }
 #endif /* COFFEE_MICRO_LOGS */
 /*---------------------------------------------------------------------------*/
+#if COFFEE_MICRO_LOGS && COFFEE_LOG_CACHE_RECORDS > 0
+static struct log_cache *
+get_log_cache(struct file *file, coffee_page_t log_page, uint16_t log_records)
+{
+  struct log_cache *cache;
+
+  if(log_records > COFFEE_LOG_CACHE_RECORDS) {
+    return NULL;
+  }
+
+  cache = &log_caches[file - coffee_files];
+  if(cache->log_page != log_page) {
+    COFFEE_READ(cache->regions, log_records * sizeof(cache->regions[0]),
+                absolute_offset(log_page, 0));
+    for(cache->records = 0;
+        cache->records < log_records && cache->regions[cache->records] != 0;
+        cache->records++);
+    cache->log_page = log_page;
+  }
+  return cache;
+}
+#endif /* COFFEE_MICRO_LOGS && COFFEE_LOG_CACHE_RECORDS > 0 */
+/*---------------------------------------------------------------------------*/
 #if COFFEE_MICRO_LOGS
 static int
-get_record_index(coffee_page_t log_page, uint16_t search_records,
+get_record_index(struct file *file, coffee_page_t log_page,
+                 uint16_t log_records, uint16_t search_records,
                  uint16_t region)
 {
   cfs_offset_t base;
   uint16_t processed;
   uint16_t batch_size;
   int16_t match_index, i;
+#if COFFEE_LOG_CACHE_RECORDS > 0
+  struct log_cache *cache;
+
+  cache = get_log_cache(file, log_page, log_records);
+  if(cache != NULL) {
+    for(i = search_records - 1; i >= 0; i--) {
+      if(cache->regions[i] - 1 == region) {
+        return i;
+      }
+    }
+    return -1;
+  }
+#endif /* COFFEE_LOG_CACHE_RECORDS > 0 */
 
   base = absolute_offset(log_page, sizeof(uint16_t) * search_records);
   batch_size = search_records > COFFEE_LOG_TABLE_LIMIT ?
@@ -722,8 +1391,8 @@ get_record_index(coffee_page_t log_page, uint16_t search_records,
 /*---------------------------------------------------------------------------*/
 #if COFFEE_MICRO_LOGS
 static int
-read_log_page(struct file_header *hdr, int16_t record_count,
-              struct log_param *lp)
+read_log_page(struct file *file, struct file_header *hdr,
+              int16_t record_count, struct log_param *lp)
 {
   uint16_t region;
   int16_t match_index;
@@ -736,7 +1405,8 @@ read_log_page(struct file_header *hdr, int16_t record_count,
   region = modify_log_buffer(log_record_size, &lp->offset, &lp->size);
 
   search_records = record_count < 0 ? log_records : record_count;
-  match_index = get_record_index(hdr->log_page, search_records, region);
+  match_index = get_record_index(file, hdr->log_page, log_records,
+                                 search_records, region);
   if(match_index < 0) {
     return -1;
   }
@@ -805,6 +1475,9 @@ merge_log(coffee_page_t file_page, int extend)
     return -1;
   }
 
+  /* The hint must cover the data before any of it is written. */
+  update_eof_hint(new_file, coffee_fd_set[fd].file->end);
+
   offset = 0;
   do {
     char buf[hdr.log_record_size == 0 ? COFFEE_PAGE_SIZE : hdr.log_record_size];
@@ -852,37 +1525,42 @@ static int
 find_next_record(struct file *file, coffee_page_t log_page,
                  int log_records)
 {
-  int log_record, preferred_batch_size;
+  int low, high, middle;
+  uint16_t index;
+#if COFFEE_LOG_CACHE_RECORDS > 0
+  struct log_cache *cache;
+#endif /* COFFEE_LOG_CACHE_RECORDS > 0 */
 
   if(file->record_count >= 0) {
     return file->record_count;
   }
 
-  preferred_batch_size = log_records > COFFEE_LOG_TABLE_LIMIT ?
-    COFFEE_LOG_TABLE_LIMIT : log_records;
-  {
-    /* The next log record is unknown at this point; search for it. */
-    uint16_t indices[preferred_batch_size];
-    uint16_t processed;
-    uint16_t batch_size;
-
-    log_record = log_records;
-    for(processed = 0; processed < log_records; processed += batch_size) {
-      batch_size = log_records - processed >= preferred_batch_size ?
-        preferred_batch_size : log_records - processed;
-
-      COFFEE_READ(&indices, batch_size * sizeof(indices[0]),
-                  absolute_offset(log_page, processed * sizeof(indices[0])));
-      for(log_record = 0; log_record < batch_size; log_record++) {
-        if(indices[log_record] == 0) {
-          log_record += processed;
-          break;
-        }
-      }
+#if COFFEE_LOG_CACHE_RECORDS > 0
+  cache = get_log_cache(file, log_page, log_records);
+  if(cache != NULL) {
+    return cache->records;
+  }
+#endif /* COFFEE_LOG_CACHE_RECORDS > 0 */
+
+  /*
+   * The next log record is unknown at this point; search for it.
+   * Records are written in order, so the used entries of the index
+   * table precede the unused ones, which are zero.
+   */
+  low = 0;
+  high = log_records;
+  while(low < high) {
+    middle = (low + high) / 2;
+    COFFEE_READ(&index, sizeof(index),
+                absolute_offset(log_page, middle * sizeof(index)));
+    if(index == 0) {
+      high = middle;
+    } else {
+      low = middle + 1;
     }
   }
 
-  return log_record;
+  return low;
 }
 #endif /* COFFEE_MICRO_LOGS */
 /*---------------------------------------------------------------------------*/
@@ -934,7 +1612,7 @@ write_log_page(struct file *file, struct log_param *lp)
     lp_out.size = log_record_size;
 
     if((lp->offset > 0 || lp->size != log_record_size) &&
-       read_log_page(&hdr, log_record, &lp_out) < 0) {
+       read_log_page(file, &hdr, log_record, &lp_out) < 0) {
       COFFEE_READ(copy_buf, sizeof(copy_buf),
                   absolute_offset(file->page, offset));
     }
@@ -954,6 +1632,13 @@ write_log_page(struct file *file, struct log_param *lp)
     COFFEE_WRITE(copy_buf, sizeof(copy_buf),
                  offset + log_record * log_record_size);
     file->record_count = log_record + 1;
+
+#if COFFEE_LOG_CACHE_RECORDS > 0
+    if(log_caches[file - coffee_files].log_page == log_page) {
+      log_caches[file - coffee_files].regions[log_record] = region;
+      log_caches[file - coffee_files].records = log_record + 1;
+    }
+#endif /* COFFEE_LOG_CACHE_RECORDS > 0 */
   }
 
   return lp->size;
@@ -1122,7 +1807,7 @@ cfs_read(int fd, void *buf, unsigned size)
     lp.offset = fdp->offset;
     lp.buf = buf;
     lp.size = bytes_left;
-    r = read_log_page(&hdr, file->record_count, &lp);
+    r = read_log_page(file, &hdr, file->record_count, &lp);
 
     /* Read from the original file if we cannot find the data in the log. */
     if(r < 0) {
@@ -1172,6 +1857,7 @@ cfs_write(int fd, const void *buf, unsigned size)
 #if COFFEE_MICRO_LOGS
   if(!(fdp->io_flags & CFS_COFFEE_IO_FLASH_AWARE) &&
      (FILE_MODIFIED(file) || fdp->offset < file->end)) {
+    update_eof_hint(file, fdp->offset + size);
     need_dummy_write = 0;
     for(bytes_left = size; bytes_left > 0;) {
       lp.offset = fdp->offset;
@@ -1187,6 +1873,7 @@ cfs_write(int fd, const void *buf, unsigned size)
       } else if(i == 0) {
         /* The file was merged with the log. */
         file = fdp->file;
+        update_eof_hint(file, fdp->offset + bytes_left);
       } else {
         /* A log record was written. */
         bytes_left -= i;
@@ -1217,6 +1904,12 @@ cfs_write(int fd, const void *buf, unsigned size)
       return -1;
     }
 
+    /*
+     * Persist the hint before the data. Should the power fail between
+     * the two writes, the hint then still covers all data, whereas a
+     * hint below the data would make file_end() miss it.
+     */
+    update_eof_hint(file, fdp->offset + size);
     COFFEE_WRITE(buf, size, absolute_offset(file->page, fdp->offset));
     fdp->offset += size;
 #if COFFEE_MICRO_LOGS
@@ -1321,6 +2014,16 @@ cfs_coffee_set_io_semantics(int fd, unsigned flags)
   return 0;
 }
 /*---------------------------------------------------------------------------*/
+const struct cfs_coffee_gc_stats *
+cfs_coffee_gc_stats(void)
+{
+#if COFFEE_BACKGROUND_GC
+  return &gc_stats;
+#else
+  return NULL;
+#endif /* COFFEE_BACKGROUND_GC */
+}
+/*---------------------------------------------------------------------------*/
 int
 cfs_coffee_format(void)
 {
@@ -1338,9 +2041,24 @@ cfs_coffee_format(void)
   memset(&coffee_fd_set, 0, sizeof(coffee_fd_set));
   next_free = 0;
   gc_wait = 1;
+#if COFFEE_NAME_INDEX
+  index_reset();
+#endif /* COFFEE_NAME_INDEX */
 
   PRINTF(" done!\n");
 
   return 0;
 }
 /*---------------------------------------------------------------------------*/
+void
+cfs_coffee_remount(void)
+{
+  memset(&coffee_files, 0, sizeof(coffee_files));
+  memset(&coffee_fd_set, 0, sizeof(coffee_fd_set));
+  next_free = 0;
+  gc_wait = 0;
+#if COFFEE_NAME_INDEX
+  index_state = INDEX_UNKNOWN;
+#endif /* COFFEE_NAME_INDEX */
+}
+/*---------------------------------------------------------------------------*/
@@ -140,6 +140,56 @@ int cfs_coffee_set_io_semantics(int fd, unsigned flags);
  */
 int cfs_coffee_format(void);
 
+/**
+ * \brief Forget the cached state of the file system.
+ *
+ * Closes all file descriptors and discards the cached file objects
+ * and the name index, so that Coffee reads the storage again as it
+ * does after a reboot. This allows testing and benchmarking the
+ * behavior after a reboot without restarting the system.
+ */
+void cfs_coffee_remount(void);
+
+/**
+ * The number of buckets in the histograms of garbage collection pauses.
+ * Bucket 0 counts pauses shorter than one millisecond, bucket i > 0
+ * counts pauses shorter than 2^i milliseconds but no shorter than
+ * 2^(i-1) milliseconds, and the last bucket counts all longer pauses.
+ * Pauses are timed with the rtimer, and with the clock only when they
+ * are too long for the rtimer.
+ *
+ * \sa cfs_coffee_gc_stats()
+ */
+#define CFS_COFFEE_GC_HISTOGRAM_SIZE	12
+
+/**
+ * Garbage collection statistics.
+ *
+ * \sa cfs_coffee_gc_stats()
+ */
+struct cfs_coffee_gc_stats {
+  /** Pauses of file operations that had to collect garbage themselves. */
+  uint16_t foreground[CFS_COFFEE_GC_HISTOGRAM_SIZE];
+  /** Steps of the background garbage collector. */
+  uint16_t background[CFS_COFFEE_GC_HISTOGRAM_SIZE];
+  /** The number of sectors that have been erased. */
+  uint16_t erased_sectors;
+};
+
+/**
+ * \brief Get the garbage collection statistics.
+ * \return A pointer to the statistics, or NULL if Coffee is built
+ *         without COFFEE_BACKGROUND_GC.
+ *
+ * When Coffee is built with COFFEE_BACKGROUND_GC set, a process erases
+ * reclaimable sectors when files are removed or reservations take free
+ * sectors, until COFFEE_GC_FREE_SECTORS sectors are free. File
+ * operations then only collect garbage themselves if the background
+ * process has not been able to keep up. The statistics tell how often, and for how long,
+ * this happens.
+ */
+const struct cfs_coffee_gc_stats *cfs_coffee_gc_stats(void);
+
 /** @} */
 /** @} */
 
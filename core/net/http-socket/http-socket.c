@@ -31,16 +31,54 @@
 #include "contiki-net.h"
 #include "ip64-addr.h"
 #include "http-socket.h"
+#include "lib/memb.h"
 
 #include <ctype.h>
 #include <stdio.h>
+#include <string.h>
 
 #define MAX_PATHLEN 80
 #define MAX_HOSTLEN 40
+
+/* How long a connection we have closed is given to finish its close
+   before its slot in the pool is taken back */
+#define CLOSE_TIMEOUT (2 * CLOCK_SECOND)
+
+/* Connection states */
+enum {
+  CONNECTION_CONNECTING,
+  CONNECTION_OPEN,
+  CONNECTION_CLOSING,
+  CONNECTION_CLOSED,
+};
+
+/* How the end of a response body is found */
+enum {
+  BODY_UNTIL_CLOSE,
+  BODY_NONE,
+  BODY_LENGTH,
+  BODY_CHUNKED,
+};
+
+/* Chunked transfer coding states */
+enum {
+  CHUNK_SIZE,
+  CHUNK_EXTENSION,
+  CHUNK_DATA,
+  CHUNK_DATA_END,
+  CHUNK_TRAILER,
+};
+
 PROCESS(http_socket_process, "HTTP socket process");
 LIST(socketlist);
+LIST(connectionlist);
+MEMB(connections, struct http_socket_connection, HTTP_SOCKET_CONNECTIONS);
 
 static void removesocket(struct http_socket *s);
+static int start_request(struct http_socket *s);
+static void close_connection(struct http_socket_connection *c,
+                             http_socket_event_t e);
+static void response_done(struct http_socket *s);
 /*---------------------------------------------------------------------------*/
 static void
 call_callback(struct http_socket *s, http_socket_event_t e,
@@ -53,20 +91,128 @@ call_callback(struct http_socket *s, http_socket_event_t e,
 }
 /*---------------------------------------------------------------------------*/
 static void
+set_timer(struct etimer *et, clock_time_t interval)
+{
+  PROCESS_CONTEXT_BEGIN(&http_socket_process);
+  etimer_set(et, interval);
+  PROCESS_CONTEXT_END(&http_socket_process);
+}
+/*---------------------------------------------------------------------------*/
+static void
+start_timeout_timer(struct http_socket *s)
+{
+  set_timer(&s->timeout_timer, HTTP_SOCKET_TIMEOUT);
+  s->timeout_timer_started = 1;
+}
+/*---------------------------------------------------------------------------*/
+/*
+ * The requests on a connection are kept in socketlist in the order they
+ * were put on the connection, which is also the order in which they are
+ * sent and answered.
+ */
+static struct http_socket *
+first_request(struct http_socket_connection *c)
+{
+  struct http_socket *s;
+
+  for(s = list_head(socketlist); s != NULL; s = list_item_next(s)) {
+    if(s->conn == c) {
+      return s;
+    }
+  }
+  return NULL;
+}
+/*---------------------------------------------------------------------------*/
+static struct http_socket *
+first_unsent_request(struct http_socket_connection *c)
+{
+  struct http_socket *s;
+
+  for(s = list_head(socketlist); s != NULL; s = list_item_next(s)) {
+    if(s->conn == c && s->sent == 0) {
+      return s;
+    }
+  }
+  return NULL;
+}
+/*---------------------------------------------------------------------------*/
+static int
+post_outstanding(struct http_socket_connection *c)
+{
+  struct http_socket *s;
+
+  for(s = list_head(socketlist); s != NULL; s = list_item_next(s)) {
+    if(s->conn == c && s->sent && s->postdata != NULL) {
+      return 1;
+    }
+  }
+  return 0;
+}
+/*---------------------------------------------------------------------------*/
+static int
+count_requests(struct http_socket_connection *c)
+{
+  struct http_socket *s;
+  int n = 0;
+
+  for(s = list_head(socketlist); s != NULL; s = list_item_next(s)) {
+    if(s->conn == c) {
+      n++;
+    }
+  }
+  return n;
+}
+/*---------------------------------------------------------------------------*/
+static int
+waiting_requests(void)
+{
+  struct http_socket *s;
+
+  /* Requests with an address but no connection wait for one to be freed */
+  for(s = list_head(socketlist); s != NULL; s = list_item_next(s)) {
+    if(s->conn == NULL && s->did_tcp_connect) {
+      return 1;
+    }
+  }
+  return 0;
+}
+/*---------------------------------------------------------------------------*/
+static void
 parse_header_init(struct http_socket *s)
 {
   PT_INIT(&s->headerpt);
 }
 /*---------------------------------------------------------------------------*/
+/* Header field names are case-insensitive (RFC 7230, section 3.2) */
+static int
+header_field_is(struct http_socket *s, const char *name)
+{
+  const char *field = s->header_field;
+
+  while(*field != '\0' && tolower((int)*field) == tolower((int)*name)) {
+    field++;
+    name++;
+  }
+  return *field == '\0' && *name == '\0';
+}
+/*---------------------------------------------------------------------------*/
 static int
 parse_header_byte(struct http_socket *s, char c)
 {
+  int n;
+
   PT_BEGIN(&s->headerpt);
 
   memset(&s->header, -1, sizeof(s->header));
+  s->body = BODY_UNTIL_CLOSE;
 
-  /* Skip the HTTP response */
-  while(c != ' ') {
+  /* Skip the HTTP version. HTTP/1.0 servers close the connection after
+     the response unless they say otherwise. */
+  s->keep_alive = 1;
+  for(s->header_chars = 0; c != ' '; s->header_chars++) {
+    if(s->header_chars == 7 && c == '0') {
+      s->keep_alive = 0;
+    }
     PT_YIELD(&s->headerpt);
   }
 
@@ -79,7 +225,7 @@ parse_header_byte(struct http_socket *s, char c)
     PT_YIELD(&s->headerpt);
   }
 
-  if(s->header.status_code == 0x200 || s->header.status_code == 0x206) {
+  if((s->header.status_code & 0xf00) == 0x200) {
     /* Read headers until data */
 
     while(1) {
@@ -93,12 +239,13 @@ parse_header_byte(struct http_socket *s, char c)
         PT_YIELD(&s->headerpt);
       } while(c != '\n');
       s->header_chars--;
-      PT_YIELD(&s->headerpt);
 
       if(s->header_chars == 0) {
-        /* This was an empty line, i.e. the end of headers */
+        /* This was an empty line, i.e. the end of headers. Exit without
+           asking for more, the body may start in the next response. */
         break;
       }
+      PT_YIELD(&s->headerpt);
 
       /* Start of line */
       s->header_chars = 0;
@@ -124,14 +271,45 @@ parse_header_byte(struct http_socket *s, char c)
           s->header_chars++;
           PT_YIELD(&s->headerpt);
         }
-        if(!strcmp(s->header_field, "Content-Length")) {
+        if(header_field_is(s, "Content-Length")) {
           s->header.content_length = 0;
           while(isdigit((int)c)) {
             s->header.content_length = s->header.content_length * 10 + c - '0';
             s->header_chars++;
             PT_YIELD(&s->headerpt);
           }
-        } else if(!strcmp(s->header_field, "Content-Range")) {
+        } else if(header_field_is(s, "Transfer-Encoding")) {
+          /* Read the value in lower case, over the field name */
+          s->header_field[0] = '\0';
+          while(c != '\r') {
+            n = strlen(s->header_field);
+            if(n < sizeof(s->header_field) - 1) {
+              s->header_field[n] = tolower((int)c);
+              s->header_field[n + 1] = '\0';
+            }
+            s->header_chars++;
+            PT_YIELD(&s->headerpt);
+          }
+          if(strstr(s->header_field, "chunked") != NULL) {
+            s->body = BODY_CHUNKED;
+          }
+        } else if(header_field_is(s, "Connection")) {
+          s->header_field[0] = '\0';
+          while(c != '\r') {
+            n = strlen(s->header_field);
+            if(n < sizeof(s->header_field) - 1) {
+              s->header_field[n] = tolower((int)c);
+              s->header_field[n + 1] = '\0';
+            }
+            s->header_chars++;
+            PT_YIELD(&s->headerpt);
+          }
+          if(strstr(s->header_field, "close") != NULL) {
+            s->keep_alive = 0;
+          } else if(strstr(s->header_field, "keep-alive") != NULL) {
+            s->keep_alive = 1;
+          }
+        } else if(header_field_is(s, "Content-Range")) {
           /* Skip the bytes-unit token */
           while(c != ' ' && c != '\t') {
             s->header_chars++;
@@ -199,91 +377,214 @@ parse_header_byte(struct http_socket *s, char c)
       }
     }
 
-    /* All headers read, now read data */
-    call_callback(s, HTTP_SOCKET_HEADER, (void *)&s->header, sizeof(s->header));
-
-    /* Should exit the pt here to indicate that all headers have been
-       read */
-    PT_EXIT(&s->headerpt);
-  } else {
-    if(s->header.status_code == 0x404) {
-      printf("File not found\n");
-    } else if(s->header.status_code == 0x301 || s->header.status_code == 0x302) {
-      printf("File moved (not handled)\n");
-    }
+    /* All headers read, the caller goes on with the body */
+  }
+  PT_EXIT(&s->headerpt);
 
-    call_callback(s, HTTP_SOCKET_ERR, (void *)&s->header, sizeof(s->header));
-    tcp_socket_close(&s->s);
-    removesocket(s);
-    PT_EXIT(&s->headerpt);
+  PT_END(&s->headerpt);
+}
+/*---------------------------------------------------------------------------*/
+static int
+hexvalue(char c)
+{
+  if(c >= '0' && c <= '9') {
+    return c - '0';
   }
+  return (c | 0x20) - 'a' + 10;
+}
+/*---------------------------------------------------------------------------*/
+/*
+ * Decodes a chunked body and passes on the chunk data only. Returns the
+ * number of bytes used, which is less than inputdatalen after a callback
+ * so that the caller can check what the callback did.
+ */
+static int
+chunked_input(struct http_socket *s,
+              const uint8_t *inputptr, int inputdatalen)
+{
+  int i = 0;
+  int len;
+  char c;
 
+  while(i < inputdatalen) {
+    c = inputptr[i];
+    switch(s->chunk_state) {
+    case CHUNK_SIZE:
+      if(!isxdigit((int)c)) {
+        /* Look at this byte again as part of the extensions */
+        s->chunk_state = CHUNK_EXTENSION;
+        break;
+      }
+      if(s->chunk_left > 0x0fffffff) {
+        /* The chunk size does not fit, so the body cannot be framed */
+        close_connection(s->conn, HTTP_SOCKET_ABORTED);
+        return inputdatalen;
+      }
+      s->chunk_left = s->chunk_left << 4 | hexvalue(c);
+      i++;
+      break;
 
-  PT_END(&s->headerpt);
+    case CHUNK_EXTENSION:
+      /* Chunk extensions are skipped up to the end of the line */
+      i++;
+      if(c == '\n') {
+        if(s->chunk_left == 0) {
+          s->chunk_state = CHUNK_TRAILER;
+          s->header_chars = 0;
+        } else {
+          s->chunk_state = CHUNK_DATA;
+        }
+      }
+      break;
+
+    case CHUNK_DATA:
+      len = MIN(s->chunk_left, inputdatalen - i);
+      s->chunk_left -= len;
+      s->bodylen += len;
+      if(s->chunk_left == 0) {
+        s->chunk_state = CHUNK_DATA_END;
+      }
+      call_callback(s, HTTP_SOCKET_DATA, &inputptr[i], len);
+      return i + len;
+
+    case CHUNK_DATA_END:
+      /* The line break after the chunk data */
+      i++;
+      if(c == '\n') {
+        s->chunk_state = CHUNK_SIZE;
+        s->chunk_left = 0;
+      }
+      break;
+
+    case CHUNK_TRAILER:
+      /* Trailer fields are skipped, an empty line ends the body */
+      i++;
+      if(c == '\n') {
+        if(s->header_chars == 0) {
+          response_done(s);
+          return i;
+        }
+        s->header_chars = 0;
+      } else if(c != '\r') {
+        s->header_chars++;
+      }
+      break;
+    }
+  }
+  return i;
 }
 /*---------------------------------------------------------------------------*/
+/*
+ * Parses the response to the request s. Returns the number of bytes used,
+ * the rest belongs to the responses to the requests after s.
+ */
 static int
-input_pt(struct http_socket *s,
-         const uint8_t *inputptr, int inputdatalen)
+response_input(struct http_socket *s,
+               const uint8_t *inputptr, int inputdatalen)
 {
+  struct http_socket_connection *c = s->conn;
   int i;
-  PT_BEGIN(&s->pt);
+  int len;
 
-  /* Parse the header */
-  s->header_received = 0;
-  do {
+  if(s->header_received == 0) {
     for(i = 0; i < inputdatalen; i++) {
       if(!PT_SCHEDULE(parse_header_byte(s, inputptr[i]))) {
         s->header_received = 1;
         break;
       }
     }
-    inputdatalen -= i;
-    inputptr += i;
 
     if(s->header_received == 0) {
       /* If we have not yet received the full header, we wait for the
          next packet to arrive. */
-      PT_YIELD(&s->pt);
+      return inputdatalen;
     }
-  } while(s->header_received == 0);
-
-  s->bodylen = 0;
-  do {
-    /* Receive the data */
-    call_callback(s, HTTP_SOCKET_DATA, inputptr, inputdatalen);
 
-    /* Close the connection if the expected content length has been received */
-    if(s->header.content_length >= 0 && s->bodylen < s->header.content_length) {
-      s->bodylen += inputdatalen;
-      if(s->bodylen >= s->header.content_length) {
-        tcp_socket_close(&s->s);
+    if((s->header.status_code & 0xf00) != 0x200) {
+      if(s->header.status_code == 0x404) {
+        printf("File not found\n");
+      } else if(s->header.status_code == 0x301 || s->header.status_code == 0x302) {
+        printf("File moved (not handled)\n");
       }
+
+      /* We did not read the rest of the response, so the connection
+         cannot be used for anything else */
+      removesocket(s);
+      close_connection(c, HTTP_SOCKET_ABORTED);
+      call_callback(s, HTTP_SOCKET_ERR, (void *)&s->header, sizeof(s->header));
+      return inputdatalen;
     }
 
-    PT_YIELD(&s->pt);
-  } while(inputdatalen > 0);
+    s->bodylen = 0;
+    if(s->body == BODY_CHUNKED) {
+      s->chunk_state = CHUNK_SIZE;
+      s->chunk_left = 0;
+    } else if(s->header.status_code == 0x204 ||
+              s->header.content_length == 0) {
+      s->body = BODY_NONE;
+    } else if(s->header.content_length > 0) {
+      s->body = BODY_LENGTH;
+    } else {
+      /* The body ends when the server closes the connection */
+      s->keep_alive = 0;
+    }
 
-  PT_END(&s->pt);
-}
-/*---------------------------------------------------------------------------*/
-static void
-start_timeout_timer(struct http_socket *s)
-{
-  PROCESS_CONTEXT_BEGIN(&http_socket_process);
-  etimer_set(&s->timeout_timer, HTTP_SOCKET_TIMEOUT);
-  PROCESS_CONTEXT_END(&http_socket_process);
-  s->timeout_timer_started = 1;
+    /* All headers read, now read data */
+    call_callback(s, HTTP_SOCKET_HEADER, (void *)&s->header, sizeof(s->header));
+
+    if(s->conn == c && s->body == BODY_NONE) {
+      response_done(s);
+    }
+    /* The last byte of the header was used as well */
+    return i + 1;
+  }
+
+  if(s->body == BODY_CHUNKED) {
+    return chunked_input(s, inputptr, inputdatalen);
+  }
+
+  len = inputdatalen;
+  if(s->body == BODY_LENGTH && s->header.content_length - s->bodylen < len) {
+    len = s->header.content_length - s->bodylen;
+  }
+  s->bodylen += len;
+
+  /* Receive the data */
+  call_callback(s, HTTP_SOCKET_DATA, inputptr, len);
+
+  if(s->conn == c && s->body == BODY_LENGTH &&
+     s->bodylen >= s->header.content_length) {
+    response_done(s);
+  }
+  return len;
 }
 /*---------------------------------------------------------------------------*/
 static int
 input(struct tcp_socket *tcps, void *ptr,
       const uint8_t *inputptr, int inputdatalen)
 {
-  struct http_socket *s = ptr;
+  struct http_socket_connection *c = ptr;
+  struct http_socket *s;
+  int len;
+
+  while(inputdatalen > 0 && c->state == CONNECTION_OPEN) {
+    s = first_request(c);
+    if(s == NULL || s->sent == 0) {
+      /* Nothing was asked for, the server is out of step with us */
+      close_connection(c, HTTP_SOCKET_ABORTED);
+      break;
+    }
+    len = response_input(s, inputptr, inputdatalen);
+    inputptr += len;
+    inputdatalen -= len;
+  }
 
-  input_pt(s, inputptr, inputdatalen);
-  start_timeout_timer(s);
+  /* The requests behind a long response must not time out while waiting */
+  for(s = list_head(socketlist); s != NULL; s = list_item_next(s)) {
+    if(s->conn == c && s->sent && c->sending != s) {
+      start_timeout_timer(s);
+    }
+  }
 
   return 0; /* all data consumed */
 }
@@ -391,96 +692,383 @@ removesocket(struct http_socket *s)
   etimer_stop(&s->timeout_timer);
   s->timeout_timer_started = 0;
   list_remove(socketlist, s);
+  if(s->conn != NULL && s->conn->sending == s) {
+    s->conn->sending = NULL;
+  }
+  s->conn = NULL;
 }
 /*---------------------------------------------------------------------------*/
-static void
-event(struct tcp_socket *tcps, void *ptr,
-      tcp_socket_event_t e)
+static int
+send_str(struct tcp_socket *tcps, const char *str)
+{
+  if(tcps == NULL) {
+    return strlen(str);
+  }
+  return tcp_socket_send_str(tcps, str);
+}
+/*---------------------------------------------------------------------------*/
+/*
+ * Writes the request line and headers of s. With tcps set to NULL,
+ * nothing is written and only the length is returned.
+ */
+static int
+send_request(struct tcp_socket *tcps, struct http_socket *s)
 {
-  struct http_socket *s = ptr;
   char host[MAX_HOSTLEN];
   char path[MAX_PATHLEN];
   uint16_t port;
   char str[42];
+  int len = 0;
+
+  if(!parse_url(s->url, host, &port, path)) {
+    return 0;
+  }
+
+  len += send_str(tcps, s->postdata != NULL ? "POST " : "GET ");
+  if(s->proxy_port != 0) {
+    /* If we are configured to route through a proxy, we should
+       provide the full URL as the path. */
+    len += send_str(tcps, s->url);
+  } else {
+    len += send_str(tcps, path);
+  }
+  /* HTTP/1.1 connections are persistent unless either side says
+     otherwise */
+  len += send_str(tcps, " HTTP/1.1\r\n");
+  len += send_str(tcps, "Host: ");
+  /* If we have IPv6 host, add the '[' and the ']' characters
+     to the host. As in rfc2732. */
+  if(memchr(host, ':', MAX_HOSTLEN)) {
+    len += send_str(tcps, "[");
+  }
+  len += send_str(tcps, host);
+  if(memchr(host, ':', MAX_HOSTLEN)) {
+    len += send_str(tcps, "]");
+  }
+  len += send_str(tcps, "\r\n");
+  if(s->postdata != NULL) {
+    if(s->content_type) {
+      len += send_str(tcps, "Content-Type: ");
+      len += send_str(tcps, s->content_type);
+      len += send_str(tcps, "\r\n");
+    }
+    len += send_str(tcps, "Content-Length: ");
+    sprintf(str, "%u", s->postdatalen);
+    len += send_str(tcps, str);
+    len += send_str(tcps, "\r\n");
+  } else if(s->length || s->pos > 0) {
+    len += send_str(tcps, "Range: bytes=");
+    if(s->length) {
+      if(s->pos >= 0) {
+        sprintf(str, "%llu-%llu", s->pos, s->pos + s->length - 1);
+      } else {
+        sprintf(str, "-%llu", s->length);
+      }
+    } else {
+      sprintf(str, "%llu-", s->pos);
+    }
+    len += send_str(tcps, str);
+    len += send_str(tcps, "\r\n");
+  }
+  len += send_str(tcps, "\r\n");
+  return len;
+}
+/*---------------------------------------------------------------------------*/
+/*
+ * Writes the requests on c that have not been sent yet. A GET is
+ * written as soon as the output buffer has room for its header, without
+ * waiting for the responses to the requests before it. A POST is not
+ * idempotent, so it is written only when it is the first request on the
+ * connection, and nothing is written after it until it has been answered
+ * (RFC 7230, section 6.3.2).
+ */
+static void
+send_requests(struct http_socket_connection *c)
+{
+  struct http_socket *s;
   int len;
 
+  while(c->state == CONNECTION_OPEN) {
+    s = c->sending;
+    if(s != NULL) {
+      if(s->postdata != NULL && s->postdatasent < s->postdatalen) {
+        len = tcp_socket_send(&c->s, s->postdata + s->postdatasent,
+                              s->postdatalen - s->postdatasent);
+        s->postdatasent += len;
+        if(s->postdatasent < s->postdatalen) {
+          /* The rest goes out when this has been sent */
+          return;
+        }
+      }
+      c->sending = NULL;
+      start_timeout_timer(s);
+    }
+
+    s = first_unsent_request(c);
+    if(s == NULL || post_outstanding(c) ||
+       (s->postdata != NULL && first_request(c) != s)) {
+      return;
+    }
+    if(send_request(NULL, s) > tcp_socket_max_sendlen(&c->s) &&
+       tcp_socket_queuelen(&c->s) > 0) {
+      return;
+    }
+    send_request(&c->s, s);
+    s->sent = 1;
+    s->postdatasent = 0;
+    s->header_received = 0;
+    parse_header_init(s);
+    c->sending = s;
+  }
+}
+/*---------------------------------------------------------------------------*/
+static void
+connection_idle(struct http_socket_connection *c)
+{
+  set_timer(&c->timer, HTTP_SOCKET_KEEPALIVE_TIMEOUT);
+  if(waiting_requests()) {
+    /* Let the process find a use for this connection, or close it to
+       make room for one that has */
+    process_poll(&http_socket_process);
+  }
+}
+/*---------------------------------------------------------------------------*/
+/*
+ * Takes the requests off a connection that will not be used any more.
+ * Requests that have not been answered at all are put back in line for
+ * another connection, while the rest get e. Only requests that never
+ * went out on an open connection may be put back more than once, and a
+ * POST that went out is never sent again, as the server may have acted
+ * on it.
+ */
+static void
+detach_requests(struct http_socket_connection *c, http_socket_event_t e,
+                uint8_t was_open)
+{
+  struct http_socket *s;
+
+  while((s = first_request(c)) != NULL) {
+    if(s->header_received == 0 &&
+       (s->postdata == NULL || s->sent == 0) &&
+       ((s->sent == 0 && was_open) || s->retried == 0)) {
+      if(s->sent || !was_open) {
+        s->retried = 1;
+      }
+      s->sent = 0;
+      s->conn = NULL;
+      process_poll(&http_socket_process);
+    } else {
+      removesocket(s);
+      call_callback(s, e, NULL, 0);
+    }
+  }
+}
+/*---------------------------------------------------------------------------*/
+static void
+close_connection(struct http_socket_connection *c, http_socket_event_t e)
+{
+  uint8_t was_open = c->state == CONNECTION_OPEN;
+
+  if(c->state == CONNECTION_CLOSING || c->state == CONNECTION_CLOSED) {
+    return;
+  }
+  c->state = CONNECTION_CLOSING;
+  c->sending = NULL;
+  tcp_socket_close(&c->s);
+  set_timer(&c->timer, CLOSE_TIMEOUT);
+  detach_requests(c, e, was_open);
+}
+/*---------------------------------------------------------------------------*/
+static void
+free_connection(struct http_socket_connection *c)
+{
+  etimer_stop(&c->timer);
+  if(c->state == CONNECTION_CLOSED) {
+    /* uIP is done with the connection and may already have given it to
+       someone else, so it must not be detached */
+    c->s.c = NULL;
+  }
+  tcp_socket_unregister(&c->s);
+  list_remove(connectionlist, c);
+  memb_free(&connections, c);
+}
+/*---------------------------------------------------------------------------*/
+static void
+restart_waiting(void)
+{
+  struct http_socket *s, *next;
+
+  for(s = list_head(socketlist); s != NULL; s = next) {
+    next = list_item_next(s);
+    if(s->conn == NULL && s->did_tcp_connect) {
+      if(start_request(s) == HTTP_SOCKET_ERR) {
+        call_callback(s, HTTP_SOCKET_ERR, NULL, 0);
+        return;
+      }
+      if(s->conn == NULL && s->did_tcp_connect) {
+        /* Still no connection to be had */
+        return;
+      }
+    }
+  }
+}
+/*---------------------------------------------------------------------------*/
+static void
+response_done(struct http_socket *s)
+{
+  struct http_socket_connection *c = s->conn;
+
+  if(c->sending == s) {
+    /* The server answered before it got all of the post data */
+    s->keep_alive = 0;
+  }
+  removesocket(s);
+  if(s->keep_alive == 0) {
+    close_connection(c, HTTP_SOCKET_CLOSED);
+  } else if(first_request(c) == NULL) {
+    connection_idle(c);
+  } else {
+    /* Requests held back by a POST may go out now */
+    send_requests(c);
+    if(waiting_requests()) {
+      /* There is room for one more request on the connection */
+      process_poll(&http_socket_process);
+    }
+  }
+  call_callback(s, HTTP_SOCKET_CLOSED, NULL, 0);
+}
+/*---------------------------------------------------------------------------*/
+static void
+event(struct tcp_socket *tcps, void *ptr,
+      tcp_socket_event_t e)
+{
+  struct http_socket_connection *c = ptr;
+  http_socket_event_t ev;
+  uint8_t was_open;
+
   if(e == TCP_SOCKET_CONNECTED) {
     printf("Connected\n");
-    if(parse_url(s->url, host, &port, path)) {
-      tcp_socket_send_str(tcps, s->postdata != NULL ? "POST " : "GET ");
-      if(s->proxy_port != 0) {
-        /* If we are configured to route through a proxy, we should
-           provide the full URL as the path. */
-        tcp_socket_send_str(tcps, s->url);
+    if(c->state == CONNECTION_CONNECTING) {
+      c->state = CONNECTION_OPEN;
+      if(first_request(c) == NULL) {
+        connection_idle(c);
       } else {
-        tcp_socket_send_str(tcps, path);
-      }
-      tcp_socket_send_str(tcps, " HTTP/1.1\r\n");
-      tcp_socket_send_str(tcps, "Connection: close\r\n");
-      tcp_socket_send_str(tcps, "Host: ");
-      /* If we have IPv6 host, add the '[' and the ']' characters
-         to the host. As in rfc2732. */
-      if(memchr(host, ':', MAX_HOSTLEN)) {
-        tcp_socket_send_str(tcps, "[");
-      }
-      tcp_socket_send_str(tcps, host);
-      if(memchr(host, ':', MAX_HOSTLEN)) {
-        tcp_socket_send_str(tcps, "]");
-      }
-      tcp_socket_send_str(tcps, "\r\n");
-      if(s->postdata != NULL) {
-        if(s->content_type) {
-          tcp_socket_send_str(tcps, "Content-Type: ");
-          tcp_socket_send_str(tcps, s->content_type);
-          tcp_socket_send_str(tcps, "\r\n");
-        }
-        tcp_socket_send_str(tcps, "Content-Length: ");
-        sprintf(str, "%u", s->postdatalen);
-        tcp_socket_send_str(tcps, str);
-        tcp_socket_send_str(tcps, "\r\n");
-      } else if(s->length || s->pos > 0) {
-        tcp_socket_send_str(tcps, "Range: bytes=");
-        if(s->length) {
-          if(s->pos >= 0) {
-            sprintf(str, "%llu-%llu", s->pos, s->pos + s->length - 1);
-          } else {
-            sprintf(str, "-%llu", s->length);
-          }
-        } else {
-          sprintf(str, "%llu-", s->pos);
-        }
-        tcp_socket_send_str(tcps, str);
-        tcp_socket_send_str(tcps, "\r\n");
-      }
-      tcp_socket_send_str(tcps, "\r\n");
-      if(s->postdata != NULL && s->postdatalen) {
-        len = tcp_socket_send(tcps, s->postdata, s->postdatalen);
-        s->postdata += len;
-        s->postdatalen -= len;
+        send_requests(c);
       }
     }
-    parse_header_init(s);
-  } else if(e == TCP_SOCKET_CLOSED) {
-    call_callback(s, HTTP_SOCKET_CLOSED, NULL, 0);
-    removesocket(s);
-    printf("Closed\n");
-  } else if(e == TCP_SOCKET_TIMEDOUT) {
-    call_callback(s, HTTP_SOCKET_TIMEDOUT, NULL, 0);
-    removesocket(s);
-    printf("Timedout\n");
-  } else if(e == TCP_SOCKET_ABORTED) {
-    call_callback(s, HTTP_SOCKET_ABORTED, NULL, 0);
-    removesocket(s);
-    printf("Aborted\n");
   } else if(e == TCP_SOCKET_DATA_SENT) {
-    if(s->postdata != NULL && s->postdatalen) {
-      len = tcp_socket_send(tcps, s->postdata, s->postdatalen);
-      s->postdata += len;
-      s->postdatalen -= len;
+    send_requests(c);
+  } else {
+    if(e == TCP_SOCKET_CLOSED) {
+      ev = HTTP_SOCKET_CLOSED;
+      printf("Closed\n");
+    } else if(e == TCP_SOCKET_TIMEDOUT) {
+      ev = HTTP_SOCKET_TIMEDOUT;
+      printf("Timedout\n");
     } else {
-      start_timeout_timer(s);
+      ev = HTTP_SOCKET_ABORTED;
+      printf("Aborted\n");
+    }
+    if(c->state != CONNECTION_CLOSING && c->state != CONNECTION_CLOSED) {
+      /* A response that runs until the connection closes is complete
+         now, any other is cut short */
+      was_open = c->state == CONNECTION_OPEN;
+      c->state = CONNECTION_CLOSING;
+      c->sending = NULL;
+      detach_requests(c, ev, was_open);
+    }
+    /* The process gives the slot back when tcp-socket is done with it */
+    c->state = CONNECTION_CLOSED;
+    process_poll(&http_socket_process);
+  }
+}
+/*---------------------------------------------------------------------------*/
+/*
+ * Finds a connection to addr:port for one more request, opening a new
+ * one if there is none with room for it. Returns NULL if the pool is
+ * full, in which case an idle connection is closed to make room. If
+ * there is neither a closing nor an idle connection, the waiting request
+ * is restarted when a response completes or a connection becomes idle.
+ */
+static struct http_socket_connection *
+get_connection(const uip_ipaddr_t *addr, uint16_t port)
+{
+  struct http_socket_connection *c;
+
+  for(c = list_head(connectionlist); c != NULL; c = list_item_next(c)) {
+    if((c->state == CONNECTION_CONNECTING || c->state == CONNECTION_OPEN) &&
+       c->port == port && uip_ipaddr_cmp(&c->addr, addr) &&
+       count_requests(c) < HTTP_SOCKET_PIPELINE) {
+      return c;
+    }
+  }
+
+  c = memb_alloc(&connections);
+  if(c == NULL) {
+    /* The process frees a closing connection for the waiting request.
+       If there is none, an idle one is closed. */
+    for(c = list_head(connectionlist); c != NULL; c = list_item_next(c)) {
+      if(c->state == CONNECTION_CLOSING || c->state == CONNECTION_CLOSED) {
+        break;
+      }
+    }
+    if(c == NULL) {
+      for(c = list_head(connectionlist); c != NULL; c = list_item_next(c)) {
+        if(first_request(c) == NULL) {
+          close_connection(c, HTTP_SOCKET_CLOSED);
+          break;
+        }
+      }
     }
+    if(c != NULL) {
+      process_poll(&http_socket_process);
+    }
+    return NULL;
+  }
+
+  uip_ipaddr_copy(&c->addr, addr);
+  c->port = port;
+  c->state = CONNECTION_CONNECTING;
+  c->sending = NULL;
+  tcp_socket_register(&c->s, c,
+                      c->inputbuf, sizeof(c->inputbuf),
+                      c->outputbuf, sizeof(c->outputbuf),
+                      input, event);
+  if(tcp_socket_connect(&c->s, addr, port) < 0) {
+    tcp_socket_unregister(&c->s);
+    memb_free(&connections, c);
+    return NULL;
+  }
+  list_add(connectionlist, c);
+  return c;
+}
+/*---------------------------------------------------------------------------*/
+static int
+attach_request(struct http_socket *s, const uip_ipaddr_t *addr, uint16_t port)
+{
+  struct http_socket_connection *c;
+
+  s->did_tcp_connect = 1;
+  c = get_connection(addr, port);
+  if(c == NULL) {
+    if(list_head(connectionlist) == NULL) {
+      /* No connection could be opened, and none will be freed */
+      removesocket(s);
+      return HTTP_SOCKET_ERR;
+    }
+    /* Wait for a connection to be freed */
+    return HTTP_SOCKET_OK;
+  }
+
+  /* Put the request last in line */
+  list_add(socketlist, s);
+  s->conn = c;
+  s->sent = 0;
+  if(c->state == CONNECTION_OPEN) {
+    etimer_stop(&c->timer);
+    send_requests(c);
   }
+  return HTTP_SOCKET_OK;
 }
 /*---------------------------------------------------------------------------*/
 static int
@@ -511,25 +1099,30 @@ start_request(struct http_socket *s)
       } else {
         /* Try to lookup the hostname. If it fails, we initiate a hostname
            lookup. */
+        addr = NULL;
         ret = resolv_lookup(host, &addr);
         if(ret == RESOLV_STATUS_UNCACHED ||
            ret == RESOLV_STATUS_EXPIRED) {
+          s->did_tcp_connect = 0;
           resolv_query(host);
           puts("Resolving host...");
           return HTTP_SOCKET_OK;
         }
-        if(addr != NULL) {
-          s->did_tcp_connect = 1;
-          tcp_socket_connect(&s->s, addr, port);
+        if(ret == RESOLV_STATUS_RESOLVING) {
+          s->did_tcp_connect = 0;
           return HTTP_SOCKET_OK;
+        }
+        if(addr != NULL) {
+          return attach_request(s, addr, port);
         } else {
+          removesocket(s);
           return HTTP_SOCKET_ERR;
         }
       }
     }
-    tcp_socket_connect(&s->s, &ip6addr, port);
-    return HTTP_SOCKET_OK;
+    return attach_request(s, &ip6addr, port);
   } else {
+    removesocket(s);
     return HTTP_SOCKET_ERR;
   }
 }
@@ -543,7 +1136,7 @@ PROCESS_THREAD(http_socket_process, ev, data)
     PROCESS_WAIT_EVENT();
 
     if(ev == resolv_event_found && data != NULL) {
-      struct http_socket *s;
+      struct http_socket *s, *next;
       const char *name = data;
       /* Either found a hostname, or not. We need to go through the
 	 list of http sockets and figure out to which connection this
@@ -551,8 +1144,9 @@ PROCESS_THREAD(http_socket_process, ev, data)
 	 it (if no hostname was found). */
       for(s = list_head(socketlist);
           s != NULL;
-          s = list_item_next(s)) {
+          s = next) {
         char host[MAX_HOSTLEN];
+        next = list_item_next(s);
         if(s->did_tcp_connect) {
           /* We already connected, ignored */
         } else if(parse_url(s->url, host, NULL, NULL) &&
@@ -562,24 +1156,60 @@ PROCESS_THREAD(http_socket_process, ev, data)
             start_request(s);
           } else {
             /* Hostname not found, kill connection. */
-            call_callback(s, HTTP_SOCKET_HOSTNAME_NOT_FOUND, NULL, 0);
             removesocket(s);
+            call_callback(s, HTTP_SOCKET_HOSTNAME_NOT_FOUND, NULL, 0);
           }
         }
       }
+    } else if(ev == PROCESS_EVENT_POLL) {
+      struct http_socket_connection *c, *next;
+      /*
+       * Connections have been closed, or requests are waiting for one.
+       * Put the waiting requests on connections that have room, then
+       * take back the slots of closed connections for the rest.
+       */
+      restart_waiting();
+      for(c = list_head(connectionlist); c != NULL; c = next) {
+        next = list_item_next(c);
+        if(c->state == CONNECTION_CLOSED ||
+           (c->state == CONNECTION_CLOSING && waiting_requests())) {
+          free_connection(c);
+        }
+      }
+      restart_waiting();
     } else if(ev == PROCESS_EVENT_TIMER) {
       struct http_socket *s;
+      struct http_socket_connection *c;
       struct etimer *timeout_timer = data;
       /*
        * A socket time-out has occurred. We need to go through the list of HTTP
        * sockets and figure out to which socket this timer event corresponds,
-       * then close this socket.
+       * then close its connection.
        */
       for(s = list_head(socketlist);
           s != NULL;
           s = list_item_next(s)) {
         if(timeout_timer == &s->timeout_timer && s->timeout_timer_started) {
-          tcp_socket_close(&s->s);
+          c = s->conn;
+          removesocket(s);
+          if(c != NULL) {
+            close_connection(c, HTTP_SOCKET_TIMEDOUT);
+          }
+          call_callback(s, HTTP_SOCKET_TIMEDOUT, NULL, 0);
+          break;
+        }
+      }
+      /* Idle connections are closed, closing ones are freed */
+      for(c = list_head(connectionlist);
+          c != NULL;
+          c = list_item_next(c)) {
+        if(timeout_timer == &c->timer) {
+          if(c->state == CONNECTION_CLOSING) {
+            free_connection(c);
+            restart_waiting();
+          } else if(first_request(c) == NULL) {
+            close_connection(c, HTTP_SOCKET_CLOSED);
+          }
           break;
         }
       }
@@ -596,6 +1226,8 @@ init(void)
   if(inited == 0) {
     process_start(&http_socket_process, NULL);
     list_init(socketlist);
+    list_init(connectionlist);
+    memb_init(&connections);
     inited = 1;
   }
 }
@@ -606,21 +1238,25 @@ http_socket_init(struct http_socket *s)
   init();
   uip_create_unspecified(&s->proxy_addr);
   s->proxy_port = 0;
+  s->conn = NULL;
 }
 /*---------------------------------------------------------------------------*/
 static void
 initialize_socket(struct http_socket *s)
 {
+  /* A request still running on this socket is replaced by the new one */
+  http_socket_close(s);
+
   s->pos = 0;
   s->length = 0;
   s->postdata = NULL;
   s->postdatalen = 0;
+  s->postdatasent = 0;
   s->timeout_timer_started = 0;
-  PT_INIT(&s->pt);
-  tcp_socket_register(&s->s, s,
-                      s->inputbuf, sizeof(s->inputbuf),
-                      s->outputbuf, sizeof(s->outputbuf),
-                      input, event);
+  s->conn = NULL;
+  s->sent = 0;
+  s->retried = 0;
+  s->header_received = 0;
 }
 /*---------------------------------------------------------------------------*/
 int
@@ -674,12 +1310,26 @@ int
 http_socket_close(struct http_socket *socket)
 {
   struct http_socket *s;
+  struct http_socket_connection *c;
+  uint8_t sent;
+
   for(s = list_head(socketlist);
       s != NULL;
       s = list_item_next(s)) {
     if(s == socket) {
-      tcp_socket_close(&s->s);
+      c = s->conn;
+      sent = s->sent;
       removesocket(s);
+      if(c != NULL) {
+        if(sent) {
+          /* The response is on its way and cannot be told apart from
+             the ones after it, so the connection has to go */
+          close_connection(c, HTTP_SOCKET_ABORTED);
+        } else if(first_request(c) == NULL &&
+                  c->state == CONNECTION_OPEN) {
+          connection_idle(c);
+        }
+      }
       return 1;
     }
   }
@@ -40,7 +40,8 @@ typedef enum {
   HTTP_SOCKET_OK,
   HTTP_SOCKET_HEADER,
   HTTP_SOCKET_DATA,
-  HTTP_SOCKET_CLOSED,
+  HTTP_SOCKET_CLOSED,  /* The response is complete, the connection may
+                          stay open for the next request */
   HTTP_SOCKET_TIMEDOUT,
   HTTP_SOCKET_ABORTED,
   HTTP_SOCKET_HOSTNAME_NOT_FOUND,
@@ -71,29 +72,71 @@ typedef void (* http_socket_callback_t)(struct http_socket *s,
 
 #define HTTP_SOCKET_TIMEOUT       ((2 * 60 + 30) * CLOCK_SECOND)
 
+/* The number of TCP connections that requests share. A request to a
+   server that already has an open connection goes out on that
+   connection, behind the requests already sent on it. */
+#ifdef HTTP_SOCKET_CONF_CONNECTIONS
+#define HTTP_SOCKET_CONNECTIONS HTTP_SOCKET_CONF_CONNECTIONS
+#else
+#define HTTP_SOCKET_CONNECTIONS 2
+#endif
+
+/* The number of requests that may be waiting for a response on one
+   connection. Set to 1 to turn off pipelining. POST requests are never
+   pipelined. */
+#ifdef HTTP_SOCKET_CONF_PIPELINE
+#define HTTP_SOCKET_PIPELINE HTTP_SOCKET_CONF_PIPELINE
+#else
+#define HTTP_SOCKET_PIPELINE 4
+#endif
+
+/* How long an idle connection is kept open for the next request */
+#ifdef HTTP_SOCKET_CONF_KEEPALIVE_TIMEOUT
+#define HTTP_SOCKET_KEEPALIVE_TIMEOUT HTTP_SOCKET_CONF_KEEPALIVE_TIMEOUT
+#else
+#define HTTP_SOCKET_KEEPALIVE_TIMEOUT (30 * CLOCK_SECOND)
+#endif
+
+struct http_socket_connection {
+  struct http_socket_connection *next;
+  struct tcp_socket s;
+  uip_ipaddr_t addr;
+  uint16_t port;
+  uint8_t state;
+  struct http_socket *sending;
+  struct etimer timer;
+  uint8_t inputbuf[HTTP_SOCKET_INPUTBUFSIZE];
+  uint8_t outputbuf[HTTP_SOCKET_OUTPUTBUFSIZE];
+};
+
 struct http_socket {
   struct http_socket *next;
-  struct tcp_socket s;
+  struct http_socket_connection *conn;
   uip_ipaddr_t proxy_addr;
   uint16_t proxy_port;
   int64_t pos;
   uint64_t length;
   const uint8_t *postdata;
   uint16_t postdatalen;
+  uint16_t postdatasent;
   http_socket_callback_t callback;
   void *callbackptr;
   int did_tcp_connect;
+  uint8_t sent;
+  uint8_t retried;
   char url[HTTP_SOCKET_URLLEN];
-  uint8_t inputbuf[HTTP_SOCKET_INPUTBUFSIZE];
-  uint8_t outputbuf[HTTP_SOCKET_OUTPUTBUFSIZE];
 
   struct etimer timeout_timer;
   uint8_t timeout_timer_started;
-  struct pt pt, headerpt;
+  struct pt headerpt;
   int header_chars;
-  char header_field[15];
+  char header_field[20];
   struct http_socket_header header;
   uint8_t header_received;
+  uint8_t keep_alive;
+  uint8_t body;
+  uint8_t chunk_state;
+  uint32_t chunk_left;
   uint64_t bodylen;
   const char *content_type;
 };
@@ -32,7 +32,6 @@
 #include "ip64-addrmap.h"
 
 #include "lib/memb.h"
-#include "lib/list.h"
 
 #include "ip64-conf.h"
 
@@ -46,82 +45,169 @@
 #define NUM_ENTRIES 32
 #endif /* IP64_ADDRMAP_CONF_ENTRIES */
 
+#ifdef IP64_ADDRMAP_CONF_HASH_BUCKETS
+#define NUM_BUCKETS IP64_ADDRMAP_CONF_HASH_BUCKETS
+#else /* IP64_ADDRMAP_CONF_HASH_BUCKETS */
+#define NUM_BUCKETS 16
+#endif /* IP64_ADDRMAP_CONF_HASH_BUCKETS */
+
 MEMB(entrymemb, struct ip64_addrmap_entry, NUM_ENTRIES);
-LIST(entrylist);
+
+/* All mappings, ordered by the time their timer expires. */
+static struct ip64_addrmap_entry *aging_head, *aging_tail;
+
+/* Mappings hashed on their IPv6 side and on their mapped port. */
+static struct ip64_addrmap_entry *hash6[NUM_BUCKETS];
+static struct ip64_addrmap_entry *hash4[NUM_BUCKETS];
 
 #define FIRST_MAPPED_PORT 10000
 #define LAST_MAPPED_PORT  20000
-static uint16_t mapped_port = FIRST_MAPPED_PORT;
+#define NUM_MAPPED_PORTS  (LAST_MAPPED_PORT - FIRST_MAPPED_PORT)
+
+/* One bit for each mapped port that is in use. */
+static uint8_t used_ports[(NUM_MAPPED_PORTS + 7) / 8];
 
-#define printf(...)
+#define PORT_IS_USED(p) (used_ports[((p) - FIRST_MAPPED_PORT) >> 3] & \
+                         (1 << (((p) - FIRST_MAPPED_PORT) & 7)))
+#define PORT_SET_USED(p) (used_ports[((p) - FIRST_MAPPED_PORT) >> 3] |= \
+                          (1 << (((p) - FIRST_MAPPED_PORT) & 7)))
+#define PORT_SET_FREE(p) (used_ports[((p) - FIRST_MAPPED_PORT) >> 3] &= \
+                          ~(1 << (((p) - FIRST_MAPPED_PORT) & 7)))
 
 /*---------------------------------------------------------------------------*/
 struct ip64_addrmap_entry *
 ip64_addrmap_list(void)
 {
-  return list_head(entrylist);
+  return aging_head;
 }
 /*---------------------------------------------------------------------------*/
 void
 ip64_addrmap_init(void)
 {
   memb_init(&entrymemb);
-  list_init(entrylist);
-  mapped_port = FIRST_MAPPED_PORT;
+  aging_head = aging_tail = NULL;
+  memset(hash6, 0, sizeof(hash6));
+  memset(hash4, 0, sizeof(hash4));
+  memset(used_ports, 0, sizeof(used_ports));
+}
+/*---------------------------------------------------------------------------*/
+static unsigned
+hash6_index(const uip_ip6addr_t *ip6addr,
+            uint16_t ip6port,
+            const uip_ip4addr_t *ip4addr,
+            uint16_t ip4port,
+            uint8_t protocol)
+{
+  return (uint16_t)(ip6addr->u16[6] ^ ip6addr->u16[7] ^
+                    ip4addr->u16[0] ^ ip4addr->u16[1] ^
+                    ip6port ^ ip4port ^ protocol) % NUM_BUCKETS;
+}
+/*---------------------------------------------------------------------------*/
+static unsigned
+hash4_index(uint16_t mapped_port)
+{
+  return mapped_port % NUM_BUCKETS;
+}
+/*---------------------------------------------------------------------------*/
+/* Check if timer a expires before timer b. */
+static int
+expires_before(const struct timer *a, const struct timer *b)
+{
+  return (clock_time_t)((a->start + a->interval) - (b->start + b->interval)) >
+    ((clock_time_t)~0 >> 1);
 }
 /*---------------------------------------------------------------------------*/
 static void
-check_age(void)
+aging_remove(struct ip64_addrmap_entry *m)
 {
-  struct ip64_addrmap_entry *m;
+  if(m->prev != NULL) {
+    m->prev->next = m->next;
+  } else {
+    aging_head = m->next;
+  }
+  if(m->next != NULL) {
+    m->next->prev = m->prev;
+  } else {
+    aging_tail = m->prev;
+  }
+}
+/*---------------------------------------------------------------------------*/
+static void
+aging_insert(struct ip64_addrmap_entry *m)
+{
+  struct ip64_addrmap_entry *n;
 
-  /* Walk through the list of address mappings, throw away the ones
-     that are too old. */
-  m = list_head(entrylist);
-  while(m != NULL) {
-    if(timer_expired(&m->timer)) {
-      list_remove(entrylist, m);
-      memb_free(&entrymemb, m);
-      m = list_head(entrylist);
-    } else {
-      m = list_item_next(m);
+  /* Mappings are mostly refreshed with the longest lifetime, so we
+     search for the place of the mapping from the end of the list. */
+  for(n = aging_tail; n != NULL && expires_before(&m->timer, &n->timer);
+      n = n->prev);
+
+  m->prev = n;
+  if(n != NULL) {
+    m->next = n->next;
+    n->next = m;
+  } else {
+    m->next = aging_head;
+    aging_head = m;
+  }
+  if(m->next != NULL) {
+    m->next->prev = m;
+  } else {
+    aging_tail = m;
+  }
+}
+/*---------------------------------------------------------------------------*/
+static void
+remove_entry(struct ip64_addrmap_entry *m)
+{
+  struct ip64_addrmap_entry **prev;
+
+  aging_remove(m);
+
+  for(prev = &hash6[hash6_index(&m->ip6addr, m->ip6port,
+                                &m->ip4addr, m->ip4port, m->protocol)];
+      *prev != NULL; prev = &(*prev)->hash6_next) {
+    if(*prev == m) {
+      *prev = m->hash6_next;
+      break;
     }
   }
+
+  for(prev = &hash4[hash4_index(m->mapped_port)];
+      *prev != NULL; prev = &(*prev)->hash4_next) {
+    if(*prev == m) {
+      *prev = m->hash4_next;
+      break;
+    }
+  }
+
+  PORT_SET_FREE(m->mapped_port);
+  memb_free(&entrymemb, m);
+}
+/*---------------------------------------------------------------------------*/
+static void
+check_age(void)
+{
+  /* Throw away the address mappings that are too old. They are all
+     at the start of the list. */
+  while(aging_head != NULL && timer_expired(&aging_head->timer)) {
+    remove_entry(aging_head);
+  }
 }
 /*---------------------------------------------------------------------------*/
 static int
 recycle(void)
 {
   /* Find the oldest recyclable mapping and remove it. */
-  struct ip64_addrmap_entry *m, *oldest;
-
-  /* Walk through the list of address mappings, throw away the ones
-     that are too old. */
+  struct ip64_addrmap_entry *m;
 
-  oldest = NULL;
-  for(m = list_head(entrylist);
-      m != NULL;
-      m = list_item_next(m)) {
+  for(m = aging_head; m != NULL; m = m->next) {
     if(m->flags & FLAGS_RECYCLABLE) {
-      if(oldest == NULL) {
-        oldest = m;
-      } else {
-        if(timer_remaining(&m->timer) <
-           timer_remaining(&oldest->timer)) {
-          oldest = m;
-        }
-      }
+      remove_entry(m);
+      return 1;
     }
   }
 
-  /* If we found an oldest recyclable entry, remove it and return
-     non-zero. */
-  if(oldest != NULL) {
-    list_remove(entrylist, oldest);
-    memb_free(&entrymemb, oldest);
-    return 1;
-  }
-
   return 0;
 }
 /*---------------------------------------------------------------------------*/
@@ -134,16 +220,9 @@ ip64_addrmap_lookup(const uip_ip6addr_t *ip6addr,
 {
   struct ip64_addrmap_entry *m;
 
-  printf("lookup ip4port %d ip6port %d\n", uip_htons(ip4port),
-	 uip_htons(ip6port));
   check_age();
-  for(m = list_head(entrylist); m != NULL; m = list_item_next(m)) {
-    printf("protocol %d %d, ip4port %d %d, ip6port %d %d, ip4 %d ip6 %d\n",
-	   m->protocol, protocol,
-	   m->ip4port, ip4port,
-	   m->ip6port, ip6port,
-	   uip_ip4addr_cmp(&m->ip4addr, ip4addr),
-	   uip_ip6addr_cmp(&m->ip6addr, ip6addr));
+  for(m = hash6[hash6_index(ip6addr, ip6port, ip4addr, ip4port, protocol)];
+      m != NULL; m = m->hash6_next) {
     if(m->protocol == protocol &&
        m->ip4port == ip4port &&
        m->ip6port == ip6port &&
@@ -162,10 +241,7 @@ ip64_addrmap_lookup_port(uint16_t mapped_port, uint8_t protocol)
   struct ip64_addrmap_entry *m;
 
   check_age();
-  for(m = list_head(entrylist); m != NULL; m = list_item_next(m)) {
-    printf("mapped port %d %d, protocol %d %d\n",
-	   m->mapped_port, mapped_port,
-	   m->protocol, protocol);
+  for(m = hash4[hash4_index(mapped_port)]; m != NULL; m = m->hash4_next) {
     if(m->mapped_port == mapped_port &&
        m->protocol == protocol) {
       m->ip4to6++;
@@ -175,11 +251,25 @@ ip64_addrmap_lookup_port(uint16_t mapped_port, uint8_t protocol)
   return NULL;
 }
 /*---------------------------------------------------------------------------*/
-static void
-increase_mapped_port(void)
+static uint16_t
+allocate_mapped_port(void)
 {
-  mapped_port = (random_rand() % (LAST_MAPPED_PORT - FIRST_MAPPED_PORT)) +
-    FIRST_MAPPED_PORT;
+  uint16_t port;
+  uint16_t i;
+
+  /* Start at a random port and take the first one that is not used by
+     any active mapping. */
+  port = (random_rand() % NUM_MAPPED_PORTS) + FIRST_MAPPED_PORT;
+  for(i = 0; i < NUM_MAPPED_PORTS; i++) {
+    if(!PORT_IS_USED(port)) {
+      PORT_SET_USED(port);
+      return port;
+    }
+    if(++port == LAST_MAPPED_PORT) {
+      port = FIRST_MAPPED_PORT;
+    }
+  }
+  return 0;
 }
 /*---------------------------------------------------------------------------*/
 struct ip64_addrmap_entry *
@@ -190,6 +280,7 @@ ip64_addrmap_create(const uip_ip6addr_t *ip6addr,
 		    uint8_t protocol)
 {
   struct ip64_addrmap_entry *m;
+  unsigned h;
 
   check_age();
   m = memb_alloc(&entrymemb);
@@ -201,6 +292,13 @@ ip64_addrmap_create(const uip_ip6addr_t *ip6addr,
     }
   }
   if(m != NULL) {
+    /* Pick a new, unused local port. */
+    m->mapped_port = allocate_mapped_port();
+    if(m->mapped_port == 0) {
+      memb_free(&entrymemb, m);
+      return NULL;
+    }
+
     uip_ip4addr_copy(&m->ip4addr, ip4addr);
     m->ip4port = ip4port;
     uip_ip6addr_copy(&m->ip6addr, ip6addr);
@@ -211,25 +309,15 @@ ip64_addrmap_create(const uip_ip6addr_t *ip6addr,
     m->ip4to6 = 0;
     timer_set(&m->timer, 0);
 
-    /* Pick a new, unused local port. First make sure that the
-       mapped_port number does not belong to any active connection. If
-       so, we keep increasing the mapped_port until we're free. */
-    {
-      struct ip64_addrmap_entry *n;
-      n = list_head(entrylist);
-      while(n != NULL) {
-	if(n->mapped_port == mapped_port) {
-	  increase_mapped_port();
-	  n = list_head(entrylist);
-	} else {
-	  n = list_item_next(m);
-	}
-      }
-    }
-    m->mapped_port = mapped_port;
-    increase_mapped_port();
+    aging_insert(m);
+
+    h = hash6_index(ip6addr, ip6port, ip4addr, ip4port, protocol);
+    m->hash6_next = hash6[h];
+    hash6[h] = m;
 
-    list_add(entrylist, m);
+    h = hash4_index(m->mapped_port);
+    m->hash4_next = hash4[h];
+    hash4[h] = m;
     return m;
   }
   return NULL;
@@ -240,7 +328,9 @@ ip64_addrmap_set_lifetime(struct ip64_addrmap_entry *e,
                           clock_time_t time)
 {
   if(e != NULL) {
+    aging_remove(e);
     timer_set(&e->timer, time);
+    aging_insert(e);
   }
 }
 /*---------------------------------------------------------------------------*/
@@ -38,6 +38,9 @@
 
 struct ip64_addrmap_entry {
   struct ip64_addrmap_entry *next;
+  struct ip64_addrmap_entry *prev;
+  struct ip64_addrmap_entry *hash6_next;
+  struct ip64_addrmap_entry *hash4_next;
   struct timer timer;
   uip_ip6addr_t ip6addr;
   uip_ip4addr_t ip4addr;
@@ -97,7 +100,8 @@ void ip64_addrmap_set_lifetime(struct ip64_addrmap_entry *e,
 void ip64_addrmap_set_recycleble(struct ip64_addrmap_entry *e);
 
 /**
- * Obtain the list of all address mappings.
+ * Obtain the list of all address mappings, ordered by the time they
+ * expire.
  */
 struct ip64_addrmap_entry *ip64_addrmap_list(void);
 #endif /* IP64_ADDRMAP_H */
@@ -32,8 +32,34 @@
 #include "ip64.h"
 #include "ip64-addr.h"
 #include "ip64-dns64.h"
+#include "net/ip/tcpip.h"
+#include "net/ipv6/uip-ds6.h"
+#include "sys/ctimer.h"
+#include "sys/stimer.h"
 
 #include <stdio.h>
+#include <string.h>
+
+/* Number of cached answers, 0 disables the cache. */
+#ifdef IP64_DNS64_CONF_CACHE_ENTRIES
+#define CACHE_ENTRIES IP64_DNS64_CONF_CACHE_ENTRIES
+#else /* IP64_DNS64_CONF_CACHE_ENTRIES */
+#define CACHE_ENTRIES 4
+#endif /* IP64_DNS64_CONF_CACHE_ENTRIES */
+
+/* Longest name, in DNS wire format, that we cache. */
+#ifdef IP64_DNS64_CONF_CACHE_NAME_LEN
+#define CACHE_NAME_LEN IP64_DNS64_CONF_CACHE_NAME_LEN
+#else /* IP64_DNS64_CONF_CACHE_NAME_LEN */
+#define CACHE_NAME_LEN 48
+#endif /* IP64_DNS64_CONF_CACHE_NAME_LEN */
+
+/* Upper bound, in seconds, on the TTL of a cached answer. */
+#ifdef IP64_DNS64_CONF_CACHE_MAX_TTL
+#define CACHE_MAX_TTL IP64_DNS64_CONF_CACHE_MAX_TTL
+#else /* IP64_DNS64_CONF_CACHE_MAX_TTL */
+#define CACHE_MAX_TTL 3600
+#endif /* IP64_DNS64_CONF_CACHE_MAX_TTL */
 
 #define DEBUG 0
 
@@ -89,6 +115,237 @@ struct dns_answer {
 #define DNS_CLASS_IN    1
 #define DNS_CLASS_ANY 255
 
+#define DNS_PORT       53
+
+#if CACHE_ENTRIES > 0
+struct cache_entry {
+  struct stimer ttl;
+  uip_ip4addr_t addr;
+  uint8_t namelen;
+  uint8_t name[CACHE_NAME_LEN];
+};
+
+static struct cache_entry cache[CACHE_ENTRIES];
+
+struct ip64_dns64_cache_stats ip64_dns64_cache_stats;
+
+/* A locally generated answer: IPv6 and UDP headers, the DNS header,
+   the question, and one AAAA record. */
+#define ANSWER_RR_SIZE (2 + 2 + 2 + 4 + 2 + 16)
+static uint8_t answer[UIP_IPUDPH_LEN + sizeof(struct dns_hdr) +
+                      CACHE_NAME_LEN + DNS_QUESTION_SIZE + ANSWER_RR_SIZE];
+static uint16_t answer_len;
+static struct ctimer answer_timer;
+#endif /* CACHE_ENTRIES > 0 */
+
+#if CACHE_ENTRIES > 0
+/*---------------------------------------------------------------------------*/
+/* Compare two names in DNS wire format, ignoring the case of ASCII
+   letters. Length octets never fall in the range of letters. */
+static int
+name_equal(const uint8_t *a, const uint8_t *b, int len)
+{
+  uint8_t ca, cb;
+
+  while(len-- > 0) {
+    ca = *a++;
+    cb = *b++;
+    if(ca >= 'A' && ca <= 'Z') {
+      ca += 'a' - 'A';
+    }
+    if(cb >= 'A' && cb <= 'Z') {
+      cb += 'a' - 'A';
+    }
+    if(ca != cb) {
+      return 0;
+    }
+  }
+  return 1;
+}
+/*---------------------------------------------------------------------------*/
+static struct cache_entry *
+cache_lookup(const uint8_t *name, int namelen)
+{
+  struct cache_entry *c;
+
+  for(c = cache; c < &cache[CACHE_ENTRIES]; c++) {
+    if(c->namelen == namelen && !stimer_expired(&c->ttl) &&
+       name_equal(c->name, name, namelen)) {
+      return c;
+    }
+  }
+  return NULL;
+}
+/*---------------------------------------------------------------------------*/
+static void
+cache_add(const uint8_t *name, int namelen, const uint8_t *addr,
+          uint32_t ttl)
+{
+  struct cache_entry *c, *victim;
+
+  if(namelen > CACHE_NAME_LEN || ttl == 0) {
+    return;
+  }
+  if(ttl > CACHE_MAX_TTL) {
+    ttl = CACHE_MAX_TTL;
+  }
+
+  /* Reuse the entry for the same name, or else the one that expires
+     first. */
+  victim = cache;
+  for(c = cache; c < &cache[CACHE_ENTRIES]; c++) {
+    if(c->namelen == namelen && name_equal(c->name, name, namelen)) {
+      victim = c;
+      break;
+    }
+    if(stimer_expired(&c->ttl) ||
+       (!stimer_expired(&victim->ttl) &&
+        stimer_remaining(&c->ttl) < stimer_remaining(&victim->ttl))) {
+      victim = c;
+    }
+  }
+
+  victim->namelen = namelen;
+  memcpy(victim->name, name, namelen);
+  uip_ipaddr(&victim->addr, addr[0], addr[1], addr[2], addr[3]);
+  stimer_set(&victim->ttl, ttl);
+  PRINTF("ip64_dns64: cached %d.%d.%d.%d for %lu seconds\n",
+         addr[0], addr[1], addr[2], addr[3], (unsigned long)ttl);
+}
+/*---------------------------------------------------------------------------*/
+static void
+send_answer(void *ptr)
+{
+  memcpy(&uip_buf[UIP_LLH_LEN], answer, answer_len);
+  uip_len = answer_len;
+  answer_len = 0;
+  tcpip_ipv6_output();
+}
+/*---------------------------------------------------------------------------*/
+static uint16_t
+chksum_add(uint16_t sum, uint16_t val)
+{
+  sum += val;
+  return sum < val ? sum + 1 : sum;
+}
+#endif /* CACHE_ENTRIES > 0 */
+/*---------------------------------------------------------------------------*/
+int
+ip64_dns64_cache_answer(const uip_ip6addr_t *srcaddr,
+                        const uip_ip6addr_t *destaddr,
+                        uint16_t srcport,
+                        const uint8_t *query, int querylen)
+{
+#if CACHE_ENTRIES > 0
+  const struct dns_hdr *hdr;
+  const uint8_t *qname, *q;
+  struct cache_entry *c;
+  struct uip_udpip_hdr *ip;
+  struct dns_hdr *ahdr;
+  uint8_t *rr;
+  int namelen, len;
+  unsigned long ttl;
+  uint16_t sum;
+
+  hdr = (const struct dns_hdr *)query;
+  if(querylen < sizeof(struct dns_hdr) ||
+     (hdr->flags1 & (DNS_FLAG1_RESPONSE | 0x78)) != 0 ||
+     hdr->numquestions[0] != 0 || hdr->numquestions[1] != 1) {
+    /* Not a standard query for a single name. */
+    return 0;
+  }
+
+  /* Find the end of the question name. */
+  qname = query + sizeof(struct dns_hdr);
+  for(q = qname; q < query + querylen && *q != 0; q += *q + 1) {
+    if(*q & 0xc0) {
+      return 0;
+    }
+  }
+  if(q + 1 + DNS_QUESTION_SIZE > query + querylen) {
+    return 0;
+  }
+  namelen = q + 1 - qname;
+  q++;
+  if(q[DNS_QUESTION_TYPE0] != 0 || q[DNS_QUESTION_TYPE1] != DNS_TYPE_AAAA ||
+     q[DNS_QUESTION_CLASS0] != 0 || q[DNS_QUESTION_CLASS1] != DNS_CLASS_IN) {
+    return 0;
+  }
+
+  c = cache_lookup(qname, namelen);
+  if(c == NULL || answer_len != 0) {
+    /* Also let the query through if the previous answer is not yet
+       sent. */
+    ip64_dns64_cache_stats.misses++;
+    return 0;
+  }
+  ip64_dns64_cache_stats.hits++;
+
+  /* Build the answer: the query with its header turned into a response
+     header, followed by a single AAAA record that points back to the
+     question name. Any additional records of the query are left out. */
+  ahdr = (struct dns_hdr *)&answer[UIP_IPUDPH_LEN];
+  len = sizeof(struct dns_hdr) + namelen + DNS_QUESTION_SIZE;
+  memcpy(ahdr, query, len);
+  ahdr->flags1 = DNS_FLAG1_RESPONSE | (hdr->flags1 & DNS_FLAG1_RD);
+  ahdr->flags2 = DNS_FLAG2_RA | DNS_FLAG2_ERR_NONE;
+  ahdr->numanswers[0] = 0;
+  ahdr->numanswers[1] = 1;
+  ahdr->numauthrr[0] = ahdr->numauthrr[1] = 0;
+  ahdr->numextrarr[0] = ahdr->numextrarr[1] = 0;
+
+  ttl = stimer_remaining(&c->ttl);
+  rr = (uint8_t *)ahdr + len;
+  rr[0] = 0xc0;
+  rr[1] = sizeof(struct dns_hdr);
+  rr[2] = 0;
+  rr[3] = DNS_TYPE_AAAA;
+  rr[4] = 0;
+  rr[5] = DNS_CLASS_IN;
+  rr[6] = ttl >> 24;
+  rr[7] = ttl >> 16;
+  rr[8] = ttl >> 8;
+  rr[9] = ttl;
+  rr[10] = 0;
+  rr[11] = 16;
+  ip64_addr_4to6(&c->addr, (uip_ip6addr_t *)&rr[12]);
+  len += ANSWER_RR_SIZE + UIP_UDPH_LEN;
+
+  /* The answer comes from the DNS server the query was sent to. */
+  ip = (struct uip_udpip_hdr *)answer;
+  ip->vtc = 0x60;
+  ip->tcf = 0;
+  ip->flow = 0;
+  ip->len[0] = len >> 8;
+  ip->len[1] = len & 0xff;
+  ip->proto = UIP_PROTO_UDP;
+  ip->ttl = uip_ds6_if.cur_hop_limit;
+  uip_ipaddr_copy(&ip->srcipaddr, destaddr);
+  uip_ipaddr_copy(&ip->destipaddr, srcaddr);
+  ip->srcport = UIP_HTONS(DNS_PORT);
+  ip->destport = srcport;
+  ip->udplen = UIP_HTONS(len);
+  ip->udpchksum = 0;
+
+  sum = uip_ntohs(uip_chksum((uint16_t *)&ip->srcipaddr,
+                             2 * sizeof(uip_ip6addr_t)));
+  sum = chksum_add(sum, len);
+  sum = chksum_add(sum, UIP_PROTO_UDP);
+  sum = chksum_add(sum, uip_ntohs(uip_chksum((uint16_t *)&ip->srcport, len)));
+  ip->udpchksum = ~uip_htons(sum);
+  if(ip->udpchksum == 0) {
+    ip->udpchksum = 0xffff;
+  }
+
+  /* We are called from the output path of the IPv6 stack, so the
+     answer is sent from a callback. */
+  answer_len = UIP_IPH_LEN + len;
+  ctimer_set(&answer_timer, 0, send_answer, NULL);
+  return 1;
+#else /* CACHE_ENTRIES > 0 */
+  return 0;
+#endif /* CACHE_ENTRIES > 0 */
+}
 /*---------------------------------------------------------------------------*/
 void
 ip64_dns64_6to4(const uint8_t *ipv6data, int ipv6datalen,
@@ -142,6 +399,11 @@ ip64_dns64_4to6(const uint8_t *ipv4data, int ipv4datalen,
   int i, j;
   int qlen, len;
   const uint8_t *qdata, *adata;
+#if CACHE_ENTRIES > 0
+  const uint8_t *qname = NULL;
+  int qnamelen = 0;
+  int cached = 0;
+#endif /* CACHE_ENTRIES > 0 */
   uint8_t *qcopy, *acopy, *lenptr;
   uint8_t *q;
   struct dns_hdr *hdr;
@@ -173,6 +435,12 @@ ip64_dns64_4to6(const uint8_t *ipv4data, int ipv4datalen,
         }
       }
     } while(qlen != 0);
+#if CACHE_ENTRIES > 0
+    if(i == 0) {
+      qname = ipv4data + sizeof(struct dns_hdr);
+      qnamelen = qdata - qname;
+    }
+#endif /* CACHE_ENTRIES > 0 */
     q = qcopy;
     if(q[DNS_QUESTION_CLASS0] == 0 && q[DNS_QUESTION_CLASS1] == DNS_CLASS_IN &&
        q[DNS_QUESTION_TYPE0] == 0 && q[DNS_QUESTION_TYPE1] == DNS_TYPE_AAAA) {
@@ -226,6 +494,18 @@ ip64_dns64_4to6(const uint8_t *ipv4data, int ipv4datalen,
 
       if(len == 4) {
         uip_ip4addr_t addr;
+#if CACHE_ENTRIES > 0
+        /* Cache the first address of a successful answer to a single
+           question. */
+        if(!cached && qname != NULL &&
+           hdr->numquestions[0] == 0 && hdr->numquestions[1] == 1 &&
+           (hdr->flags2 & DNS_FLAG2_ERR_MASK) == DNS_FLAG2_ERR_NONE) {
+          cache_add(qname, qnamelen, adata,
+                    ((uint32_t)adata[-6] << 24) | ((uint32_t)adata[-5] << 16) |
+                    (adata[-4] << 8) | adata[-3]);
+          cached = 1;
+        }
+#endif /* CACHE_ENTRIES > 0 */
         uip_ipaddr(&addr, adata[0], adata[1], adata[2], adata[3]);
         ip64_addr_4to6(&addr, (uip_ip6addr_t *)acopy);
 
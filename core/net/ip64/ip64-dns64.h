@@ -37,4 +37,22 @@ void ip64_dns64_6to4(const uint8_t *ipv6data, int ipv6datalen,
 int ip64_dns64_4to6(const uint8_t *ipv4data, int ipv4datalen,
                     uint8_t *ipv6data, int ipv6datalen);
 
+/*
+ * Answer an AAAA query from the IPv6 network with a cached answer.
+ * Answers to A queries, translated by ip64_dns64_4to6(), are cached
+ * for their TTL. Returns 1 if the query was answered and should not
+ * be forwarded.
+ */
+int ip64_dns64_cache_answer(const uip_ip6addr_t *srcaddr,
+                            const uip_ip6addr_t *destaddr,
+                            uint16_t srcport,
+                            const uint8_t *query, int querylen);
+
+struct ip64_dns64_cache_stats {
+  uint32_t hits;
+  uint32_t misses;
+};
+
+extern struct ip64_dns64_cache_stats ip64_dns64_cache_stats;
+
 #endif /* IP64_DNS64_H_ */
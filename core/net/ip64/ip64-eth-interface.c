@@ -88,6 +88,7 @@ static int
 output(void)
 {
   int len, ret;
+  uint8_t *ipv4packet;
 
   printf("ip64-interface: output source ");
   PRINT6ADDR(&UIP_IP_BUF->srcipaddr);
@@ -96,23 +97,25 @@ output(void)
   PRINTF("\n");
 
   printf("<--------------\n");
-  len = ip64_6to4(&uip_buf[UIP_LLH_LEN], uip_len,
-		  &ip64_packet_buffer[sizeof(struct ip64_eth_hdr)]);
+  /* Translate the packet in place in uip_buf. The IPv4 header ends
+     where the IPv6 header did, which leaves room for the Ethernet
+     header in front of it. */
+  ipv4packet = &uip_buf[UIP_LLH_LEN + IP64_6TO4_INPLACE_OFFSET];
+  len = ip64_6to4(&uip_buf[UIP_LLH_LEN], uip_len, ipv4packet);
 
   printf("ip64-interface: output len %d\n", len);
   if(len > 0) {
-    if(ip64_arp_check_cache(&ip64_packet_buffer[sizeof(struct ip64_eth_hdr)])) {
+    if(ip64_arp_check_cache(ipv4packet)) {
       printf("Create header\n");
-      ret = ip64_arp_create_ethhdr(ip64_packet_buffer,
-				   &ip64_packet_buffer[sizeof(struct ip64_eth_hdr)]);
+      ret = ip64_arp_create_ethhdr(ipv4packet - sizeof(struct ip64_eth_hdr),
+				   ipv4packet);
       if(ret > 0) {
 	len += ret;
-	IP64_ETH_DRIVER.output(ip64_packet_buffer, len);
+	IP64_ETH_DRIVER.output(ipv4packet - sizeof(struct ip64_eth_hdr), len);
       }
     } else {
       printf("Create request\n");
-      len = ip64_arp_create_arp_request(ip64_packet_buffer,
-					&ip64_packet_buffer[sizeof(struct ip64_eth_hdr)]);
+      len = ip64_arp_create_arp_request(ip64_packet_buffer, ipv4packet);
       return IP64_ETH_DRIVER.output(ip64_packet_buffer, len);
     }
   }
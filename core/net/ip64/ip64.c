@@ -299,6 +299,37 @@ chksum(uint16_t sum, const uint8_t *data, uint16_t len)
   return sum;
 }
 /*---------------------------------------------------------------------------*/
+/* Remove the 16-bit words in data, which must be of even length, from
+   the one's complement sum (RFC 1624). */
+static uint16_t
+chksum_remove(uint16_t sum, const uint8_t *data, uint16_t len)
+{
+  uint16_t t;
+
+  for(; len >= 2; len -= 2, data += 2) {
+    t = ~((data[0] << 8) + data[1]);
+    sum += t;
+    if(sum < t) {
+      sum++;		/* carry */
+    }
+  }
+  return sum;
+}
+/*---------------------------------------------------------------------------*/
+/* Replace the 16-bit word old with new in the one's complement sum. */
+static uint16_t
+chksum_replace16(uint16_t sum, uint16_t old, uint16_t new)
+{
+  uint8_t w[2];
+
+  w[0] = old >> 8;
+  w[1] = old & 0xff;
+  sum = chksum_remove(sum, w, 2);
+  w[0] = new >> 8;
+  w[1] = new & 0xff;
+  return chksum(sum, w, 2);
+}
+/*---------------------------------------------------------------------------*/
 static uint16_t
 ipv4_checksum(struct ipv4_hdr *hdr)
 {
@@ -368,10 +399,17 @@ ip64_6to4(const uint8_t *ipv6packet, const uint16_t ipv6packet_len,
   struct tcp_hdr *tcphdr;
   struct icmpv4_hdr *icmpv4hdr;
   struct icmpv6_hdr *icmpv6hdr;
+  struct ipv6_hdr v6hdr_copy;
   uint16_t ipv6len, ipv4len;
+  uint16_t sum, srcport;
+  uint8_t icmptype;
+  int full_chksum;
   struct ip64_addrmap_entry *m;
 
-  v6hdr = (struct ipv6_hdr *)ipv6packet;
+  /* The IPv4 packet may overlap the IPv6 packet, so we work on a copy
+     of the IPv6 header. */
+  memcpy(&v6hdr_copy, ipv6packet, IPV6_HDRLEN);
+  v6hdr = &v6hdr_copy;
   v4hdr = (struct ipv4_hdr *)resultpacket;
 
   if((v6hdr->len[0] << 8) + v6hdr->len[1] <= ipv6packet_len) {
@@ -381,16 +419,28 @@ ip64_6to4(const uint8_t *ipv6packet, const uint16_t ipv6packet_len,
     return 0;
   }
 
-  /* We copy the data from the IPv6 packet into the IPv4 packet. We do
-     not modify the data in any way. */
-  memcpy(&resultpacket[IPV4_HDRLEN],
-	 &ipv6packet[IPV6_HDRLEN],
-	 ipv6len - IPV6_HDRLEN);
+  /* We move the data from the IPv6 packet into the IPv4 packet. We do
+     not modify the data in any way. Nothing needs to be moved when the
+     packet is translated in place, at IP64_6TO4_INPLACE_OFFSET. */
+  if(&resultpacket[IPV4_HDRLEN] != &ipv6packet[IPV6_HDRLEN]) {
+    memmove(&resultpacket[IPV4_HDRLEN],
+            &ipv6packet[IPV6_HDRLEN],
+            ipv6len - IPV6_HDRLEN);
+  }
 
   udphdr = (struct udp_hdr *)&resultpacket[IPV4_HDRLEN];
   tcphdr = (struct tcp_hdr *)&resultpacket[IPV4_HDRLEN];
   icmpv4hdr = (struct icmpv4_hdr *)&resultpacket[IPV4_HDRLEN];
-  icmpv6hdr = (struct icmpv6_hdr *)&ipv6packet[IPV6_HDRLEN];
+  icmpv6hdr = (struct icmpv6_hdr *)&resultpacket[IPV4_HDRLEN];
+
+  /* The transport layer checksum is updated with the changes we make
+     to the pseudo header, the port numbers, and the ICMP type, rather
+     than recomputed over the whole packet. This also means that a bad
+     checksum stays bad. Only DNS requests, which we rewrite, get a full
+     checksum computation. */
+  full_chksum = 0;
+  icmptype = 0;
+  srcport = udphdr->srcport;
 
   /* Translate the IPv6 header into an IPv4 header. */
 
@@ -424,42 +474,40 @@ ip64_6to4(const uint8_t *ipv6packet, const uint16_t ipv6packet_len,
   case IP_PROTO_TCP:
     PRINTF("ip64_6to4: TCP header\n");
     v4hdr->proto = IP_PROTO_TCP;
-
-    /* Compute and check the TCP checksum - since we're going to
-       recompute it ourselves, we must ensure that it was correct in
-       the first place. */
-    if(ipv6_transport_checksum(ipv6packet, ipv6len,
-                               IP_PROTO_TCP) != 0xffff) {
-      PRINTF("Bad TCP checksum, dropping packet\n");
-    }
-
+    sum = ~uip_ntohs(tcphdr->tcpchksum);
     break;
 
   case IP_PROTO_UDP:
     PRINTF("ip64_6to4: UDP header\n");
     v4hdr->proto = IP_PROTO_UDP;
+    sum = ~uip_ntohs(udphdr->udpchksum);
 
-    /* Check if this is a DNS request. If so, we should rewrite it
-       with the DNS64 module. */
+    /* Check if this is a DNS request. If so, we answer it from the
+       DNS64 cache or rewrite it with the DNS64 module, which does so
+       in place. */
     if(udphdr->destport == UIP_HTONS(DNS_PORT)) {
-      ip64_dns64_6to4((uint8_t *)v6hdr + IPV6_HDRLEN + sizeof(struct udp_hdr),
+      if(ip64_dns64_cache_answer(&v6hdr->srcipaddr, &v6hdr->destipaddr,
+                                 udphdr->srcport,
+                                 (uint8_t *)udphdr + sizeof(struct udp_hdr),
+                                 ipv6len - IPV6_HDRLEN -
+                                 sizeof(struct udp_hdr))) {
+        PRINTF("ip64_6to4: DNS request answered from cache\n");
+        return 0;
+      }
+      ip64_dns64_6to4((uint8_t *)udphdr + sizeof(struct udp_hdr),
                       ipv6len - IPV6_HDRLEN - sizeof(struct udp_hdr),
                       (uint8_t *)udphdr + sizeof(struct udp_hdr),
                       BUFSIZE - IPV4_HDRLEN - sizeof(struct udp_hdr));
-    }
-    /* Compute and check the UDP checksum - since we're going to
-       recompute it ourselves, we must ensure that it was correct in
-       the first place. */
-    if(ipv6_transport_checksum(ipv6packet, ipv6len,
-                               IP_PROTO_UDP) != 0xffff) {
-      PRINTF("Bad UDP checksum, dropping packet\n");
+      full_chksum = 1;
     }
     break;
 
   case IP_PROTO_ICMPV6:
     PRINTF("ip64_6to4: ICMPv6 header\n");
     v4hdr->proto = IP_PROTO_ICMPV4;
+    sum = ~uip_ntohs(icmpv6hdr->icmpchksum);
     /* Translate only ECHO_REPLY messages. */
+    icmptype = icmpv6hdr->type;
     if(icmpv6hdr->type == ICMP6_ECHO_REPLY) {
       icmpv4hdr->type = ICMP_ECHO_REPLY;
     } else {
@@ -614,27 +662,43 @@ ip64_6to4(const uint8_t *ipv6packet, const uint16_t ipv6packet_len,
 
 
 
+  /* The TCP and UDP pseudo headers differ only in the addresses, since
+     the length and protocol fields add up to the same sum. The ICMPv4
+     checksum has no pseudo header at all. */
+  if(v4hdr->proto == IP_PROTO_ICMPV4) {
+    sum = chksum_remove(sum, (uint8_t *)&v6hdr->srcipaddr,
+                        2 * sizeof(uip_ip6addr_t));
+    sum = chksum_replace16(sum, ipv6len - IPV6_HDRLEN, 0);
+    sum = chksum_replace16(sum, IP_PROTO_ICMPV6, 0);
+    sum = chksum_replace16(sum, icmptype << 8, icmpv4hdr->type << 8);
+  } else {
+    sum = chksum_remove(sum, (uint8_t *)&v6hdr->srcipaddr,
+                        2 * sizeof(uip_ip6addr_t));
+    sum = chksum(sum, (uint8_t *)&v4hdr->srcipaddr, 2 * sizeof(uip_ip4addr_t));
+    sum = chksum_replace16(sum, uip_ntohs(srcport), uip_ntohs(udphdr->srcport));
+  }
+
   /* The checksum is in different places in the different protocol
      headers, so we need to be sure that we update the correct
      field. */
   switch(v4hdr->proto) {
   case IP_PROTO_TCP:
-    tcphdr->tcpchksum = 0;
-    tcphdr->tcpchksum = ~(ipv4_transport_checksum(resultpacket, ipv4len,
-						  IP_PROTO_TCP));
+    tcphdr->tcpchksum = ~uip_htons(sum);
     break;
   case IP_PROTO_UDP:
-    udphdr->udpchksum = 0;
-    udphdr->udpchksum = ~(ipv4_transport_checksum(resultpacket, ipv4len,
-						  IP_PROTO_UDP));
+    if(full_chksum) {
+      udphdr->udpchksum = 0;
+      udphdr->udpchksum = ~(ipv4_transport_checksum(resultpacket, ipv4len,
+                                                    IP_PROTO_UDP));
+    } else {
+      udphdr->udpchksum = ~uip_htons(sum);
+    }
     if(udphdr->udpchksum == 0) {
       udphdr->udpchksum = 0xffff;
     }
     break;
   case IP_PROTO_ICMPV4:
-    icmpv4hdr->icmpchksum = 0;
-    icmpv4hdr->icmpchksum = ~(ipv4_transport_checksum(resultpacket, ipv4len,
-						      IP_PROTO_ICMPV4));
+    icmpv4hdr->icmpchksum = ~uip_htons(sum);
     break;
 
   default:
@@ -657,11 +721,18 @@ ip64_4to6(const uint8_t *ipv4packet, const uint16_t ipv4packet_len,
   struct tcp_hdr *tcphdr;
   struct icmpv4_hdr *icmpv4hdr;
   struct icmpv6_hdr *icmpv6hdr;
+  struct ipv4_hdr v4hdr_copy;
   uint16_t ipv4len, ipv6len, ipv6_packet_len;
+  uint16_t sum, destport;
+  uint8_t icmptype;
+  int full_chksum;
   struct ip64_addrmap_entry *m;
 
+  /* The IPv6 packet may overlap the IPv4 packet, so we work on a copy
+     of the IPv4 header. */
+  memcpy(&v4hdr_copy, ipv4packet, IPV4_HDRLEN);
+  v4hdr = &v4hdr_copy;
   v6hdr = (struct ipv6_hdr *)resultpacket;
-  v4hdr = (struct ipv4_hdr *)ipv4packet;
 
   if((v4hdr->len[0] << 8) + v4hdr->len[1] <= ipv4packet_len) {
     ipv4len = (v4hdr->len[0] << 8) + v4hdr->len[1];
@@ -680,16 +751,27 @@ ip64_4to6(const uint8_t *ipv4packet, const uint16_t ipv4packet_len,
     PRINTF("ip64_4to6: packet too big to fit in buffer, dropping\n");
     return 0;
   }
-  /* We copy the data from the IPv4 packet into the IPv6 packet. */
-  memcpy(&resultpacket[IPV6_HDRLEN],
-	 &ipv4packet[IPV4_HDRLEN],
-	 ipv4len - IPV4_HDRLEN);
-  
+  /* We move the data from the IPv4 packet into the IPv6 packet. The
+     two may overlap when the packet is translated in place. */
+  if(&resultpacket[IPV6_HDRLEN] != &ipv4packet[IPV4_HDRLEN]) {
+    memmove(&resultpacket[IPV6_HDRLEN],
+            &ipv4packet[IPV4_HDRLEN],
+            ipv4len - IPV4_HDRLEN);
+  }
+
   udphdr = (struct udp_hdr *)&resultpacket[IPV6_HDRLEN];
   tcphdr = (struct tcp_hdr *)&resultpacket[IPV6_HDRLEN];
-  icmpv4hdr = (struct icmpv4_hdr *)&ipv4packet[IPV4_HDRLEN];
+  icmpv4hdr = (struct icmpv4_hdr *)&resultpacket[IPV6_HDRLEN];
   icmpv6hdr = (struct icmpv6_hdr *)&resultpacket[IPV6_HDRLEN];
 
+  /* As for ip64_6to4(), the transport layer checksum is updated
+     incrementally. DNS responses, which we rewrite, and UDP datagrams
+     without a checksum, which is mandatory in IPv6, get a full
+     checksum computation. */
+  full_chksum = 0;
+  icmptype = 0;
+  destport = udphdr->destport;
+
   ipv6len = ipv4len - IPV4_HDRLEN + IPV6_HDRLEN;
   ipv6_packet_len = ipv6len - IPV6_HDRLEN;
 
@@ -728,30 +810,50 @@ ip64_4to6(const uint8_t *ipv4packet, const uint16_t ipv4packet_len,
   switch(v4hdr->proto) {
   case IP_PROTO_UDP:
     v6hdr->nxthdr = IP_PROTO_UDP;
+    sum = ~uip_ntohs(udphdr->udpchksum);
+    if(udphdr->udpchksum == 0) {
+      full_chksum = 1;
+    }
     /* Check if this is a DNS request. If so, we should rewrite it
        with the DNS64 module. */
     if(udphdr->srcport == UIP_HTONS(DNS_PORT)) {
-      int len;
+      int len, dnslen;
+      uint8_t *dnsdata;
+
+      /* The DNS64 module grows the answers as it copies them, so we
+         first move the DNS data out of the way, to the end of the
+         buffer. */
+      dnslen = ipv4len - IPV4_HDRLEN - sizeof(struct udp_hdr);
+      if(IPV6_HDRLEN + sizeof(struct udp_hdr) + 2 * dnslen >
+         BUFSIZE - UIP_LLH_LEN) {
+        PRINTF("ip64_4to6: DNS response too big to rewrite, dropping\n");
+        return 0;
+      }
+      dnsdata = &resultpacket[BUFSIZE - UIP_LLH_LEN - dnslen];
+      memmove(dnsdata, (uint8_t *)udphdr + sizeof(struct udp_hdr), dnslen);
 
-      len = ip64_dns64_4to6((uint8_t *)v4hdr + IPV4_HDRLEN + sizeof(struct udp_hdr),
-                            ipv4len - IPV4_HDRLEN - sizeof(struct udp_hdr),
-                            (uint8_t *)v6hdr + IPV6_HDRLEN + sizeof(struct udp_hdr),
-                            ipv6_packet_len - sizeof(struct udp_hdr));
+      len = ip64_dns64_4to6(dnsdata, dnslen,
+                            (uint8_t *)udphdr + sizeof(struct udp_hdr),
+                            dnslen);
       ipv6_packet_len = len + sizeof(struct udp_hdr);
       v6hdr->len[0] = ipv6_packet_len >> 8;
       v6hdr->len[1] = ipv6_packet_len & 0xff;
       ipv6len = ipv6_packet_len + IPV6_HDRLEN;
-
+      udphdr->udplen = uip_htons(ipv6_packet_len);
+      full_chksum = 1;
     }
     break;
 
   case IP_PROTO_TCP:
     v6hdr->nxthdr = IP_PROTO_TCP;
+    sum = ~uip_ntohs(tcphdr->tcpchksum);
     break;
 
   case IP_PROTO_ICMPV4:
     /* Allow only ICMPv4 ECHO_REQUESTS (ping packets) through to the
        local IPv6 host. */
+    sum = ~uip_ntohs(icmpv4hdr->icmpchksum);
+    icmptype = icmpv4hdr->type;
     if(icmpv4hdr->type == ICMP_ECHO) {
       PRINTF("ip64_4to6: translating ICMPv4 ECHO packet\n");
       v6hdr->nxthdr = IP_PROTO_ICMPV6;
@@ -849,31 +951,44 @@ ip64_4to6(const uint8_t *ipv4packet, const uint16_t ipv4packet_len,
     }
   }
 
+  /* The ICMPv6 checksum, unlike the ICMPv4 one, covers a pseudo
+     header. */
+  if(v6hdr->nxthdr == IP_PROTO_ICMPV6) {
+    sum = chksum(sum, (uint8_t *)&v6hdr->srcipaddr, 2 * sizeof(uip_ip6addr_t));
+    sum = chksum_replace16(sum, 0, ipv6_packet_len);
+    sum = chksum_replace16(sum, 0, IP_PROTO_ICMPV6);
+    sum = chksum_replace16(sum, icmptype << 8, icmpv6hdr->type << 8);
+  } else {
+    sum = chksum_remove(sum, (uint8_t *)&v4hdr->srcipaddr,
+                        2 * sizeof(uip_ip4addr_t));
+    sum = chksum(sum, (uint8_t *)&v6hdr->srcipaddr, 2 * sizeof(uip_ip6addr_t));
+    sum = chksum_replace16(sum, uip_ntohs(destport),
+                           uip_ntohs(udphdr->destport));
+  }
+
   /* The checksum is in different places in the different protocol
      headers, so we need to be sure that we update the correct
      field. */
   switch(v6hdr->nxthdr) {
   case IP_PROTO_TCP:
-    tcphdr->tcpchksum = 0;
-    tcphdr->tcpchksum = ~(ipv6_transport_checksum(resultpacket,
-						  ipv6len,
-						  IP_PROTO_TCP));
+    tcphdr->tcpchksum = ~uip_htons(sum);
     break;
   case IP_PROTO_UDP:
-    udphdr->udpchksum = 0;
-    udphdr->udpchksum = ~(ipv6_transport_checksum(resultpacket,
-						  ipv6len,
-						  IP_PROTO_UDP));
+    if(full_chksum) {
+      udphdr->udpchksum = 0;
+      udphdr->udpchksum = ~(ipv6_transport_checksum(resultpacket,
+                                                    ipv6len,
+                                                    IP_PROTO_UDP));
+    } else {
+      udphdr->udpchksum = ~uip_htons(sum);
+    }
     if(udphdr->udpchksum == 0) {
       udphdr->udpchksum = 0xffff;
     }
     break;
 
   case IP_PROTO_ICMPV6:
-    icmpv6hdr->icmpchksum = 0;
-    icmpv6hdr->icmpchksum = ~(ipv6_transport_checksum(resultpacket,
-                                                ipv6len,
-                                                IP_PROTO_ICMPV6));
+    icmpv6hdr->icmpchksum = ~uip_htons(sum);
     break;
   default:
     PRINTF("ip64_4to6: transport protocol %d not implemented\n", v4hdr->proto);
@@ -35,6 +35,17 @@
 #include "net/ip/uip.h"
 
 void ip64_init(void);
+
+/*
+ * ip64_6to4() and ip64_4to6() translate a packet into resultpacket
+ * and return the length of the translated packet, or 0 if it could
+ * not be translated. The result may overlap the original packet. A
+ * packet is translated without moving its payload if the IPv4 packet
+ * is placed IP64_6TO4_INPLACE_OFFSET bytes into the IPv6 packet, or
+ * the other way around.
+ */
+#define IP64_6TO4_INPLACE_OFFSET 20
+
 int ip64_6to4(const uint8_t *ipv6packet, const uint16_t ipv6len,
               uint8_t *resultpacket);
 int ip64_4to6(const uint8_t *ipv4packet, const uint16_t ipv4len,
@@ -307,6 +307,14 @@ in()
   }
 
   UIP_MCAST6_STATS_ADD(mcast_in_all);
+
+  /* Link-layer retransmissions may get us the same datagram more than once */
+  if(uip_mcast6_route_is_duplicate()) {
+    PRINTF("ESMRF: Duplicate, dropping\n");
+    UIP_MCAST6_STATS_ADD(mcast_dropped);
+    return UIP_MCAST6_DROP;
+  }
+
   UIP_MCAST6_STATS_ADD(mcast_in_unique);
 
   /* If we have an entry in the mcast routing table, something with
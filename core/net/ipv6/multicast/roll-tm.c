@@ -192,15 +192,35 @@ struct trickle_param {
  * \brief Add n to s: (s + n) modulo (2 ^ SERIAL_BITS) => ((s + n) % 0x8000)
  */
 #define SEQ_VAL_ADD(s, n) (((s) + (n)) % 0x8000)
+
+/**
+ * \brief Distance from s2 to s1: (s1 - s2) modulo (2 ^ SERIAL_BITS)
+ */
+#define SEQ_VAL_DIFF(s1, s2) ((uint16_t)((s1) - (s2)) & 0x7FFF)
 /*---------------------------------------------------------------------------*/
 /* Sliding Windows */
+struct mcast_packet;
+
+/* Number of sequence values indexed by the slots of a window */
+#define SLIDING_WINDOW_SLOTS 32
+
+/* Slot value for a sequence value that is not buffered */
+#define SLIDING_WINDOW_SLOT_NONE 0xFF
+#if ROLL_TM_BUFF_NUM >= SLIDING_WINDOW_SLOT_NONE
+#error "ROLL_TM_BUFF_NUM too large for the sliding window slots"
+#endif
+
 struct sliding_window {
+  struct sliding_window *hash_next; /* Next window in the same hash bucket */
+  struct mcast_packet *head;    /* Buffered packets, ascending seq. values */
   seed_id_t seed_id;
   int16_t lower_bound;          /* lolipop */
   int16_t upper_bound;          /* lolipop */
   int16_t min_listed;           /* lolipop */
   uint8_t flags;                /* Is used, Trickle param, Is listed */
   uint8_t count;
+  /* Slot i: index in buffered_msgs of seq. value lower_bound + i */
+  uint8_t slots[SLIDING_WINDOW_SLOTS];
 };
 
 #define SLIDING_WINDOW_U_BIT 0x80       /* Is used */
@@ -225,7 +245,6 @@ struct sliding_window {
  * w: pointer to a sliding window
  */
 #define SLIDING_WINDOW_IS_USED_CLR(w) ((w)->flags &= ~SLIDING_WINDOW_U_BIT)
-#define window_free(w) SLIDING_WINDOW_IS_USED_CLR(w)
 
 /**
  * \brief Set 'Is Seen' bit for window w
@@ -266,6 +285,7 @@ struct sliding_window {
 /*---------------------------------------------------------------------------*/
 /* Multicast Packet Buffers */
 struct mcast_packet {
+  struct mcast_packet *next;    /* Next packet in the window or free list */
 #if ROLL_TM_SHORT_SEEDS
   /* Short seeds are stored inside the message */
   seed_id_t seed_id;
@@ -442,7 +462,9 @@ static struct roll_tm_stats stats;
 /*---------------------------------------------------------------------------*/
 static struct trickle_param t[2];
 static struct sliding_window windows[ROLL_TM_WINS];
+static struct sliding_window *window_table[ROLL_TM_WIN_HASH_BUCKETS];
 static struct mcast_packet buffered_msgs[ROLL_TM_BUFF_NUM];
+static struct mcast_packet *free_msgs;
 /*---------------------------------------------------------------------------*/
 /* Temporary Stores */
 /*---------------------------------------------------------------------------*/
@@ -470,7 +492,9 @@ extern uint16_t uip_slen;
 /*---------------------------------------------------------------------------*/
 static void icmp_input(void);
 static void icmp_output(void);
-static void window_update_bounds(void);
+static void window_free(struct sliding_window *);
+static void window_remove_packet(struct mcast_packet *);
+static void buffer_free(struct mcast_packet *);
 static void reset_trickle_timer(uint8_t);
 static void handle_timer(void *);
 /*---------------------------------------------------------------------------*/
@@ -604,7 +628,7 @@ handle_timer(void *ptr)
                      TRICKLE_ACTIVE(param));
 
       if(locmpptr->dwell > TRICKLE_DWELL(param)) {
-        locmpptr->sw->count--;
+        window_remove_packet(locmpptr);
         PRINTF("ROLL TM: M=%u Free Packet %u (%lu > %lu), Window now at %u\n",
                m, locmpptr->seq_val, locmpptr->dwell,
                TRICKLE_DWELL(param), locmpptr->sw->count);
@@ -614,7 +638,7 @@ handle_timer(void *ptr)
           PRINTF("\n");
           window_free(locmpptr->sw);
         }
-        MCAST_PACKET_FREE(locmpptr);
+        buffer_free(locmpptr);
       } else if(MCAST_PACKET_TTL(locmpptr) > 0) {
         /* Handle multicast transmissions */
         if(locmpptr->active < TRICKLE_ACTIVE(param) &&
@@ -646,8 +670,6 @@ handle_timer(void *ptr)
   param->inconsistency = 0;
   param->c = 0;
 
-  window_update_bounds();
-
   /* Temporarily store 'now' in t_next */
   param->t_next = clock_time();
   if(param->t_next >= param->t_end) {
@@ -682,27 +704,67 @@ reset_trickle_timer(uint8_t index)
   ctimer_set(&t[index].ct, t[index].t_next, handle_timer, (void *)&t[index]);
 }
 /*---------------------------------------------------------------------------*/
+static uint8_t
+window_hash(seed_id_t *s, uint8_t m)
+{
+#if ROLL_TM_SHORT_SEEDS
+  return (s->u8[0] ^ s->u8[1] ^ m) & (ROLL_TM_WIN_HASH_BUCKETS - 1);
+#else
+  return (s->u8[14] ^ s->u8[15] ^ m) & (ROLL_TM_WIN_HASH_BUCKETS - 1);
+#endif
+}
+/*---------------------------------------------------------------------------*/
 static struct sliding_window *
-window_allocate()
+window_allocate(seed_id_t *s, uint8_t m)
 {
+  uint8_t h;
+
   for(iterswptr = &windows[ROLL_TM_WINS - 1]; iterswptr >= windows;
       iterswptr--) {
     if(!SLIDING_WINDOW_IS_USED(iterswptr)) {
+      iterswptr->head = NULL;
+      memset(iterswptr->slots, SLIDING_WINDOW_SLOT_NONE,
+             sizeof(iterswptr->slots));
       iterswptr->count = 0;
       iterswptr->lower_bound = -1;
       iterswptr->upper_bound = -1;
       iterswptr->min_listed = -1;
+      iterswptr->flags = 0;
+      if(m) {
+        SLIDING_WINDOW_M_SET(iterswptr);
+      }
+      SLIDING_WINDOW_IS_USED_SET(iterswptr);
+      seed_id_cpy(&iterswptr->seed_id, s);
+
+      h = window_hash(s, m);
+      iterswptr->hash_next = window_table[h];
+      window_table[h] = iterswptr;
       return iterswptr;
     }
   }
   return NULL;
 }
 /*---------------------------------------------------------------------------*/
+static void
+window_free(struct sliding_window *w)
+{
+  struct sliding_window **prev;
+
+  for(prev = &window_table[window_hash(&w->seed_id, SLIDING_WINDOW_GET_M(w))];
+      *prev != NULL; prev = &(*prev)->hash_next) {
+    if(*prev == w) {
+      *prev = w->hash_next;
+      break;
+    }
+  }
+  SLIDING_WINDOW_IS_USED_CLR(w);
+}
+/*---------------------------------------------------------------------------*/
 static struct sliding_window *
 window_lookup(seed_id_t *s, uint8_t m)
 {
-  for(iterswptr = &windows[ROLL_TM_WINS - 1]; iterswptr >= windows;
-      iterswptr--) {
+  for(iterswptr = window_table[window_hash(s, m)]; iterswptr != NULL;
+      iterswptr = iterswptr->hash_next) {
     VERBOSE_PRINTF("ROLL TM: M=%u (%u) ", SLIDING_WINDOW_GET_M(iterswptr), m);
     VERBOSE_PRINT_SEED(&iterswptr->seed_id);
     VERBOSE_PRINTF("\n");
@@ -714,33 +776,132 @@ window_lookup(seed_id_t *s, uint8_t m)
   return NULL;
 }
 /*---------------------------------------------------------------------------*/
+/*
+ * Recalculate the lower bound of window w from its oldest buffered packet,
+ * and the buffer slots of sequence values relative to it
+ */
 static void
-window_update_bounds()
+window_rebuild_slots(struct sliding_window *w)
 {
-  for(iterswptr = &windows[ROLL_TM_WINS - 1]; iterswptr >= windows;
-      iterswptr--) {
-    iterswptr->lower_bound = -1;
+  struct mcast_packet *p;
+  uint16_t offset;
+
+  memset(w->slots, SLIDING_WINDOW_SLOT_NONE, sizeof(w->slots));
+  if(w->head == NULL) {
+    w->lower_bound = -1;
+    return;
   }
 
-  for(locmpptr = &buffered_msgs[ROLL_TM_BUFF_NUM - 1];
-      locmpptr >= buffered_msgs; locmpptr--) {
-    if(MCAST_PACKET_IS_USED(locmpptr)) {
-      iterswptr = locmpptr->sw;
-      VERBOSE_PRINTF("ROLL TM: Update Bounds: [%d - %d] vs %u\n",
-                     iterswptr->lower_bound, iterswptr->upper_bound,
-                     locmpptr->seq_val);
-      if(iterswptr->lower_bound < 0
-         || SEQ_VAL_IS_LT(locmpptr->seq_val, iterswptr->lower_bound)) {
-        iterswptr->lower_bound = locmpptr->seq_val;
-      }
-      if(iterswptr->upper_bound < 0 ||
-         SEQ_VAL_IS_GT(locmpptr->seq_val, iterswptr->upper_bound)) {
-        iterswptr->upper_bound = locmpptr->seq_val;
+  w->lower_bound = w->head->seq_val;
+  for(p = w->head; p != NULL; p = p->next) {
+    offset = SEQ_VAL_DIFF(p->seq_val, w->lower_bound);
+    if(offset >= SLIDING_WINDOW_SLOTS) {
+      break;
+    }
+    w->slots[offset] = p - buffered_msgs;
+  }
+}
+/*---------------------------------------------------------------------------*/
+/* Add packet p to window w, keeping its packets sorted by sequence value */
+static void
+window_add_packet(struct sliding_window *w, struct mcast_packet *p)
+{
+  struct mcast_packet **prev;
+  uint16_t offset;
+
+  for(prev = &w->head; *prev != NULL; prev = &(*prev)->next) {
+    if(!SEQ_VAL_IS_LT((*prev)->seq_val, p->seq_val)) {
+      break;
+    }
+  }
+  p->next = *prev;
+  *prev = p;
+  p->sw = w;
+
+  /* If this is a new Seq Num, update the window upper bound */
+  if(w->count == 0 || SEQ_VAL_IS_GT(p->seq_val, w->upper_bound)) {
+    w->upper_bound = p->seq_val;
+    VERBOSE_PRINTF("ROLL TM: New Upper Bound %u\n", w->upper_bound);
+  }
+  w->count++;
+
+  if(w->head == p) {
+    window_rebuild_slots(w);
+    VERBOSE_PRINTF("ROLL TM: New Lower Bound %u\n", w->lower_bound);
+  } else {
+    offset = SEQ_VAL_DIFF(p->seq_val, w->lower_bound);
+    if(offset < SLIDING_WINDOW_SLOTS) {
+      w->slots[offset] = p - buffered_msgs;
+    }
+  }
+}
+/*---------------------------------------------------------------------------*/
+/*
+ * Remove packet p from its window. The upper bound is left alone: it keeps
+ * track of the highest sequence value we have seen for this window
+ */
+static void
+window_remove_packet(struct mcast_packet *p)
+{
+  struct sliding_window *w = p->sw;
+  struct mcast_packet **prev;
+  uint16_t offset;
+
+  for(prev = &w->head; *prev != NULL; prev = &(*prev)->next) {
+    if(*prev == p) {
+      *prev = p->next;
+      w->count--;
+      if(prev == &w->head) {
+        window_rebuild_slots(w);
+      } else {
+        offset = SEQ_VAL_DIFF(p->seq_val, w->lower_bound);
+        if(offset < SLIDING_WINDOW_SLOTS) {
+          w->slots[offset] = SLIDING_WINDOW_SLOT_NONE;
+        }
       }
+      return;
     }
   }
 }
 /*---------------------------------------------------------------------------*/
+/*
+ * Find the buffered packet with sequence value seq in window w. Only values
+ * beyond the slots of the window need a walk through its packets
+ */
+static struct mcast_packet *
+window_find(struct sliding_window *w, uint16_t seq)
+{
+  struct mcast_packet *p;
+  uint16_t offset;
+
+  if(w->head == NULL) {
+    return NULL;
+  }
+
+  offset = SEQ_VAL_DIFF(seq, w->lower_bound);
+  if(offset < SLIDING_WINDOW_SLOTS) {
+    if(w->slots[offset] == SLIDING_WINDOW_SLOT_NONE) {
+      return NULL;
+    }
+    return &buffered_msgs[w->slots[offset]];
+  }
+
+  for(p = w->head; p != NULL; p = p->next) {
+    if(SEQ_VAL_IS_EQ(p->seq_val, seq)) {
+      return p;
+    }
+  }
+  return NULL;
+}
+/*---------------------------------------------------------------------------*/
+static void
+buffer_free(struct mcast_packet *p)
+{
+  MCAST_PACKET_FREE(p);
+  p->next = free_msgs;
+  free_msgs = p;
+}
+/*---------------------------------------------------------------------------*/
 static struct mcast_packet *
 buffer_reclaim()
 {
@@ -754,7 +915,7 @@ buffer_reclaim()
     }
   }
 
-  if(largest->count == 1) {
+  if(largest->count <= 1) {
     /* Can't reclaim last entry for a window and this is the largest window */
     return NULL;
   }
@@ -763,36 +924,25 @@ buffer_reclaim()
   PRINT_SEED(&largest->seed_id);
   PRINTF(" M=%u, count was %u\n",
          SLIDING_WINDOW_GET_M(largest), largest->count);
-  /* Find the packet at the lowest bound for the largest window */
-  for(locmpptr = &buffered_msgs[ROLL_TM_BUFF_NUM - 1];
-      locmpptr >= buffered_msgs; locmpptr--) {
-    if(MCAST_PACKET_IS_USED(locmpptr) && (locmpptr->sw == largest) &&
-       SEQ_VAL_IS_EQ(locmpptr->seq_val, largest->lower_bound)) {
-      rv = locmpptr;
-      PRINTF("ROLL TM: Reclaim seq. val %u\n", locmpptr->seq_val);
-      MCAST_PACKET_FREE(rv);
-      largest->count--;
-      window_update_bounds();
-      VERBOSE_PRINTF("ROLL TM: Reclaim - new bounds [%u , %u]\n",
-                     largest->lower_bound, largest->upper_bound);
-      return rv;
-    }
-  }
 
-  /* oops */
-  return NULL;
+  /* The packet at the lowest bound heads the window */
+  rv = largest->head;
+  PRINTF("ROLL TM: Reclaim seq. val %u\n", rv->seq_val);
+  window_remove_packet(rv);
+  MCAST_PACKET_FREE(rv);
+  VERBOSE_PRINTF("ROLL TM: Reclaim - new bounds [%u , %u]\n",
+                 largest->lower_bound, largest->upper_bound);
+  return rv;
 }
 /*---------------------------------------------------------------------------*/
 static struct mcast_packet *
 buffer_allocate()
 {
-  for(locmpptr = &buffered_msgs[ROLL_TM_BUFF_NUM - 1];
-      locmpptr >= buffered_msgs; locmpptr--) {
-    if(!MCAST_PACKET_IS_USED(locmpptr)) {
-      return locmpptr;
-    }
+  locmpptr = free_msgs;
+  if(locmpptr != NULL) {
+    free_msgs = locmpptr->next;
   }
-  return NULL;
+  return locmpptr;
 }
 /*---------------------------------------------------------------------------*/
 static void
@@ -832,18 +982,15 @@ icmp_output()
 
       buffer = (uint8_t *)sl + sizeof(struct sequence_list_header);
 
-      for(locmpptr = &buffered_msgs[ROLL_TM_BUFF_NUM - 1];
-          locmpptr >= buffered_msgs; locmpptr--) {
-        if(MCAST_PACKET_IS_USED(locmpptr) &&
-           locmpptr->active < TRICKLE_ACTIVE((&t[SLIDING_WINDOW_GET_M(iterswptr)]))) {
-          if(locmpptr->sw == iterswptr) {
-            sl->seq_len++;
-            PRINTF(", %u", locmpptr->seq_val);
-            *buffer = (uint8_t)(locmpptr->seq_val >> 8);
-            buffer++;
-            *buffer = (uint8_t)(locmpptr->seq_val & 0xFF);
-            buffer++;
-          }
+      for(locmpptr = iterswptr->head; locmpptr != NULL;
+          locmpptr = locmpptr->next) {
+        if(locmpptr->active < TRICKLE_ACTIVE((&t[SLIDING_WINDOW_GET_M(iterswptr)]))) {
+          sl->seq_len++;
+          PRINTF(", %u", locmpptr->seq_val);
+          *buffer = (uint8_t)(locmpptr->seq_val >> 8);
+          buffer++;
+          *buffer = (uint8_t)(locmpptr->seq_val & 0xFF);
+          buffer++;
         }
       }
       PRINTF(", Len=%u\n", sl->seq_len);
@@ -978,17 +1125,11 @@ accept(uint8_t in)
       UIP_MCAST6_STATS_ADD(mcast_dropped);
       return UIP_MCAST6_DROP;
     }
-    for(locmpptr = &buffered_msgs[ROLL_TM_BUFF_NUM - 1];
-        locmpptr >= buffered_msgs; locmpptr--) {
-      if(MCAST_PACKET_IS_USED(locmpptr) &&
-         locmpptr->sw == locswptr &&
-         SLIDING_WINDOW_GET_M(locmpptr->sw) == m &&
-         SEQ_VAL_IS_EQ(seq_val, locmpptr->seq_val)) {
-        /* Seen before , drop */
-        PRINTF("ROLL TM: Seen before\n");
-        UIP_MCAST6_STATS_ADD(mcast_dropped);
-        return UIP_MCAST6_DROP;
-      }
+    if(window_find(locswptr, seq_val) != NULL) {
+      /* Seen before , drop */
+      PRINTF("ROLL TM: Seen before\n");
+      UIP_MCAST6_STATS_ADD(mcast_dropped);
+      return UIP_MCAST6_DROP;
     }
   }
 
@@ -997,7 +1138,7 @@ accept(uint8_t in)
   /* We have not seen this message before */
   /* Allocate a window if we have to */
   if(!locswptr) {
-    locswptr = window_allocate();
+    locswptr = window_allocate(seed_ptr, m);
     PRINTF("ROLL TM: New seed\n");
   }
   if(!locswptr) {
@@ -1020,9 +1161,9 @@ accept(uint8_t in)
     PRINTF("ROLL TM: Buffer reclaim failed\n");
     if(locswptr->count == 0) {
       window_free(locswptr);
-      UIP_MCAST6_STATS_ADD(mcast_dropped);
-      return UIP_MCAST6_DROP;
     }
+    UIP_MCAST6_STATS_ADD(mcast_dropped);
+    return UIP_MCAST6_DROP;
   }
 #if UIP_MCAST6_STATS
   if(in == ROLL_TM_DGRAM_IN) {
@@ -1031,39 +1172,20 @@ accept(uint8_t in)
 #endif
 
   /* We have a window and we have a buffer. Accept this message */
-  /* Set the seed ID and correct M for this window */
-  SLIDING_WINDOW_M_CLR(locswptr);
-  if(m) {
-    SLIDING_WINDOW_M_SET(locswptr);
-  }
-  SLIDING_WINDOW_IS_USED_SET(locswptr);
-  seed_id_cpy(&locswptr->seed_id, seed_ptr);
   PRINTF("ROLL TM: Window for seed ");
   PRINT_SEED(&locswptr->seed_id);
   PRINTF(" M=%u, count=%u\n",
          SLIDING_WINDOW_GET_M(locswptr), locswptr->count);
 
-  /* If this window was previously empty, set its lower bound to this packet */
-  if(locswptr->count == 0) {
-    locswptr->lower_bound = seq_val;
-    VERBOSE_PRINTF("ROLL TM: New Lower Bound %u\n", locswptr->lower_bound);
-  }
-
-  /* If this is a new Seq Num, update the window upper bound */
-  if(locswptr->count == 0 || SEQ_VAL_IS_GT(seq_val, locswptr->upper_bound)) {
-    locswptr->upper_bound = seq_val;
-    VERBOSE_PRINTF("ROLL TM: New Upper Bound %u\n", locswptr->upper_bound);
-  }
-
-  locswptr->count++;
-
   memset(locmpptr, 0, sizeof(struct mcast_packet));
   memcpy(&locmpptr->buff, UIP_IP_BUF, uip_len);
-  locmpptr->sw = locswptr;
   locmpptr->buff_len = uip_len;
   locmpptr->seq_val = seq_val;
   MCAST_PACKET_USED_SET(locmpptr);
 
+  /* Sets the window bounds if this is a new lowest or highest Seq Num */
+  window_add_packet(locswptr, locmpptr);
+
   PRINTF("ROLL TM: Window for seed ");
   PRINT_SEED(&locswptr->seed_id);
   PRINTF(" M=%u, %u values within [%u , %u]\n",
@@ -1136,18 +1258,16 @@ icmp_input()
 
   ROLL_TM_STATS_ADD(icmp_in);
 
-  /* Reset Is-Listed bit for all windows */
+  /*
+   * Reset Is-Listed bit for all windows. The Is-Listed bits of cached packets
+   * only matter for listed windows, so they are reset when their window is
+   * first listed
+   */
   for(iterswptr = &windows[ROLL_TM_WINS - 1]; iterswptr >= windows;
       iterswptr--) {
     SLIDING_WINDOW_LISTED_CLR(iterswptr);
   }
 
-  /* Reset Is-Listed bit for all cached packets */
-  for(locmpptr = &buffered_msgs[ROLL_TM_BUFF_NUM - 1];
-      locmpptr >= buffered_msgs; locmpptr--) {
-    MCAST_PACKET_LISTED_CLR(locmpptr);
-  }
-
   locslhptr = (struct sequence_list_header *)UIP_ICMP_PAYLOAD;
 
   VERBOSE_PRINTF("ROLL TM: ICMPv6 In, parse from %p to %p\n",
@@ -1199,7 +1319,13 @@ icmp_input()
 
     /* If we have a window, iterate sequence values and check consistency */
     if(locswptr) {
-      SLIDING_WINDOW_LISTED_SET(locswptr);
+      if(!SLIDING_WINDOW_IS_LISTED(locswptr)) {
+        SLIDING_WINDOW_LISTED_SET(locswptr);
+        for(locmpptr = locswptr->head; locmpptr != NULL;
+            locmpptr = locmpptr->next) {
+          MCAST_PACKET_LISTED_CLR(locmpptr);
+        }
+      }
       locswptr->min_listed = -1;
       PRINTF("ROLL TM: ICMPv6 In, Window bounds [%u , %u]\n",
              locswptr->lower_bound, locswptr->upper_bound);
@@ -1222,23 +1348,17 @@ icmp_input()
 
           inconsistency = 1;
           /* Check if the advertised sequence is in our buffer */
-          for(locmpptr = &buffered_msgs[ROLL_TM_BUFF_NUM - 1];
-              locmpptr >= buffered_msgs; locmpptr--) {
-            if(MCAST_PACKET_IS_USED(locmpptr) && locmpptr->sw == locswptr) {
-              if(SEQ_VAL_IS_EQ(locmpptr->seq_val, val)) {
-
-                inconsistency = 0;
-                MCAST_PACKET_LISTED_SET(locmpptr);
-                PRINTF("ROLL TM: ICMPv6 In, %u listed\n", locmpptr->seq_val);
-
-                /* Update lowest seq. num listed for this window
-                 * We need this to check for "we have new" */
-                if(locswptr->min_listed == -1 ||
-                   SEQ_VAL_IS_LT(val, locswptr->min_listed)) {
-                  locswptr->min_listed = val;
-                }
-                break;
-              }
+          locmpptr = window_find(locswptr, val);
+          if(locmpptr != NULL) {
+            inconsistency = 0;
+            MCAST_PACKET_LISTED_SET(locmpptr);
+            PRINTF("ROLL TM: ICMPv6 In, %u listed\n", locmpptr->seq_val);
+
+            /* Update lowest seq. num listed for this window
+             * We need this to check for "we have new" */
+            if(locswptr->min_listed == -1 ||
+               SEQ_VAL_IS_LT(val, locswptr->min_listed)) {
+              locswptr->min_listed = val;
             }
           }
           if(inconsistency) {
@@ -1265,10 +1385,13 @@ icmp_input()
 
   /* Check for "We have new */
   PRINTF("ROLL TM: ICMPv6 In, Check our buffer\n");
-  for(locmpptr = &buffered_msgs[ROLL_TM_BUFF_NUM - 1];
-      locmpptr >= buffered_msgs; locmpptr--) {
-    if(MCAST_PACKET_IS_USED(locmpptr)) {
-      locswptr = locmpptr->sw;
+  for(locswptr = &windows[ROLL_TM_WINS - 1]; locswptr >= windows;
+      locswptr--) {
+    if(!SLIDING_WINDOW_IS_USED(locswptr)) {
+      continue;
+    }
+    for(locmpptr = locswptr->head; locmpptr != NULL;
+        locmpptr = locmpptr->next) {
       PRINTF("ROLL TM: ICMPv6 In, ");
       PRINTF("Check %u, Seed L: %u, This L: %u Min L: %d\n",
              locmpptr->seq_val, SLIDING_WINDOW_IS_LISTED(locswptr),
@@ -1414,9 +1537,16 @@ init()
   PRINTF("ROLL TM: ROLL Multicast - Draft #%u\n", ROLL_TM_VER);
 
   memset(windows, 0, sizeof(windows));
+  memset(window_table, 0, sizeof(window_table));
   memset(buffered_msgs, 0, sizeof(buffered_msgs));
   memset(t, 0, sizeof(t));
 
+  free_msgs = NULL;
+  for(locmpptr = &buffered_msgs[ROLL_TM_BUFF_NUM - 1];
+      locmpptr >= buffered_msgs; locmpptr--) {
+    buffer_free(locmpptr);
+  }
+
   ROLL_TM_STATS_INIT();
   UIP_MCAST6_STATS_INIT(&stats);
 
@@ -175,6 +175,16 @@
 #define ROLL_TM_WINS 2
 #endif
 /*---------------------------------------------------------------------------*/
+/**
+ * Number of hash buckets used to look up the sliding window of a seed.
+ * Must be a power of two
+ */
+#ifdef ROLL_TM_CONF_WIN_HASH_BUCKETS
+#define ROLL_TM_WIN_HASH_BUCKETS ROLL_TM_CONF_WIN_HASH_BUCKETS
+#else
+#define ROLL_TM_WIN_HASH_BUCKETS 4
+#endif
+/*---------------------------------------------------------------------------*/
 /**
  * Maximum Number of Buffered Multicast Messages
  * This buffer is shared across all Seed IDs, therefore a new very active Seed
@@ -41,6 +41,7 @@
  */
 
 #include "contiki.h"
+#include "lib/crc16.h"
 #include "lib/list.h"
 #include "lib/memb.h"
 #include "net/ip/uip.h"
@@ -56,19 +57,76 @@
 #else
 #define UIP_MCAST6_ROUTE_ROUTES 1
 #endif /* UIP_CONF_DS6_MCAST_ROUTES */
+
+/* Number of hash buckets used for group lookups. Must be a power of two */
+#ifdef UIP_MCAST6_ROUTE_CONF_HASH_BUCKETS
+#define UIP_MCAST6_ROUTE_HASH_BUCKETS UIP_MCAST6_ROUTE_CONF_HASH_BUCKETS
+#else
+#define UIP_MCAST6_ROUTE_HASH_BUCKETS 8
+#endif /* UIP_MCAST6_ROUTE_CONF_HASH_BUCKETS */
+
+/* Number of recently seen datagrams remembered for duplicate detection */
+#ifdef UIP_MCAST6_ROUTE_CONF_SEEN_CACHE_SIZE
+#define UIP_MCAST6_ROUTE_SEEN_CACHE_SIZE UIP_MCAST6_ROUTE_CONF_SEEN_CACHE_SIZE
+#else
+#define UIP_MCAST6_ROUTE_SEEN_CACHE_SIZE 8
+#endif /* UIP_MCAST6_ROUTE_CONF_SEEN_CACHE_SIZE */
+
+/*
+ * How long a datagram is remembered. Copies caused by link-layer
+ * retransmissions and by neighbours forwarding the same datagram arrive
+ * within a short time, while a datagram that an application sends again
+ * later is a new one.
+ */
+#ifdef UIP_MCAST6_ROUTE_CONF_SEEN_LIFETIME
+#define UIP_MCAST6_ROUTE_SEEN_LIFETIME UIP_MCAST6_ROUTE_CONF_SEEN_LIFETIME
+#else
+#define UIP_MCAST6_ROUTE_SEEN_LIFETIME CLOCK_SECOND
+#endif /* UIP_MCAST6_ROUTE_CONF_SEEN_LIFETIME */
+
+/* Number of payload bytes covered by a datagram fingerprint */
+#ifdef UIP_MCAST6_ROUTE_CONF_SEEN_PAYLOAD_LEN
+#define UIP_MCAST6_ROUTE_SEEN_PAYLOAD_LEN UIP_MCAST6_ROUTE_CONF_SEEN_PAYLOAD_LEN
+#else
+#define UIP_MCAST6_ROUTE_SEEN_PAYLOAD_LEN 32
+#endif /* UIP_MCAST6_ROUTE_CONF_SEEN_PAYLOAD_LEN */
+/*---------------------------------------------------------------------------*/
+#define UIP_IP_BUF ((struct uip_ip_hdr *)&uip_buf[UIP_LLH_LEN])
 /*---------------------------------------------------------------------------*/
 LIST(mcast_route_list);
 MEMB(mcast_route_memb, uip_mcast6_route_t, UIP_MCAST6_ROUTE_ROUTES);
 
+static uip_mcast6_route_t *route_hash[UIP_MCAST6_ROUTE_HASH_BUCKETS];
+
 static uip_mcast6_route_t *locmcastrt;
+
+#if UIP_MCAST6_ROUTE_SEEN_CACHE_SIZE
+/* Ring of fingerprints of recently seen datagrams */
+static struct {
+  uint32_t fingerprint;
+  clock_time_t time;
+} seen[UIP_MCAST6_ROUTE_SEEN_CACHE_SIZE];
+static uint8_t seen_next;
+static uint8_t seen_count;
+#endif /* UIP_MCAST6_ROUTE_SEEN_CACHE_SIZE */
+/*---------------------------------------------------------------------------*/
+/*
+ * Groups usually differ in their group ID, i.e. the low-order bytes of the
+ * address, so those are all we hash.
+ */
+static uint8_t
+group_hash(const uip_ipaddr_t *group)
+{
+  return (group->u8[12] ^ group->u8[13] ^ group->u8[14] ^ group->u8[15]) &
+    (UIP_MCAST6_ROUTE_HASH_BUCKETS - 1);
+}
 /*---------------------------------------------------------------------------*/
 uip_mcast6_route_t *
 uip_mcast6_route_lookup(uip_ipaddr_t *group)
 {
-  locmcastrt = NULL;
-  for(locmcastrt = list_head(mcast_route_list);
+  for(locmcastrt = route_hash[group_hash(group)];
       locmcastrt != NULL;
-      locmcastrt = list_item_next(locmcastrt)) {
+      locmcastrt = locmcastrt->hash_next) {
     if(uip_ipaddr_cmp(&locmcastrt->group, group)) {
       return locmcastrt;
     }
@@ -89,23 +147,28 @@ uip_mcast6_route_add(uip_ipaddr_t *group)
       return NULL;
     }
     list_add(mcast_route_list, locmcastrt);
+
+    uip_ipaddr_copy(&(locmcastrt->group), group);
+    locmcastrt->hash_next = route_hash[group_hash(group)];
+    route_hash[group_hash(group)] = locmcastrt;
   }
 
   /* Reaching here means we either found the prefix or allocated a new one */
 
-  uip_ipaddr_copy(&(locmcastrt->group), group);
-
   return locmcastrt;
 }
 /*---------------------------------------------------------------------------*/
 void
 uip_mcast6_route_rm(uip_mcast6_route_t *route)
 {
-  /* Make sure it's actually in the list */
-  for(locmcastrt = list_head(mcast_route_list);
-      locmcastrt != NULL;
-      locmcastrt = list_item_next(locmcastrt)) {
-    if(locmcastrt == route) {
+  uip_mcast6_route_t **prev;
+
+  /* Make sure it's actually in the table */
+  for(prev = &route_hash[group_hash(&route->group)];
+      *prev != NULL;
+      prev = &(*prev)->hash_next) {
+    if(*prev == route) {
+      *prev = route->hash_next;
       list_remove(mcast_route_list, route);
       memb_free(&mcast_route_memb, route);
       return;
@@ -125,11 +188,57 @@ uip_mcast6_route_count(void)
   return list_length(mcast_route_list);
 }
 /*---------------------------------------------------------------------------*/
+uint8_t
+uip_mcast6_route_is_duplicate(void)
+{
+#if UIP_MCAST6_ROUTE_SEEN_CACHE_SIZE
+  uint32_t fingerprint;
+  uint16_t payload_len;
+  uint16_t crc;
+  clock_time_t now;
+  uint8_t i;
+
+  payload_len = ((UIP_IP_BUF->len[0] << 8) | UIP_IP_BUF->len[1]) - uip_ext_len;
+  if(payload_len > UIP_MCAST6_ROUTE_SEEN_PAYLOAD_LEN) {
+    payload_len = UIP_MCAST6_ROUTE_SEEN_PAYLOAD_LEN;
+  }
+
+  /* Two independent halves: addresses and payload */
+  crc = crc16_data((uint8_t *)&UIP_IP_BUF->srcipaddr,
+                   2 * sizeof(uip_ipaddr_t), 0);
+  fingerprint = (uint32_t)crc << 16;
+  crc = crc16_data(UIP_IP_BUF->len, 2, 0);
+  crc = crc16_data(&uip_buf[uip_l2_l3_hdr_len], payload_len, crc);
+  fingerprint |= crc;
+
+  now = clock_time();
+  for(i = 0; i < seen_count; i++) {
+    if(seen[i].fingerprint == fingerprint &&
+       now - seen[i].time < UIP_MCAST6_ROUTE_SEEN_LIFETIME) {
+      return 1;
+    }
+  }
+
+  seen[seen_next].fingerprint = fingerprint;
+  seen[seen_next].time = now;
+  seen_next = (seen_next + 1) % UIP_MCAST6_ROUTE_SEEN_CACHE_SIZE;
+  if(seen_count < UIP_MCAST6_ROUTE_SEEN_CACHE_SIZE) {
+    seen_count++;
+  }
+#endif /* UIP_MCAST6_ROUTE_SEEN_CACHE_SIZE */
+  return 0;
+}
+/*---------------------------------------------------------------------------*/
 void
 uip_mcast6_route_init()
 {
   memb_init(&mcast_route_memb);
   list_init(mcast_route_list);
+  memset(route_hash, 0, sizeof(route_hash));
+#if UIP_MCAST6_ROUTE_SEEN_CACHE_SIZE
+  seen_next = 0;
+  seen_count = 0;
+#endif /* UIP_MCAST6_ROUTE_SEEN_CACHE_SIZE */
 }
 /*---------------------------------------------------------------------------*/
 /** @} */
@@ -50,6 +50,7 @@
 /** \brief An entry in the multicast routing table */
 typedef struct uip_mcast6_route {
   struct uip_mcast6_route *next; /**< Routes are arranged in a linked list */
+  struct uip_mcast6_route *hash_next; /**< Next route in the same hash bucket */
   uip_ipaddr_t group; /**< The multicast group */
   uint32_t lifetime; /**< Entry lifetime seconds */
   void *dag; /**< Pointer to an rpl_dag_t struct */
@@ -92,6 +93,26 @@ int uip_mcast6_route_count(void);
  * If the multicast routes list is empty, this function will return NULL
  */
 uip_mcast6_route_t *uip_mcast6_route_list_head(void);
+
+/**
+ * \brief Check whether the datagram in uip_buf has been seen recently
+ * \return 1 if the datagram is a duplicate, 0 otherwise
+ *
+ *        SMRF-style datagrams carry no sequence number, so datagrams are
+ *        identified by a fingerprint of their source, destination and
+ *        leading payload bytes. Extension headers parsed by the core
+ *        (uip_ext_len), which may change hop by hop, are not covered.
+ *        A datagram not found in the cache of recently seen datagrams is
+ *        added to it, replacing the oldest entry. Entries expire after
+ *        UIP_MCAST6_ROUTE_CONF_SEEN_LIFETIME clock ticks (one second by
+ *        default), so that a datagram sent again later, such as a
+ *        periodic beacon with the same contents, is not dropped.
+ *
+ *        The cache size is set with UIP_MCAST6_ROUTE_CONF_SEEN_CACHE_SIZE.
+ *        A size of 0 disables duplicate detection and this function always
+ *        returns 0.
+ */
+uint8_t uip_mcast6_route_is_duplicate(void);
 /*---------------------------------------------------------------------------*/
 /**
  * \brief Multicast routing table init routine
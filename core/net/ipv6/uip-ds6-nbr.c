@@ -69,14 +69,137 @@ void LINK_NEIGHBOR_CALLBACK(const linkaddr_t *addr, int status, int numtx);
 #define LINK_NEIGHBOR_CALLBACK(addr, status, numtx)
 #endif /* UIP_CONF_DS6_LINK_NEIGHBOR_CALLBACK */
 
+/* Number of buckets in the IPv6 address index of the neighbor cache */
+#ifdef UIP_DS6_NBR_CONF_HASH_BUCKETS
+#define UIP_DS6_NBR_HASH_BUCKETS UIP_DS6_NBR_CONF_HASH_BUCKETS
+#else
+#define UIP_DS6_NBR_HASH_BUCKETS 8
+#endif /* UIP_DS6_NBR_CONF_HASH_BUCKETS */
+
 NBR_TABLE_GLOBAL(uip_ds6_nbr_t, ds6_neighbors);
 
+/* Neighbors indexed by IPv6 address */
+static uip_ds6_nbr_t *nbr_hash[UIP_DS6_NBR_HASH_BUCKETS];
+
+/* Last neighbor found by link-layer address */
+static uip_ds6_nbr_t *last_ll_nbr;
+
+#if UIP_ND6_SEND_NS
+/*
+ * Expiry queues of the neighbors in the states that need periodic
+ * processing. Entries in the REACHABLE and DELAY queues all get the same
+ * timeout when they enter the queue, so they expire in queue order. The
+ * INCOMPLETE and PROBE queues only hold neighbors being solicited.
+ * STALE neighbors need no processing and are not queued.
+ */
+LIST(incomplete_nbrs);
+LIST(reachable_nbrs);
+LIST(delay_nbrs);
+LIST(probe_nbrs);
+#endif /* UIP_ND6_SEND_NS */
+
 /*---------------------------------------------------------------------------*/
 void
 uip_ds6_neighbors_init(void)
 {
   link_stats_init();
   nbr_table_register(ds6_neighbors, (nbr_table_callback *)uip_ds6_nbr_rm);
+  memset(nbr_hash, 0, sizeof(nbr_hash));
+  last_ll_nbr = NULL;
+#if UIP_ND6_SEND_NS
+  list_init(incomplete_nbrs);
+  list_init(reachable_nbrs);
+  list_init(delay_nbrs);
+  list_init(probe_nbrs);
+#endif /* UIP_ND6_SEND_NS */
+}
+/*---------------------------------------------------------------------------*/
+static uint8_t
+nbr_hash_index(const uip_ipaddr_t *ipaddr)
+{
+  return (ipaddr->u8[13] ^ ipaddr->u8[14] ^ ipaddr->u8[15]) %
+    UIP_DS6_NBR_HASH_BUCKETS;
+}
+/*---------------------------------------------------------------------------*/
+#if UIP_ND6_SEND_NS
+static list_t
+state_queue(uint8_t state)
+{
+  switch(state) {
+  case NBR_INCOMPLETE:
+    return incomplete_nbrs;
+  case NBR_REACHABLE:
+    return reachable_nbrs;
+  case NBR_DELAY:
+    return delay_nbrs;
+  case NBR_PROBE:
+    return probe_nbrs;
+  default:
+    return NULL;
+  }
+}
+#endif /* UIP_ND6_SEND_NS */
+/*---------------------------------------------------------------------------*/
+/* Remove a neighbor from the address index and from its expiry queue */
+static void
+nbr_unlink(uip_ds6_nbr_t *nbr)
+{
+  uip_ds6_nbr_t **prev;
+#if UIP_ND6_SEND_NS
+  list_t queue;
+
+  queue = state_queue(nbr->state);
+  if(queue != NULL) {
+    list_remove(queue, nbr);
+  }
+#endif /* UIP_ND6_SEND_NS */
+
+  for(prev = &nbr_hash[nbr_hash_index(&nbr->ipaddr)]; *prev != NULL;
+      prev = &(*prev)->hash_next) {
+    if(*prev == nbr) {
+      *prev = nbr->hash_next;
+      break;
+    }
+  }
+
+  if(last_ll_nbr == nbr) {
+    last_ll_nbr = NULL;
+  }
+}
+/*---------------------------------------------------------------------------*/
+void
+uip_ds6_nbr_set_state(uip_ds6_nbr_t *nbr, uint8_t state)
+{
+#if UIP_ND6_SEND_NS
+  list_t queue;
+
+  queue = state_queue(nbr->state);
+  if(queue != NULL) {
+    list_remove(queue, nbr);
+  }
+
+  switch(state) {
+  case NBR_REACHABLE:
+    stimer_set(&nbr->reachable, UIP_ND6_REACHABLE_TIME / 1000);
+    break;
+  case NBR_DELAY:
+    stimer_set(&nbr->reachable, UIP_ND6_DELAY_FIRST_PROBE_TIME);
+    nbr->nscount = 0;
+    break;
+  case NBR_PROBE:
+    stimer_set(&nbr->sendns, 0);
+    nbr->nscount = 0;
+    break;
+  default:
+    break;
+  }
+
+  queue = state_queue(state);
+  if(queue != NULL) {
+    list_add(queue, nbr);
+  }
+#endif /* UIP_ND6_SEND_NS */
+  nbr->state = state;
 }
 /*---------------------------------------------------------------------------*/
 uip_ds6_nbr_t *
@@ -84,14 +207,25 @@ uip_ds6_nbr_add(const uip_ipaddr_t *ipaddr, const uip_lladdr_t *lladdr,
                 uint8_t isrouter, uint8_t state, nbr_table_reason_t reason,
                 void *data)
 {
-  uip_ds6_nbr_t *nbr = nbr_table_add_lladdr(ds6_neighbors, (linkaddr_t*)lladdr
-                                            , reason, data);
+  uip_ds6_nbr_t *nbr;
+  uint8_t h;
+
+  /* Adding an existing link-layer address clears its entry, unlink it first */
+  nbr = nbr_table_get_from_lladdr(ds6_neighbors, (linkaddr_t*)lladdr);
+  if(nbr != NULL) {
+    nbr_unlink(nbr);
+  }
+
+  nbr = nbr_table_add_lladdr(ds6_neighbors, (linkaddr_t*)lladdr
+                             , reason, data);
   if(nbr) {
     uip_ipaddr_copy(&nbr->ipaddr, ipaddr);
+    h = nbr_hash_index(ipaddr);
+    nbr->hash_next = nbr_hash[h];
+    nbr_hash[h] = nbr;
 #if UIP_ND6_SEND_RA || !UIP_CONF_ROUTER
     nbr->isrouter = isrouter;
 #endif /* UIP_ND6_SEND_RA || !UIP_CONF_ROUTER */
-    nbr->state = state;
 #if UIP_CONF_IPV6_QUEUE_PKT
     uip_packetqueue_new(&nbr->packethandle);
 #endif /* UIP_CONF_IPV6_QUEUE_PKT */
@@ -99,15 +233,14 @@ uip_ds6_nbr_add(const uip_ipaddr_t *ipaddr, const uip_lladdr_t *lladdr,
     nbr->netif_idx = if_ds6_selector; // associate the neighbor to the current interface
 #endif /* UIP_CONF_DS6_INTERFACES_NUMBER > 1 */
 #if UIP_ND6_SEND_NS
-    if(nbr->state == NBR_REACHABLE) {
-      stimer_set(&nbr->reachable, UIP_ND6_REACHABLE_TIME / 1000);
-    } else {
-      /* We set the timer in expired state */
-      stimer_set(&nbr->reachable, 0);
-    }
+    /* We set the timers in expired state, entering REACHABLE restarts it */
+    stimer_set(&nbr->reachable, 0);
     stimer_set(&nbr->sendns, 0);
     nbr->nscount = 0;
+    /* A fresh entry is in no expiry queue yet */
+    nbr->state = NBR_STALE;
 #endif /* UIP_ND6_SEND_NS */
+    uip_ds6_nbr_set_state(nbr, state);
     PRINTF("Adding neighbor with ip addr ");
     PRINT6ADDR(ipaddr);
     PRINTF(" link addr ");
@@ -134,6 +267,7 @@ uip_ds6_nbr_rm(uip_ds6_nbr_t *nbr)
     uip_packetqueue_free(&nbr->packethandle);
 #endif /* UIP_CONF_IPV6_QUEUE_PKT */
     NEIGHBOR_STATE_CHANGED(nbr);
+    nbr_unlink(nbr);
     return nbr_table_remove(ds6_neighbors, nbr);
   }
   return 0;
@@ -171,13 +305,13 @@ uip_ds6_nbr_num(void)
 uip_ds6_nbr_t *
 uip_ds6_nbr_lookup(const uip_ipaddr_t *ipaddr)
 {
-  uip_ds6_nbr_t *nbr = nbr_table_head(ds6_neighbors);
+  uip_ds6_nbr_t *nbr;
   if(ipaddr != NULL) {
-    while(nbr != NULL) {
+    for(nbr = nbr_hash[nbr_hash_index(ipaddr)]; nbr != NULL;
+        nbr = nbr->hash_next) {
       if(uip_ipaddr_cmp(&nbr->ipaddr, ipaddr)) {
         return nbr;
       }
-      nbr = nbr_table_next(ds6_neighbors, nbr);
     }
   }
   return NULL;
@@ -186,7 +320,17 @@ uip_ds6_nbr_lookup(const uip_ipaddr_t *ipaddr)
 uip_ds6_nbr_t *
 uip_ds6_nbr_ll_lookup(const uip_lladdr_t *lladdr)
 {
-  return nbr_table_get_from_lladdr(ds6_neighbors, (linkaddr_t*)lladdr);
+  const linkaddr_t *last_lladdr;
+
+  /* Consecutive packets mostly go to the same next hop */
+  if(lladdr != NULL && last_ll_nbr != NULL) {
+    last_lladdr = nbr_table_get_lladdr(ds6_neighbors, last_ll_nbr);
+    if(last_lladdr != NULL && linkaddr_cmp(last_lladdr, (linkaddr_t*)lladdr)) {
+      return last_ll_nbr;
+    }
+  }
+  last_ll_nbr = nbr_table_get_from_lladdr(ds6_neighbors, (linkaddr_t*)lladdr);
+  return last_ll_nbr;
 }
 
 /*---------------------------------------------------------------------------*/
@@ -240,8 +384,7 @@ uip_ds6_link_neighbor_callback(int status, int numtx)
     uip_ds6_nbr_t *nbr;
     nbr = uip_ds6_nbr_ll_lookup((uip_lladdr_t *)dest);
     if(nbr != NULL && nbr->state != NBR_INCOMPLETE) {
-      nbr->state = NBR_REACHABLE;
-      stimer_set(&nbr->reachable, UIP_ND6_REACHABLE_TIME / 1000);
+      uip_ds6_nbr_set_state(nbr, NBR_REACHABLE);
       PRINTF("uip-ds6-neighbor : received a link layer ACK : ");
       PRINTLLADDR((uip_lladdr_t *)dest);
       PRINTF(" is reachable.\n");
@@ -256,85 +399,100 @@ uip_ds6_link_neighbor_callback(int status, int numtx)
 void
 uip_ds6_neighbor_periodic(void)
 {
-  uip_ds6_nbr_t *nbr = nbr_table_head(ds6_neighbors);
-  while(nbr != NULL) {
+  uip_ds6_nbr_t *nbr;
+  uip_ds6_nbr_t *next;
+
+  for(nbr = list_head(reachable_nbrs); nbr != NULL; nbr = next) {
+    next = list_item_next(nbr);
+    if(!stimer_expired(&nbr->reachable)) {
+      /* The rest of the queue expires later */
+      break;
+    }
 #if UIP_CONF_DS6_INTERFACES_NUMBER > 1
-	/* update only neighbors of the selected interface */
-	if(nbr->netif_idx != if_ds6_selector) {
-		nbr = nbr_table_next(ds6_neighbors, nbr);
-		continue;
-	}
+    /* update only neighbors of the selected interface */
+    if(nbr->netif_idx != if_ds6_selector) {
+      continue;
+    }
 #endif /* UIP_CONF_DS6_INTERFACES_NUMBER > 1 */
-    switch(nbr->state) {
-    case NBR_REACHABLE:
-      if(stimer_expired(&nbr->reachable)) {
 #if UIP_CONF_IPV6_RPL
-        /* when a neighbor leave its REACHABLE state and is a default router,
-           instead of going to STALE state it enters DELAY state in order to
-           force a NUD on it. Otherwise, if there is no upward traffic, the
-           node never knows if the default router is still reachable. This
-           mimics the 6LoWPAN-ND behavior.
-         */
-        if(uip_ds6_defrt_lookup(&nbr->ipaddr) != NULL) {
-          PRINTF("REACHABLE: defrt moving to DELAY (");
-          PRINT6ADDR(&nbr->ipaddr);
-          PRINTF(")\n");
-          nbr->state = NBR_DELAY;
-          stimer_set(&nbr->reachable, UIP_ND6_DELAY_FIRST_PROBE_TIME);
-          nbr->nscount = 0;
-        } else {
-          PRINTF("REACHABLE: moving to STALE (");
-          PRINT6ADDR(&nbr->ipaddr);
-          PRINTF(")\n");
-          nbr->state = NBR_STALE;
-        }
+    /* when a neighbor leave its REACHABLE state and is a default router,
+       instead of going to STALE state it enters DELAY state in order to
+       force a NUD on it. Otherwise, if there is no upward traffic, the
+       node never knows if the default router is still reachable. This
+       mimics the 6LoWPAN-ND behavior.
+     */
+    if(uip_ds6_defrt_lookup(&nbr->ipaddr) != NULL) {
+      PRINTF("REACHABLE: defrt moving to DELAY (");
+      PRINT6ADDR(&nbr->ipaddr);
+      PRINTF(")\n");
+      uip_ds6_nbr_set_state(nbr, NBR_DELAY);
+    } else {
+      PRINTF("REACHABLE: moving to STALE (");
+      PRINT6ADDR(&nbr->ipaddr);
+      PRINTF(")\n");
+      uip_ds6_nbr_set_state(nbr, NBR_STALE);
+    }
 #else /* UIP_CONF_IPV6_RPL */
-        PRINTF("REACHABLE: moving to STALE (");
-        PRINT6ADDR(&nbr->ipaddr);
-        PRINTF(")\n");
-        nbr->state = NBR_STALE;
+    PRINTF("REACHABLE: moving to STALE (");
+    PRINT6ADDR(&nbr->ipaddr);
+    PRINTF(")\n");
+    uip_ds6_nbr_set_state(nbr, NBR_STALE);
 #endif /* UIP_CONF_IPV6_RPL */
-      }
-      break;
-    case NBR_INCOMPLETE:
-      if(nbr->nscount >= UIP_ND6_MAX_MULTICAST_SOLICIT) {
-        uip_ds6_nbr_rm(nbr);
-      } else if(stimer_expired(&nbr->sendns) && (uip_len == 0)) {
-        nbr->nscount++;
-        PRINTF("NBR_INCOMPLETE: NS %u\n", nbr->nscount);
-        uip_nd6_ns_output(NULL, NULL, &nbr->ipaddr);
-        stimer_set(&nbr->sendns, uip_ds6_if.retrans_timer / 1000);
-      }
-      break;
-    case NBR_DELAY:
-      if(stimer_expired(&nbr->reachable)) {
-        nbr->state = NBR_PROBE;
-        nbr->nscount = 0;
-        PRINTF("DELAY: moving to PROBE\n");
-        stimer_set(&nbr->sendns, 0);
-      }
+  }
+
+  for(nbr = list_head(delay_nbrs); nbr != NULL; nbr = next) {
+    next = list_item_next(nbr);
+    if(!stimer_expired(&nbr->reachable)) {
       break;
-    case NBR_PROBE:
-      if(nbr->nscount >= UIP_ND6_MAX_UNICAST_SOLICIT) {
-        uip_ds6_defrt_t *locdefrt;
-        PRINTF("PROBE END\n");
-        if((locdefrt = uip_ds6_defrt_lookup(&nbr->ipaddr)) != NULL) {
-          if (!locdefrt->isinfinite) {
-            uip_ds6_defrt_rm(locdefrt);
-          }
+    }
+#if UIP_CONF_DS6_INTERFACES_NUMBER > 1
+    if(nbr->netif_idx != if_ds6_selector) {
+      continue;
+    }
+#endif /* UIP_CONF_DS6_INTERFACES_NUMBER > 1 */
+    PRINTF("DELAY: moving to PROBE\n");
+    uip_ds6_nbr_set_state(nbr, NBR_PROBE);
+  }
+
+  for(nbr = list_head(incomplete_nbrs); nbr != NULL; nbr = next) {
+    next = list_item_next(nbr);
+#if UIP_CONF_DS6_INTERFACES_NUMBER > 1
+    if(nbr->netif_idx != if_ds6_selector) {
+      continue;
+    }
+#endif /* UIP_CONF_DS6_INTERFACES_NUMBER > 1 */
+    if(nbr->nscount >= UIP_ND6_MAX_MULTICAST_SOLICIT) {
+      uip_ds6_nbr_rm(nbr);
+    } else if(stimer_expired(&nbr->sendns) && (uip_len == 0)) {
+      nbr->nscount++;
+      PRINTF("NBR_INCOMPLETE: NS %u\n", nbr->nscount);
+      uip_nd6_ns_output(NULL, NULL, &nbr->ipaddr);
+      stimer_set(&nbr->sendns, uip_ds6_if.retrans_timer / 1000);
+    }
+  }
+
+  for(nbr = list_head(probe_nbrs); nbr != NULL; nbr = next) {
+    next = list_item_next(nbr);
+#if UIP_CONF_DS6_INTERFACES_NUMBER > 1
+    if(nbr->netif_idx != if_ds6_selector) {
+      continue;
+    }
+#endif /* UIP_CONF_DS6_INTERFACES_NUMBER > 1 */
+    if(nbr->nscount >= UIP_ND6_MAX_UNICAST_SOLICIT) {
+      uip_ds6_defrt_t *locdefrt;
+      PRINTF("PROBE END\n");
+      if((locdefrt = uip_ds6_defrt_lookup(&nbr->ipaddr)) != NULL) {
+        if (!locdefrt->isinfinite) {
+          uip_ds6_defrt_rm(locdefrt);
         }
-        uip_ds6_nbr_rm(nbr);
-      } else if(stimer_expired(&nbr->sendns) && (uip_len == 0)) {
-        nbr->nscount++;
-        PRINTF("PROBE: NS %u\n", nbr->nscount);
-        uip_nd6_ns_output(NULL, &nbr->ipaddr, &nbr->ipaddr);
-        stimer_set(&nbr->sendns, uip_ds6_if.retrans_timer / 1000);
       }
-      break;
-    default:
-      break;
+      uip_ds6_nbr_rm(nbr);
+    } else if(stimer_expired(&nbr->sendns) && (uip_len == 0)) {
+      nbr->nscount++;
+      PRINTF("PROBE: NS %u\n", nbr->nscount);
+      uip_nd6_ns_output(NULL, &nbr->ipaddr, &nbr->ipaddr);
+      stimer_set(&nbr->sendns, uip_ds6_if.retrans_timer / 1000);
     }
-    nbr = nbr_table_next(ds6_neighbors, nbr);
   }
 }
 /*---------------------------------------------------------------------------*/
@@ -344,9 +502,8 @@ uip_ds6_nbr_refresh_reachable_state(const uip_ipaddr_t *ipaddr)
   uip_ds6_nbr_t *nbr;
   nbr = uip_ds6_nbr_lookup(ipaddr);
   if(nbr != NULL) {
-    nbr->state = NBR_REACHABLE;
+    uip_ds6_nbr_set_state(nbr, NBR_REACHABLE);
     nbr->nscount = 0;
-    stimer_set(&nbr->reachable, UIP_ND6_REACHABLE_TIME / 1000);
   }
 }
 /*---------------------------------------------------------------------------*/
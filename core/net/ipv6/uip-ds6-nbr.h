@@ -66,6 +66,10 @@ NBR_TABLE_DECLARE(ds6_neighbors);
 
 /** \brief An entry in the nbr cache */
 typedef struct uip_ds6_nbr {
+#if UIP_ND6_SEND_NS
+  struct uip_ds6_nbr *next;     /* Next entry in the expiry queue of state */
+#endif /* UIP_ND6_SEND_NS */
+  struct uip_ds6_nbr *hash_next;
   uip_ipaddr_t ipaddr;
   uint8_t isrouter;
   uint8_t state;
@@ -91,6 +95,16 @@ uip_ds6_nbr_t *uip_ds6_nbr_add(const uip_ipaddr_t *ipaddr,
                                uint8_t isrouter, uint8_t state,
                                nbr_table_reason_t reason, void *data);
 int uip_ds6_nbr_rm(uip_ds6_nbr_t *nbr);
+
+/**
+ * \brief Change the state of a neighbor. State changes must go through this
+ * function so that the neighbor is kept in the expiry queue of its state.
+ * Entering REACHABLE or DELAY (re)starts the reachable timer, and entering
+ * PROBE restarts the probing.
+ * \param nbr the neighbor
+ * \param state the new state (NBR_INCOMPLETE ... NBR_PROBE)
+ */
+void uip_ds6_nbr_set_state(uip_ds6_nbr_t *nbr, uint8_t state);
 const uip_lladdr_t *uip_ds6_nbr_get_ll(const uip_ds6_nbr_t *nbr);
 const uip_ipaddr_t *uip_ds6_nbr_get_ipaddr(const uip_ds6_nbr_t *nbr);
 uip_ds6_nbr_t *uip_ds6_nbr_lookup(const uip_ipaddr_t *ipaddr);
@@ -241,10 +241,10 @@ ns_input(void)
               /* failed to update the lladdr */
               goto discard;
             }
-            nbr->state = NBR_STALE;
+            uip_ds6_nbr_set_state(nbr, NBR_STALE);
           } else {
             if(nbr->state == NBR_INCOMPLETE) {
-              nbr->state = NBR_STALE;
+              uip_ds6_nbr_set_state(nbr, NBR_STALE);
             }
           }
         }
@@ -551,13 +551,13 @@ na_input(void)
        * See: uip_ds6_nbr_refresh_reachable_state()
        */
       if(!is_solicited) {
-        nbr->state = NBR_STALE;
+        uip_ds6_nbr_set_state(nbr, NBR_STALE);
       }
       nbr->isrouter = is_router;
     } else { /* NBR is not INCOMPLETE */
       if(!is_override && is_llchange) {
         if(nbr->state == NBR_REACHABLE) {
-          nbr->state = NBR_STALE;
+          uip_ds6_nbr_set_state(nbr, NBR_STALE);
         }
         goto discard;
       } else {
@@ -927,7 +927,7 @@ ra_input(void)
           goto discard;
         }
         if(nbr->state == NBR_INCOMPLETE) {
-          nbr->state = NBR_STALE;
+          uip_ds6_nbr_set_state(nbr, NBR_STALE);
         }
         if(memcmp(&nd6_opt_llao[UIP_ND6_OPT_DATA_OFFSET],
                   lladdr, UIP_LLADDR_LEN) != 0) {
@@ -936,7 +936,7 @@ ra_input(void)
             /* failed to update the lladdr */
             goto discard;
           }
-          nbr->state = NBR_STALE;
+          uip_ds6_nbr_set_state(nbr, NBR_STALE);
         }
         nbr->isrouter = 1;
       }
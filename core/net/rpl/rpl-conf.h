@@ -338,4 +338,36 @@
 #define RPL_DIS_START_DELAY             5
 #endif
 
+/*
+ * DIO batching. When enabled, incoming DIOs are queued and processed
+ * together once per RPL_DIO_BATCH_WINDOW. A DIO replaces any queued DIO
+ * from the same sender for the same instance, and DIOs arriving while
+ * the queue is full are dropped. Parent rank updates resulting from a
+ * batch are processed in a single rank recalculation pass. This limits
+ * the processing load during DIO storms, e.g., on global repair.
+ */
+#ifdef RPL_CONF_WITH_DIO_BATCHING
+#define RPL_WITH_DIO_BATCHING RPL_CONF_WITH_DIO_BATCHING
+#else
+#define RPL_WITH_DIO_BATCHING 0
+#endif
+
+/*
+ * Maximum number of DIOs queued in a batch.
+ */
+#ifdef RPL_CONF_DIO_BATCH_SIZE
+#define RPL_DIO_BATCH_SIZE RPL_CONF_DIO_BATCH_SIZE
+#else
+#define RPL_DIO_BATCH_SIZE 4
+#endif
+
+/*
+ * Time during which DIOs are collected before a batch is processed.
+ */
+#ifdef RPL_CONF_DIO_BATCH_WINDOW
+#define RPL_DIO_BATCH_WINDOW RPL_CONF_DIO_BATCH_WINDOW
+#else
+#define RPL_DIO_BATCH_WINDOW (CLOCK_SECOND / 8)
+#endif
+
 #endif /* RPL_CONF_H */
@@ -50,6 +50,7 @@
 #include "net/ipv6/uip-nd6.h"
 #include "net/ipv6/uip-ds6-nbr.h"
 #include "net/nbr-table.h"
+#include "net/packetbuf.h"
 #include "net/ipv6/multicast/uip-mcast6.h"
 #include "lib/list.h"
 #include "lib/memb.h"
@@ -87,6 +88,29 @@ NBR_TABLE_GLOBAL(rpl_parent_t, rpl_parents);
 rpl_instance_t instance_table[RPL_MAX_INSTANCES];
 rpl_instance_t *default_instance;
 
+#if RPL_WITH_DIO_BATCHING
+/* DIOs waiting to be processed in the next batch. */
+struct queued_dio {
+  struct queued_dio *next;
+  uip_ipaddr_t from;
+  uip_lladdr_t lladdr;
+  rpl_dio_t dio;
+  /* Set when the sender was accepted as a candidate parent. */
+  uint8_t accepted;
+};
+MEMB(queued_dio_memb, struct queued_dio, RPL_DIO_BATCH_SIZE);
+LIST(queued_dio_list);
+static struct ctimer dio_batch_timer;
+/* The queued DIO being processed, or NULL outside of a batch. The
+   packetbuf no longer holds its link-layer sender. */
+static struct queued_dio *dio_batch_current;
+/* Instances whose parents were updated by the batch. */
+static struct {
+  uint8_t dags;       /* Bitmask of DAGs in dag_table with updated parents */
+  uint8_t had_parent; /* A preferred parent was set when the batch began */
+} dio_batch_instances[RPL_MAX_INSTANCES];
+#endif /* RPL_WITH_DIO_BATCHING */
+
 /*---------------------------------------------------------------------------*/
 void
 rpl_print_neighbor_list(void)
@@ -139,6 +163,10 @@ void
 rpl_dag_init(void)
 {
   nbr_table_register(rpl_parents, (nbr_table_callback *)nbr_callback);
+#if RPL_WITH_DIO_BATCHING
+  memb_init(&queued_dio_memb);
+  list_init(queued_dio_list);
+#endif /* RPL_WITH_DIO_BATCHING */
 }
 /*---------------------------------------------------------------------------*/
 rpl_parent_t *
@@ -257,6 +285,51 @@ rpl_set_preferred_parent(rpl_dag_t *dag, rpl_parent_t *p)
   }
 }
 /*---------------------------------------------------------------------------*/
+/* Take a parent out of the path cost ordered parent list of its DAG. */
+static void
+unlink_parent(rpl_parent_t *p)
+{
+  if(p->dag != NULL && p->dag->parents != NULL) {
+    list_remove(p->dag->parents, p);
+  }
+}
+/*---------------------------------------------------------------------------*/
+/* Insert a parent in the parent list of its DAG, which is kept sorted by
+   ascending path cost. Parents of equal cost keep their insertion order. */
+static void
+link_parent(rpl_parent_t *p)
+{
+  rpl_dag_t *dag;
+  rpl_parent_t *prev;
+  rpl_parent_t *q;
+
+  dag = p->dag;
+  if(dag == NULL || dag->parents == NULL) {
+    return;
+  }
+
+  if(dag->instance != NULL && dag->instance->of != NULL) {
+    p->path_cost = dag->instance->of->parent_path_cost(p);
+  } else {
+    p->path_cost = 0xffff;
+  }
+
+  prev = NULL;
+  for(q = list_head(dag->parents);
+      q != NULL && q->path_cost <= p->path_cost;
+      q = list_item_next(q)) {
+    prev = q;
+  }
+  list_insert(dag->parents, prev, p);
+}
+/*---------------------------------------------------------------------------*/
+void
+rpl_update_parent_order(rpl_parent_t *p)
+{
+  unlink_parent(p);
+  link_parent(p);
+}
+/*---------------------------------------------------------------------------*/
 /* Greater-than function for the lollipop counter.                      */
 /*---------------------------------------------------------------------------*/
 static int
@@ -601,6 +674,7 @@ rpl_alloc_dag(uint8_t instance_id, uip_ipaddr_t *dag_id)
       dag->rank = INFINITE_RANK;
       dag->min_rank = INFINITE_RANK;
       dag->instance = instance;
+      LIST_STRUCT_INIT(dag, parents);
       return dag;
     }
   }
@@ -688,6 +762,12 @@ rpl_add_parent(rpl_dag_t *dag, rpl_dio_t *dio, uip_ipaddr_t *addr)
   PRINT6ADDR(addr);
   PRINTF("\n");
   if(lladdr != NULL) {
+    /* The neighbor table clears an existing entry on insertion, so take it
+       out of its DAG parent list first. */
+    p = nbr_table_get_from_lladdr(rpl_parents, (linkaddr_t *)lladdr);
+    if(p != NULL) {
+      unlink_parent(p);
+    }
     /* Add parent in rpl_parents - again this is due to DIO */
     p = nbr_table_add_lladdr(rpl_parents, (linkaddr_t *)lladdr,
                              NBR_TABLE_REASON_RPL_DIO, dio);
@@ -700,6 +780,7 @@ rpl_add_parent(rpl_dag_t *dag, rpl_dio_t *dio, uip_ipaddr_t *addr)
 #if RPL_WITH_MC
       memcpy(&p->mc, &dio->mc, sizeof(p->mc));
 #endif /* RPL_WITH_MC */
+      link_parent(p);
     }
   }
 
@@ -849,46 +930,75 @@ rpl_select_dag(rpl_instance_t *instance, rpl_parent_t *p)
   return best_dag;
 }
 /*---------------------------------------------------------------------------*/
+static int
+parent_is_candidate(rpl_dag_t *dag, rpl_parent_t *p, int fresh_only)
+{
+  /* Exclude parents from other DAGs or announcing an infinite rank */
+  if(p->dag != dag || p->rank == INFINITE_RANK || p->rank < ROOT_RANK(dag->instance)) {
+    if(p->rank < ROOT_RANK(dag->instance)) {
+      PRINTF("RPL: Parent has invalid rank\n");
+    }
+    return 0;
+  }
+
+  if(fresh_only && !rpl_parent_is_fresh(p)) {
+    /* Filter out non-fresh parents if fresh_only is set */
+    return 0;
+  }
+
+#if UIP_ND6_SEND_NS
+  {
+  uip_ds6_nbr_t *nbr = rpl_get_nbr(p);
+  /* Exclude links to a neighbor that is not reachable at a NUD level */
+  if(nbr == NULL || nbr->state != NBR_REACHABLE) {
+    return 0;
+  }
+  }
+#endif /* UIP_ND6_SEND_NS */
+
+  return 1;
+}
+/*---------------------------------------------------------------------------*/
 static rpl_parent_t *
 best_parent(rpl_dag_t *dag, int fresh_only)
 {
   rpl_parent_t *p;
   rpl_of_t *of;
   rpl_parent_t *best = NULL;
+  int preferred_seen = 0;
 
   if(dag == NULL || dag->instance == NULL || dag->instance->of == NULL) {
     return NULL;
   }
 
   of = dag->instance->of;
-  /* Search for the best parent according to the OF */
-  for(p = nbr_table_head(rpl_parents); p != NULL; p = nbr_table_next(rpl_parents, p)) {
-
-    /* Exclude parents from other DAGs or announcing an infinite rank */
-    if(p->dag != dag || p->rank == INFINITE_RANK || p->rank < ROOT_RANK(dag->instance)) {
-      if(p->rank < ROOT_RANK(dag->instance)) {
-        PRINTF("RPL: Parent has invalid rank\n");
-      }
-      continue;
+  /*
+   * The DAG parent list is sorted by path cost, so we only need to ask
+   * the OF to compare the cheapest acceptable parents, which may tie.
+   * Every change of a parent rank or link metric re-sorts the parent
+   * with rpl_update_parent_order(), so the cached costs are current.
+   * The preferred parent is compared separately, since the OF may stick
+   * to it even when a cheaper parent is around.
+   */
+  for(p = list_head(dag->parents); p != NULL; p = list_item_next(p)) {
+    if(best != NULL && p->path_cost > best->path_cost) {
+      /* All remaining parents are more expensive than the best one */
+      break;
     }
 
-    if(fresh_only && !rpl_parent_is_fresh(p)) {
-      /* Filter out non-fresh parents if fresh_only is set */
-      continue;
+    if(p == dag->preferred_parent) {
+      preferred_seen = 1;
     }
 
-#if UIP_ND6_SEND_NS
-    {
-    uip_ds6_nbr_t *nbr = rpl_get_nbr(p);
-    /* Exclude links to a neighbor that is not reachable at a NUD level */
-    if(nbr == NULL || nbr->state != NBR_REACHABLE) {
-      continue;
-    }
+    if(parent_is_candidate(dag, p, fresh_only)) {
+      /* Now we have an acceptable parent, check if it is the new best */
+      best = of->best_parent(best, p);
     }
-#endif /* UIP_ND6_SEND_NS */
+  }
 
-    /* Now we have an acceptable parent, check if it is the new best */
-    best = of->best_parent(best, p);
+  if(!preferred_seen && dag->preferred_parent != NULL &&
+     parent_is_candidate(dag, dag->preferred_parent, fresh_only)) {
+    best = of->best_parent(best, dag->preferred_parent);
   }
 
   return best;
@@ -939,6 +1049,7 @@ rpl_remove_parent(rpl_parent_t *parent)
 
   rpl_nullify_parent(parent);
 
+  unlink_parent(parent);
   nbr_table_remove(rpl_parents, parent);
 }
 /*---------------------------------------------------------------------------*/
@@ -998,7 +1109,9 @@ rpl_move_parent(rpl_dag_t *dag_src, rpl_dag_t *dag_dst, rpl_parent_t *parent)
   PRINT6ADDR(rpl_get_parent_ipaddr(parent));
   PRINTF("\n");
 
+  unlink_parent(parent);
   parent->dag = dag_dst;
+  link_parent(parent);
 }
 /*---------------------------------------------------------------------------*/
 int
@@ -1218,6 +1331,7 @@ rpl_add_dag(uip_ipaddr_t *from, rpl_dio_t *dio)
     }
   }
   p->rank = dio->rank;
+  rpl_update_parent_order(p);
 
   /* Determine the objective function by using the
      objective code point of the DIO. */
@@ -1358,18 +1472,16 @@ rpl_recalculate_ranks(void)
   }
 }
 /*---------------------------------------------------------------------------*/
-int
-rpl_process_parent_event(rpl_instance_t *instance, rpl_parent_t *p)
+/*
+ * Handles the part of a parent event that does not depend on the DAG
+ * selection. Returns 0 if the parent has an unacceptable rank, in which
+ * case it has been nullified.
+ */
+static int
+check_parent(rpl_instance_t *instance, rpl_parent_t *p)
 {
-  int return_value;
-  rpl_parent_t *last_parent = instance->current_dag->preferred_parent;
-
-#if DEBUG
-  rpl_rank_t old_rank;
-  old_rank = instance->current_dag->rank;
-#endif /* DEBUG */
-
-  return_value = 1;
+  /* The rank or link metric of the parent may have changed. */
+  rpl_update_parent_order(p);
 
   if(RPL_IS_STORING(instance)
       && uip_ds6_route_is_nexthop(rpl_get_parent_ipaddr(p))
@@ -1386,6 +1498,25 @@ rpl_process_parent_event(rpl_instance_t *instance, rpl_parent_t *p)
     PRINTF("RPL: Unacceptable rank %u (Current min %u, MaxRankInc %u)\n", (unsigned)p->rank,
         p->dag->min_rank, p->dag->instance->max_rankinc);
     rpl_nullify_parent(p);
+    return 0;
+  }
+  return 1;
+}
+/*---------------------------------------------------------------------------*/
+int
+rpl_process_parent_event(rpl_instance_t *instance, rpl_parent_t *p)
+{
+  int return_value;
+  rpl_parent_t *last_parent = instance->current_dag->preferred_parent;
+
+#if DEBUG
+  rpl_rank_t old_rank;
+  old_rank = instance->current_dag->rank;
+#endif /* DEBUG */
+
+  return_value = 1;
+
+  if(!check_parent(instance, p)) {
     if(p != instance->current_dag->preferred_parent) {
       return 0;
     } else {
@@ -1423,8 +1554,19 @@ rpl_process_parent_event(rpl_instance_t *instance, rpl_parent_t *p)
 static int
 add_nbr_from_dio(uip_ipaddr_t *from, rpl_dio_t *dio)
 {
+  uip_ds6_nbr_t *nbr;
+
   /* add this to the neighbor cache if not already there */
-  if(rpl_icmp6_update_nbr_table(from, NBR_TABLE_REASON_RPL_DIO, dio) == NULL) {
+#if RPL_WITH_DIO_BATCHING
+  if(dio_batch_current != NULL) {
+    nbr = rpl_icmp6_update_nbr_table_lladdr(from, &dio_batch_current->lladdr,
+                                            NBR_TABLE_REASON_RPL_DIO, dio);
+  } else
+#endif /* RPL_WITH_DIO_BATCHING */
+  {
+    nbr = rpl_icmp6_update_nbr_table(from, NBR_TABLE_REASON_RPL_DIO, dio);
+  }
+  if(nbr == NULL) {
     PRINTF("RPL: Out of memory, dropping DIO from ");
     PRINT6ADDR(from);
     PRINTF("\n");
@@ -1433,6 +1575,52 @@ add_nbr_from_dio(uip_ipaddr_t *from, rpl_dio_t *dio)
   return 1;
 }
 /*---------------------------------------------------------------------------*/
+static int
+process_parent_event_from_dio(rpl_instance_t *instance, rpl_parent_t *p)
+{
+#if RPL_WITH_DIO_BATCHING
+  rpl_parent_t *last_parent;
+  int acceptable;
+  int i;
+
+  if(dio_batch_current != NULL) {
+    /* Reject the parent now, but leave the DAG selection to the end of
+       the batch. */
+    last_parent = instance->current_dag->preferred_parent;
+    acceptable = check_parent(instance, p);
+    if(!acceptable && p != last_parent) {
+      return 0;
+    }
+    i = instance - instance_table;
+    if(dio_batch_instances[i].dags == 0) {
+      dio_batch_instances[i].had_parent = last_parent != NULL;
+    }
+    dio_batch_instances[i].dags |= 1 << (p->dag - instance->dag_table);
+    return acceptable;
+  }
+#endif /* RPL_WITH_DIO_BATCHING */
+  return rpl_process_parent_event(instance, p);
+}
+/*---------------------------------------------------------------------------*/
+static void
+process_dio_from_parent(rpl_instance_t *instance, rpl_dag_t *dag,
+                        rpl_parent_t *p, uip_ipaddr_t *from, rpl_dio_t *dio)
+{
+  /* We don't use route control, so we can have only one official parent. */
+  if(dag->joined && p == dag->preferred_parent) {
+    if(should_refresh_routes(instance, dio, p)) {
+      /* Our parent is requesting a new DAO. Increment DTSN in turn,
+       * in both storing and non-storing mode (see RFC6550 section 9.6.) */
+      RPL_LOLLIPOP_INCREMENT(instance->dtsn_out);
+      rpl_schedule_dao(instance);
+    }
+    /* We received a new DIO from our preferred parent.
+     * Call uip_ds6_defrt_add to set a fresh value for the lifetime counter */
+    uip_ds6_defrt_add(from, RPL_DEFAULT_ROUTE_INFINITE_LIFETIME ? 0 : RPL_LIFETIME(instance, instance->default_lifetime));
+  }
+  p->dtsn = dio->dtsn;
+}
+/*---------------------------------------------------------------------------*/
 void
 rpl_process_dio(uip_ipaddr_t *from, rpl_dio_t *dio)
 {
@@ -1608,24 +1796,185 @@ rpl_process_dio(uip_ipaddr_t *from, rpl_dio_t *dio)
 #if RPL_WITH_MC
   memcpy(&p->mc, &dio->mc, sizeof(p->mc));
 #endif /* RPL_WITH_MC */
-  if(rpl_process_parent_event(instance, p) == 0) {
+  /* The new rank and metric container change the path cost */
+  rpl_update_parent_order(p);
+  if(process_parent_event_from_dio(instance, p) == 0) {
     PRINTF("RPL: The candidate parent is rejected\n");
     return;
   }
 
-  /* We don't use route control, so we can have only one official parent. */
-  if(dag->joined && p == dag->preferred_parent) {
-    if(should_refresh_routes(instance, dio, p)) {
-      /* Our parent is requesting a new DAO. Increment DTSN in turn,
-       * in both storing and non-storing mode (see RFC6550 section 9.6.) */
-      RPL_LOLLIPOP_INCREMENT(instance->dtsn_out);
-      rpl_schedule_dao(instance);
+#if RPL_WITH_DIO_BATCHING
+  if(dio_batch_current != NULL) {
+    /* The preferred parent is known only once the batch is processed. */
+    dio_batch_current->accepted = 1;
+    return;
+  }
+#endif /* RPL_WITH_DIO_BATCHING */
+  process_dio_from_parent(instance, dag, p, from, dio);
+}
+/*---------------------------------------------------------------------------*/
+#if RPL_WITH_DIO_BATCHING
+static rpl_parent_t *
+find_dag_parent(rpl_dag_t *dag)
+{
+  rpl_parent_t *p;
+
+  for(p = nbr_table_head(rpl_parents); p != NULL;
+      p = nbr_table_next(rpl_parents, p)) {
+    if(p->dag == dag) {
+      return p;
     }
-    /* We received a new DIO from our preferred parent.
-     * Call uip_ds6_defrt_add to set a fresh value for the lifetime counter */
-    uip_ds6_defrt_add(from, RPL_DEFAULT_ROUTE_INFINITE_LIFETIME ? 0 : RPL_LIFETIME(instance, instance->default_lifetime));
   }
-  p->dtsn = dio->dtsn;
+  return NULL;
+}
+/*---------------------------------------------------------------------------*/
+static void
+select_dag_after_batch(rpl_instance_t *instance, uint8_t dags, int had_parent)
+{
+  rpl_dag_t *dag;
+  rpl_parent_t *p, *candidate;
+  int i;
+
+  /* rpl_select_dag reselects the parent of the DAG it is given. Prefer
+     the current DAG, and reselect the parents of the other DAGs here. */
+  p = NULL;
+  for(i = 0; i < RPL_MAX_DAG_PER_INSTANCE; i++) {
+    dag = &instance->dag_table[i];
+    if(!(dags & (1 << i)) || !dag->used ||
+       (candidate = find_dag_parent(dag)) == NULL) {
+      continue;
+    }
+    if(p == NULL || dag == instance->current_dag) {
+      if(p != NULL) {
+        rpl_select_parent(p->dag);
+      }
+      p = candidate;
+    } else {
+      rpl_select_parent(dag);
+    }
+  }
+
+  if(p == NULL || rpl_select_dag(instance, p) == NULL) {
+    if(had_parent) {
+      /* No suitable parent anymore; trigger a local repair. */
+      PRINTF("RPL: No parents found in any DAG\n");
+      rpl_local_repair(instance);
+    }
+  }
+}
+/*---------------------------------------------------------------------------*/
+static void
+process_dio_batch(void *ptr)
+{
+  struct queued_dio *q;
+  rpl_instance_t *instance;
+  rpl_dag_t *dag;
+  rpl_parent_t *p;
+  int i;
+
+  memset(dio_batch_instances, 0, sizeof(dio_batch_instances));
+  for(q = list_head(queued_dio_list); q != NULL; q = list_item_next(q)) {
+    dio_batch_current = q;
+    rpl_process_dio(&q->from, &q->dio);
+  }
+  dio_batch_current = NULL;
+
+  /* Select the DAG and preferred parent once per instance. */
+  for(i = 0; i < RPL_MAX_INSTANCES; i++) {
+    if(dio_batch_instances[i].dags != 0 && instance_table[i].used) {
+      select_dag_after_batch(&instance_table[i], dio_batch_instances[i].dags,
+                             dio_batch_instances[i].had_parent);
+    }
+  }
+
+  /* Finish processing the DIOs now that the preferred parents are known. */
+  while((q = list_pop(queued_dio_list)) != NULL) {
+    if(q->accepted) {
+      instance = rpl_get_instance(q->dio.instance_id);
+      dag = get_dag(q->dio.instance_id, &q->dio.dag_id);
+      if(instance != NULL && dag != NULL &&
+         (p = rpl_find_parent(dag, &q->from)) != NULL) {
+        process_dio_from_parent(instance, dag, p, &q->from, &q->dio);
+      }
+    }
+    memb_free(&queued_dio_memb, q);
+  }
+}
+/*---------------------------------------------------------------------------*/
+/*
+ * Counts a DIO that is replaced by a newer one from the same sender before
+ * it is processed, so that the trickle redundancy check still sees every
+ * consistent DIO that was received.
+ */
+static void
+count_coalesced_dio(uip_ipaddr_t *from, rpl_dio_t *dio)
+{
+  rpl_instance_t *instance;
+  rpl_dag_t *dag;
+  rpl_parent_t *p;
+
+  instance = rpl_get_instance(dio->instance_id);
+  dag = get_dag(dio->instance_id, &dio->dag_id);
+  if(instance == NULL || dag == NULL || dag->version != dio->version ||
+     dio->rank < ROOT_RANK(instance)) {
+    return;
+  }
+
+  if(dag->rank == ROOT_RANK(instance)) {
+    if(dio->rank != INFINITE_RANK) {
+      instance->dio_counter++;
+    }
+    return;
+  }
+
+  p = rpl_find_parent(dag, from);
+  if(dag->joined && p != NULL && p->rank == dio->rank) {
+    instance->dio_counter++;
+  }
+}
+/*---------------------------------------------------------------------------*/
+void
+rpl_queue_dio(uip_ipaddr_t *from, rpl_dio_t *dio)
+{
+  struct queued_dio *q;
+
+  for(q = list_head(queued_dio_list); q != NULL; q = list_item_next(q)) {
+    if(q->dio.instance_id == dio->instance_id &&
+       uip_ipaddr_cmp(&q->from, from)) {
+      /* Only the most recent DIO from a sender is worth processing. */
+      PRINTF("RPL: Coalescing DIO from ");
+      PRINT6ADDR(from);
+      PRINTF("\n");
+      count_coalesced_dio(&q->from, &q->dio);
+      memcpy(&q->lladdr, packetbuf_addr(PACKETBUF_ADDR_SENDER),
+             sizeof(q->lladdr));
+      memcpy(&q->dio, dio, sizeof(q->dio));
+      RPL_STAT(rpl_stats.dio_coalesced++);
+      return;
+    }
+  }
+
+  q = memb_alloc(&queued_dio_memb);
+  if(q == NULL) {
+    PRINTF("RPL: DIO queue full, dropping DIO from ");
+    PRINT6ADDR(from);
+    PRINTF("\n");
+    RPL_STAT(rpl_stats.dio_suppressed++);
+    return;
+  }
+
+  uip_ipaddr_copy(&q->from, from);
+  q->accepted = 0;
+  memcpy(&q->lladdr, packetbuf_addr(PACKETBUF_ADDR_SENDER),
+         sizeof(q->lladdr));
+  memcpy(&q->dio, dio, sizeof(q->dio));
+
+  if(list_head(queued_dio_list) == NULL) {
+    /* First DIO of a new batch */
+    ctimer_set(&dio_batch_timer, RPL_DIO_BATCH_WINDOW, process_dio_batch, NULL);
+  }
+  list_add(queued_dio_list, q);
 }
+#endif /* RPL_WITH_DIO_BATCHING */
 /*---------------------------------------------------------------------------*/
 /** @} */
@@ -185,24 +185,33 @@ set16(uint8_t *buffer, int pos, uint16_t value)
 }
 /*---------------------------------------------------------------------------*/
 uip_ds6_nbr_t *
-rpl_icmp6_update_nbr_table(uip_ipaddr_t *from, nbr_table_reason_t reason, void *data)
+rpl_icmp6_update_nbr_table_lladdr(uip_ipaddr_t *from,
+                                  const uip_lladdr_t *lladdr,
+                                  nbr_table_reason_t reason, void *data)
 {
   uip_ds6_nbr_t *nbr;
 
   if((nbr = uip_ds6_nbr_lookup(from)) == NULL) {
-    if((nbr = uip_ds6_nbr_add(from, (uip_lladdr_t *)
-                              packetbuf_addr(PACKETBUF_ADDR_SENDER),
+    if((nbr = uip_ds6_nbr_add(from, lladdr,
                               0, NBR_REACHABLE, reason, data)) != NULL) {
       PRINTF("RPL: Neighbor added to neighbor cache ");
       PRINT6ADDR(from);
       PRINTF(", ");
-      PRINTLLADDR((uip_lladdr_t *)packetbuf_addr(PACKETBUF_ADDR_SENDER));
+      PRINTLLADDR(lladdr);
       PRINTF("\n");
     }
   }
 
   return nbr;
- }
+}
+/*---------------------------------------------------------------------------*/
+uip_ds6_nbr_t *
+rpl_icmp6_update_nbr_table(uip_ipaddr_t *from, nbr_table_reason_t reason, void *data)
+{
+  return rpl_icmp6_update_nbr_table_lladdr(from, (uip_lladdr_t *)
+                                           packetbuf_addr(PACKETBUF_ADDR_SENDER),
+                                           reason, data);
+}
 /*---------------------------------------------------------------------------*/
 static void
 dis_input(void)
@@ -459,7 +468,11 @@ dio_input(void)
   RPL_DEBUG_DIO_INPUT(&from, &dio);
 #endif
 
+#if RPL_WITH_DIO_BATCHING
+  rpl_queue_dio(&from, &dio);
+#else /* RPL_WITH_DIO_BATCHING */
   rpl_process_dio(&from, &dio);
+#endif /* RPL_WITH_DIO_BATCHING */
 
  discard:
   uip_clear_buf();
@@ -701,6 +714,7 @@ dao_input_storing(void)
       PRINTF("RPL: Loop detected when receiving a unicast DAO from a node with a lower rank! (%u < %u)\n",
           DAG_RANK(parent->rank, instance), DAG_RANK(dag->rank, instance));
       parent->rank = INFINITE_RANK;
+      rpl_update_parent_order(parent);
       parent->flags |= RPL_PARENT_FLAG_UPDATED;
       return;
     }
@@ -709,6 +723,7 @@ dao_input_storing(void)
     if(parent != NULL && parent == dag->preferred_parent) {
       PRINTF("RPL: Loop detected when receiving a unicast DAO from our parent\n");
       parent->rank = INFINITE_RANK;
+      rpl_update_parent_order(parent);
       parent->flags |= RPL_PARENT_FLAG_UPDATED;
       return;
     }
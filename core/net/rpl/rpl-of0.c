@@ -107,6 +107,7 @@ dao_ack_callback(rpl_parent_t *p, int status)
     /* punish the total lack of ACK with a similar punishment */
     link_stats_packet_sent(rpl_get_parent_lladdr(p), MAC_TX_OK, 10);
   }
+  rpl_update_parent_order(p);
 #endif /* LINK_STATS_CONF_ENABLED */
 }
 #endif /* RPL_WITH_DAO_ACK */
@@ -324,6 +324,8 @@ struct rpl_stats {
   uint16_t loop_errors;
   uint16_t loop_warnings;
   uint16_t root_repairs;
+  uint16_t dio_coalesced;
+  uint16_t dio_suppressed;
 };
 typedef struct rpl_stats rpl_stats_t;
 
@@ -353,12 +355,17 @@ void dao_ack_output(rpl_instance_t *, uip_ipaddr_t *, uint8_t, uint8_t);
 void rpl_icmp6_register_handlers(void);
 uip_ds6_nbr_t *rpl_icmp6_update_nbr_table(uip_ipaddr_t *from,
                                           nbr_table_reason_t r, void *data);
+uip_ds6_nbr_t *rpl_icmp6_update_nbr_table_lladdr(uip_ipaddr_t *from,
+                                                 const uip_lladdr_t *lladdr,
+                                                 nbr_table_reason_t r,
+                                                 void *data);
 
 /* RPL logic functions. */
 void rpl_join_dag(uip_ipaddr_t *from, rpl_dio_t *dio);
 void rpl_join_instance(uip_ipaddr_t *from, rpl_dio_t *dio);
 void rpl_local_repair(rpl_instance_t *instance);
 void rpl_process_dio(uip_ipaddr_t *, rpl_dio_t *);
+void rpl_queue_dio(uip_ipaddr_t *, rpl_dio_t *);
 int rpl_process_parent_event(rpl_instance_t *, rpl_parent_t *);
 
 /* DAG object management. */
@@ -375,6 +382,8 @@ rpl_parent_t *rpl_find_parent_any_dag(rpl_instance_t *instance, uip_ipaddr_t *ad
 void rpl_nullify_parent(rpl_parent_t *);
 void rpl_remove_parent(rpl_parent_t *);
 void rpl_move_parent(rpl_dag_t *dag_src, rpl_dag_t *dag_dst, rpl_parent_t *parent);
+/* Re-sort a parent in its DAG parent list after a rank or metric change. */
+void rpl_update_parent_order(rpl_parent_t *parent);
 rpl_parent_t *rpl_select_parent(rpl_dag_t *dag);
 rpl_dag_t *rpl_select_dag(rpl_instance_t *instance,rpl_parent_t *parent);
 void rpl_recalculate_ranks(void);
@@ -266,6 +266,8 @@ rpl_link_neighbor_callback(const linkaddr_t *addr, int status, int numtx)
       if(parent != NULL) {
         /* Trigger DAG rank recalculation. */
         PRINTF("RPL: rpl_link_neighbor_callback triggering update\n");
+        /* The link metric has changed */
+        rpl_update_parent_order(parent);
         parent->flags |= RPL_PARENT_FLAG_UPDATED;
       }
     }
@@ -291,6 +293,7 @@ rpl_ipv6_neighbor_callback(uip_ds6_nbr_t *nbr)
       p = rpl_find_parent_any_dag(instance, &nbr->ipaddr);
       if(p != NULL) {
         p->rank = INFINITE_RANK;
+        rpl_update_parent_order(p);
         /* Trigger DAG rank recalculation. */
         PRINTF("RPL: rpl_ipv6_neighbor_callback infinite rank\n");
         p->flags |= RPL_PARENT_FLAG_UPDATED;
@@ -112,11 +112,15 @@ struct rpl_dag;
 #define RPL_PARENT_FLAG_LINK_METRIC_VALID 0x2
 
 struct rpl_parent {
+  /* Next parent of the same DAG, in ascending path cost order. */
+  struct rpl_parent *next;
   struct rpl_dag *dag;
 #if RPL_WITH_MC
   rpl_metric_container_t mc;
 #endif /* RPL_WITH_MC */
   rpl_rank_t rank;
+  /* Path cost through this parent, as of its last reordering. */
+  uint16_t path_cost;
   uint8_t dtsn;
   uint8_t flags;
 };
@@ -146,6 +150,8 @@ struct rpl_dag {
   struct rpl_instance *instance;
   rpl_prefix_t prefix_info;
   uint32_t lifetime;
+  /* Candidate parents of this DAG, sorted by path cost. */
+  LIST_STRUCT(parents);
 };
 typedef struct rpl_dag rpl_dag_t;
 typedef struct rpl_instance rpl_instance_t;
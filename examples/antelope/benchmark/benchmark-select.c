@@ -0,0 +1,198 @@
+/*
+ * Copyright (c) 2026, Contiki contributors.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * 3. Neither the name of the copyright holder nor the names of its
+ *    contributors may be used to endorse or promote products derived
+ *    from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE
+ * COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+ * OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/**
+ * \file
+ *	Measures the selection throughput of Antelope for a large relation.
+ *
+ *	Build it with and without batch processing of selections to
+ *	compare the two:
+ *
+ *	  make TARGET=native
+ *	  make TARGET=native DEFINES=DB_SELECT_BATCH_SIZE=32
+ *
+ *	The row cache of the storage layer is enabled with
+ *	DEFINES=DB_STORAGE_PAGE_SIZE=128.
+ */
+
+#include <stdio.h>
+
+#include "contiki.h"
+
+#include "antelope.h"
+#include "relation.h"
+
+#ifndef BENCHMARK_ROWS
+#define BENCHMARK_ROWS		20000
+#endif
+
+#ifndef BENCHMARK_ROUNDS
+#define BENCHMARK_ROUNDS	5
+#endif
+
+static const char *queries[] = {
+  "SELECT time, value FROM samples WHERE value > 900;",
+  "SELECT time, sensor, value FROM samples WHERE sensor = 3 AND value < 100;",
+  "SELECT time, value FROM samples WHERE value * 2 > 1800 OR value < 5;",
+  "SELECT COUNT(value) FROM samples WHERE value > 100;"
+};
+
+PROCESS(benchmark_select, "Antelope selection benchmark");
+AUTOSTART_PROCESSES(&benchmark_select);
+
+static db_result_t
+run_query(db_handle_t *handle, const char *query)
+{
+  db_result_t result;
+
+  result = db_query(handle, query);
+  if(DB_ERROR(result)) {
+    printf("Query \"%s\" failed: %s\n", query, db_get_result_message(result));
+    db_free(handle);
+    return result;
+  }
+
+  while(db_processing(handle)) {
+    result = db_process(handle);
+    if(DB_ERROR(result) || result == DB_FINISHED) {
+      break;
+    }
+  }
+  db_free(handle);
+
+  return DB_ERROR(result) ? result : DB_OK;
+}
+
+PROCESS_THREAD(benchmark_select, ev, data)
+{
+  static db_handle_t handle;
+  static unsigned long row;
+  static unsigned query;
+  static unsigned round;
+  static unsigned long matching;
+  static unsigned long checksum;
+  static clock_time_t start;
+  static relation_t *rel;
+  unsigned long elapsed;
+  attribute_value_t value;
+  db_result_t result;
+  char buf[64];
+
+  PROCESS_BEGIN();
+
+  db_init();
+
+  printf("Antelope selection benchmark: %lu rows, batch size %d\n",
+         (unsigned long)BENCHMARK_ROWS, DB_SELECT_BATCH_SIZE);
+
+  run_query(&handle, "REMOVE RELATION samples;");
+  if(DB_ERROR(run_query(&handle, "CREATE RELATION samples;")) ||
+     DB_ERROR(run_query(&handle, "CREATE ATTRIBUTE time DOMAIN LONG IN samples;")) ||
+     DB_ERROR(run_query(&handle, "CREATE ATTRIBUTE sensor DOMAIN INT IN samples;")) ||
+     DB_ERROR(run_query(&handle, "CREATE ATTRIBUTE value DOMAIN INT IN samples;"))) {
+    PROCESS_EXIT();
+  }
+
+  /* Generate sensor samples with values that are spread evenly. The
+     relation is kept loaded while inserting, as a logging application
+     would do, so that the inserted rows can be written in pages. */
+  rel = relation_load("samples");
+  if(rel == NULL) {
+    PROCESS_EXIT();
+  }
+
+  start = clock_time();
+  for(row = 0; row < BENCHMARK_ROWS; row++) {
+    snprintf(buf, sizeof(buf), "INSERT (%lu, %u, %u) INTO samples;",
+             row * 10, (unsigned)(row % 8), (unsigned)((row * 7919) % 1000));
+    if(DB_ERROR(run_query(&handle, buf))) {
+      relation_release(rel);
+      PROCESS_EXIT();
+    }
+    if(row % 1000 == 0) {
+      PROCESS_PAUSE();
+    }
+  }
+  if(DB_ERROR(relation_release(rel))) {
+    printf("Failed to store the inserted rows\n");
+    PROCESS_EXIT();
+  }
+  printf("Inserted %lu rows in %lu ms\n", (unsigned long)BENCHMARK_ROWS,
+         (unsigned long)(clock_time() - start) * 1000 / CLOCK_SECOND);
+
+  for(query = 0; query < sizeof(queries) / sizeof(queries[0]); query++) {
+    start = clock_time();
+    for(round = 0; round < BENCHMARK_ROUNDS; round++) {
+      result = db_query(&handle, queries[query]);
+      if(DB_ERROR(result)) {
+        printf("Query \"%s\" failed: %s\n", queries[query],
+               db_get_result_message(result));
+        break;
+      }
+
+      matching = checksum = 0;
+      while(db_processing(&handle)) {
+        result = db_process(&handle);
+        if(result == DB_GOT_ROW) {
+          matching++;
+          if(DB_SUCCESS(db_get_value(&value, &handle, 0))) {
+            checksum += db_value_to_long(&value);
+          }
+        } else if(result == DB_FINISHED) {
+          break;
+        } else if(DB_ERROR(result)) {
+          printf("Processing failed: %s\n", db_get_result_message(result));
+          break;
+        }
+      }
+      db_free(&handle);
+    }
+
+    if(DB_ERROR(result)) {
+      continue;
+    }
+
+    elapsed = (unsigned long)(clock_time() - start) * 1000 / CLOCK_SECOND;
+    printf("%s\n  %lu matching rows (checksum %lu), %lu ms for %u rounds",
+           queries[query], matching, checksum, elapsed, BENCHMARK_ROUNDS);
+    if(elapsed > 0) {
+      printf(", %lu rows/s",
+             (unsigned long)BENCHMARK_ROWS * BENCHMARK_ROUNDS * 1000 / elapsed);
+    }
+    printf("\n");
+    PROCESS_PAUSE();
+  }
+
+  run_query(&handle, "REMOVE RELATION samples;");
+  printf("Antelope selection benchmark finished\n");
+
+  PROCESS_END();
+}
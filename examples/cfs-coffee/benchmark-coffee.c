@@ -0,0 +1,152 @@
+/*
+ * Copyright (c) 2026, Contiki contributors.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * 3. Neither the name of the copyright holder nor the names of its
+ *    contributors may be used to endorse or promote products derived
+ *    from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE
+ * COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+ * OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+/*---------------------------------------------------------------------------*/
+/**
+ * \file
+ *         Measures the time that Coffee needs to create, open, and
+ *         look up files when the storage holds many files, and to
+ *         open a file after a reboot. Run it on
+ *         the native platform with and without COFFEE_NAME_INDEX
+ *         to compare the sequential scan with the RAM index.
+ */
+/*---------------------------------------------------------------------------*/
+#include "contiki.h"
+#include "cfs/cfs.h"
+#include "cfs/cfs-coffee.h"
+
+#include <stdio.h>
+/*---------------------------------------------------------------------------*/
+#ifndef BENCHMARK_FILES
+#define BENCHMARK_FILES   256
+#endif
+#ifndef BENCHMARK_ROUNDS
+#define BENCHMARK_ROUNDS  20
+#endif
+/*---------------------------------------------------------------------------*/
+PROCESS(benchmark_coffee_process, "Coffee benchmark process");
+AUTOSTART_PROCESSES(&benchmark_coffee_process);
+/*---------------------------------------------------------------------------*/
+static void
+file_name(char *buf, int i)
+{
+  sprintf(buf, "file-%d", i);
+}
+/*---------------------------------------------------------------------------*/
+static void
+print_time(const char *what, clock_time_t start, unsigned long operations)
+{
+  unsigned long elapsed;
+
+  elapsed = (unsigned long)(clock_time() - start) * 1000 / CLOCK_SECOND;
+  printf("%s: %lu operations in %lu ms\n", what, operations, elapsed);
+}
+/*---------------------------------------------------------------------------*/
+PROCESS_THREAD(benchmark_coffee_process, ev, data)
+{
+  char name[16];
+  clock_time_t start;
+  int i, round, fd, failures;
+
+  PROCESS_BEGIN();
+
+  printf("Coffee benchmark: %d files, %d rounds\n",
+         BENCHMARK_FILES, BENCHMARK_ROUNDS);
+
+  cfs_coffee_format();
+  failures = 0;
+
+  /* Create the files. Each reservation searches for free pages. */
+  start = clock_time();
+  for(i = 0; i < BENCHMARK_FILES; i++) {
+    file_name(name, i);
+    if(cfs_coffee_reserve(name, 1) < 0) {
+      failures++;
+    }
+  }
+  print_time("Reserve", start, BENCHMARK_FILES);
+
+  /* Open the last file after a simulated reboot. With the name index,
+     this includes building the index from the storage. */
+  start = clock_time();
+  for(round = 0; round < BENCHMARK_ROUNDS; round++) {
+    cfs_coffee_remount();
+    file_name(name, BENCHMARK_FILES - 1);
+    fd = cfs_open(name, CFS_READ);
+    if(fd < 0) {
+      failures++;
+    }
+    cfs_close(fd);
+  }
+  print_time("Mount and open", start, BENCHMARK_ROUNDS);
+
+  /* Open every file, as an application does after booting. */
+  start = clock_time();
+  for(round = 0; round < BENCHMARK_ROUNDS; round++) {
+    for(i = 0; i < BENCHMARK_FILES; i++) {
+      file_name(name, i);
+      fd = cfs_open(name, CFS_READ);
+      if(fd < 0) {
+        failures++;
+      }
+      cfs_close(fd);
+    }
+  }
+  print_time("Open", start, (unsigned long)BENCHMARK_FILES * BENCHMARK_ROUNDS);
+
+  /* Look up files that do not exist. */
+  start = clock_time();
+  for(round = 0; round < BENCHMARK_ROUNDS; round++) {
+    for(i = 0; i < BENCHMARK_FILES; i++) {
+      file_name(name, BENCHMARK_FILES + i);
+      fd = cfs_open(name, CFS_READ);
+      if(fd >= 0) {
+        failures++;
+        cfs_close(fd);
+      }
+    }
+  }
+  print_time("Miss", start, (unsigned long)BENCHMARK_FILES * BENCHMARK_ROUNDS);
+
+  /* Remove and re-create every other file. */
+  start = clock_time();
+  for(i = 0; i < BENCHMARK_FILES; i += 2) {
+    file_name(name, i);
+    if(cfs_remove(name) < 0 || cfs_coffee_reserve(name, 1) < 0) {
+      failures++;
+    }
+  }
+  print_time("Remove and reserve", start, BENCHMARK_FILES / 2);
+
+  printf("Coffee benchmark finished with %d failures\n", failures);
+
+  PROCESS_END();
+}
+/*---------------------------------------------------------------------------*/
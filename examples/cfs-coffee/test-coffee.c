@@ -40,6 +40,7 @@
 #include "contiki.h"
 #include "cfs/cfs.h"
 #include "cfs/cfs-coffee.h"
+#include "cfs-coffee-arch.h"
 #include "lib/crc16.h"
 #include "lib/random.h"
 
@@ -51,6 +52,9 @@ AUTOSTART_PROCESSES(&testcoffee_process);
 /*---------------------------------------------------------------------------*/
 #define TEST_FAIL(x) 	error = (x); goto end;
 #define FILE_SIZE	4096
+/* Files of half a sector, enough to fill the storage four times. */
+#define GC_FILE_SIZE	(COFFEE_SECTOR_SIZE / 2)
+#define GC_FILES	(int)(4 * COFFEE_SIZE / COFFEE_SECTOR_SIZE)
 /*---------------------------------------------------------------------------*/
 static int
 coffee_test_basic(void)
@@ -304,6 +308,39 @@ coffee_test_modify(void)
     cfs_close(wfd);
   }
 
+  /* Test 9-13: Read the last write again and write once more after a
+     simulated reboot, when the micro log has to be searched on the
+     storage. */
+  cfs_coffee_remount();
+  wfd = cfs_open("T3", CFS_WRITE | CFS_READ);
+  if(wfd < 0) {
+    TEST_FAIL(9);
+  }
+  for(r = 0; r < 2; r++) {
+    if(r == 1) {
+      offset = random_rand() % FILE_SIZE;
+      for(i = 0; i < sizeof(buf); i++) {
+        buf[i] = i;
+      }
+      if(cfs_seek(wfd, offset, CFS_SEEK_SET) != offset ||
+         cfs_write(wfd, buf, sizeof(buf)) != sizeof(buf)) {
+        TEST_FAIL(10);
+      }
+    }
+    if(cfs_seek(wfd, offset, CFS_SEEK_SET) != offset) {
+      TEST_FAIL(11);
+    }
+    memset(buf, 0, sizeof(buf));
+    if(cfs_read(wfd, buf, sizeof(buf)) != sizeof(buf)) {
+      TEST_FAIL(12);
+    }
+    for(i = 0; i < sizeof(buf); i++) {
+      if(buf[i] != i) {
+        TEST_FAIL(13);
+      }
+    }
+  }
+
   error = 0;
 end:
   cfs_close(wfd);
@@ -311,6 +348,82 @@ end:
   return error;
 }
 /*---------------------------------------------------------------------------*/
+#if CONTIKI_TARGET_NATIVE
+/*
+ * A power failure is simulated by dropping all writes to the storage
+ * after a given number of them. The Makefile wraps xmem_pwrite() for
+ * the native platform.
+ */
+static int writes_left = -1;
+
+int __real_xmem_pwrite(const void *buf, int size, unsigned long offset);
+
+int
+__wrap_xmem_pwrite(const void *buf, int size, unsigned long offset)
+{
+  if(writes_left == 0) {
+    return size;
+  }
+  if(writes_left > 0) {
+    writes_left--;
+  }
+  return __real_xmem_pwrite(buf, size, offset);
+}
+/*---------------------------------------------------------------------------*/
+static int
+coffee_test_power_failure(void)
+{
+  int error;
+  int fd;
+  static unsigned char buf[2000];
+  int writes;
+  cfs_offset_t size;
+
+  fd = -1;
+  memset(buf, 0x55, sizeof(buf));
+
+  /* Test 1-4: Lose power after each storage write of an append that takes
+     the file past the first eighth of its extent, and check that the file
+     has either its old or its new size on the next mount. */
+  for(writes = 0; writes < 3; writes++) {
+    fd = cfs_open("T4", CFS_WRITE);
+    if(fd < 0) {
+      TEST_FAIL(1);
+    }
+    if(cfs_write(fd, buf, 1000) != 1000) {
+      TEST_FAIL(2);
+    }
+    cfs_close(fd);
+
+    fd = cfs_open("T4", CFS_WRITE | CFS_APPEND);
+    writes_left = writes;
+    cfs_write(fd, buf, sizeof(buf));
+    writes_left = -1;
+    cfs_close(fd);
+
+    cfs_coffee_remount();
+
+    fd = cfs_open("T4", CFS_READ);
+    if(fd < 0) {
+      TEST_FAIL(3);
+    }
+    size = cfs_seek(fd, 0, CFS_SEEK_END);
+    if(size != 1000 && size != 1000 + sizeof(buf)) {
+      TEST_FAIL(4);
+    }
+    cfs_close(fd);
+    cfs_remove("T4");
+  }
+
+  error = 0;
+end:
+  writes_left = -1;
+  cfs_close(fd);
+  cfs_remove("T4");
+  return error;
+}
+#endif /* CONTIKI_TARGET_NATIVE */
+/*---------------------------------------------------------------------------*/
 static int
 coffee_test_gc(void)
 {
@@ -333,6 +446,36 @@ coffee_test_gc(void)
   return 0;
 }
 /*---------------------------------------------------------------------------*/
+static int
+coffee_test_background_gc(int i)
+{
+  char name[12];
+
+  /* Keep the last two files, so that they share sectors with the
+     removed files. */
+  sprintf(name, "G%d", i);
+  if(cfs_coffee_reserve(name, GC_FILE_SIZE) < 0) {
+    return 1;
+  }
+  if(i >= 2) {
+    sprintf(name, "G%d", i - 2);
+    cfs_remove(name);
+  }
+  return 0;
+}
+/*---------------------------------------------------------------------------*/
+static unsigned
+gc_pauses(const uint16_t *histogram)
+{
+  unsigned pauses;
+  int i;
+
+  for(pauses = i = 0; i < CFS_COFFEE_GC_HISTOGRAM_SIZE; i++) {
+    pauses += histogram[i];
+  }
+  return pauses;
+}
+/*---------------------------------------------------------------------------*/
 static void
 print_result(const char *test_name, int result)
 {
@@ -347,7 +490,11 @@ print_result(const char *test_name, int result)
 PROCESS_THREAD(testcoffee_process, ev, data)
 {
   int start;
-  int result;
+  static int result;
+  static const struct cfs_coffee_gc_stats *stats;
+  static unsigned erased, foreground, background;
+  static int i;
+  char name[12];
 
   PROCESS_BEGIN();
 
@@ -367,9 +514,44 @@ PROCESS_THREAD(testcoffee_process, ev, data)
   result = coffee_test_modify();
   print_result("File modification", result);
 
+#if CONTIKI_TARGET_NATIVE
+  result = coffee_test_power_failure();
+  print_result("Power failure", result);
+#endif /* CONTIKI_TARGET_NATIVE */
+
   result = coffee_test_gc();
   print_result("Garbage collection", result);
 
+  /* Coffee only keeps statistics if it collects garbage in the
+     background. Yield after each reservation to let it run. */
+  stats = cfs_coffee_gc_stats();
+  if(stats != NULL) {
+    erased = stats->erased_sectors;
+    foreground = gc_pauses(stats->foreground);
+    background = gc_pauses(stats->background);
+
+    for(i = 0, result = 0; i < GC_FILES && result == 0; i++) {
+      result = coffee_test_background_gc(i);
+      PROCESS_PAUSE();
+    }
+    for(i = GC_FILES - 2; i < GC_FILES; i++) {
+      sprintf(name, "G%d", i);
+      cfs_remove(name);
+    }
+
+    if(result == 0) {
+      if(stats->erased_sectors == erased) {
+        result = 2;
+      } else if(gc_pauses(stats->background) == background) {
+        result = 3;
+      } else if(gc_pauses(stats->foreground) != foreground) {
+        /* The background process did not keep up. */
+        result = 4;
+      }
+    }
+    print_result("Background garbage collection", result);
+  }
+
   printf("Coffee test finished. Duration: %d seconds\n",
          (int)(clock_seconds() - start));
 
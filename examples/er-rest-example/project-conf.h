@@ -103,5 +103,14 @@
 /* Enable client-side support for COAP observe */
 #define COAP_OBSERVE_CLIENT 1
 
+/* Serve a CFS file with blockwise transfers at test/file */
+#ifndef ER_EXAMPLE_CONF_FILE
+#if CONTIKI_TARGET_NATIVE
+#define ER_EXAMPLE_CONF_FILE           1
+#else
+#define ER_EXAMPLE_CONF_FILE           0
+#endif
+#endif
+
 
 #endif /* __PROJECT_ERBIUM_CONF_H__ */
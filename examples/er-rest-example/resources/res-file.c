@@ -0,0 +1,84 @@
+/*
+ * Copyright (c) 2026, Contiki contributors.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * 3. Neither the name of the copyright holder nor the names of its
+ *    contributors may be used to endorse or promote products derived
+ *    from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE
+ * COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+ * OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+/**
+ * \file
+ *      Example resource that streams uploads and downloads through CFS
+ */
+
+#include "rest-engine.h"
+#include "er-coap.h"
+#include "er-coap-block-cfs.h"
+#include "cfs/cfs.h"
+
+#define FILE_NAME     "upload"
+#define MAX_FILE_SIZE 32768
+
+static void res_get_handler(void *request, void *response, uint8_t *buffer, uint16_t preferred_size, int32_t *offset);
+static void res_put_handler(void *request, void *response, uint8_t *buffer, uint16_t preferred_size, int32_t *offset);
+static void res_delete_handler(void *request, void *response, uint8_t *buffer, uint16_t preferred_size, int32_t *offset);
+
+/*
+ * Uploads with Block1 are written to the file block by block, and downloads with Block2 read
+ * only the requested block, so the file size is not limited by the available RAM.
+ */
+RESOURCE(res_file,
+         "title=\"File: PUT, GET, DELETE\";sz=32768",
+         res_get_handler,
+         NULL,
+         res_put_handler,
+         res_delete_handler);
+
+static void
+res_get_handler(void *request, void *response, uint8_t *buffer, uint16_t preferred_size, int32_t *offset)
+{
+  if(coap_block2_cfs_handler(request, response, buffer, preferred_size, offset, FILE_NAME) >= 0) {
+    REST.set_header_content_type(response, REST.type.APPLICATION_OCTET_STREAM);
+  }
+}
+static void
+res_put_handler(void *request, void *response, uint8_t *buffer, uint16_t preferred_size, int32_t *offset)
+{
+  if(coap_block1_cfs_handler(request, response, FILE_NAME, MAX_FILE_SIZE) == 0) {
+    /* last block written */
+    REST.set_response_status(response, REST.status.CHANGED);
+  }
+}
+static void
+res_delete_handler(void *request, void *response, uint8_t *buffer, uint16_t preferred_size, int32_t *offset)
+{
+  if(coap_block_cfs_remove(FILE_NAME) == 0) {
+    REST.set_response_status(response, REST.status.DELETED);
+  } else {
+    REST.set_response_status(response, REST.status.NOT_FOUND);
+  }
+}
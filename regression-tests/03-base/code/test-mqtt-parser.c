@@ -0,0 +1,307 @@
+/*
+ * Copyright (c) 2026, Contiki contributors.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * 3. Neither the name of the copyright holder nor the names of its
+ *    contributors may be used to endorse or promote products derived
+ *    from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE
+ * COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+ * OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Feeds a stream of MQTT packets from the broker to the MQTT engine, cut into
+ * segments at random places, and checks that the same messages come out no
+ * matter where the segments end. Runs in Cooja, or natively with
+ * make TARGET=native test-mqtt-parser
+ */
+
+#include <stdio.h>
+#include <string.h>
+
+#include "contiki.h"
+#include "unit-test.h"
+#include "lib/random.h"
+
+#include "mqtt.h"
+
+PROCESS(test_process, "mqtt parser test");
+AUTOSTART_PROCESSES(&test_process);
+
+#define ROUNDS     50
+#define BIG_SIZE   1000
+
+static struct mqtt_connection conn;
+
+static uint8_t stream[2048];
+static uint16_t stream_len;
+static uint8_t big[BIG_SIZE];
+
+/* What came out of the engine */
+static uint8_t received[BIG_SIZE];
+static uint32_t received_len;
+static uint8_t publish_count;
+static uint8_t first_chunk_count;
+static uint8_t messages_ok;
+static uint8_t error_count;
+
+static void
+test_print_report(const unit_test_t *utp)
+{
+  printf("=check-me= ");
+  if(utp->result == unit_test_failure) {
+    printf("FAILED   - %s: exit at L%u\n", utp->descr, utp->exit_line);
+  } else {
+    printf("SUCCEEDED - %s\n", utp->descr);
+  }
+}
+/*---------------------------------------------------------------------------*/
+static void
+mqtt_event(struct mqtt_connection *m, mqtt_event_t event, void *data)
+{
+  struct mqtt_message *msg = data;
+
+  if(event == MQTT_EVENT_ERROR) {
+    error_count++;
+    return;
+  }
+  if(event != MQTT_EVENT_PUBLISH) {
+    return;
+  }
+
+  if(msg->first_chunk) {
+    first_chunk_count++;
+    received_len = 0;
+  }
+  if(received_len + msg->payload_chunk_length <= sizeof(received)) {
+    memcpy(&received[received_len], msg->payload_chunk,
+           msg->payload_chunk_length);
+  }
+  received_len += msg->payload_chunk_length;
+
+  if(msg->payload_left > 0) {
+    return;
+  }
+  publish_count++;
+
+  /* The stream holds these messages, in this order */
+  switch(publish_count) {
+  case 1:
+    messages_ok += !strcmp(msg->topic, "a/b") && received_len == 5 &&
+      !memcmp(received, "hello", 5);
+    break;
+  case 2:
+    messages_ok += !strcmp(msg->topic, "sensors/big") && msg->mid == 0x1234 &&
+      msg->payload_length == BIG_SIZE && received_len == BIG_SIZE &&
+      !memcmp(received, big, BIG_SIZE);
+    break;
+  case 3:
+    messages_ok += !strcmp(msg->topic, "retained") && received_len == 0;
+    break;
+  case 4:
+    messages_ok += !strcmp(msg->topic, "last") && received_len == 1 &&
+      received[0] == 'z';
+    break;
+  }
+}
+/*---------------------------------------------------------------------------*/
+static void
+add_bytes(const void *data, uint16_t len)
+{
+  memcpy(&stream[stream_len], data, len);
+  stream_len += len;
+}
+/*---------------------------------------------------------------------------*/
+static void
+add_header(uint8_t fhdr, uint32_t remaining_length)
+{
+  uint8_t byte;
+
+  add_bytes(&fhdr, 1);
+  do {
+    byte = remaining_length % 128;
+    remaining_length /= 128;
+    if(remaining_length > 0) {
+      byte |= 0x80;
+    }
+    add_bytes(&byte, 1);
+  } while(remaining_length > 0);
+}
+/*---------------------------------------------------------------------------*/
+static void
+add_publish(uint8_t qos, const char *topic, uint16_t mid,
+            const uint8_t *payload, uint16_t payload_len)
+{
+  uint16_t topic_len = strlen(topic);
+  uint8_t bytes[2];
+
+  add_header(0x30 | (qos << 1),
+             2 + topic_len + (qos ? 2 : 0) + payload_len);
+  bytes[0] = topic_len >> 8;
+  bytes[1] = topic_len & 0xFF;
+  add_bytes(bytes, 2);
+  add_bytes(topic, topic_len);
+  if(qos) {
+    bytes[0] = mid >> 8;
+    bytes[1] = mid & 0xFF;
+    add_bytes(bytes, 2);
+  }
+  add_bytes(payload, payload_len);
+}
+/*---------------------------------------------------------------------------*/
+static void
+build_stream(void)
+{
+  static const uint8_t pingresp[] = { 0xD0, 0x00 };
+  static const uint8_t puback[] = { 0x40, 0x02, 0x00, 0x07 };
+  char long_topic[MQTT_MAX_TOPIC_LENGTH + 10];
+  uint16_t i;
+
+  for(i = 0; i < BIG_SIZE; i++) {
+    big[i] = i * 7;
+  }
+  memset(long_topic, 't', sizeof(long_topic) - 1);
+  long_topic[sizeof(long_topic) - 1] = '\0';
+
+  stream_len = 0;
+  add_publish(0, "a/b", 0, (const uint8_t *)"hello", 5);
+  add_bytes(pingresp, sizeof(pingresp));
+  add_publish(1, "sensors/big", 0x1234, big, BIG_SIZE);
+  add_bytes(puback, sizeof(puback));
+  /* Dropped, the topic does not fit */
+  add_publish(0, long_topic, 0, (const uint8_t *)"x", 1);
+  add_publish(0, "retained", 0, NULL, 0);
+  /* Dropped, too large for anything but a PUBLISH */
+  add_header(0xB0, MQTT_INPUT_BUFF_SIZE + 1);
+  stream_len += MQTT_INPUT_BUFF_SIZE + 1;
+  add_publish(0, "last", 0, (const uint8_t *)"z", 1);
+}
+/*---------------------------------------------------------------------------*/
+static void
+feed(uint16_t max_segment)
+{
+  uint16_t pos = 0;
+  uint16_t len;
+
+  publish_count = 0;
+  first_chunk_count = 0;
+  messages_ok = 0;
+  error_count = 0;
+
+  while(pos < stream_len) {
+    len = 1 + random_rand() % max_segment;
+    if(len > stream_len - pos) {
+      len = stream_len - pos;
+    }
+    conn.socket.input_callback(&conn.socket, conn.socket.ptr,
+                               &stream[pos], len);
+    pos += len;
+  }
+}
+/*---------------------------------------------------------------------------*/
+UNIT_TEST_REGISTER(test_whole_stream, "Whole stream at once");
+UNIT_TEST(test_whole_stream)
+{
+  UNIT_TEST_BEGIN();
+
+  feed(stream_len);
+
+  UNIT_TEST_ASSERT(publish_count == 4 && first_chunk_count == 4 &&
+                   messages_ok == 4 && error_count == 0);
+
+  UNIT_TEST_END();
+}
+/*---------------------------------------------------------------------------*/
+UNIT_TEST_REGISTER(test_byte_by_byte, "One byte per segment");
+UNIT_TEST(test_byte_by_byte)
+{
+  UNIT_TEST_BEGIN();
+
+  feed(1);
+
+  UNIT_TEST_ASSERT(publish_count == 4 && first_chunk_count == 4 &&
+                   messages_ok == 4 && error_count == 0);
+
+  UNIT_TEST_END();
+}
+/*---------------------------------------------------------------------------*/
+UNIT_TEST_REGISTER(test_random_segments, "Random segment boundaries");
+UNIT_TEST(test_random_segments)
+{
+  uint8_t round;
+
+  UNIT_TEST_BEGIN();
+
+  for(round = 0; round < ROUNDS; round++) {
+    feed(round < ROUNDS / 2 ? 16 : 300);
+    UNIT_TEST_ASSERT(publish_count == 4 && first_chunk_count == 4 &&
+                     messages_ok == 4 && error_count == 0);
+  }
+
+  UNIT_TEST_END();
+}
+/*---------------------------------------------------------------------------*/
+UNIT_TEST_REGISTER(test_bad_remaining_length, "Bad remaining length");
+UNIT_TEST(test_bad_remaining_length)
+{
+  static const uint8_t bad[] = { 0x30, 0xFF, 0xFF, 0xFF, 0xFF, 0x01 };
+
+  UNIT_TEST_BEGIN();
+
+  error_count = 0;
+  conn.socket.input_callback(&conn.socket, conn.socket.ptr,
+                             bad, sizeof(bad));
+  UNIT_TEST_ASSERT(error_count == 1);
+
+  /* The parser starts over with the next segment */
+  feed(64);
+  UNIT_TEST_ASSERT(publish_count == 4 && messages_ok == 4);
+
+  UNIT_TEST_END();
+}
+/*---------------------------------------------------------------------------*/
+PROCESS_THREAD(test_process, ev, data)
+{
+  PROCESS_BEGIN();
+
+  random_init(0x4d51);
+  build_stream();
+
+  /* Let the engine set up its socket, no broker needs to answer */
+  mqtt_register(&conn, &test_process, "parser-test", mqtt_event, 128);
+  mqtt_connect(&conn, "fd00::1", 1883, 60);
+  while(conn.socket.input_callback == NULL) {
+    PROCESS_PAUSE();
+  }
+
+  printf("Run unit-test\n");
+  printf("---\n");
+
+  UNIT_TEST_RUN(test_whole_stream);
+  UNIT_TEST_RUN(test_byte_by_byte);
+  UNIT_TEST_RUN(test_random_segments);
+  UNIT_TEST_RUN(test_bad_remaining_length);
+
+  printf("=check-me= DONE\n");
+  PROCESS_END();
+}